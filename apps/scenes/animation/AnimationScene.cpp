@@ -91,13 +91,21 @@ void AnimationScene::doInitialize()
                                   DEFAULT_LIGHT_MATERIAL);
         m_gpuKernel->setPrimitiveIsMovable(m_nbPrimitives, false);
 
-        addCornellBox(m_cornellBoxType);
-        if (frame != 0)
-            m_gpuKernel->compactBoxes(true);
+        // The Cornell box does not move, it is shared by all frames when the
+        // engine supports instances, and copied in every frame otherwise
+        const bool shared = m_gpuKernel->supportsInstances();
+        if (frame == 0 || !shared)
+        {
+            const unsigned int from = m_gpuKernel->getNbActivePrimitives();
+            addCornellBox(m_cornellBoxType);
+            if (shared)
+                m_gpuKernel->createStaticGeometry(from);
+        }
     }
     m_currentFrame = 0;
     m_wait = 0;
     m_gpuKernel->setFrame(m_currentFrame);
+    m_gpuKernel->compactFrames();
 }
 
 void AnimationScene::doAnimate()
@@ -60,6 +60,10 @@
 #include <scenes/science/MoleculeScene.h>
 #include <scenes/science/SwcScene.h>
 
+#if !defined(USE_CUDA) && !defined(USE_OPENCL)
+#include <solr/engines/cpu/CPUKernel.h>
+#endif
+
 // Ray-tracing Kernel
 solr::GPUKernel *gKernel = solr::SingletonKernel::kernel();
 
@@ -248,6 +252,16 @@ void readParameters(const std::vector<std::string> &parameters)
             if (key.find("-opencl-kernel") != std::string::npos)
                 gKernel->setKernelFilename(value);
 #endif // USE_OPENCL
+#if !defined(USE_CUDA) && !defined(USE_OPENCL)
+            if (key.find("-tileSize") != std::string::npos)
+                static_cast<CPUKernel *>(gKernel)->setTileSize(atoi(value.c_str()));
+            if (key.find("-threads") != std::string::npos)
+                static_cast<CPUKernel *>(gKernel)->setNbThreads(atoi(value.c_str()));
+            if (key.find("-rayPackets") != std::string::npos)
+                static_cast<CPUKernel *>(gKernel)->setPacketWidth(atoi(value.c_str()));
+            if (key.find("-wideBVH") != std::string::npos)
+                static_cast<CPUKernel *>(gKernel)->setWideBVH(atoi(value.c_str()) == 1);
+#endif
             if (key.find("-objFile") != std::string::npos)
                 gFilename = value.c_str();
             if (key.find("-width") != std::string::npos)
@@ -260,6 +274,16 @@ void readParameters(const std::vector<std::string> &parameters)
                 gSceneId = atoi(value.c_str());
             if (key.find("-cornellBox") != std::string::npos)
                 gCornellBoxType = atoi(value.c_str());
+            if (key.find("-accelerationStructure") != std::string::npos)
+                gKernel->setAccelerationStructure(static_cast<AccelerationStructure>(atoi(value.c_str())));
+            if (key.find("-compressedBoxes") != std::string::npos)
+                gKernel->setCompressedBoxes(atoi(value.c_str()) == 1);
+            if (key.find("-backgroundBuilds") != std::string::npos)
+                gKernel->setBackgroundBuilds(atoi(value.c_str()) == 1);
+            if (key.find("-samplingThreshold") != std::string::npos)
+                gKernel->setSamplingThreshold(static_cast<float>(atof(value.c_str())));
+            if (key.find("-sampler") != std::string::npos)
+                gKernel->setSampler(static_cast<SamplerType>(atoi(value.c_str())));
         }
         ++it;
     }
@@ -279,6 +303,10 @@ void initgl(int argc, char **argv)
 #ifdef USE_OPENCL
     caption += " (Powered by OpenCL)";
     glutInitWindowSize(gWindowWidth, gWindowHeight);
+#endif
+#if !defined(USE_CUDA) && !defined(USE_OPENCL)
+    caption += " (Powered by the CPU)";
+    glutInitWindowSize(gWindowWidth, gWindowHeight);
 #endif
     glutCreateWindow(caption.c_str());
     glutDisplayFunc(display);
@@ -345,6 +373,14 @@ void display()
             else
             {
                 si.pathTracingIteration++;
+
+                // With adaptive sampling, the frame is complete once every pixel converged
+                if (gKernel->getSamplingThreshold() > 0.f && si.pathTracingIteration > NB_MAX_ITERATIONS &&
+                    si.pathTracingIteration < si.maxPathTracingIterations && gKernel->getNbActivePixels() == 0)
+                {
+                    LOG_INFO(1, "All pixels converged after " << si.pathTracingIteration << " iterations");
+                    si.pathTracingIteration = si.maxPathTracingIterations;
+                }
             }
 #ifdef WIN32
             if (gHelp)
@@ -374,7 +410,10 @@ void display()
             gScene->getKernel()->render_end();
 
             if (gBenchmarking)
+            {
+                gKernel->benchmarkBoxes();
                 Cleanup(EXIT_SUCCESS);
+            }
         }
 
         // Screenshot
@@ -30,12 +30,15 @@
 
 const unsigned int BOUNDING_BOXES_TREE_DEPTH = 64;
 const unsigned int NB_MAX_BOXES = 2500000;
+const unsigned int COMPRESSED_BOXES_HEADER_SIZE = 2;
+const unsigned int COMPRESSED_BOXES_TREE_DEPTH = 32; // Deeper hierarchies are not compressed
+const unsigned int COMPRESSED_BOXES_QUANTIZATION_STEPS = 255;
 const unsigned int NB_MAX_PRIMITIVES = 2500000;
-const unsigned int NB_MAX_LAMPS = 512;
+const unsigned int NB_MAX_LAMPS = 512; // Initial device allocation, grows with the scene
 const unsigned int NB_MAX_MATERIALS = 65506 + 30; // Last 30 materials are reserved
 const unsigned int NB_MAX_TEXTURES = 512;
 const unsigned int NB_MAX_FRAMES = 512;
-const unsigned int NB_MAX_LIGHTINFORMATIONS = 512;
+const unsigned int NB_MAX_LIGHTINFORMATIONS = 512; // Initial device allocation, grows with the scene
 const unsigned int MAX_BITMAP_WIDTH = 1920;
 const unsigned int MAX_BITMAP_HEIGHT = 1080;
 const unsigned int MAX_BITMAP_SIZE = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT;
@@ -49,6 +52,7 @@ const int gColorDepth = 3;
 
 // Globals
 #define PI 3.14159265358979323846f
+#define SOLR_EPSILON 1e-6f // Lower bound of light sampling distances and probabilities
 #define STANDARD_LUNINANCE_STRENGTH 0.1f
 #define SKYBOX_LUNINANCE_STRENGTH 0.2f
 #define EXTENDED_GEOMETRY // Includes spheres, cylinders, etc
@@ -30,6 +30,22 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <sstream>
+#include <thread>
+
+// SIMD box tests of the wide hierarchy. The AVX test is compiled for its
+// instruction set whatever the flags of the library, and selected at runtime
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define WIDE_BVH_AVX
+#include <immintrin.h>
+#endif
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WIDE_BVH_SSE
+#include <xmmintrin.h>
+#endif
 
 // JPeg
 #include <images/ImageLoader.h>
@@ -104,948 +120,3939 @@ vec3f max3(const vec3f a, const vec3f b, const vec3f c)
     return r;
 }
 
-namespace solr
+// Surface area heuristic
+const float SAH_TRAVERSAL_COST = 1.f;
+const float SAH_INTERSECTION_COST = 1.f;
+const size_t SAH_MAX_PRIMITIVES_PER_LEAF = 16;
+const int SAH_NB_BINS = 16;
+const int SAH_NB_CHUNKS = 64;                    // Chunks used to process large ranges in parallel
+const size_t SAH_MIN_PARALLEL_TASK_SIZE = 4096;  // Smaller ranges are built by a single thread
+const size_t SAH_NB_TASKS = 256;                 // Number of subtrees built concurrently
+
+// Linear BVH
+const size_t LBVH_MAX_PRIMITIVES_PER_LEAF = 4;
+const size_t LBVH_63_BITS_THRESHOLD = 1 << 18; // Larger scenes use 63-bit Morton codes
+const int LBVH_RADIX_BITS = 8;
+const int LBVH_RADIX_SIZE = 1 << LBVH_RADIX_BITS;
+
+// Spatial splits
+const int SBVH_NB_BINS = 32;
+const float SBVH_MIN_OVERLAP = 1e-5f;     // Overlap of children, relative to the root, for spatial splits to be tried
+const float SBVH_MAX_DUPLICATION = 0.3f;  // References added by spatial splits, relative to the initial ones
+
+// Refitting
+const int DIRTY_RANGE_GAP = 16;        // Unmodified elements transfered to avoid splitting ranges
+const size_t NB_MAX_DIRTY_RANGES = 64; // Transfers per buffer before falling back to a single one
+
+// Dynamic BVH
+const int DYNAMIC_BVH_MAX_PRIMITIVES_PER_LEAF = 4;
+const size_t DYNAMIC_BVH_MAX_REINSERTIONS = 1024; // Moved references reinserted by an update, more are refitted
+const float DYNAMIC_BVH_MAX_INSERTIONS = 0.25f;   // Added references, relative to the hierarchy, before a rebuild
+const float DYNAMIC_BVH_MAX_COST_RATIO = 1.3f;    // Cost increase, relative to the built hierarchy, before a rebuild
+const float DYNAMIC_BVH_MAX_UNUSED_SLOTS = 0.5f;  // Unused part of the slots before a rebuild
+const int DYNAMIC_BVH_SPARE_SLOTS = 8;            // Slots are grown by 1/DYNAMIC_BVH_SPARE_SLOTS at least
+
+// Compressed boxes
+const float COMPRESSED_BOXES_TOLERANCE = 1e-5f; // Margin absorbing rounding differences with GPU decoders
+const int BENCHMARK_MAX_RAYS = 512 * 512;
+const size_t BENCHMARK_CACHE_LINE_SIZE = 64;
+const size_t BENCHMARK_CACHE_NB_SETS = 512; // 256 KB with 8 ways, the size of a typical L2 cache
+const size_t BENCHMARK_CACHE_NB_WAYS = 8;
+
+struct BVHReference
 {
-GPUKernel *SingletonKernel::m_kernel = 0;
+    vec3f parameters[2];
+    vec3f center;
+    long index;
+    unsigned long long mortonCode;
+};
 
-SingletonKernel::SingletonKernel()
+struct BVHBin
+{
+    vec3f parameters[2];
+    size_t count;
+};
+
+// Range of references with the bounds of their primitives and of their centers
+struct BVHRange
+{
+    size_t begin;
+    size_t end;
+    int depth;
+    vec3f parameters[2];
+    vec3f centers[2];
+};
+
+// Bin of a spatial split, counting the references starting and ending in it
+struct BVHSpatialBin
+{
+    vec3f parameters[2];
+    size_t entries;
+    size_t exits;
+};
+
+// Plane splitting a range in space, with the bounds and number of references
+// of both sides
+struct BVHSpatialSplit
+{
+    int axis;
+    float position;
+    float cost;
+    vec3f parameters[2][2];
+    size_t counts[2];
+};
+
+// Node of the top of the hierarchy, split before subtrees are built in parallel
+struct BVHTask
+{
+    BVHRange range;
+    int children[2]; // -1 when the subtree is built by a single thread
+    solr::BVHNodeContainer nodes;
+    size_t nodeOffset;
+    size_t nbNodes;
+};
+
+float vec3fComponent(const vec3f &v, const int axis)
 {
+    return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
 }
 
-GPUKernel *SingletonKernel::kernel()
+void setVec3fComponent(vec3f &v, const int axis, const float value)
 {
-    if (!m_kernel)
-#ifdef USE_CUDA
-        m_kernel = new CudaKernel();
-#else
-#ifdef USE_OPENCL
-        m_kernel = new OpenCLKernel();
-#else
-        m_kernel = new CPUKernel();
-#endif // USE_OPENCL
-#endif // USE_CUDA
-    return m_kernel;
+    if (axis == 0)
+        v.x = value;
+    else if (axis == 1)
+        v.y = value;
+    else
+        v.z = value;
 }
 
-float GPUKernel::dotProduct(const vec3f &a, const vec3f &b)
+float boxHalfArea(const vec3f &corner0, const vec3f &corner1)
 {
-    return a.x * b.x + a.y * b.y + a.z * b.z;
+    const float x = corner1.x - corner0.x;
+    const float y = corner1.y - corner0.y;
+    const float z = corner1.z - corner0.z;
+    return x * y + y * z + z * x;
 }
 
-// ________________________________________________________________________________
-float GPUKernel::vectorLength(const vec3f &vector)
+void resetBounds(vec3f parameters[2])
 {
-    return sqrt(vector.x * vector.x + vector.y * vector.y + vector.z * vector.z);
+    const float limit = std::numeric_limits<float>::max();
+    parameters[0] = make_vec3f(limit, limit, limit);
+    parameters[1] = make_vec3f(-limit, -limit, -limit);
 }
 
-// ________________________________________________________________________________
-void GPUKernel::normalizeVector(vec3f &v)
+void growBounds(vec3f parameters[2], const vec3f &corner0, const vec3f &corner1)
 {
-    float l = vectorLength(v);
-    if (l != 0.f)
-    {
-        v.x /= l;
-        v.y /= l;
-        v.z /= l;
-    }
+    parameters[0] = min2(parameters[0], corner0);
+    parameters[1] = max2(parameters[1], corner1);
 }
 
-vec3f GPUKernel::crossProduct(const vec3f &b, const vec3f &c)
+int nbChunks(const size_t nbReferences)
 {
-    vec3f a;
-    a.x = b.y * c.z - b.z * c.y;
-    a.y = b.z * c.x - b.x * c.z;
-    a.z = b.x * c.y - b.y * c.x;
-    return a;
+    return (nbReferences >= SAH_MIN_PARALLEL_TASK_SIZE) ? SAH_NB_CHUNKS : 1;
 }
 
-#ifndef WIN32
-typedef struct
+void computeRangeBounds(const std::vector<BVHReference> &references, BVHRange &range)
 {
-    short bfType;
-    int bfSize;
-    short Reserved1;
-    short Reserved2;
-    int bfOffBits;
-} BITMAPFILEHEADER;
+    const size_t nbReferences = range.end - range.begin;
+    const int chunks = nbChunks(nbReferences);
+    std::vector<BVHRange> chunkRanges(chunks);
+#pragma omp parallel for if (chunks > 1)
+    for (int c = 0; c < chunks; ++c)
+    {
+        BVHRange &chunk = chunkRanges[c];
+        resetBounds(chunk.parameters);
+        resetBounds(chunk.centers);
+        const size_t end = range.begin + nbReferences * (c + 1) / chunks;
+        for (size_t i = range.begin + nbReferences * c / chunks; i < end; ++i)
+        {
+            growBounds(chunk.parameters, references[i].parameters[0], references[i].parameters[1]);
+            growBounds(chunk.centers, references[i].center, references[i].center);
+        }
+    }
+    resetBounds(range.parameters);
+    resetBounds(range.centers);
+    for (const auto &chunk : chunkRanges)
+    {
+        growBounds(range.parameters, chunk.parameters[0], chunk.parameters[1]);
+        growBounds(range.centers, chunk.centers[0], chunk.centers[1]);
+    }
+}
 
-typedef struct
+int binIndex(const BVHReference &reference, const BVHRange &range, const int axis)
 {
-    int biSizeImage;
-    int biWidth;
-    int biHeight;
-} BITMAPINFOHEADER;
-#endif
+    const float minimum = vec3fComponent(range.centers[0], axis);
+    const float extent = vec3fComponent(range.centers[1], axis) - minimum;
+    const int bin = static_cast<int>(SAH_NB_BINS * (vec3fComponent(reference.center, axis) - minimum) / extent);
+    return std::min(std::max(bin, 0), SAH_NB_BINS - 1);
+}
 
-GPUKernel::GPUKernel()
-    : m_oculus(false)
-    , m_hBoundingBoxes(0)
-    , m_hPrimitives(0)
-    , m_hLamps(0)
-    , m_hMaterials(0)
-    , m_hRandoms(0)
-    , m_hPrimitivesXYIds(0)
-    , m_nbActiveMaterials(-1)
-    , m_nbActiveTextures(0)
-    , m_lightInformationSize(0)
-    , m_maxPrimitivesPerBox(0)
-    , m_doneWithAdding(false)
-    , m_addingIndex(0)
-    , m_distortion(0.1f)
-    , m_frame(0)
-    , m_nbFrames(0)
-    , m_morph(0.f)
-    , m_treeDepth(2)
-    , m_bitmap(0)
-    , m_primitivesTransfered(false)
-    , m_materialsTransfered(false)
-    , m_texturesTransfered(false)
-    , m_randomsTransfered(false)
-    , m_refresh(true)
-    , m_activeLogging(false)
-    , m_lightInformation(0)
-    , m_optimalNbOfBoxes(NB_MAX_BOXES)
-    , m_GLMode(-1)
-    , m_currentMaterial(0)
-    , m_pointSize(1.f)
-#if USE_KINECT
-    , m_hVideo(0)
-    , m_hDepth(0)
-    , m_skeletons(0)
-    , m_hNextDepthFrameEvent(0)
-    , m_hNextVideoFrameEvent(0)
-    , m_hNextSkeletonEvent(0)
-    , m_pVideoStreamHandle(0)
-    , m_pDepthStreamHandle(0)
-    , m_skeletonsBody(-1)
-    , m_skeletonsLamp(-1)
-    , m_skeletonIndex(-1)
-#endif // USE_KINECT
-#ifdef USE_OCULUS
-    , m_sensorFusion(0)
-#endif // USE_OCULUS
+/*
+________________________________________________________________________________
+
+Splits a range of references in two, using the surface area heuristic
+evaluated on SAH_NB_BINS bins per axis. Large ranges are binned in parallel.
+Returns false if intersecting all primitives is cheaper than splitting
+________________________________________________________________________________
+*/
+bool splitRange(std::vector<BVHReference> &references, const BVHRange &range, BVHRange &left, BVHRange &right)
 {
-    LOG_INFO(1, "");
-    LOG_INFO(1, "                     _|_|_|            _|              _|_|_|  ");
-    LOG_INFO(1, "                   _|          _|_|    _|              _|    _|");
-    LOG_INFO(1, "                     _|_|    _|    _|  _|  _|_|_|_|_|  _|_|_|  ");
-    LOG_INFO(1, "                         _|  _|    _|  _|              _|    _|");
-    LOG_INFO(1, "                   _|_|_|      _|_|    _|              _|    _|");
-    LOG_INFO(1, "");
-    LOG_INFO(1, "                            Speed Of Light Ray-tracer");
-    LOG_INFO(1, "                       Created by cyrille.favreau@gmail.com");
-    LOG_INFO(1, "");
+    const size_t nbReferences = range.end - range.begin;
+    if (nbReferences <= 1 || range.depth >= static_cast<int>(BOUNDING_BOXES_TREE_DEPTH) - 1)
+        return false;
+
+    float extents[3];
+    for (int axis(0); axis < 3; ++axis)
+        extents[axis] = vec3fComponent(range.centers[1], axis) - vec3fComponent(range.centers[0], axis);
+
+    // Bin reference centers along each axis
+    const int chunks = nbChunks(nbReferences);
+    std::vector<BVHBin> bins(chunks * 3 * SAH_NB_BINS);
+    for (auto &bin : bins)
+    {
+        resetBounds(bin.parameters);
+        bin.count = 0;
+    }
+#pragma omp parallel for if (chunks > 1)
+    for (int c = 0; c < chunks; ++c)
+    {
+        BVHBin *chunkBins = &bins[c * 3 * SAH_NB_BINS];
+        const size_t end = range.begin + nbReferences * (c + 1) / chunks;
+        for (size_t i = range.begin + nbReferences * c / chunks; i < end; ++i)
+            for (int axis = 0; axis < 3; ++axis)
+                if (extents[axis] > 0.f)
+                {
+                    BVHBin &bin = chunkBins[axis * SAH_NB_BINS + binIndex(references[i], range, axis)];
+                    growBounds(bin.parameters, references[i].parameters[0], references[i].parameters[1]);
+                    ++bin.count;
+                }
+    }
+    for (int c(1); c < chunks; ++c)
+        for (int b(0); b < 3 * SAH_NB_BINS; ++b)
+        {
+            const BVHBin &bin = bins[c * 3 * SAH_NB_BINS + b];
+            growBounds(bins[b].parameters, bin.parameters[0], bin.parameters[1]);
+            bins[b].count += bin.count;
+        }
 
-    for (int i(0); i < NB_MAX_FRAMES; ++i)
+    // Sweep bins and keep the cheapest split
+    float area = boxHalfArea(range.parameters[0], range.parameters[1]);
+    area = (area > 0.f) ? area : 1.f;
+    int bestAxis(-1);
+    int bestBin(-1);
+    float bestCost = std::numeric_limits<float>::max();
+    for (int axis(0); axis < 3; ++axis)
     {
-        m_nbActiveBoxes[i] = 0;
-        m_nbActivePrimitives[i] = 0;
-        m_nbActiveLamps[i] = 0;
+        if (extents[axis] <= 0.f)
+            continue;
+        const BVHBin *axisBins = &bins[axis * SAH_NB_BINS];
+        float rightAreas[SAH_NB_BINS];
+        size_t rightCounts[SAH_NB_BINS];
+        vec3f bounds[2];
+        resetBounds(bounds);
+        size_t count(0);
+        for (int b(SAH_NB_BINS - 1); b > 0; --b)
+        {
+            growBounds(bounds, axisBins[b].parameters[0], axisBins[b].parameters[1]);
+            count += axisBins[b].count;
+            rightAreas[b] = boxHalfArea(bounds[0], bounds[1]);
+            rightCounts[b] = count;
+        }
+        resetBounds(bounds);
+        count = 0;
+        for (int b(0); b < SAH_NB_BINS - 1; ++b)
+        {
+            growBounds(bounds, axisBins[b].parameters[0], axisBins[b].parameters[1]);
+            count += axisBins[b].count;
+            if (count == 0 || rightCounts[b + 1] == 0)
+                continue;
+            const float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST *
+                                                        (boxHalfArea(bounds[0], bounds[1]) * count +
+                                                         rightAreas[b + 1] * rightCounts[b + 1]) /
+                                                        area;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
     }
 
-    LOG_INFO(3, "----------++++++++++  GPU Kernel created  ++++++++++----------");
-    LOG_INFO(3, "CPU: SceneInfo         : " << sizeof(SceneInfo));
-    LOG_INFO(3, "CPU: Ray               : " << sizeof(Ray));
-    LOG_INFO(3, "CPU: PrimitiveType     : " << sizeof(PrimitiveType));
-    LOG_INFO(3, "CPU: Material          : " << sizeof(Material));
-    LOG_INFO(3, "CPU: BoundingBox       : " << sizeof(BoundingBox));
-    LOG_INFO(3, "CPU: Primitive         : " << sizeof(Primitive));
-    LOG_INFO(3, "CPU: PostProcessingType: " << sizeof(PostProcessingType));
-    LOG_INFO(3, "CPU: PostProcessingInfo: " << sizeof(PostProcessingInfo));
-    LOG_INFO(3, "Textures " << NB_MAX_TEXTURES);
+    const bool tooLarge = (nbReferences > SAH_MAX_PRIMITIVES_PER_LEAF);
+    if (!tooLarge && (bestAxis == -1 || bestCost >= SAH_INTERSECTION_COST * nbReferences))
+        return false;
 
-    m_viewPos.x = 0.f;
-    m_viewPos.y = 0.f;
-    m_viewPos.z = 0.f;
-    m_viewDir.x = 0.f;
-    m_viewDir.y = 0.f;
-    m_viewDir.z = 0.f;
+    size_t middle;
+    if (bestAxis == -1)
+        // All centers are identical, split the leaf in two halves
+        middle = range.begin + nbReferences / 2;
+    else
+        middle = std::partition(references.begin() + range.begin, references.begin() + range.end,
+                                [&](const BVHReference &reference) {
+                                    return binIndex(reference, range, bestAxis) <= bestBin;
+                                }) -
+                 references.begin();
+
+    left.begin = range.begin;
+    left.end = middle;
+    left.depth = range.depth + 1;
+    computeRangeBounds(references, left);
+    right.begin = middle;
+    right.end = range.end;
+    right.depth = range.depth + 1;
+    computeRangeBounds(references, right);
+    return true;
+}
 
-#if USE_KINECT
-    // Initialize Kinect
-    LOG_INFO(1, "----------------------------");
-    LOG_INFO(1, "                         O  ");
-    LOG_INFO(1, "                       --+--");
-    LOG_INFO(1, "                         |  ");
-    LOG_INFO(1, "Kinect initialization   / \\");
+// Spreads the 21 lower bits of a value so that there are two zero bits between each of them
+unsigned long long expandMortonBits(unsigned long long v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
 
-    HRESULT hr = NuiInitialize(NUI_INITIALIZE_FLAG_USES_DEPTH_AND_PLAYER_INDEX | NUI_INITIALIZE_FLAG_USES_SKELETON |
-                               NUI_INITIALIZE_FLAG_USES_COLOR);
-    m_kinectEnabled = (hr == S_OK);
+/*
+________________________________________________________________________________
 
-    if (m_kinectEnabled)
+Sorts references by Morton code with a least significant digit radix sort.
+Each chunk of references builds its own digit histogram, a prefix sum gives
+every chunk its scatter position, and chunks are then scattered concurrently.
+Passes where all codes share the same digit are skipped
+________________________________________________________________________________
+*/
+void sortMortonCodes(std::vector<BVHReference> &references, const int nbBits)
+{
+    const size_t nbReferences = references.size();
+    const int chunks = nbChunks(nbReferences);
+    std::vector<BVHReference> buffer(nbReferences);
+    std::vector<size_t> histograms(chunks * LBVH_RADIX_SIZE);
+    for (int shift(0); shift < nbBits; shift += LBVH_RADIX_BITS)
     {
-        m_hNextDepthFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        m_hNextVideoFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        m_hNextSkeletonEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        std::fill(histograms.begin(), histograms.end(), 0);
+#pragma omp parallel for if (chunks > 1)
+        for (int c = 0; c < chunks; ++c)
+        {
+            size_t *histogram = &histograms[c * LBVH_RADIX_SIZE];
+            const size_t end = nbReferences * (c + 1) / chunks;
+            for (size_t i = nbReferences * c / chunks; i < end; ++i)
+                ++histogram[(references[i].mortonCode >> shift) & (LBVH_RADIX_SIZE - 1)];
+        }
 
-        m_skeletons = CreateEvent(NULL, TRUE, FALSE, NULL);
-        NuiSkeletonTrackingEnable(m_skeletons, NUI_SKELETON_TRACKING_FLAG_ENABLE_SEATED_SUPPORT);
+        // Digit-major prefix sum so that the sort remains stable across chunks
+        size_t offset(0);
+        bool sorted(false);
+        for (int d(0); d < LBVH_RADIX_SIZE; ++d)
+            for (int c(0); c < chunks; ++c)
+            {
+                const size_t count = histograms[c * LBVH_RADIX_SIZE + d];
+                sorted |= (count == nbReferences);
+                histograms[c * LBVH_RADIX_SIZE + d] = offset;
+                offset += count;
+            }
+        if (sorted)
+            continue;
 
-        NuiImageStreamOpen(NUI_IMAGE_TYPE_COLOR, NUI_IMAGE_RESOLUTION_640x480, 0, 2, m_hNextVideoFrameEvent,
-                           &m_pVideoStreamHandle);
-        NuiImageStreamOpen(NUI_IMAGE_TYPE_DEPTH_AND_PLAYER_INDEX, NUI_IMAGE_RESOLUTION_320x240, 0, 2,
-                           m_hNextDepthFrameEvent, &m_pDepthStreamHandle);
+#pragma omp parallel for if (chunks > 1)
+        for (int c = 0; c < chunks; ++c)
+        {
+            size_t *positions = &histograms[c * LBVH_RADIX_SIZE];
+            const size_t end = nbReferences * (c + 1) / chunks;
+            for (size_t i = nbReferences * c / chunks; i < end; ++i)
+                buffer[positions[(references[i].mortonCode >> shift) & (LBVH_RADIX_SIZE - 1)]++] = references[i];
+        }
+        references.swap(buffer);
+    }
+}
 
-        NuiCameraElevationSetAngle(0);
+/*
+________________________________________________________________________________
+
+Splits a range of references sorted by Morton code where the highest bit
+differing between its first and last codes changes. Ranges sharing a single
+code are cut in halves. Bounds are not computed, inner nodes being refitted
+from the leaves when the hierarchy is streamed to the GPU
+________________________________________________________________________________
+*/
+bool splitMortonRange(std::vector<BVHReference> &references, const BVHRange &range, BVHRange &left,
+                      BVHRange &right)
+{
+    const size_t nbReferences = range.end - range.begin;
+    if (nbReferences <= LBVH_MAX_PRIMITIVES_PER_LEAF ||
+        range.depth >= static_cast<int>(BOUNDING_BOXES_TREE_DEPTH) - 1)
+        return false;
+
+    const unsigned long long first = references[range.begin].mortonCode;
+    const unsigned long long last = references[range.end - 1].mortonCode;
+    size_t middle = range.begin + nbReferences / 2;
+    if (first != last)
+    {
+        unsigned long long bit = 1ULL << 63;
+        while ((bit & (first ^ last)) == 0)
+            bit >>= 1;
+        middle = std::partition_point(references.begin() + range.begin, references.begin() + range.end,
+                                      [bit](const BVHReference &reference) {
+                                          return (reference.mortonCode & bit) == 0;
+                                      }) -
+                 references.begin();
+    }
+
+    left.begin = range.begin;
+    left.end = middle;
+    left.depth = range.depth + 1;
+    right.begin = middle;
+    right.end = range.end;
+    right.depth = range.depth + 1;
+    return true;
+}
+
+typedef bool (*BVHSplitFunction)(std::vector<BVHReference> &, const BVHRange &, BVHRange &, BVHRange &);
+
+/*
+________________________________________________________________________________
+
+Recursively builds the hierarchy of a range. Nodes are appended in depth-first
+order so that the number of nodes in a subtree is the number of boxes the GPU
+can skip when the ray misses the node. Leaves are visited in the order of their
+ranges, so primitives of the hierarchy are simply the sorted references
+________________________________________________________________________________
+*/
+void buildBVHSubtree(std::vector<BVHReference> &references, const BVHRange &range, const BVHSplitFunction split,
+                     solr::BVHNodeContainer &nodes)
+{
+    const size_t nodeIndex = nodes.size();
+    solr::CPUBVHNode node;
+    memset(&node, 0, sizeof(solr::CPUBVHNode));
+    node.parameters[0] = range.parameters[0];
+    node.parameters[1] = range.parameters[1];
+    node.depth = range.depth;
+    node.indexForNextBox = 1;
+    nodes.push_back(node);
+
+    BVHRange left, right;
+    if (split(references, range, left, right))
+    {
+        buildBVHSubtree(references, left, split, nodes);
+        buildBVHSubtree(references, right, split, nodes);
+        nodes[nodeIndex].indexForNextBox = static_cast<int>(nodes.size() - nodeIndex);
     }
     else
     {
-        LOG_ERROR("    FAILED");
+        nodes[nodeIndex].startIndex = static_cast<int>(range.begin);
+        nodes[nodeIndex].nbPrimitives = static_cast<int>(range.end - range.begin);
     }
-    LOG_INFO(3, "----------------------------");
-#endif // USE_KINECT
 }
 
-GPUKernel::~GPUKernel()
+// Assigns depth-first positions to the nodes of the task tree
+void layoutBVHTask(std::vector<BVHTask> &tasks, const int index, size_t &nbNodes)
 {
-    LOG_INFO(3, "GPUKernel::~GPUKernel");
-
-#if USE_KINECT
-    if (m_kinectEnabled)
+    BVHTask &task = tasks[index];
+    task.nodeOffset = nbNodes;
+    if (task.children[0] == -1)
+        nbNodes += task.nodes.size();
+    else
     {
-        CloseHandle(m_skeletons);
-        CloseHandle(m_hNextDepthFrameEvent);
-        CloseHandle(m_hNextVideoFrameEvent);
-        CloseHandle(m_hNextSkeletonEvent);
-        NuiShutdown();
+        ++nbNodes;
+        layoutBVHTask(tasks, task.children[0], nbNodes);
+        layoutBVHTask(tasks, task.children[1], nbNodes);
     }
-#endif // USE_KINECT
-
-    cleanup();
-    LOG_INFO(3, "----------++++++++++ GPU Kernel Destroyed ++++++++++----------");
+    task.nbNodes = nbNodes - task.nodeOffset;
 }
 
-void GPUKernel::initBuffers()
+/*
+________________________________________________________________________________
+
+Builds a hierarchy from references with known bounds and centers, using the
+surface area heuristic or Morton codes. The top of the hierarchy is split until
+there are enough subtrees to keep all threads busy. Order receives the index of
+each reference, in leaf order. Returns the number of subtrees
+________________________________________________________________________________
+*/
+size_t buildBVH(std::vector<BVHReference> &references, const bool morton, solr::BVHNodeContainer &nodes,
+                std::vector<int> &order)
 {
-    LOG_INFO(3, "GPUKernel::initBuffers");
+    std::vector<BVHTask> tasks(1);
+    tasks[0].range.begin = 0;
+    tasks[0].range.end = references.size();
+    tasks[0].range.depth = 0;
+    computeRangeBounds(references, tasks[0].range);
+
+    BVHSplitFunction split = splitRange;
+    if (morton)
+    {
+        // Quantize centers on the scene grid and sort them along the Z-order curve
+        const int bitsPerAxis = (references.size() > LBVH_63_BITS_THRESHOLD) ? 21 : 10;
+        const float cells = static_cast<float>((1 << bitsPerAxis) - 1);
+        const vec3f &minimum = tasks[0].range.centers[0];
+        const vec3f &maximum = tasks[0].range.centers[1];
+        const vec3f scale = make_vec3f((maximum.x > minimum.x) ? cells / (maximum.x - minimum.x) : 0.f,
+                                       (maximum.y > minimum.y) ? cells / (maximum.y - minimum.y) : 0.f,
+                                       (maximum.z > minimum.z) ? cells / (maximum.z - minimum.z) : 0.f);
+#pragma omp parallel for
+        for (int i = 0; i < static_cast<int>(references.size()); ++i)
+        {
+            BVHReference &reference = references[i];
+            reference.mortonCode =
+                (expandMortonBits(static_cast<unsigned long long>((reference.center.x - minimum.x) * scale.x)) << 2) |
+                (expandMortonBits(static_cast<unsigned long long>((reference.center.y - minimum.y) * scale.y)) << 1) |
+                expandMortonBits(static_cast<unsigned long long>((reference.center.z - minimum.z) * scale.z));
+        }
+        sortMortonCodes(references, 3 * bitsPerAxis);
+        split = splitMortonRange;
+    }
 
-    // Setup CPU resources
-    m_lightInformation = new LightInformation[NB_MAX_LIGHTINFORMATIONS];
-
-    m_hMaterials = new Material[NB_MAX_MATERIALS + 1];
-    memset(m_hMaterials, 0, NB_MAX_MATERIALS * sizeof(Material));
-
-#ifndef USE_MANAGED_MEMORY
-    m_hBoundingBoxes = new BoundingBox[NB_MAX_BOXES];
-    memset(m_hBoundingBoxes, 0, NB_MAX_BOXES * sizeof(BoundingBox));
+    // Split the top of the hierarchy until there are enough subtrees to keep
+    // all threads busy. Large SAH ranges are themselves binned in parallel
+    const size_t taskSize = std::max(SAH_MIN_PARALLEL_TASK_SIZE, references.size() / SAH_NB_TASKS);
+    std::vector<int> subtrees;
+    for (size_t t(0); t < tasks.size(); ++t)
+    {
+        BVHRange left, right;
+        tasks[t].children[0] = -1;
+        tasks[t].children[1] = -1;
+        if (tasks[t].range.end - tasks[t].range.begin > taskSize && split(references, tasks[t].range, left, right))
+        {
+            tasks[t].children[0] = static_cast<int>(tasks.size());
+            tasks[t].children[1] = static_cast<int>(tasks.size() + 1);
+            tasks.resize(tasks.size() + 2);
+            tasks[tasks.size() - 2].range = left;
+            tasks[tasks.size() - 1].range = right;
+        }
+        else
+            subtrees.push_back(static_cast<int>(t));
+    }
 
-    m_hPrimitives = new Primitive[NB_MAX_PRIMITIVES];
-    memset(m_hPrimitives, 0, NB_MAX_PRIMITIVES * sizeof(Primitive));
-#endif
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < static_cast<int>(subtrees.size()); ++i)
+    {
+        BVHTask &task = tasks[subtrees[i]];
+        buildBVHSubtree(references, task.range, split, task.nodes);
+    }
 
-    m_hLamps = new Lamp[NB_MAX_LAMPS];
-    memset(m_hLamps, 0, NB_MAX_LAMPS * sizeof(Lamp));
+    // Gather subtrees into a single depth-first array of nodes
+    size_t nbNodes(0);
+    layoutBVHTask(tasks, 0, nbNodes);
+    nodes.resize(nbNodes);
+#pragma omp parallel for
+    for (int t = 0; t < static_cast<int>(tasks.size()); ++t)
+    {
+        const BVHTask &task = tasks[t];
+        if (task.children[0] == -1)
+        {
+            std::copy(task.nodes.begin(), task.nodes.end(), nodes.begin() + task.nodeOffset);
+        }
+        else
+        {
+            solr::CPUBVHNode &node = nodes[task.nodeOffset];
+            memset(&node, 0, sizeof(solr::CPUBVHNode));
+            node.parameters[0] = task.range.parameters[0];
+            node.parameters[1] = task.range.parameters[1];
+            node.depth = task.range.depth;
+            node.indexForNextBox = static_cast<int>(task.nbNodes);
+        }
+    }
 
-    // Textures
-    memset(m_hTextures, 0, NB_MAX_TEXTURES * sizeof(TextureInfo));
+    // Leaves index a flat array of elements, in the order of the sorted
+    // references
+    order.resize(references.size());
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(references.size()); ++i)
+        order[i] = static_cast<int>(references[i].index);
+    return subtrees.size();
+}
 
-    // Randoms
-    size_t size = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT;
-    if (m_hRandoms)
-        delete m_hRandoms;
-    m_hRandoms = new RandomBuffer[size];
+// Caps of cylinders and cones are discs orthogonal to their axis. Along each
+// world axis, they extend by radius * sqrt(1 - axis^2) around the end points
+vec3f capExtent(const solr::CPUPrimitive &primitive)
+{
+    vec3f axis = make_vec3f(primitive.p1.x - primitive.p0.x, primitive.p1.y - primitive.p0.y,
+                            primitive.p1.z - primitive.p0.z);
+    const float length = sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+    if (length != 0.f)
+        axis = make_vec3f(axis.x / length, axis.y / length, axis.z / length);
+    const float radius = primitive.size.x;
+    return make_vec3f(radius * sqrt(std::max(0.f, 1.f - axis.x * axis.x)),
+                      radius * sqrt(std::max(0.f, 1.f - axis.y * axis.y)),
+                      radius * sqrt(std::max(0.f, 1.f - axis.z * axis.z)));
+}
 
-    // Primitive IDs
-    if (m_hPrimitivesXYIds)
-        delete m_hPrimitivesXYIds;
-    m_hPrimitivesXYIds = new PrimitiveXYIdBuffer[size];
-    memset(m_hPrimitivesXYIds, 0, size * sizeof(PrimitiveXYIdBuffer));
+/*
+________________________________________________________________________________
 
-    // Bitmap
-    if (m_bitmap)
-        delete m_bitmap;
-    size *= gColorDepth;
-    m_bitmap = new BitmapBuffer[size];
-    memset(m_bitmap, 0, size * sizeof(BitmapBuffer));
-    LOG_INFO(3, m_bitmap << " - Bitmap Size=" << size);
+Bounds of the part of a reference lying between two planes orthogonal to an
+axis. Triangles are clipped as polygons, cylinders and cones along their axis,
+caps included. Other primitives and instances are bounded by their box, cut by
+the planes. Returns false if nothing remains between the planes
+________________________________________________________________________________
+*/
+bool clipReference(const solr::PrimitiveContainer &primitives, const BVHReference &reference, const int axis,
+                   const float minimum, const float maximum, vec3f parameters[2])
+{
+    parameters[0] = reference.parameters[0];
+    parameters[1] = reference.parameters[1];
+    if (reference.index < static_cast<long>(primitives.size()))
+    {
+        const solr::CPUPrimitive &primitive = primitives[reference.index];
+        switch (primitive.type)
+        {
+        case ptTriangle:
+        {
+            // Sutherland-Hodgman, one plane after the other. A triangle clipped
+            // by two parallel planes has at most five vertices
+            vec3f polygons[2][5] = {{primitive.p0, primitive.p1, primitive.p2}};
+            int nbVertices(3);
+            for (int plane(0); plane < 2; ++plane)
+            {
+                const vec3f *input = polygons[plane];
+                vec3f *output = polygons[1 - plane];
+                const float bound = (plane == 0) ? minimum : maximum;
+                int nbClipped(0);
+                for (int i(0); i < nbVertices; ++i)
+                {
+                    const vec3f &a = input[i];
+                    const vec3f &b = input[(i + 1) % nbVertices];
+                    const float ca = vec3fComponent(a, axis);
+                    const float cb = vec3fComponent(b, axis);
+                    const bool insideA = (plane == 0) ? (ca >= bound) : (ca <= bound);
+                    const bool insideB = (plane == 0) ? (cb >= bound) : (cb <= bound);
+                    if (insideA)
+                        output[nbClipped++] = a;
+                    if (insideA != insideB)
+                    {
+                        const float t = (bound - ca) / (cb - ca);
+                        output[nbClipped++] =
+                            make_vec3f(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+                    }
+                }
+                nbVertices = nbClipped;
+            }
+            vec3f bounds[2];
+            resetBounds(bounds);
+            for (int i(0); i < nbVertices; ++i)
+                growBounds(bounds, polygons[0][i], polygons[0][i]);
+            parameters[0] = max2(parameters[0], bounds[0]);
+            parameters[1] = min2(parameters[1], bounds[1]);
+            break;
+        }
+        case ptCylinder:
+        case ptCone:
+        {
+            // Part of the axis whose caps reach the slab, widened by the caps
+            const vec3f extent = capExtent(primitive);
+            const float e = vec3fComponent(extent, axis);
+            const float c0 = vec3fComponent(primitive.p0, axis);
+            const float c1 = vec3fComponent(primitive.p1, axis);
+            float t0(0.f);
+            float t1(1.f);
+            if (c1 != c0)
+            {
+                const float ta = (minimum - e - c0) / (c1 - c0);
+                const float tb = (maximum + e - c0) / (c1 - c0);
+                t0 = std::max(t0, std::min(ta, tb));
+                t1 = std::min(t1, std::max(ta, tb));
+            }
+            if (t0 > t1)
+                return false;
+            const vec3f &p0 = primitive.p0;
+            const vec3f &p1 = primitive.p1;
+            const vec3f q0 = make_vec3f(p0.x + (p1.x - p0.x) * t0, p0.y + (p1.y - p0.y) * t0, p0.z + (p1.z - p0.z) * t0);
+            const vec3f q1 = make_vec3f(p0.x + (p1.x - p0.x) * t1, p0.y + (p1.y - p0.y) * t1, p0.z + (p1.z - p0.z) * t1);
+            const vec3f corner0 = min2(q0, q1);
+            const vec3f corner1 = max2(q0, q1);
+            parameters[0] = max2(parameters[0], make_vec3f(corner0.x - extent.x, corner0.y - extent.y, corner0.z - extent.z));
+            parameters[1] = min2(parameters[1], make_vec3f(corner1.x + extent.x, corner1.y + extent.y, corner1.z + extent.z));
+            break;
+        }
+        default:
+            break;
+        }
+    }
 
-#ifdef USE_OCULUS
-    LOG_INFO(1, "Initializing Oculus DK1");
-    LOG_INFO(1, "-----------------------");
-    LOG_INFO(1, "        [ O O ]");
-    LOG_INFO(1, "-----------------------");
-    initializeOVR();
-#endif // USE_OCULUS
+    setVec3fComponent(parameters[0], axis, std::max(vec3fComponent(parameters[0], axis), minimum));
+    setVec3fComponent(parameters[1], axis, std::min(vec3fComponent(parameters[1], axis), maximum));
+    return parameters[0].x <= parameters[1].x && parameters[0].y <= parameters[1].y &&
+           parameters[0].z <= parameters[1].z;
 }
 
-void GPUKernel::cleanup()
+/*
+________________________________________________________________________________
+
+Looks for the cheapest plane splitting a range in space, using SBVH_NB_BINS
+bins per axis spanning the bounds of the range. References are clipped into
+every bin they overlap, entering the first one and leaving the last one, so
+that the cost of a plane accounts for the references it would duplicate.
+Returns false if no plane leaves references on both sides
+________________________________________________________________________________
+*/
+bool findSpatialSplit(const solr::PrimitiveContainer &primitives, const std::vector<BVHReference> &references,
+                      const BVHRange &range, BVHSpatialSplit &split)
 {
-#ifdef USE_OCULUS
-// finializeOVR();
-#endif // USE_OCULUS
+    float area = boxHalfArea(range.parameters[0], range.parameters[1]);
+    area = (area > 0.f) ? area : 1.f;
+    split.axis = -1;
+    split.cost = std::numeric_limits<float>::max();
+    for (int axis(0); axis < 3; ++axis)
+    {
+        const float minimum = vec3fComponent(range.parameters[0], axis);
+        const float binSize = (vec3fComponent(range.parameters[1], axis) - minimum) / SBVH_NB_BINS;
+        if (binSize <= 0.f)
+            continue;
 
-    LOG_INFO(3, "Cleaning up resources");
+        BVHSpatialBin bins[SBVH_NB_BINS];
+        for (int b(0); b < SBVH_NB_BINS; ++b)
+        {
+            resetBounds(bins[b].parameters);
+            bins[b].entries = 0;
+            bins[b].exits = 0;
+        }
+        for (size_t i(range.begin); i < range.end; ++i)
+        {
+            const BVHReference &reference = references[i];
+            const int first = std::min(
+                std::max(static_cast<int>((vec3fComponent(reference.parameters[0], axis) - minimum) / binSize), 0),
+                SBVH_NB_BINS - 1);
+            const int last = std::min(
+                std::max(static_cast<int>((vec3fComponent(reference.parameters[1], axis) - minimum) / binSize), first),
+                SBVH_NB_BINS - 1);
+            ++bins[first].entries;
+            ++bins[last].exits;
+            for (int b(first); b <= last; ++b)
+            {
+                vec3f clipped[2];
+                if (clipReference(primitives, reference, axis, minimum + b * binSize, minimum + (b + 1) * binSize,
+                                  clipped))
+                    growBounds(bins[b].parameters, clipped[0], clipped[1]);
+            }
+        }
 
-    for (int i(0); i < NB_MAX_FRAMES; ++i)
-    {
-        for (int j(0); j < BOUNDING_BOXES_TREE_DEPTH; ++j)
+        // Sweep bins. References entering left of a plane go to its left
+        // child, and references leaving right of it to its right child
+        vec3f rightBounds[SBVH_NB_BINS][2];
+        size_t rightCounts[SBVH_NB_BINS];
+        vec3f bounds[2];
+        resetBounds(bounds);
+        size_t count(0);
+        for (int b(SBVH_NB_BINS - 1); b > 0; --b)
         {
-            m_boundingBoxes[i][j].clear();
+            growBounds(bounds, bins[b].parameters[0], bins[b].parameters[1]);
+            count += bins[b].exits;
+            rightBounds[b][0] = bounds[0];
+            rightBounds[b][1] = bounds[1];
+            rightCounts[b] = count;
         }
-        m_nbActiveBoxes[i] = 0;
+        resetBounds(bounds);
+        count = 0;
+        for (int b(0); b < SBVH_NB_BINS - 1; ++b)
+        {
+            growBounds(bounds, bins[b].parameters[0], bins[b].parameters[1]);
+            count += bins[b].entries;
+            if (count == 0 || rightCounts[b + 1] == 0)
+                continue;
+            const float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST *
+                                                        (boxHalfArea(bounds[0], bounds[1]) * count +
+                                                         boxHalfArea(rightBounds[b + 1][0], rightBounds[b + 1][1]) *
+                                                             rightCounts[b + 1]) /
+                                                        area;
+            if (cost < split.cost)
+            {
+                split.axis = axis;
+                split.position = minimum + (b + 1) * binSize;
+                split.cost = cost;
+                split.parameters[0][0] = bounds[0];
+                split.parameters[0][1] = bounds[1];
+                split.parameters[1][0] = rightBounds[b + 1][0];
+                split.parameters[1][1] = rightBounds[b + 1][1];
+                split.counts[0] = count;
+                split.counts[1] = rightCounts[b + 1];
+            }
+        }
+    }
+    return split.axis != -1;
+}
 
-        m_primitives[i].clear();
-        m_nbActivePrimitives[i] = 0;
+/*
+________________________________________________________________________________
 
-        m_lamps[i].clear();
-        m_nbActiveLamps[i] = 0;
+Distributes references on both sides of a spatial split. References straddling
+the plane are clipped into both children, unless keeping them whole in one of
+the children is cheaper, in which case they are not duplicated
+________________________________________________________________________________
+*/
+void performSpatialSplit(const solr::PrimitiveContainer &primitives, const std::vector<BVHReference> &references,
+                         const BVHRange &range, const BVHSpatialSplit &split, std::vector<BVHReference> &left,
+                         std::vector<BVHReference> &right)
+{
+    const int axis = split.axis;
+    const float leftArea = boxHalfArea(split.parameters[0][0], split.parameters[0][1]);
+    const float rightArea = boxHalfArea(split.parameters[1][0], split.parameters[1][1]);
+    const float nbLeft = static_cast<float>(split.counts[0]);
+    const float nbRight = static_cast<float>(split.counts[1]);
+    for (size_t i(range.begin); i < range.end; ++i)
+    {
+        const BVHReference &reference = references[i];
+        if (vec3fComponent(reference.parameters[1], axis) <= split.position)
+        {
+            left.push_back(reference);
+            continue;
+        }
+        if (vec3fComponent(reference.parameters[0], axis) >= split.position)
+        {
+            right.push_back(reference);
+            continue;
+        }
 
-        m_minPos[i].x = -m_sceneInfo.viewDistance;
-        m_minPos[i].y = -m_sceneInfo.viewDistance;
-        m_minPos[i].z = -m_sceneInfo.viewDistance;
-        m_maxPos[i].x = m_sceneInfo.viewDistance;
-        m_maxPos[i].y = m_sceneInfo.viewDistance;
-        m_maxPos[i].z = m_sceneInfo.viewDistance;
+        vec3f bounds[2][2] = {{split.parameters[0][0], split.parameters[0][1]},
+                              {split.parameters[1][0], split.parameters[1][1]}};
+        growBounds(bounds[0], reference.parameters[0], reference.parameters[1]);
+        growBounds(bounds[1], reference.parameters[0], reference.parameters[1]);
+        const float duplicateCost = leftArea * nbLeft + rightArea * nbRight;
+        const float leftCost = boxHalfArea(bounds[0][0], bounds[0][1]) * nbLeft + rightArea * (nbRight - 1.f);
+        const float rightCost = leftArea * (nbLeft - 1.f) + boxHalfArea(bounds[1][0], bounds[1][1]) * nbRight;
+
+        const bool duplicate = duplicateCost < std::min(leftCost, rightCost);
+        BVHReference halves[2] = {reference, reference};
+        const bool clipped[2] = {duplicate && clipReference(primitives, reference, axis,
+                                                            vec3fComponent(range.parameters[0], axis),
+                                                            split.position, halves[0].parameters),
+                                 duplicate && clipReference(primitives, reference, axis, split.position,
+                                                            vec3fComponent(range.parameters[1], axis),
+                                                            halves[1].parameters)};
+        if (clipped[0] && clipped[1])
+        {
+            for (int h(0); h < 2; ++h)
+                halves[h].center = make_vec3f((halves[h].parameters[0].x + halves[h].parameters[1].x) / 2.f,
+                                              (halves[h].parameters[0].y + halves[h].parameters[1].y) / 2.f,
+                                              (halves[h].parameters[0].z + halves[h].parameters[1].z) / 2.f);
+            left.push_back(halves[0]);
+            right.push_back(halves[1]);
+        }
+        else if (clipped[1] || (!clipped[0] && rightCost < leftCost))
+            right.push_back(reference);
+        else
+            left.push_back(reference);
     }
+}
 
-    for (int i(0); i < NB_MAX_TEXTURES; ++i)
+/*
+________________________________________________________________________________
+
+Recursively builds a hierarchy with spatial splits (Stich et al., "Spatial
+splits in bounding volume hierarchies"). Nodes start with the object split of
+splitRange. When its children overlap by more than SBVH_MIN_OVERLAP of the
+root, or when it would rather make a leaf, a spatial split is also evaluated
+and kept if cheaper, as long as the budget of duplicated references allows it. References are consumed, and
+leaves append their indices to order, where a primitive may appear several
+times
+________________________________________________________________________________
+*/
+void buildSBVHSubtree(const solr::PrimitiveContainer &primitives, std::vector<BVHReference> &references,
+                      const int depth, const float rootArea, size_t &budget, solr::BVHNodeContainer &nodes,
+                      std::vector<int> &order)
+{
+    BVHRange range;
+    range.begin = 0;
+    range.end = references.size();
+    range.depth = depth;
+    computeRangeBounds(references, range);
+
+    const size_t nodeIndex = nodes.size();
+    solr::CPUBVHNode node;
+    memset(&node, 0, sizeof(solr::CPUBVHNode));
+    node.parameters[0] = range.parameters[0];
+    node.parameters[1] = range.parameters[1];
+    node.depth = depth;
+    node.indexForNextBox = 1;
+    nodes.push_back(node);
+
+    BVHRange left, right;
+    const bool objectSplit = splitRange(references, range, left, right);
+    bool spatialSplit =
+        (budget > 0 && references.size() > 1 && depth < static_cast<int>(BOUNDING_BOXES_TREE_DEPTH) - 1);
+    if (spatialSplit && objectSplit)
     {
-#ifdef USE_KINECT
-        if (i > 1 && m_hTextures[i].buffer)
-            delete[] m_hTextures[i].buffer;
-#else
-        if (m_hTextures[i].buffer != 0)
+        const vec3f overlap[2] = {max2(left.parameters[0], right.parameters[0]),
+                                  min2(left.parameters[1], right.parameters[1])};
+        spatialSplit = overlap[0].x < overlap[1].x && overlap[0].y < overlap[1].y && overlap[0].z < overlap[1].z &&
+                       boxHalfArea(overlap[0], overlap[1]) > SBVH_MIN_OVERLAP * rootArea;
+    }
+    std::vector<BVHReference> children[2];
+    if (spatialSplit)
+    {
+        float area = boxHalfArea(range.parameters[0], range.parameters[1]);
+        area = (area > 0.f) ? area : 1.f;
+        const float objectCost =
+            objectSplit ? SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST *
+                                                   (boxHalfArea(left.parameters[0], left.parameters[1]) *
+                                                        (left.end - left.begin) +
+                                                    boxHalfArea(right.parameters[0], right.parameters[1]) *
+                                                        (right.end - right.begin)) /
+                                                   area
+                        : SAH_INTERSECTION_COST * references.size();
+        BVHSpatialSplit split;
+        if (findSpatialSplit(primitives, references, range, split) && split.cost < objectCost)
         {
-            LOG_INFO(3, "[cleanup] Buffer " << i << " needs to be released");
-            delete[] m_hTextures[i].buffer;
-            m_hTextures[i].buffer = 0;
+            performSpatialSplit(primitives, references, range, split, children[0], children[1]);
+            const size_t duplicates = children[0].size() + children[1].size() - references.size();
+            if (children[0].empty() || children[1].empty() || duplicates > budget)
+            {
+                children[0].clear();
+                children[1].clear();
+            }
+            else
+                budget -= duplicates;
         }
-#endif // USE_KINECT
     }
-    memset(m_hTextures, 0, NB_MAX_TEXTURES * sizeof(TextureInfo));
+    if (children[0].empty() && !objectSplit)
+    {
+        nodes[nodeIndex].startIndex = static_cast<int>(order.size());
+        nodes[nodeIndex].nbPrimitives = static_cast<int>(references.size());
+        for (const auto &reference : references)
+            order.push_back(static_cast<int>(reference.index));
+        return;
+    }
+    if (children[0].empty())
+    {
+        children[0].assign(references.begin() + left.begin, references.begin() + left.end);
+        children[1].assign(references.begin() + right.begin, references.begin() + right.end);
+    }
 
-    m_vertices.clear();
-    m_normals.clear();
-    m_textCoords.clear();
+    // References of the node are no longer needed while its children are built
+    std::vector<BVHReference>().swap(references);
+    buildSBVHSubtree(primitives, children[0], depth + 1, rootArea, budget, nodes, order);
+    buildSBVHSubtree(primitives, children[1], depth + 1, rootArea, budget, nodes, order);
+    nodes[nodeIndex].indexForNextBox = static_cast<int>(nodes.size() - nodeIndex);
+}
 
-    if (m_hRandoms)
-        delete m_hRandoms;
-    m_hRandoms = 0;
-    if (m_bitmap)
-        delete[] m_bitmap;
-    m_bitmap = 0;
-#ifndef USE_MANAGED_MEMORY
-    if (m_hBoundingBoxes)
-        delete m_hBoundingBoxes;
-    m_hBoundingBoxes = 0;
-    if (m_hPrimitives)
-        delete m_hPrimitives;
-    m_hPrimitives = nullptr;
-#endif
-    if (m_hLamps)
-        delete m_hLamps;
-    m_hLamps = 0;
-    if (m_hMaterials)
-        delete m_hMaterials;
-    m_hMaterials = 0;
-    if (m_hPrimitivesXYIds)
-        delete m_hPrimitivesXYIds;
-    m_hPrimitivesXYIds = 0;
-    if (m_lightInformation)
-        delete m_lightInformation;
-    m_lightInformation = 0;
+/*
+________________________________________________________________________________
 
-    m_nbActiveMaterials = -1;
-    m_nbActiveTextures = 0;
-    m_materialsTransfered = false;
-    m_primitivesTransfered = false;
-    m_texturesTransfered = false;
-    m_randomsTransfered = false;
+Builds a hierarchy with spatial splits from references with known bounds and
+centers. At most SBVH_MAX_DUPLICATION references are added for each one, and
+the GPU buffer of primitives is never exceeded. The build is sequential, large
+ranges being binned in parallel by splitRange. Returns the number of
+references added by spatial splits
+________________________________________________________________________________
+*/
+size_t buildSBVH(const solr::PrimitiveContainer &primitives, std::vector<BVHReference> &references,
+                 solr::BVHNodeContainer &nodes, std::vector<int> &order)
+{
+    const size_t nbReferences = references.size();
+    vec3f bounds[2];
+    resetBounds(bounds);
+    for (const auto &reference : references)
+        growBounds(bounds, reference.parameters[0], reference.parameters[1]);
+    const float rootArea = boxHalfArea(bounds[0], bounds[1]);
+
+    size_t budget = static_cast<size_t>(nbReferences * SBVH_MAX_DUPLICATION);
+    budget = (nbReferences < NB_MAX_PRIMITIVES) ? std::min(budget, NB_MAX_PRIMITIVES - nbReferences) : 0;
+    nodes.clear();
+    order.clear();
+    order.reserve(nbReferences + budget);
+    buildSBVHSubtree(primitives, references, 0, rootArea, budget, nodes, order);
+    return order.size() - nbReferences;
+}
 
-    // Morphing
-    m_morph = 0.f;
-#if USE_KINECT
-    m_hVideo = 0;
-    m_hDepth = 0;
-    m_skeletons = 0;
-    m_hNextDepthFrameEvent = 0;
-    m_hNextVideoFrameEvent = 0;
-    m_hNextSkeletonEvent = 0;
-    m_pVideoStreamHandle = 0;
-    m_pDepthStreamHandle = 0;
-    m_skeletonsBody = -1;
-    m_skeletonsLamp = -1;
-    m_skeletonIndex = -1;
-#endif // USE_KINECT
+// Surface area heuristic cost of a node of a dynamic hierarchy
+double dynamicNodeCost(const solr::CPUDynamicBVHNode &node)
+{
+    const float area = boxHalfArea(node.parameters[0], node.parameters[1]);
+    if (node.children[0] == -1)
+        return SAH_INTERSECTION_COST * area * node.nbPrimitives;
+    return SAH_TRAVERSAL_COST * area;
 }
 
-void GPUKernel::reshape()
+// Recomputes the bounds and the size of an inner node from its children
+void refitDynamicNode(solr::CPUDynamicBVH &tree, const int index)
 {
-    // m_randomsTransfered=false;
+    solr::CPUDynamicBVHNode &node = tree.nodes[index];
+    const solr::CPUDynamicBVHNode &left = tree.nodes[node.children[0]];
+    const solr::CPUDynamicBVHNode &right = tree.nodes[node.children[1]];
+    tree.cost -= dynamicNodeCost(node);
+    node.parameters[0] = min2(left.parameters[0], right.parameters[0]);
+    node.parameters[1] = max2(left.parameters[1], right.parameters[1]);
+    node.nbNodes = 1 + left.nbNodes + right.nbNodes;
+    node.flatIndex = -1;
+    tree.cost += dynamicNodeCost(node);
 }
 
 /*
 ________________________________________________________________________________
 
-Sets camera
+Tree rotation of a dynamic hierarchy: a child of the node is swapped with a
+grandchild when this reduces the area of the other child. Bounds of the node
+are unchanged, and swapped subtrees keep their flattened copy
 ________________________________________________________________________________
 */
-void GPUKernel::setCamera(const vec3f &eye, const vec3f &dir, const vec4f &angles)
+void rotateDynamicNode(solr::CPUDynamicBVH &tree, const int index)
 {
-    LOG_INFO(3, "GPUKernel::setCamera(" << eye.x << "," << eye.y << "," << eye.z << " -> " << dir.x << "," << dir.y
-                                        << "," << dir.z << " : " << angles.x << "," << angles.y << "," << angles.z
-                                        << ")");
-    m_viewPos = eye;
-    m_viewDir = dir;
-    m_angles = angles;
-    m_refresh = true;
+    float bestGain(0.f);
+    int bestChild(-1);
+    int bestGrandchild(-1);
+    for (int c(0); c < 2; ++c)
+    {
+        const solr::CPUDynamicBVHNode &child = tree.nodes[tree.nodes[index].children[c]];
+        const solr::CPUDynamicBVHNode &other = tree.nodes[tree.nodes[index].children[1 - c]];
+        if (other.children[0] == -1)
+            continue;
+        const float area = boxHalfArea(other.parameters[0], other.parameters[1]);
+        for (int g(0); g < 2; ++g)
+        {
+            // The child takes the place of grandchild g, next to grandchild 1-g
+            const solr::CPUDynamicBVHNode &kept = tree.nodes[other.children[1 - g]];
+            const float gain = area - boxHalfArea(min2(child.parameters[0], kept.parameters[0]),
+                                                  max2(child.parameters[1], kept.parameters[1]));
+            if (gain > bestGain)
+            {
+                bestGain = gain;
+                bestChild = c;
+                bestGrandchild = g;
+            }
+        }
+    }
+    if (bestChild == -1)
+        return;
+
+    solr::CPUDynamicBVHNode &node = tree.nodes[index];
+    const int child = node.children[bestChild];
+    const int other = node.children[1 - bestChild];
+    const int grandchild = tree.nodes[other].children[bestGrandchild];
+    node.children[bestChild] = grandchild;
+    tree.nodes[grandchild].parent = index;
+    tree.nodes[other].children[bestGrandchild] = child;
+    tree.nodes[child].parent = other;
+    refitDynamicNode(tree, other);
+}
+
+// Unchanged subtree copied from the previous flattened hierarchy
+struct BVHNodeCopy
+{
+    int source;
+    int destination;
+    int nbNodes;
+    int depthOffset;
+};
+
+/*
+________________________________________________________________________________
+
+Flattens a dynamic hierarchy in depth-first order. Subtrees that did not change
+since the previous flattening are copied from it, only their depth may differ,
+and are reported in destination order. Returns false when the hierarchy is too
+deep for GPU kernels
+________________________________________________________________________________
+*/
+bool flattenDynamicBVH(const solr::CPUDynamicBVH &tree, const solr::BVHNodeContainer &previous,
+                       solr::BVHNodeContainer &nodes, std::vector<int> &flatNodes, std::vector<BVHNodeCopy> &copies)
+{
+    nodes.clear();
+    flatNodes.clear();
+    copies.clear();
+    if (tree.root == -1)
+        return true;
+
+    nodes.reserve(tree.nodes[tree.root].nbNodes);
+    flatNodes.reserve(tree.nodes[tree.root].nbNodes);
+    std::vector<vec2i> stack(1, make_vec2i(tree.root, 0));
+    while (!stack.empty())
+    {
+        const int index = stack.back().x;
+        const int depth = stack.back().y;
+        stack.pop_back();
+        if (depth >= static_cast<int>(BOUNDING_BOXES_TREE_DEPTH) - 1)
+            return false;
+
+        const solr::CPUDynamicBVHNode &node = tree.nodes[index];
+        if (node.flatIndex != -1)
+        {
+            BVHNodeCopy copy;
+            copy.source = node.flatIndex;
+            copy.destination = static_cast<int>(nodes.size());
+            copy.nbNodes = node.nbNodes;
+            copy.depthOffset = depth - previous[node.flatIndex].depth;
+            nodes.insert(nodes.end(), previous.begin() + copy.source,
+                         previous.begin() + copy.source + copy.nbNodes);
+            flatNodes.insert(flatNodes.end(), tree.flatNodes.begin() + copy.source,
+                             tree.flatNodes.begin() + copy.source + copy.nbNodes);
+            if (copy.depthOffset != 0)
+                for (int i = copy.destination; i < copy.destination + copy.nbNodes; ++i)
+                {
+                    nodes[i].depth += copy.depthOffset;
+                    if (nodes[i].depth >= static_cast<int>(BOUNDING_BOXES_TREE_DEPTH) - 1)
+                        return false;
+                }
+            copies.push_back(copy);
+            continue;
+        }
+
+        solr::CPUBVHNode flat;
+        memset(&flat, 0, sizeof(solr::CPUBVHNode));
+        flat.parameters[0] = node.parameters[0];
+        flat.parameters[1] = node.parameters[1];
+        flat.indexForNextBox = node.nbNodes;
+        flat.depth = depth;
+        if (node.children[0] == -1)
+        {
+            flat.startIndex = node.startIndex;
+            flat.nbPrimitives = node.nbPrimitives;
+        }
+        else
+        {
+            // Smallest subtree first, like layoutBVH does
+            const int first = (tree.nodes[node.children[1]].nbNodes < tree.nodes[node.children[0]].nbNodes) ? 1 : 0;
+            stack.push_back(make_vec2i(node.children[1 - first], depth + 1));
+            stack.push_back(make_vec2i(node.children[first], depth + 1));
+        }
+        nodes.push_back(flat);
+        flatNodes.push_back(index);
+    }
+    return true;
+}
+
+/*
+________________________________________________________________________________
+
+Cache friendly layout of a flattened hierarchy. Traversals test the first child
+right after its parent, and only reach the second one after skipping the whole
+subtree of the first one. Siblings are reordered so that the child with the
+smallest subtree comes first, which shortens the jump to the second child when
+the first one is missed. Leaves are then numbered in traversal order, so that
+the primitives of consecutive leaves are contiguous
+________________________________________________________________________________
+*/
+void layoutBVH(solr::BVHNodeContainer &nodes, std::vector<int> &order)
+{
+    if (nodes.empty())
+        return;
+
+    solr::BVHNodeContainer layout;
+    layout.reserve(nodes.size());
+    std::vector<int> layoutOrder;
+    layoutOrder.reserve(order.size());
+    std::vector<int> stack(1, 0);
+    while (!stack.empty())
+    {
+        const int index = stack.back();
+        stack.pop_back();
+        solr::CPUBVHNode node = nodes[index];
+        if (node.nbPrimitives != 0)
+        {
+            layoutOrder.insert(layoutOrder.end(), order.begin() + node.startIndex,
+                               order.begin() + node.startIndex + node.nbPrimitives);
+            node.startIndex = static_cast<int>(layoutOrder.size()) - node.nbPrimitives;
+        }
+        else
+        {
+            int first = index + 1;
+            int second = first + nodes[first].indexForNextBox;
+            if (nodes[second].indexForNextBox < nodes[first].indexForNextBox)
+                std::swap(first, second);
+            stack.push_back(second);
+            stack.push_back(first);
+        }
+        layout.push_back(node);
+    }
+    nodes.swap(layout);
+    order.swap(layoutOrder);
+}
+
+// Power of a light, or of all the lights below a node of the light hierarchy
+float lightPower(const LightInformation &light, const bool node)
+{
+    return node ? light.color.w : light.color.w * (light.color.x + light.color.y + light.color.z) / 3.f;
+}
+
+/*
+________________________________________________________________________________
+
+Recursively builds the light hierarchy of a range of lights, split at the
+median of the largest extent of their locations. Returns the index of the root
+of the range, which is the light itself for a single light
+________________________________________________________________________________
+*/
+int buildLightSubtree(std::vector<LightInformation> &lightInformation, std::vector<int> &lights, const size_t begin,
+                      const size_t end)
+{
+    if (end - begin == 1)
+        return lights[begin];
+
+    vec3f bounds[2];
+    resetBounds(bounds);
+    for (size_t i(begin); i < end; ++i)
+    {
+        const vec3f &location = lightInformation[lights[i]].location;
+        growBounds(bounds, location, location);
+    }
+    const vec3f extent = make_vec3f(bounds[1].x - bounds[0].x, bounds[1].y - bounds[0].y, bounds[1].z - bounds[0].z);
+    const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z) ? 1 : 2;
+    const size_t middle = begin + (end - begin) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + middle, lights.begin() + end,
+                     [&](const int a, const int b) {
+                         return vec3fComponent(lightInformation[a].location, axis) <
+                                vec3fComponent(lightInformation[b].location, axis);
+                     });
+
+    const int index = static_cast<int>(lightInformation.size());
+    lightInformation.push_back(LightInformation());
+    const int first = buildLightSubtree(lightInformation, lights, begin, middle);
+    const int second = buildLightSubtree(lightInformation, lights, middle, end);
+    const int nbLights = static_cast<int>(lights.size());
+
+    LightInformation &node = lightInformation[index];
+    memset(&node, 0, sizeof(LightInformation));
+    node.primitiveId = first;
+    node.materialId = second;
+    node.location = make_vec3f((bounds[0].x + bounds[1].x) / 2.f, (bounds[0].y + bounds[1].y) / 2.f,
+                               (bounds[0].z + bounds[1].z) / 2.f);
+    node.color.x = sqrt(extent.x * extent.x + extent.y * extent.y + extent.z * extent.z) / 2.f;
+    node.color.w = lightPower(lightInformation[first], first >= nbLights) +
+                   lightPower(lightInformation[second], second >= nbLights);
+    return index;
+}
+
+// Too many ranges of modified elements collapse into a single one
+void collapseDirtyRanges(std::vector<vec2i> &ranges)
+{
+    if (ranges.size() > NB_MAX_DIRTY_RANGES)
+    {
+        vec2i range = ranges[0];
+        for (const auto &r : ranges)
+            range = make_vec2i(std::min(range.x, r.x), std::max(range.y, r.y));
+        ranges.assign(1, range);
+    }
+}
+
+// Adds the [begin, end) range of modified elements, ranges being added in
+// increasing order
+void addDirtyRange(std::vector<vec2i> &ranges, const int begin, const int end)
+{
+    if (!ranges.empty() && begin >= ranges.back().x && begin <= ranges.back().y + DIRTY_RANGE_GAP)
+        ranges.back().y = std::max(ranges.back().y, end);
+    else
+        ranges.push_back(make_vec2i(begin, end));
+}
+
+// Set associative cache with least recently used replacement, simulating the
+// cache of a core to count the misses of traversals
+class CacheSimulator
+{
+public:
+    CacheSimulator()
+        : m_tags(BENCHMARK_CACHE_NB_SETS * BENCHMARK_CACHE_NB_WAYS, std::numeric_limits<size_t>::max())
+    {
+    }
+
+    // Returns the number of cache lines of [address, address + size) that were
+    // not cached
+    int access(const void *address, const size_t size)
+    {
+        const size_t begin = reinterpret_cast<size_t>(address) / BENCHMARK_CACHE_LINE_SIZE;
+        const size_t end = (reinterpret_cast<size_t>(address) + size - 1) / BENCHMARK_CACHE_LINE_SIZE;
+        int nbMisses = 0;
+        for (size_t line = begin; line <= end; ++line)
+        {
+            // Ways of a set are ordered from the most to the least recently used
+            size_t *ways = &m_tags[(line % BENCHMARK_CACHE_NB_SETS) * BENCHMARK_CACHE_NB_WAYS];
+            size_t way = 0;
+            while (way < BENCHMARK_CACHE_NB_WAYS - 1 && ways[way] != line)
+                ++way;
+            if (ways[way] != line)
+                ++nbMisses;
+            for (; way > 0; --way)
+                ways[way] = ways[way - 1];
+            ways[0] = line;
+        }
+        return nbMisses;
+    }
+
+private:
+    std::vector<size_t> m_tags;
+};
+
+/*
+________________________________________________________________________________
+
+Merges sorted indices into [x, y) ranges of modified elements. Indices closer
+than DIRTY_RANGE_GAP share a range, and too many ranges collapse into one
+________________________________________________________________________________
+*/
+void addDirtyRanges(std::vector<vec2i> &ranges, const std::vector<int> &indices)
+{
+    for (const auto index : indices)
+        addDirtyRange(ranges, index, index + 1);
+    collapseDirtyRanges(ranges);
+}
+
+// Decodes quantized corners relative to the decoded box of the parent, the way
+// GPU kernels do
+void dequantizeBox(const vec3f parent[2], const CompressedBoundingBox &node, vec3f parameters[2])
+{
+    const float scale = 1.f / static_cast<float>(COMPRESSED_BOXES_QUANTIZATION_STEPS);
+    const vec3f step = make_vec3f((parent[1].x - parent[0].x) * scale, (parent[1].y - parent[0].y) * scale,
+                                  (parent[1].z - parent[0].z) * scale);
+    parameters[0] = make_vec3f(parent[0].x + step.x * node.lower[0], parent[0].y + step.y * node.lower[1],
+                               parent[0].z + step.z * node.lower[2]);
+    parameters[1] = make_vec3f(parent[0].x + step.x * node.upper[0], parent[0].y + step.y * node.upper[1],
+                               parent[0].z + step.z * node.upper[2]);
+}
+
+/*
+________________________________________________________________________________
+
+Quantizes a box relative to the decoded box of its parent. Corners are rounded
+outwards, with a small margin, so that the decoded box always encloses the
+original one, even when decoders round slightly differently
+________________________________________________________________________________
+*/
+void quantizeBox(const vec3f parent[2], const vec3f parameters[2], CompressedBoundingBox &node, vec3f decoded[2])
+{
+    const int steps = static_cast<int>(COMPRESSED_BOXES_QUANTIZATION_STEPS);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float origin = vec3fComponent(parent[0], axis);
+        const float extent = vec3fComponent(parent[1], axis) - origin;
+        const float step = extent * (1.f / static_cast<float>(COMPRESSED_BOXES_QUANTIZATION_STEPS));
+        const float margin = extent * COMPRESSED_BOXES_TOLERANCE;
+        int lower = 0;
+        int upper = steps;
+        if (step > 0.f)
+        {
+            const float corner0 = vec3fComponent(parameters[0], axis);
+            const float corner1 = vec3fComponent(parameters[1], axis);
+            lower = std::max(0, std::min(steps, static_cast<int>(floor((corner0 - origin) / step))));
+            upper = std::max(0, std::min(steps, static_cast<int>(ceil((corner1 - origin) / step))));
+            while (lower > 0 && origin + step * lower > corner0 - margin)
+                --lower;
+            while (upper < steps && origin + step * upper < corner1 + margin)
+                ++upper;
+        }
+        node.lower[axis] = static_cast<unsigned char>(lower);
+        node.upper[axis] = static_cast<unsigned char>(upper);
+    }
+    dequantizeBox(parent, node, decoded);
+}
+
+/*
+________________________________________________________________________________
+
+Creates a node of the wide hierarchy from candidate boxes. A candidate is
+either a box with its descendants (index >= 0), or only the primitives of a box
+(-1 - index). Boxes with the largest surface are replaced by their children
+until the node is full. Remaining boxes with children become inner nodes
+________________________________________________________________________________
+*/
+int collapseWideBVHNode(const BoundingBox *boxes, std::vector<int> candidates,
+                        std::vector<solr::CPUWideBVHNode> &nodes)
+{
+    while (true)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for (size_t i = 0; i < candidates.size(); ++i)
+        {
+            const int box = candidates[i];
+            if (box < 0 || boxes[box].indexForNextBox.x <= 1)
+                continue;
+            size_t nbChildren = (boxes[box].nbPrimitives > 0) ? 1 : 0;
+            for (int child = box + 1; child < box + boxes[box].indexForNextBox.x;
+                 child += boxes[child].indexForNextBox.x)
+                ++nbChildren;
+            // A single box is always expanded, its children being spread if needed
+            const float area = boxHalfArea(boxes[box].parameters[0], boxes[box].parameters[1]);
+            const bool fits =
+                candidates.size() == 1 || candidates.size() - 1 + nbChildren <= static_cast<size_t>(solr::WIDE_BVH_WIDTH);
+            if (fits && area > bestArea)
+            {
+                best = static_cast<int>(i);
+                bestArea = area;
+            }
+        }
+        if (best == -1)
+            break;
+
+        const int box = candidates[best];
+        candidates.erase(candidates.begin() + best);
+        if (boxes[box].nbPrimitives > 0)
+            candidates.push_back(-1 - box);
+        for (int child = box + 1; child < box + boxes[box].indexForNextBox.x; child += boxes[child].indexForNextBox.x)
+            candidates.push_back(child);
+    }
+
+    const int index = static_cast<int>(nodes.size());
+    nodes.push_back(solr::CPUWideBVHNode());
+    solr::CPUWideBVHNode node;
+    vec3f empty[2];
+    resetBounds(empty);
+    for (int i = 0; i < solr::WIDE_BVH_WIDTH; ++i)
+    {
+        vec3f parameters[2] = {empty[0], empty[1]};
+        node.children[i] = 0;
+        if (candidates.size() > static_cast<size_t>(solr::WIDE_BVH_WIDTH))
+        {
+            // Too many boxes at the same level, they are spread among children
+            const size_t begin = candidates.size() * i / solr::WIDE_BVH_WIDTH;
+            const size_t end = candidates.size() * (i + 1) / solr::WIDE_BVH_WIDTH;
+            for (size_t c = begin; c < end; ++c)
+            {
+                const int box = (candidates[c] < 0) ? -1 - candidates[c] : candidates[c];
+                growBounds(parameters, boxes[box].parameters[0], boxes[box].parameters[1]);
+            }
+            node.children[i] = collapseWideBVHNode(
+                boxes, std::vector<int>(candidates.begin() + begin, candidates.begin() + end), nodes);
+        }
+        else if (i < static_cast<int>(candidates.size()))
+        {
+            const int box = (candidates[i] < 0) ? -1 - candidates[i] : candidates[i];
+            parameters[0] = boxes[box].parameters[0];
+            parameters[1] = boxes[box].parameters[1];
+            if (candidates[i] < 0 || boxes[box].indexForNextBox.x <= 1)
+                node.children[i] = -1 - box;
+            else
+                node.children[i] = collapseWideBVHNode(boxes, std::vector<int>(1, box), nodes);
+        }
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            node.parameters[0][axis][i] = vec3fComponent(parameters[0], axis);
+            node.parameters[1][axis][i] = vec3fComponent(parameters[1], axis);
+        }
+    }
+    nodes[index] = node;
+    return index;
+}
+
+// Grows bounds with the leaf boxes below a child of the wide hierarchy. Returns
+// the number of children below it whose corners do not contain their leaves
+int checkWideBVHChild(const BoundingBox *boxes, const std::vector<solr::CPUWideBVHNode> &nodes, const int child,
+                      vec3f bounds[2])
+{
+    if (child < 0)
+    {
+        growBounds(bounds, boxes[-1 - child].parameters[0], boxes[-1 - child].parameters[1]);
+        return 0;
+    }
+    int nbErrors = 0;
+    const solr::CPUWideBVHNode &node = nodes[child];
+    for (int i = 0; i < solr::WIDE_BVH_WIDTH; ++i)
+    {
+        // Only the root is node 0, so 0 marks an empty child
+        if (node.children[i] == 0)
+            continue;
+        vec3f leaves[2];
+        resetBounds(leaves);
+        nbErrors += checkWideBVHChild(boxes, nodes, node.children[i], leaves);
+        bool contained = true;
+        for (int axis = 0; axis < 3; ++axis)
+            contained = contained && vec3fComponent(leaves[0], axis) >= node.parameters[0][axis][i] &&
+                        vec3fComponent(leaves[1], axis) <= node.parameters[1][axis][i];
+        if (!contained)
+            ++nbErrors;
+        growBounds(bounds, leaves[0], leaves[1]);
+    }
+    return nbErrors;
+}
+
+#ifdef WIDE_BVH_AVX
+__attribute__((target("avx"))) static int intersectWideBVHNodeAVX(const solr::CPUWideBVHNode &node,
+                                                                  const solr::WideBVHTraversal &traversal,
+                                                                  const float tmax, float *distances)
+{
+    __m256 tNear = _mm256_setzero_ps();
+    __m256 tFar = _mm256_set1_ps(tmax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const int sign = traversal.signs[axis];
+        const __m256 origin = _mm256_set1_ps(vec3fComponent(traversal.origin, axis));
+        const __m256 invDirection = _mm256_set1_ps(vec3fComponent(traversal.invDirection, axis));
+        const __m256 near = _mm256_loadu_ps(node.parameters[sign][axis]);
+        const __m256 far = _mm256_loadu_ps(node.parameters[1 - sign][axis]);
+        tNear = _mm256_max_ps(tNear, _mm256_mul_ps(_mm256_sub_ps(near, origin), invDirection));
+        tFar = _mm256_min_ps(tFar, _mm256_mul_ps(_mm256_sub_ps(far, origin), invDirection));
+    }
+    _mm256_storeu_ps(distances, tNear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+}
+#endif
+
+// Tests a ray against all children of a wide node. Returns a mask of the
+// children hit, and their entry distances
+int intersectWideBVHNode(const solr::CPUWideBVHNode &node, const solr::WideBVHTraversal &traversal,
+                         const float tmax, float *distances)
+{
+#ifdef WIDE_BVH_AVX
+    static const bool avx = __builtin_cpu_supports("avx");
+    if (avx)
+        return intersectWideBVHNodeAVX(node, traversal, tmax, distances);
+#endif
+#if defined(WIDE_BVH_SSE)
+    int mask = 0;
+    for (int half = 0; half < solr::WIDE_BVH_WIDTH; half += 4)
+    {
+        __m128 tNear = _mm_setzero_ps();
+        __m128 tFar = _mm_set1_ps(tmax);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const int sign = traversal.signs[axis];
+            const __m128 origin = _mm_set1_ps(vec3fComponent(traversal.origin, axis));
+            const __m128 invDirection = _mm_set1_ps(vec3fComponent(traversal.invDirection, axis));
+            const __m128 near = _mm_loadu_ps(node.parameters[sign][axis] + half);
+            const __m128 far = _mm_loadu_ps(node.parameters[1 - sign][axis] + half);
+            tNear = _mm_max_ps(tNear, _mm_mul_ps(_mm_sub_ps(near, origin), invDirection));
+            tFar = _mm_min_ps(tFar, _mm_mul_ps(_mm_sub_ps(far, origin), invDirection));
+        }
+        _mm_storeu_ps(distances + half, tNear);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) << half;
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int i = 0; i < solr::WIDE_BVH_WIDTH; ++i)
+    {
+        float tNear = 0.f;
+        float tFar = tmax;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const int sign = traversal.signs[axis];
+            const float origin = vec3fComponent(traversal.origin, axis);
+            const float invDirection = vec3fComponent(traversal.invDirection, axis);
+            tNear = std::max(tNear, (node.parameters[sign][axis][i] - origin) * invDirection);
+            tFar = std::min(tFar, (node.parameters[1 - sign][axis][i] - origin) * invDirection);
+        }
+        distances[i] = tNear;
+        if (tNear <= tFar)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Slab test of a ray against a box, for CPU traversals
+bool rayBoxIntersection(const vec3f parameters[2], const vec3f &origin, const vec3f &invDirection, const float t1)
+{
+    float tmin = 0.f;
+    float tmax = t1;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float o = vec3fComponent(origin, axis);
+        const float inv = vec3fComponent(invDirection, axis);
+        float t0 = (vec3fComponent(parameters[0], axis) - o) * inv;
+        float t2 = (vec3fComponent(parameters[1], axis) - o) * inv;
+        if (t0 > t2)
+            std::swap(t0, t2);
+        tmin = std::max(tmin, t0);
+        tmax = std::min(tmax, t2);
+        if (tmin > tmax)
+            return false;
+    }
+    return true;
+}
+
+namespace solr
+{
+GPUKernel *SingletonKernel::m_kernel = 0;
+
+SingletonKernel::SingletonKernel()
+{
+}
+
+GPUKernel *SingletonKernel::kernel()
+{
+    if (!m_kernel)
+#ifdef USE_CUDA
+        m_kernel = new CudaKernel();
+#else
+#ifdef USE_OPENCL
+        m_kernel = new OpenCLKernel();
+#else
+        m_kernel = new CPUKernel();
+#endif // USE_OPENCL
+#endif // USE_CUDA
+    return m_kernel;
+}
+
+float GPUKernel::dotProduct(const vec3f &a, const vec3f &b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// ________________________________________________________________________________
+float GPUKernel::vectorLength(const vec3f &vector)
+{
+    return sqrt(vector.x * vector.x + vector.y * vector.y + vector.z * vector.z);
+}
+
+// ________________________________________________________________________________
+void GPUKernel::normalizeVector(vec3f &v)
+{
+    float l = vectorLength(v);
+    if (l != 0.f)
+    {
+        v.x /= l;
+        v.y /= l;
+        v.z /= l;
+    }
+}
+
+vec3f GPUKernel::crossProduct(const vec3f &b, const vec3f &c)
+{
+    vec3f a;
+    a.x = b.y * c.z - b.z * c.y;
+    a.y = b.z * c.x - b.x * c.z;
+    a.z = b.x * c.y - b.y * c.x;
+    return a;
+}
+
+#ifndef WIN32
+typedef struct
+{
+    short bfType;
+    int bfSize;
+    short Reserved1;
+    short Reserved2;
+    int bfOffBits;
+} BITMAPFILEHEADER;
+
+typedef struct
+{
+    int biSizeImage;
+    int biWidth;
+    int biHeight;
+} BITMAPINFOHEADER;
+#endif
+
+GPUKernel::GPUKernel()
+    : m_oculus(false)
+    , m_hBoundingBoxes(0)
+    , m_hPrimitives(0)
+    , m_hMaterials(0)
+    , m_hPrimitivesXYIds(0)
+    , m_nbActiveMaterials(-1)
+    , m_nbActiveTextures(0)
+    , m_lightInformationSize(0)
+    , m_maxPrimitivesPerBox(0)
+    , m_boxesBuildTime(0.0)
+    , m_doneWithAdding(false)
+    , m_addingIndex(0)
+    , m_distortion(0.1f)
+    , m_frame(0)
+    , m_nbFrames(0)
+    , m_morph(0.f)
+    , m_treeDepth(2)
+    , m_bitmap(0)
+    , m_primitivesTransfered(false)
+    , m_materialsTransfered(false)
+    , m_texturesTransfered(false)
+    , m_refresh(true)
+    , m_activeLogging(false)
+    , m_accelerationStructure(asGrid)
+    , m_compressedBoxes(false)
+    , m_samplingThreshold(0.f)
+    , m_sampler(stRandom)
+    , m_backgroundBuilds(false)
+    , m_backgroundBuild(0)
+    , m_backgroundBuildRequested(false)
+    , m_streamedFrame(-1)
+    , m_nbTopLevelBoxes(0)
+    , m_optimalNbOfBoxes(NB_MAX_BOXES)
+    , m_GLMode(-1)
+    , m_currentMaterial(0)
+    , m_pointSize(1.f)
+#if USE_KINECT
+    , m_hVideo(0)
+    , m_hDepth(0)
+    , m_skeletons(0)
+    , m_hNextDepthFrameEvent(0)
+    , m_hNextVideoFrameEvent(0)
+    , m_hNextSkeletonEvent(0)
+    , m_pVideoStreamHandle(0)
+    , m_pDepthStreamHandle(0)
+    , m_skeletonsBody(-1)
+    , m_skeletonsLamp(-1)
+    , m_skeletonIndex(-1)
+#endif // USE_KINECT
+#ifdef USE_OCULUS
+    , m_sensorFusion(0)
+#endif // USE_OCULUS
+{
+    LOG_INFO(1, "");
+    LOG_INFO(1, "                     _|_|_|            _|              _|_|_|  ");
+    LOG_INFO(1, "                   _|          _|_|    _|              _|    _|");
+    LOG_INFO(1, "                     _|_|    _|    _|  _|  _|_|_|_|_|  _|_|_|  ");
+    LOG_INFO(1, "                         _|  _|    _|  _|              _|    _|");
+    LOG_INFO(1, "                   _|_|_|      _|_|    _|              _|    _|");
+    LOG_INFO(1, "");
+    LOG_INFO(1, "                            Speed Of Light Ray-tracer");
+    LOG_INFO(1, "                       Created by cyrille.favreau@gmail.com");
+    LOG_INFO(1, "");
+
+    for (int i(0); i < NB_MAX_FRAMES; ++i)
+    {
+        m_nbActiveBoxes[i] = 0;
+        m_nbActivePrimitives[i] = 0;
+        m_nbActiveLamps[i] = 0;
+    }
+
+    LOG_INFO(3, "----------++++++++++  GPU Kernel created  ++++++++++----------");
+    LOG_INFO(3, "CPU: SceneInfo         : " << sizeof(SceneInfo));
+    LOG_INFO(3, "CPU: Ray               : " << sizeof(Ray));
+    LOG_INFO(3, "CPU: PrimitiveType     : " << sizeof(PrimitiveType));
+    LOG_INFO(3, "CPU: Material          : " << sizeof(Material));
+    LOG_INFO(3, "CPU: BoundingBox       : " << sizeof(BoundingBox));
+    LOG_INFO(3, "CPU: Primitive         : " << sizeof(Primitive));
+    LOG_INFO(3, "CPU: PostProcessingType: " << sizeof(PostProcessingType));
+    LOG_INFO(3, "CPU: PostProcessingInfo: " << sizeof(PostProcessingInfo));
+    LOG_INFO(3, "Textures " << NB_MAX_TEXTURES);
+
+    m_viewPos.x = 0.f;
+    m_viewPos.y = 0.f;
+    m_viewPos.z = 0.f;
+    m_viewDir.x = 0.f;
+    m_viewDir.y = 0.f;
+    m_viewDir.z = 0.f;
+
+#if USE_KINECT
+    // Initialize Kinect
+    LOG_INFO(1, "----------------------------");
+    LOG_INFO(1, "                         O  ");
+    LOG_INFO(1, "                       --+--");
+    LOG_INFO(1, "                         |  ");
+    LOG_INFO(1, "Kinect initialization   / \\");
+
+    HRESULT hr = NuiInitialize(NUI_INITIALIZE_FLAG_USES_DEPTH_AND_PLAYER_INDEX | NUI_INITIALIZE_FLAG_USES_SKELETON |
+                               NUI_INITIALIZE_FLAG_USES_COLOR);
+    m_kinectEnabled = (hr == S_OK);
+
+    if (m_kinectEnabled)
+    {
+        m_hNextDepthFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_hNextVideoFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_hNextSkeletonEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+        m_skeletons = CreateEvent(NULL, TRUE, FALSE, NULL);
+        NuiSkeletonTrackingEnable(m_skeletons, NUI_SKELETON_TRACKING_FLAG_ENABLE_SEATED_SUPPORT);
+
+        NuiImageStreamOpen(NUI_IMAGE_TYPE_COLOR, NUI_IMAGE_RESOLUTION_640x480, 0, 2, m_hNextVideoFrameEvent,
+                           &m_pVideoStreamHandle);
+        NuiImageStreamOpen(NUI_IMAGE_TYPE_DEPTH_AND_PLAYER_INDEX, NUI_IMAGE_RESOLUTION_320x240, 0, 2,
+                           m_hNextDepthFrameEvent, &m_pDepthStreamHandle);
+
+        NuiCameraElevationSetAngle(0);
+    }
+    else
+    {
+        LOG_ERROR("    FAILED");
+    }
+    LOG_INFO(3, "----------------------------");
+#endif // USE_KINECT
+}
+
+GPUKernel::~GPUKernel()
+{
+    LOG_INFO(3, "GPUKernel::~GPUKernel");
+
+#if USE_KINECT
+    if (m_kinectEnabled)
+    {
+        CloseHandle(m_skeletons);
+        CloseHandle(m_hNextDepthFrameEvent);
+        CloseHandle(m_hNextVideoFrameEvent);
+        CloseHandle(m_hNextSkeletonEvent);
+        NuiShutdown();
+    }
+#endif // USE_KINECT
+
+    cleanup();
+    LOG_INFO(3, "----------++++++++++ GPU Kernel Destroyed ++++++++++----------");
+}
+
+void GPUKernel::initBuffers()
+{
+    LOG_INFO(3, "GPUKernel::initBuffers");
+
+    // Setup CPU resources
+    m_hMaterials = new Material[NB_MAX_MATERIALS + 1];
+    memset(m_hMaterials, 0, NB_MAX_MATERIALS * sizeof(Material));
+
+#ifndef USE_MANAGED_MEMORY
+    m_hBoundingBoxes = new BoundingBox[NB_MAX_BOXES];
+    memset(m_hBoundingBoxes, 0, NB_MAX_BOXES * sizeof(BoundingBox));
+
+    m_hPrimitives = new Primitive[NB_MAX_PRIMITIVES];
+    memset(m_hPrimitives, 0, NB_MAX_PRIMITIVES * sizeof(Primitive));
+#endif
+
+    // Textures
+    memset(m_hTextures, 0, NB_MAX_TEXTURES * sizeof(TextureInfo));
+
+    // Primitive IDs
+    size_t size = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT;
+    if (m_hPrimitivesXYIds)
+        delete m_hPrimitivesXYIds;
+    m_hPrimitivesXYIds = new PrimitiveXYIdBuffer[size];
+    memset(m_hPrimitivesXYIds, 0, size * sizeof(PrimitiveXYIdBuffer));
+
+    // Bitmap
+    if (m_bitmap)
+        delete m_bitmap;
+    size *= gColorDepth;
+    m_bitmap = new BitmapBuffer[size];
+    memset(m_bitmap, 0, size * sizeof(BitmapBuffer));
+    LOG_INFO(3, m_bitmap << " - Bitmap Size=" << size);
+
+#ifdef USE_OCULUS
+    LOG_INFO(1, "Initializing Oculus DK1");
+    LOG_INFO(1, "-----------------------");
+    LOG_INFO(1, "        [ O O ]");
+    LOG_INFO(1, "-----------------------");
+    initializeOVR();
+#endif // USE_OCULUS
+}
+
+void GPUKernel::cleanup()
+{
+#ifdef USE_OCULUS
+// finializeOVR();
+#endif // USE_OCULUS
+
+    LOG_INFO(3, "Cleaning up resources");
+    cancelBackgroundBuild();
+
+    m_hCompressedBoxes.clear();
+    m_wideBVHNodes.clear();
+    m_meshes.clear();
+    m_instances.clear();
+    m_meshBoxes.clear();
+    m_nbTopLevelBoxes = 0;
+    for (int i(0); i < NB_MAX_FRAMES; ++i)
+    {
+        for (int j(0); j < BOUNDING_BOXES_TREE_DEPTH; ++j)
+        {
+            m_boundingBoxes[i][j].clear();
+        }
+        m_bvhNodes[i].clear();
+        m_bvhPrimitives[i].clear();
+        m_bvhStreamInfo[i] = BVHStreamInfo();
+        m_nbActiveBoxes[i] = 0;
+
+        m_primitives[i].clear();
+        m_nbActivePrimitives[i] = 0;
+
+        m_lamps[i].clear();
+        m_nbActiveLamps[i] = 0;
+
+        m_minPos[i].x = -m_sceneInfo.viewDistance;
+        m_minPos[i].y = -m_sceneInfo.viewDistance;
+        m_minPos[i].z = -m_sceneInfo.viewDistance;
+        m_maxPos[i].x = m_sceneInfo.viewDistance;
+        m_maxPos[i].y = m_sceneInfo.viewDistance;
+        m_maxPos[i].z = m_sceneInfo.viewDistance;
+    }
+
+    for (int i(0); i < NB_MAX_TEXTURES; ++i)
+    {
+#ifdef USE_KINECT
+        if (i > 1 && m_hTextures[i].buffer)
+            delete[] m_hTextures[i].buffer;
+#else
+        if (m_hTextures[i].buffer != 0)
+        {
+            LOG_INFO(3, "[cleanup] Buffer " << i << " needs to be released");
+            delete[] m_hTextures[i].buffer;
+            m_hTextures[i].buffer = 0;
+        }
+#endif // USE_KINECT
+    }
+    memset(m_hTextures, 0, NB_MAX_TEXTURES * sizeof(TextureInfo));
+
+    m_vertices.clear();
+    m_normals.clear();
+    m_textCoords.clear();
+
+    if (m_bitmap)
+        delete[] m_bitmap;
+    m_bitmap = 0;
+#ifndef USE_MANAGED_MEMORY
+    if (m_hBoundingBoxes)
+        delete m_hBoundingBoxes;
+    m_hBoundingBoxes = 0;
+    if (m_hPrimitives)
+        delete m_hPrimitives;
+    m_hPrimitives = nullptr;
+#endif
+    m_hLamps.clear();
+    if (m_hMaterials)
+        delete m_hMaterials;
+    m_hMaterials = 0;
+    if (m_hPrimitivesXYIds)
+        delete m_hPrimitivesXYIds;
+    m_hPrimitivesXYIds = 0;
+    m_lightInformation.clear();
+    m_lightInformationSize = 0;
+
+    m_nbActiveMaterials = -1;
+    m_nbActiveTextures = 0;
+    m_materialsTransfered = false;
+    m_primitivesTransfered = false;
+    m_texturesTransfered = false;
+
+    // Morphing
+    m_morph = 0.f;
+#if USE_KINECT
+    m_hVideo = 0;
+    m_hDepth = 0;
+    m_skeletons = 0;
+    m_hNextDepthFrameEvent = 0;
+    m_hNextVideoFrameEvent = 0;
+    m_hNextSkeletonEvent = 0;
+    m_pVideoStreamHandle = 0;
+    m_pDepthStreamHandle = 0;
+    m_skeletonsBody = -1;
+    m_skeletonsLamp = -1;
+    m_skeletonIndex = -1;
+#endif // USE_KINECT
+}
+
+void GPUKernel::reshape()
+{
+}
+
+/*
+________________________________________________________________________________
+
+Sets camera
+________________________________________________________________________________
+*/
+void GPUKernel::setCamera(const vec3f &eye, const vec3f &dir, const vec4f &angles)
+{
+    LOG_INFO(3, "GPUKernel::setCamera(" << eye.x << "," << eye.y << "," << eye.z << " -> " << dir.x << "," << dir.y
+                                        << "," << dir.z << " : " << angles.x << "," << angles.y << "," << angles.z
+                                        << ")");
+    m_viewPos = eye;
+    m_viewDir = dir;
+    m_angles = angles;
+    m_refresh = true;
+}
+
+int GPUKernel::addPrimitive(PrimitiveType type, bool belongsToModel)
+{
+    LOG_INFO(3, "GPUKernel::addPrimitive");
+    int returnValue = -1;
+    if (m_doneWithAdding)
+    {
+        returnValue = m_addingIndex;
+        m_addingIndex++;
+    }
+    else
+    {
+        CPUPrimitive primitive;
+        memset(&primitive, 0, sizeof(CPUPrimitive));
+        primitive.belongsToModel = belongsToModel;
+        primitive.type = type;
+        int index = static_cast<int>(m_primitives[m_frame].size());
+        m_primitives[m_frame].push_back(primitive);
+        LOG_INFO(3, "m_primitives.size() = " << m_primitives[m_frame].size());
+        returnValue = index;
+    }
+    return returnValue;
+}
+
+CPUPrimitive *GPUKernel::getPrimitive(const unsigned int index)
+{
+    CPUPrimitive *returnValue(NULL);
+    if (index < m_primitives[m_frame].size())
+    {
+        returnValue = &(m_primitives[m_frame])[index];
+    }
+    return returnValue;
+}
+
+void GPUKernel::removePrimitive(const int index)
+{
+    if (index < 0 || index >= static_cast<int>(m_primitives[m_frame].size()))
+    {
+        LOG_ERROR("GPUKernel::removePrimitive: Out of bounds (" << index << "/" << m_primitives[m_frame].size()
+                                                                << ")");
+        return;
+    }
+    std::vector<unsigned char> &removed = m_removedPrimitives[m_frame];
+    if (index >= static_cast<int>(removed.size()))
+        removed.resize(m_primitives[m_frame].size(), 0);
+    removed[index] = 1;
+    if (!m_dynamicBVH[m_frame].nodes.empty())
+        m_dynamicBVH[m_frame].pending.push_back(index);
+}
+
+void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, float w, float h, float d, int materialId)
+{
+    setPrimitive(index, x0, y0, z0, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, w, h, d, materialId);
+}
+
+void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, float x1, float y1, float z1, float w,
+                             float h, float d, int materialId)
+{
+    setPrimitive(index, x0, y0, z0, x1, y1, z1, 0.f, 0.f, 0.f, w, h, d, materialId);
+}
+
+void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, float x1, float y1, float z1, float x2,
+                             float y2, float z2, float w, float h, float d, int materialId)
+{
+    float scale = 1.f;
+    m_primitivesTransfered = false;
+    if (index >= 0 && index < m_primitives[m_frame].size())
+    {
+        if (index < m_removedPrimitives[m_frame].size())
+            m_removedPrimitives[m_frame][index] = 0;
+        (m_primitives[m_frame])[index].movable = true;
+        (m_primitives[m_frame])[index].p0.x = x0 * scale;
+        (m_primitives[m_frame])[index].p0.y = y0 * scale;
+        (m_primitives[m_frame])[index].p0.z = z0 * scale;
+        (m_primitives[m_frame])[index].p1.x = x1 * scale;
+        (m_primitives[m_frame])[index].p1.y = y1 * scale;
+        (m_primitives[m_frame])[index].p1.z = z1 * scale;
+        (m_primitives[m_frame])[index].p2.x = x2 * scale;
+        (m_primitives[m_frame])[index].p2.y = y2 * scale;
+        (m_primitives[m_frame])[index].p2.z = z2 * scale;
+        (m_primitives[m_frame])[index].size.x = w * scale;
+        (m_primitives[m_frame])[index].size.y = h * scale;
+        (m_primitives[m_frame])[index].size.z = d * scale;
+        (m_primitives[m_frame])[index].n0 = make_vec3f();
+        (m_primitives[m_frame])[index].n1 = make_vec3f();
+        (m_primitives[m_frame])[index].n2 = make_vec3f();
+        (m_primitives[m_frame])[index].vt0 = make_vec2f();
+        (m_primitives[m_frame])[index].vt1 = make_vec2f();
+        (m_primitives[m_frame])[index].vt2 = make_vec2f();
+        (m_primitives[m_frame])[index].materialId = materialId;
+
+        switch ((m_primitives[m_frame])[index].type)
+        {
+        case ptSphere:
+        {
+            (m_primitives[m_frame])[index].size.x = w * scale;
+            (m_primitives[m_frame])[index].size.y = w * scale;
+            (m_primitives[m_frame])[index].size.z = w * scale;
+            break;
+        }
+        case ptEllipsoid:
+        {
+            (m_primitives[m_frame])[index].size.x = w * scale;
+            (m_primitives[m_frame])[index].size.y = h * scale;
+            (m_primitives[m_frame])[index].size.z = d * scale;
+            break;
+        }
+        case ptCylinder:
+        case ptCone:
+        {
+            // Axis
+            vec4f axis;
+            axis.x = x1 * scale - x0 * scale;
+            axis.y = y1 * scale - y0 * scale;
+            axis.z = z1 * scale - z0 * scale;
+            float len = sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+            if (len != 0.f)
+            {
+                axis.x /= len;
+                axis.y /= len;
+                axis.z /= len;
+            }
+            (m_primitives[m_frame])[index].n1.x = axis.x;
+            (m_primitives[m_frame])[index].n1.y = axis.y;
+            (m_primitives[m_frame])[index].n1.z = axis.z;
+
+            // Center
+            (m_primitives[m_frame])[index].p2.x = (x0 * scale + x1 * scale) / 2.f;
+            (m_primitives[m_frame])[index].p2.y = (y0 * scale + y1 * scale) / 2.f;
+            (m_primitives[m_frame])[index].p2.z = (z0 * scale + z1 * scale) / 2.f;
+
+            // Length
+            (m_primitives[m_frame])[index].size.x = w * scale;
+            (m_primitives[m_frame])[index].size.y = w * scale;
+            (m_primitives[m_frame])[index].size.z = w * scale;
+            break;
+        }
+#ifdef USE_KINECT
+        case ptCamera:
+        {
+            (m_primitives[m_frame])[index].n0.x = 0.f;
+            (m_primitives[m_frame])[index].n0.y = 0.f;
+            (m_primitives[m_frame])[index].n0.z = -1.f;
+            break;
+        }
+#endif // USE_KINECT
+        case ptXYPlane:
+        {
+            (m_primitives[m_frame])[index].n0.x = 0.f;
+            (m_primitives[m_frame])[index].n0.y = 0.f;
+            (m_primitives[m_frame])[index].n0.z = 1.f;
+            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
+            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            break;
+        }
+        case ptYZPlane:
+        {
+            (m_primitives[m_frame])[index].n0.x = 1.f;
+            (m_primitives[m_frame])[index].n0.y = 0.f;
+            (m_primitives[m_frame])[index].n0.z = 0.f;
+            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
+            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            break;
+        }
+        case ptXZPlane:
+        case ptCheckboard:
+        {
+            (m_primitives[m_frame])[index].n0.x = 0.f;
+            (m_primitives[m_frame])[index].n0.y = 1.f;
+            (m_primitives[m_frame])[index].n0.z = 0.f;
+            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
+            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            break;
+        }
+        case ptTriangle:
+        {
+            vec3f v0, v1;
+            v0.x = (m_primitives[m_frame])[index].p1.x - (m_primitives[m_frame])[index].p0.x;
+            v0.y = (m_primitives[m_frame])[index].p1.y - (m_primitives[m_frame])[index].p0.y;
+            v0.z = (m_primitives[m_frame])[index].p1.z - (m_primitives[m_frame])[index].p0.z;
+            normalizeVector(v0);
+
+            v1.x = (m_primitives[m_frame])[index].p2.x - (m_primitives[m_frame])[index].p0.x;
+            v1.y = (m_primitives[m_frame])[index].p2.y - (m_primitives[m_frame])[index].p0.y;
+            v1.z = (m_primitives[m_frame])[index].p2.z - (m_primitives[m_frame])[index].p0.z;
+            normalizeVector(v1);
+
+            (m_primitives[m_frame])[index].n0 = crossProduct(v0, v1);
+            normalizeVector((m_primitives[m_frame])[index].n0);
+            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
+            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            break;
+        }
+        }
+        // min
+        m_minPos[m_frame].x = std::min(x0 * scale, m_minPos[m_frame].x);
+        m_minPos[m_frame].y = std::min(y0 * scale, m_minPos[m_frame].y);
+        m_minPos[m_frame].z = std::min(z0 * scale, m_minPos[m_frame].z);
+
+        // max
+        m_maxPos[m_frame].x = std::max(x0 * scale, m_maxPos[m_frame].x);
+        m_maxPos[m_frame].y = std::max(y0 * scale, m_maxPos[m_frame].y);
+        m_maxPos[m_frame].z = std::max(z0 * scale, m_maxPos[m_frame].z);
+        invalidatePrimitive(index);
+    }
+    else
+    {
+        LOG_ERROR("GPUKernel::setPrimitive: Out of bounds (" << index << "/" << NB_MAX_PRIMITIVES << ")");
+    }
+}
+
+void GPUKernel::invalidatePrimitive(const unsigned int index)
+{
+    // Flags streamed primitives so that they are refitted by compactBoxes(false)
+    BVHStreamInfo &info = m_bvhStreamInfo[m_frame];
+    if (index < info.slots.size() && info.slots[index] != -1)
+        info.moved[info.slots[index]] = 1;
+    else if (!m_dynamicBVH[m_frame].nodes.empty())
+        // Primitives out of a dynamic hierarchy are inserted by its next update
+        m_dynamicBVH[m_frame].pending.push_back(index);
+}
+
+void GPUKernel::setPrimitiveIsMovable(const int &index, bool movable)
+{
+    if (index >= 0 && index < m_primitives[m_frame].size())
+    {
+        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
+        primitive.movable = movable;
+    }
+}
+
+void GPUKernel::setPrimitiveBellongsToModel(const int &index, bool bellongsToModel)
+{
+    if (index >= 0 && index < m_primitives[m_frame].size())
+    {
+        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
+        primitive.belongsToModel = bellongsToModel;
+    }
+}
+
+void GPUKernel::setPrimitiveTextureCoordinates(const unsigned int index, const vec2f& vt0, const vec2f& vt1, const vec2f& vt2)
+{
+    if (index < m_primitives[m_frame].size())
+    {
+        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
+        primitive.vt0 = vt0;
+        primitive.vt1 = vt1;
+        primitive.vt2 = vt2;
+        invalidatePrimitive(index);
+    }
+}
+
+void GPUKernel::setPrimitiveNormals(int unsigned index, vec3f n0, vec3f n1, vec3f n2)
+{
+    if (index < m_primitives[m_frame].size())
+    {
+        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
+        normalizeVector(n0);
+        primitive.n0 = n0;
+        normalizeVector(n1);
+        primitive.n1 = n1;
+        normalizeVector(n2);
+        primitive.n2 = n2;
+        invalidatePrimitive(index);
+    }
+}
+
+unsigned int GPUKernel::getPrimitiveAt(int x, int y)
+{
+    LOG_INFO(3, "GPUKernel::getPrimitiveAt(" << x << "," << y << ")");
+    unsigned int returnValue = -1;
+    unsigned int index = y * m_sceneInfo.size.x + x;
+    if (index < static_cast<unsigned int>(m_sceneInfo.size.x * m_sceneInfo.size.y))
+    {
+        returnValue = m_hPrimitivesXYIds[index].x;
+    }
+    return returnValue;
+}
+
+bool GPUKernel::updateBoundingBox(CPUBoundingBox &box)
+{
+    LOG_INFO(3, "GPUKernel::updateBoundingBox()");
+
+    bool result(false);
+
+    // Process box size
+    vec3f corner0;
+    vec3f corner1;
+
+    box.parameters[0].x = 1000000;
+    box.parameters[0].y = 1000000;
+    box.parameters[0].z = 1000000;
+    box.parameters[1].x = -1000000;
+    box.parameters[1].y = -1000000;
+    box.parameters[1].z = -1000000;
+
+    for (const auto &p : box.primitives)
+    {
+        CPUPrimitive &primitive = (m_primitives[m_frame])[p];
+        result = (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f);
+        getPrimitiveBounds(primitive, corner0, corner1);
+        box.parameters[0] = min2(box.parameters[0], corner0);
+        box.parameters[1] = max2(box.parameters[1], corner1);
+    }
+
+    box.center.x = (box.parameters[0].x + box.parameters[1].x) / 2.f;
+    box.center.y = (box.parameters[0].y + box.parameters[1].y) / 2.f;
+    box.center.z = (box.parameters[0].z + box.parameters[1].z) / 2.f;
+    // LOG_INFO(1,"Box
+    // Center="<<box.center.x<<","<<box.center.y<<","<<box.center.z);
+    return result;
+}
+
+void GPUKernel::getPrimitiveBounds(const CPUPrimitive &primitive, vec3f &corner0, vec3f &corner1)
+{
+    switch (primitive.type)
+    {
+    case ptTriangle:
+    {
+        corner0 = min3(primitive.p0, primitive.p1, primitive.p2);
+        corner1 = max3(primitive.p0, primitive.p1, primitive.p2);
+        break;
+    }
+    case ptCylinder:
+    case ptCone:
+    {
+        const vec3f extent = capExtent(primitive);
+        corner0 = min2(primitive.p0, primitive.p1);
+        corner1 = max2(primitive.p0, primitive.p1);
+        corner0 = make_vec3f(corner0.x - extent.x, corner0.y - extent.y, corner0.z - extent.z);
+        corner1 = make_vec3f(corner1.x + extent.x, corner1.y + extent.y, corner1.z + extent.z);
+        break;
+    }
+    case ptSphere:
+    case ptEnvironment:
+    {
+        const float radius = primitive.size.x;
+        corner0 = make_vec3f(primitive.p0.x - radius, primitive.p0.y - radius, primitive.p0.z - radius);
+        corner1 = make_vec3f(primitive.p0.x + radius, primitive.p0.y + radius, primitive.p0.z + radius);
+        break;
+    }
+    default:
+    {
+        // Ellipsoids and planes are centered on p0 and extend by size
+        corner0 = make_vec3f(primitive.p0.x - primitive.size.x, primitive.p0.y - primitive.size.y,
+                             primitive.p0.z - primitive.size.z);
+        corner1 = make_vec3f(primitive.p0.x + primitive.size.x, primitive.p0.y + primitive.size.y,
+                             primitive.p0.z + primitive.size.z);
+        break;
+    }
+    }
+}
+
+void GPUKernel::getReferenceBounds(const int reference, vec3f &corner0, vec3f &corner1)
+{
+    const int nbPrimitives = static_cast<int>(m_primitives[m_frame].size());
+    if (reference < nbPrimitives)
+    {
+        getPrimitiveBounds(m_primitives[m_frame][reference], corner0, corner1);
+        return;
+    }
+
+    // Instances are bounded by the corners of their mesh, in world space
+    const CPUInstance &instance = m_instances[reference - nbPrimitives];
+    const vec3f *bounds = m_meshes[instance.mesh].parameters;
+    vec3f parameters[2];
+    resetBounds(parameters);
+    for (int i = 0; i < 8; ++i)
+    {
+        const float x = bounds[i & 1].x;
+        const float y = bounds[(i >> 1) & 1].y;
+        const float z = bounds[(i >> 2) & 1].z;
+        const vec3f corner =
+            make_vec3f(instance.position.x + instance.axes[0].x * x + instance.axes[1].x * y + instance.axes[2].x * z,
+                       instance.position.y + instance.axes[0].y * x + instance.axes[1].y * y + instance.axes[2].y * z,
+                       instance.position.z + instance.axes[0].z * x + instance.axes[1].z * y + instance.axes[2].z * z);
+        growBounds(parameters, corner, corner);
+    }
+    corner0 = parameters[0];
+    corner1 = parameters[1];
+}
+
+bool GPUKernel::updateOutterBoundingBox(CPUBoundingBox &outterBox, const int depth)
+{
+    LOG_INFO(3, "GPUKernel::updateOutterBoundingBox()");
+
+    bool result(false);
+
+    // Reset box size
+    outterBox.parameters[0].x = m_sceneInfo.viewDistance;
+    outterBox.parameters[0].y = m_sceneInfo.viewDistance;
+    outterBox.parameters[0].z = m_sceneInfo.viewDistance;
+    outterBox.parameters[1].x = -m_sceneInfo.viewDistance;
+    outterBox.parameters[1].y = -m_sceneInfo.viewDistance;
+    outterBox.parameters[1].z = -m_sceneInfo.viewDistance;
+
+    LOG_INFO(3, "OutterBox: (" << outterBox.center.x << "," << outterBox.center.y << "," << outterBox.center.z << "),("
+                               << outterBox.indexForNextBox << "," << outterBox.primitives.size() << "),("
+                               << outterBox.parameters[0].x << "," << outterBox.parameters[0].y << ","
+                               << outterBox.parameters[0].z << "),(" << outterBox.parameters[1].x << ","
+                               << outterBox.parameters[1].y << "," << outterBox.parameters[1].z << ")");
+
+    // Process box size
+    for (const auto &p : outterBox.primitives)
+    {
+        try
+        {
+            CPUBoundingBox &box = (m_boundingBoxes[m_frame][depth])[p];
+            if (outterBox.parameters[0].x > box.parameters[0].x)
+                outterBox.parameters[0].x = box.parameters[0].x;
+            if (outterBox.parameters[0].y > box.parameters[0].y)
+                outterBox.parameters[0].y = box.parameters[0].y;
+            if (outterBox.parameters[0].z > box.parameters[0].z)
+                outterBox.parameters[0].z = box.parameters[0].z;
+            if (outterBox.parameters[1].x < box.parameters[1].x)
+                outterBox.parameters[1].x = box.parameters[1].x;
+            if (outterBox.parameters[1].y < box.parameters[1].y)
+                outterBox.parameters[1].y = box.parameters[1].y;
+            if (outterBox.parameters[1].z < box.parameters[1].z)
+                outterBox.parameters[1].z = box.parameters[1].z;
+        }
+        catch (...)
+        {
+            LOG_ERROR("Ca chie grave dans les boites!");
+        }
+    }
+    outterBox.center.x = (outterBox.parameters[0].x + outterBox.parameters[1].x) / 2.f;
+    outterBox.center.y = (outterBox.parameters[0].y + outterBox.parameters[1].y) / 2.f;
+    outterBox.center.z = (outterBox.parameters[0].z + outterBox.parameters[1].z) / 2.f;
+
+    return result;
+}
+
+void GPUKernel::resetBoxes(bool resetPrimitives)
+{
+    if (resetPrimitives)
+        for (int i(0); i < m_boundingBoxes[m_frame][0].size(); ++i)
+            resetBox(m_boundingBoxes[m_frame][0][i], resetPrimitives);
+    else
+        m_boundingBoxes[m_frame][0].clear();
+}
+
+void GPUKernel::resetBox(CPUBoundingBox &box, bool resetPrimitives)
+{
+    LOG_INFO(3, "GPUKernel::resetBox(" << resetPrimitives << ")");
+    if (resetPrimitives)
+    {
+        box.primitives.clear();
+        box.indexForNextBox = 1;
+    }
+    box.parameters[0].x = m_sceneInfo.viewDistance;
+    box.parameters[0].y = m_sceneInfo.viewDistance;
+    box.parameters[0].z = m_sceneInfo.viewDistance;
+    box.parameters[1].x = -m_sceneInfo.viewDistance;
+    box.parameters[1].y = -m_sceneInfo.viewDistance;
+    box.parameters[1].z = -m_sceneInfo.viewDistance;
+}
+
+int GPUKernel::processBoxes(const int boxSize, bool simulate)
+{
+    vec4f boxSteps;
+    boxSteps.x = (m_maxPos[m_frame].x - m_minPos[m_frame].x) / boxSize;
+    boxSteps.y = (m_maxPos[m_frame].y - m_minPos[m_frame].y) / boxSize;
+    boxSteps.z = (m_maxPos[m_frame].z - m_minPos[m_frame].z) / boxSize;
+
+    boxSteps.x = (boxSteps.x == 0.f) ? 1 : boxSteps.x;
+    boxSteps.y = (boxSteps.y == 0.f) ? 1 : boxSteps.y;
+    boxSteps.z = (boxSteps.z == 0.f) ? 1 : boxSteps.z;
+
+    std::map<unsigned int, unsigned int> primitivesPerBox;
+
+    // Add primitives to boxes
+    unsigned int p = 0;
+    size_t maxPrimitivesPerBox = 0;
+    for (const auto &primitive : m_primitives[m_frame])
+    {
+
+        const auto &center = primitive.p0;
+        unsigned int X = static_cast<int>((center.x - m_minPos[m_frame].x) / boxSteps.x);
+        unsigned int Y = static_cast<int>((center.y - m_minPos[m_frame].y) / boxSteps.y);
+        unsigned int Z = static_cast<int>((center.z - m_minPos[m_frame].z) / boxSteps.z);
+        unsigned int B = 1 + 1000 * (X * boxSize * boxSize + Y * boxSize + Z);
+
+        if (simulate)
+            if (primitivesPerBox.find(B) == primitivesPerBox.end())
+                primitivesPerBox[B] = 0;
+            else
+                primitivesPerBox[B]++;
+        else
+        {
+            if (primitivesPerBox.find(B) == primitivesPerBox.end())
+            {
+                // Create Box B since it does not exist yet
+                CPUBoundingBox box;
+                memset(&box, 0, sizeof(CPUBoundingBox));
+                box.parameters[0].x = m_sceneInfo.viewDistance;
+                box.parameters[0].y = m_sceneInfo.viewDistance;
+                box.parameters[0].z = m_sceneInfo.viewDistance;
+                box.parameters[1].x = -m_sceneInfo.viewDistance;
+                box.parameters[1].y = -m_sceneInfo.viewDistance;
+                box.parameters[1].z = -m_sceneInfo.viewDistance;
+                box.indexForNextBox = 1;
+                m_boundingBoxes[m_frame][0].insert(std::make_pair(B, box));
+            }
+
+            // Lights
+            if (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f)
+            {
+                // Lights are added to first box of higher level
+                m_boundingBoxes[m_frame][m_treeDepth][0].primitives.push_back(p);
+                LOG_INFO(3, "[" << m_treeDepth << "] Lamp " << p << " added (" << primitive.p0.x << ","
+                                << primitive.p0.y << "," << primitive.p0.z << " " << m_nbActiveLamps[m_frame]
+                                << "), Material ID=" << primitive.materialId);
+            }
+            else
+            {
+                // LOG_INFO(3, "Adding primitive to box " << B);
+                m_boundingBoxes[m_frame][0][B].primitives.push_back(p);
+                if (m_boundingBoxes[m_frame][0][B].primitives.size() > maxPrimitivesPerBox)
+                    maxPrimitivesPerBox = m_boundingBoxes[m_frame][0][B].primitives.size();
+            }
+        }
+        ++p;
+    }
+
+    // Now update box sizes
+    if (!simulate)
+        for (auto &box : m_boundingBoxes[m_frame][0])
+            updateBoundingBox(box.second);
+
+    LOG_INFO(3, "Maximum number of primitives per box=" << maxPrimitivesPerBox << " for level 0");
+    return static_cast<int>(maxPrimitivesPerBox);
+}
+
+int GPUKernel::processOutterBoxes(const int boxSize, const int boundingBoxesDepth)
+{
+    LOG_INFO(3, "processOutterBoxes(" << boxSize << "," << boundingBoxesDepth << ")");
+    vec4f boxSteps;
+    boxSteps.x = (m_maxPos[m_frame].x - m_minPos[m_frame].x) / boxSize;
+    boxSteps.y = (m_maxPos[m_frame].y - m_minPos[m_frame].y) / boxSize;
+    boxSteps.z = (m_maxPos[m_frame].z - m_minPos[m_frame].z) / boxSize;
+
+    boxSteps.x = (boxSteps.x == 0.f) ? 1 : boxSteps.x;
+    boxSteps.y = (boxSteps.y == 0.f) ? 1 : boxSteps.y;
+    boxSteps.z = (boxSteps.z == 0.f) ? 1 : boxSteps.z;
+
+    // Create boxes in Rubik's cube mode :-)
+    size_t maxPrimitivesPerBox(0);
+    for (const auto &box : m_boundingBoxes[m_frame][boundingBoxesDepth - 1])
+    {
+        const auto &center = box.second.center;
+        int X = static_cast<int>((center.x - m_minPos[m_frame].x) / boxSteps.x);
+        int Y = static_cast<int>((center.y - m_minPos[m_frame].y) / boxSteps.y);
+        int Z = static_cast<int>((center.z - m_minPos[m_frame].z) / boxSteps.z);
+        int B = (X * boxSize * boxSize + Y * boxSize + Z);
+
+        B++; // Index 0 is used to store lights, so we start storing primitives
+             // from index 1
+
+        // Box B
+        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[0].x = m_sceneInfo.viewDistance;
+        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[0].y = m_sceneInfo.viewDistance;
+        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[0].z = m_sceneInfo.viewDistance;
+        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[1].x = -m_sceneInfo.viewDistance;
+        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[1].y = -m_sceneInfo.viewDistance;
+        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[1].z = -m_sceneInfo.viewDistance;
+        m_boundingBoxes[m_frame][boundingBoxesDepth][B].primitives.push_back(box.first);
+        if (m_boundingBoxes[m_frame][boundingBoxesDepth][B].primitives.size() > maxPrimitivesPerBox)
+            maxPrimitivesPerBox = m_boundingBoxes[m_frame][boundingBoxesDepth][B].primitives.size();
+    }
+    LOG_INFO(3, "Depth " << boundingBoxesDepth << ": " << m_boundingBoxes[m_frame][boundingBoxesDepth].size()
+                         << " created");
+
+    // Now update box sizes
+    for (auto &box : m_boundingBoxes[m_frame][boundingBoxesDepth])
+        updateOutterBoundingBox(box.second, boundingBoxesDepth - 1);
+
+    LOG_INFO(3, "Maximum number of sub-boxes per box=" << maxPrimitivesPerBox << " for level " << boundingBoxesDepth);
+    return static_cast<int>(maxPrimitivesPerBox);
+}
+
+// Hierarchy built from a snapshot of the scene. The build only reads the
+// snapshot, so that it can run in a background thread while the previous
+// hierarchy is rendered
+struct BVHBuildTask
+{
+    int frame;
+    AccelerationStructure structure;
+    size_t nbPrimitives;                          // Size of the scene when it was snapshot
+    size_t nbInstances;
+    std::vector<unsigned char> removed;           // Removed primitives when the scene was snapshot
+    std::vector<long> lights;                     // Primitives of the lights box
+    std::vector<BVHReference> references;         // Other references, with their bounds
+    PrimitiveContainer primitives;                // Copy of the primitives, only for spatial splits
+    const PrimitiveContainer *splitPrimitives;    // Primitives clipped by spatial splits
+    BVHNodeContainer nodes;
+    std::vector<int> order;
+    size_t nbSubtrees;
+    size_t nbDuplicates;
+    double buildTime; // Milliseconds
+    std::atomic<bool> ready;
+    std::thread thread;
+};
+
+// Builds the hierarchy of a snapshot, without accessing the kernel
+void buildBVHTask(BVHBuildTask &task)
+{
+    const auto start = std::chrono::steady_clock::now();
+    task.nbSubtrees = 1;
+    task.nbDuplicates = 0;
+    if (!task.references.empty())
+    {
+        if (task.structure == asSBVH)
+            task.nbDuplicates = buildSBVH(*task.splitPrimitives, task.references, task.nodes, task.order);
+        else
+            task.nbSubtrees = buildBVH(task.references, task.structure == asLBVH, task.nodes, task.order);
+        layoutBVH(task.nodes, task.order);
+    }
+    std::vector<BVHReference>().swap(task.references);
+    PrimitiveContainer().swap(task.primitives);
+    task.buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    task.ready = true;
+}
+
+int GPUKernel::processBVHBoxes()
+{
+    LOG_INFO(3, "GPUKernel::processBVHBoxes");
+    BVHBuildTask task;
+    snapshotBVH(task, false);
+    buildBVHTask(task);
+    return installBVH(task);
+}
+
+// Collects the references of the hierarchy of the current frame and their bounds
+void GPUKernel::snapshotBVH(BVHBuildTask &task, const bool copyPrimitives)
+{
+    // Instances are referenced after the primitives, and are leaves of the
+    // hierarchy of the scene like any other primitive
+    const PrimitiveContainer &primitives = m_primitives[m_frame];
+    const std::vector<unsigned char> &removed = m_removedPrimitives[m_frame];
+    task.frame = m_frame;
+    task.structure = m_accelerationStructure;
+    task.nbPrimitives = primitives.size();
+    task.nbInstances = m_instances.size();
+    task.removed = removed;
+    task.ready = false;
+    std::vector<BVHReference> &references = task.references;
+    references.reserve(primitives.size() + m_instances.size());
+    for (size_t i(0); i < primitives.size() + m_instances.size(); ++i)
+    {
+        if (i < removed.size() && removed[i] != 0)
+            continue;
+        if (i < primitives.size() && m_hMaterials[primitives[i].materialId].innerIllumination.x != 0.f)
+            task.lights.push_back(static_cast<long>(i));
+        else
+        {
+            BVHReference reference;
+            reference.index = static_cast<long>(i);
+            references.push_back(reference);
+        }
+    }
+
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(references.size()); ++i)
+    {
+        BVHReference &reference = references[i];
+        getReferenceBounds(reference.index, reference.parameters[0], reference.parameters[1]);
+        reference.center = make_vec3f((reference.parameters[0].x + reference.parameters[1].x) / 2.f,
+                                      (reference.parameters[0].y + reference.parameters[1].y) / 2.f,
+                                      (reference.parameters[0].z + reference.parameters[1].z) / 2.f);
+    }
+
+    // Spatial splits clip primitives, which may be modified during a
+    // background build
+    task.splitPrimitives = &primitives;
+    if (copyPrimitives && task.structure == asSBVH)
+    {
+        task.primitives = primitives;
+        task.splitPrimitives = &task.primitives;
+    }
+}
+
+// Makes the hierarchy of a task the one of the current frame, and returns the
+// maximum number of primitives per leaf
+int GPUKernel::installBVH(BVHBuildTask &task)
+{
+    for (int i(0); i < BOUNDING_BOXES_TREE_DEPTH; ++i)
+        m_boundingBoxes[m_frame][i].clear();
+
+    // Lights are stored in the first box of level 1
+    m_treeDepth = 1;
+    CPUBoundingBox &lights = m_boundingBoxes[m_frame][m_treeDepth][0];
+    resetBox(lights, true);
+    lights.primitives.swap(task.lights);
+
+    // Spatial splits bound leaves by the clipped parts of their references,
+    // which only remain valid until primitives move
+    BVHNodeContainer &nodes = m_bvhNodes[m_frame];
+    nodes.swap(task.nodes);
+    m_bvhPrimitives[m_frame].swap(task.order);
+    m_bvhStreamInfo[m_frame].clipped = (task.nbDuplicates != 0);
+    m_dynamicBVH[m_frame] = CPUDynamicBVH();
+    if (nodes.empty())
+        return 0;
+
+    if (task.structure == asDynamic)
+        buildDynamicBVH();
+    const size_t nbNodes = nodes.size();
+    size_t nbLeaves(0);
+    size_t maxPrimitivesPerBox(0);
+    for (const auto &node : nodes)
+        if (node.nbPrimitives != 0)
+        {
+            ++nbLeaves;
+            maxPrimitivesPerBox = std::max(maxPrimitivesPerBox, static_cast<size_t>(node.nbPrimitives));
+        }
+
+    const size_t nbReferences = m_bvhPrimitives[m_frame].size() - task.nbDuplicates;
+    LOG_INFO(3, "BVH hierarchy: " << nbNodes << " nodes, " << nbLeaves << " leaves, " << task.nbSubtrees
+                                  << " subtrees, " << lights.primitives.size() << " lights, " << m_instances.size()
+                                  << " instances, " << task.nbDuplicates << " split references out of "
+                                  << nbReferences);
+    return static_cast<int>(maxPrimitivesPerBox);
+}
+
+/*
+________________________________________________________________________________
+
+Builds the hierarchies of all the frames holding primitives, and streams the
+one of the current frame. Frames are built concurrently, each one by a single
+thread, in batches of as many frames as there are cores so that only a few
+snapshots are held at a time. Grids are built frame by frame. Returns the
+number of boxes of the current frame
+________________________________________________________________________________
+*/
+int GPUKernel::compactFrames()
+{
+    LOG_INFO(3, "GPUKernel::compactFrames");
+    cancelBackgroundBuild();
+    const int currentFrame = m_frame;
+    std::vector<int> frames;
+    for (int frame(0); frame < static_cast<int>(NB_MAX_FRAMES); ++frame)
+        if (!m_primitives[frame].empty())
+            frames.push_back(frame);
+
+    if (m_accelerationStructure == asGrid)
+    {
+        for (const auto frame : frames)
+        {
+            m_frame = frame;
+            compactBoxes(true);
+        }
+        m_frame = currentFrame;
+        return compactBoxes(false);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const size_t batchSize = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t first(0); first < frames.size(); first += batchSize)
+    {
+        const int nbTasks = static_cast<int>(std::min(batchSize, frames.size() - first));
+        std::vector<BVHBuildTask> tasks(nbTasks);
+        for (int i(0); i < nbTasks; ++i)
+        {
+            m_frame = frames[first + i];
+            snapshotBVH(tasks[i], false);
+        }
+
+#pragma omp parallel for schedule(dynamic) if (nbTasks > 1)
+        for (int i = 0; i < nbTasks; ++i)
+            buildBVHTask(tasks[i]);
+
+        for (int i(0); i < nbTasks; ++i)
+        {
+            m_frame = frames[first + i];
+            installBVH(tasks[i]);
+        }
+    }
+    m_frame = currentFrame;
+    m_primitivesTransfered = false;
+    streamDataToGPU();
+    m_boxesBuildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO(1, "Frames.............: " << frames.size());
+    LOG_INFO(1, "Build time.........: " << m_boxesBuildTime << " ms");
+    return static_cast<int>(m_nbActiveBoxes[m_frame]);
+}
+
+void GPUKernel::setBackgroundBuilds(const bool value)
+{
+    if (!value)
+        cancelBackgroundBuild();
+    m_backgroundBuilds = value;
+}
+
+/*
+________________________________________________________________________________
+
+Starts building the hierarchy of the current frame in a background thread.
+References and their bounds are collected by the calling thread, which keeps
+rendering the streamed hierarchy until swapBackgroundBuild installs the new
+one. The build only reads its snapshot of the scene, so the scene can be
+modified while it runs
+________________________________________________________________________________
+*/
+void GPUKernel::startBackgroundBuild()
+{
+    LOG_INFO(3, "GPUKernel::startBackgroundBuild");
+    m_backgroundBuildRequested = false;
+    m_backgroundBuild = new BVHBuildTask;
+    snapshotBVH(*m_backgroundBuild, true);
+    m_backgroundBuild->thread = std::thread(buildBVHTask, std::ref(*m_backgroundBuild));
 }
 
-int GPUKernel::addPrimitive(PrimitiveType type, bool belongsToModel)
+/*
+________________________________________________________________________________
+
+Installs and streams the hierarchy built in the background once it is ready.
+Hierarchies built before primitives were added or removed miss references and
+are discarded. Another build is started if the scene changed since the
+snapshot, or if a reconstruction was requested in the meantime. Returns true
+if the streamed hierarchy was replaced
+________________________________________________________________________________
+*/
+bool GPUKernel::swapBackgroundBuild()
 {
-    LOG_INFO(3, "GPUKernel::addPrimitive");
-    int returnValue = -1;
-    if (m_doneWithAdding)
+    BVHBuildTask *task = m_backgroundBuild;
+    if (!task || !task->ready || task->frame != m_frame)
+        return false;
+    task->thread.join();
+    m_backgroundBuild = 0;
+
+    const bool valid = (task->nbPrimitives == m_primitives[m_frame].size() && task->nbInstances == m_instances.size() &&
+                        task->removed == m_removedPrimitives[m_frame]);
+    if (valid)
     {
-        returnValue = m_addingIndex;
-        m_addingIndex++;
+        const auto start = std::chrono::steady_clock::now();
+        const int maxPrimitivesPerBox = installBVH(*task);
+        m_primitivesTransfered = false;
+        streamDataToGPU();
+        const double swapTime =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        m_boxesBuildTime = task->buildTime + swapTime;
+        LOG_INFO(1, "Primitives.........: " << m_primitives[m_frame].size());
+        LOG_INFO(1, "BVH nodes..........: " << m_bvhNodes[m_frame].size());
+        LOG_INFO(1, "Primitives per leaf: " << maxPrimitivesPerBox);
+        LOG_INFO(1, "Build time.........: " << task->buildTime << " ms in background, " << swapTime << " ms to swap");
     }
     else
-    {
-        CPUPrimitive primitive;
-        memset(&primitive, 0, sizeof(CPUPrimitive));
-        primitive.belongsToModel = belongsToModel;
-        primitive.type = type;
-        int index = static_cast<int>(m_primitives[m_frame].size());
-        m_primitives[m_frame][index] = primitive;
-        LOG_INFO(3, "m_primitives.size() = " << m_primitives[m_frame].size());
-        returnValue = index;
-    }
-    return returnValue;
+        LOG_INFO(3, "Scene modified during the background build, building it again");
+    delete task;
+
+    if (!valid || m_backgroundBuildRequested)
+        startBackgroundBuild();
+    return valid;
 }
 
-CPUPrimitive *GPUKernel::getPrimitive(const unsigned int index)
+// Waits for the background build to complete and discards it
+void GPUKernel::cancelBackgroundBuild()
 {
-    CPUPrimitive *returnValue(NULL);
-    if (index <= m_primitives[m_frame].size())
+    if (m_backgroundBuild)
     {
-        returnValue = &(m_primitives[m_frame])[index];
+        m_backgroundBuild->thread.join();
+        delete m_backgroundBuild;
+        m_backgroundBuild = 0;
     }
-    return returnValue;
+    m_backgroundBuildRequested = false;
 }
 
-void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, float w, float h, float d, int materialId)
+void GPUKernel::refitBox(const int index)
 {
-    setPrimitive(index, x0, y0, z0, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, w, h, d, materialId);
+    // Children immediately follow their parent in the flattened array, and
+    // skip indices jump from one child to the next
+    BoundingBox &box = m_hBoundingBoxes[index];
+    int child = index + 1;
+    box.parameters[0] = m_hBoundingBoxes[child].parameters[0];
+    box.parameters[1] = m_hBoundingBoxes[child].parameters[1];
+    child += m_hBoundingBoxes[child].indexForNextBox.x;
+    while (child < index + box.indexForNextBox.x)
+    {
+        box.parameters[0] = min2(box.parameters[0], m_hBoundingBoxes[child].parameters[0]);
+        box.parameters[1] = max2(box.parameters[1], m_hBoundingBoxes[child].parameters[1]);
+        child += m_hBoundingBoxes[child].indexForNextBox.x;
+    }
 }
 
-void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, float x1, float y1, float z1, float w,
-                             float h, float d, int materialId)
-{
-    setPrimitive(index, x0, y0, z0, x1, y1, z1, 0.f, 0.f, 0.f, w, h, d, materialId);
-}
+/*
+________________________________________________________________________________
 
-void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, float x1, float y1, float z1, float x2,
-                             float y2, float z2, float w, float h, float d, int materialId)
+Updates the hierarchy after primitives have moved, without changing its
+topology. Moved primitives are copied to the GPU buffer, the leaves containing
+them are recomputed, and their ancestors are refitted level by level, from the
+deepest one. Only the modified ranges of boxes and primitives are transfered
+________________________________________________________________________________
+*/
+void GPUKernel::refitBoxes()
 {
-    float scale = 1.f;
-    m_primitivesTransfered = false;
-    if (index >= 0 && index <= m_primitives[m_frame].size())
+    LOG_INFO(3, "GPUKernel::refitBoxes");
+    BVHStreamInfo &info = m_bvhStreamInfo[m_frame];
+    if (m_streamedFrame != m_frame || info.primitives.empty())
     {
-        (m_primitives[m_frame])[index].movable = true;
-        (m_primitives[m_frame])[index].p0.x = x0 * scale;
-        (m_primitives[m_frame])[index].p0.y = y0 * scale;
-        (m_primitives[m_frame])[index].p0.z = z0 * scale;
-        (m_primitives[m_frame])[index].p1.x = x1 * scale;
-        (m_primitives[m_frame])[index].p1.y = y1 * scale;
-        (m_primitives[m_frame])[index].p1.z = z1 * scale;
-        (m_primitives[m_frame])[index].p2.x = x2 * scale;
-        (m_primitives[m_frame])[index].p2.y = y2 * scale;
-        (m_primitives[m_frame])[index].p2.z = z2 * scale;
-        (m_primitives[m_frame])[index].size.x = w * scale;
-        (m_primitives[m_frame])[index].size.y = h * scale;
-        (m_primitives[m_frame])[index].size.z = d * scale;
-        (m_primitives[m_frame])[index].n0 = make_vec3f();
-        (m_primitives[m_frame])[index].n1 = make_vec3f();
-        (m_primitives[m_frame])[index].n2 = make_vec3f();
-        (m_primitives[m_frame])[index].vt0 = make_vec2f();
-        (m_primitives[m_frame])[index].vt1 = make_vec2f();
-        (m_primitives[m_frame])[index].vt2 = make_vec2f();
-        (m_primitives[m_frame])[index].materialId = materialId;
-
-        switch ((m_primitives[m_frame])[index].type)
-        {
-        case ptSphere:
-        {
-            (m_primitives[m_frame])[index].size.x = w * scale;
-            (m_primitives[m_frame])[index].size.y = w * scale;
-            (m_primitives[m_frame])[index].size.z = w * scale;
-            break;
-        }
-        case ptEllipsoid:
-        {
-            (m_primitives[m_frame])[index].size.x = w * scale;
-            (m_primitives[m_frame])[index].size.y = h * scale;
-            (m_primitives[m_frame])[index].size.z = d * scale;
-            break;
-        }
-        case ptCylinder:
-        case ptCone:
-        {
-            // Axis
-            vec4f axis;
-            axis.x = x1 * scale - x0 * scale;
-            axis.y = y1 * scale - y0 * scale;
-            axis.z = z1 * scale - z0 * scale;
-            float len = sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
-            if (len != 0.f)
-            {
-                axis.x /= len;
-                axis.y /= len;
-                axis.z /= len;
-            }
-            (m_primitives[m_frame])[index].n1.x = axis.x;
-            (m_primitives[m_frame])[index].n1.y = axis.y;
-            (m_primitives[m_frame])[index].n1.z = axis.z;
+        // GPU buffers hold another frame, or nothing was streamed yet
+        streamDataToGPU();
+        return;
+    }
 
-            // Center
-            (m_primitives[m_frame])[index].p2.x = (x0 * scale + x1 * scale) / 2.f;
-            (m_primitives[m_frame])[index].p2.y = (y0 * scale + y1 * scale) / 2.f;
-            (m_primitives[m_frame])[index].p2.z = (z0 * scale + z1 * scale) / 2.f;
+    // Copies of references duplicated by spatial splits move together
+    std::vector<int> moved;
+    for (int i(0); i < static_cast<int>(info.moved.size()); ++i)
+        if (info.moved[i] != 0)
+            for (int copy = info.slots[info.primitives[i]]; copy != -1; copy = info.copies[copy])
+                info.moved[copy] = 1;
+    for (int i(0); i < static_cast<int>(info.moved.size()); ++i)
+        if (info.moved[i] != 0)
+            moved.push_back(i);
+    if (moved.empty())
+        return;
+
+    // Refitted leaves are bounded by whole references, clipped bounds are lost
+    info.clipped = false;
 
-            // Length
-            (m_primitives[m_frame])[index].size.x = w * scale;
-            (m_primitives[m_frame])[index].size.y = w * scale;
-            (m_primitives[m_frame])[index].size.z = w * scale;
-            break;
-        }
-#ifdef USE_KINECT
-        case ptCamera:
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(moved.size()); ++i)
+    {
+        const int index = moved[i];
+        streamReferenceToGPU(info.primitives[index], index);
+        if (index < info.nbLights)
         {
-            (m_primitives[m_frame])[index].n0.x = 0.f;
-            (m_primitives[m_frame])[index].n0.y = 0.f;
-            (m_primitives[m_frame])[index].n0.z = -1.f;
-            break;
+            const vec3f &location = m_primitives[m_frame][info.primitives[index]].p0;
+            m_lightInformation[index].location = make_vec3f(location.x, location.y, location.z);
         }
-#endif // USE_KINECT
-        case ptXYPlane:
+        info.moved[index] = 0;
+    }
+    addDirtyRanges(m_dirtyPrimitives, moved);
+    if (moved.front() < info.nbLights)
+        buildLightTree();
+
+    // Leaves containing moved primitives. Box 0 holds the lights and has fixed bounds
+    std::vector<unsigned char> refitted(m_nbActiveBoxes[m_frame], 0);
+    std::vector<int> leaves;
+    for (const auto index : moved)
+    {
+        const int leaf = info.leaves[index];
+        if (leaf != 0 && refitted[leaf] == 0)
         {
-            (m_primitives[m_frame])[index].n0.x = 0.f;
-            (m_primitives[m_frame])[index].n0.y = 0.f;
-            (m_primitives[m_frame])[index].n0.z = 1.f;
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
-            break;
+            refitted[leaf] = 1;
+            leaves.push_back(leaf);
         }
-        case ptYZPlane:
+    }
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(leaves.size()); ++i)
+    {
+        BoundingBox &box = m_hBoundingBoxes[leaves[i]];
+        resetBounds(box.parameters);
+        for (int p = box.startIndex; p < box.startIndex + box.nbPrimitives; ++p)
         {
-            (m_primitives[m_frame])[index].n0.x = 1.f;
-            (m_primitives[m_frame])[index].n0.y = 0.f;
-            (m_primitives[m_frame])[index].n0.z = 0.f;
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
-            break;
+            vec3f corners[2];
+            getReferenceBounds(info.primitives[p], corners[0], corners[1]);
+            growBounds(box.parameters, corners[0], corners[1]);
         }
-        case ptXZPlane:
-        case ptCheckboard:
+    }
+
+    // Ancestors, grouped by depth. Nodes of a same depth are independent
+    std::vector<std::vector<int>> levels;
+    for (const auto leaf : leaves)
+    {
+        int parent = info.parents[leaf];
+        while (parent != -1 && refitted[parent] == 0)
         {
-            (m_primitives[m_frame])[index].n0.x = 0.f;
-            (m_primitives[m_frame])[index].n0.y = 1.f;
-            (m_primitives[m_frame])[index].n0.z = 0.f;
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
-            break;
+            refitted[parent] = 1;
+            const size_t depth = m_hBoundingBoxes[parent].startIndex;
+            if (depth >= levels.size())
+                levels.resize(depth + 1);
+            levels[depth].push_back(parent);
+            parent = info.parents[parent];
         }
-        case ptTriangle:
-        {
-            vec3f v0, v1;
-            v0.x = (m_primitives[m_frame])[index].p1.x - (m_primitives[m_frame])[index].p0.x;
-            v0.y = (m_primitives[m_frame])[index].p1.y - (m_primitives[m_frame])[index].p0.y;
-            v0.z = (m_primitives[m_frame])[index].p1.z - (m_primitives[m_frame])[index].p0.z;
-            normalizeVector(v0);
+    }
+    for (int depth(static_cast<int>(levels.size()) - 1); depth >= 0; --depth)
+    {
+        const std::vector<int> &level = levels[depth];
+#pragma omp parallel for
+        for (int i = 0; i < static_cast<int>(level.size()); ++i)
+            refitBox(level[i]);
+    }
 
-            v1.x = (m_primitives[m_frame])[index].p2.x - (m_primitives[m_frame])[index].p0.x;
-            v1.y = (m_primitives[m_frame])[index].p2.y - (m_primitives[m_frame])[index].p0.y;
-            v1.z = (m_primitives[m_frame])[index].p2.z - (m_primitives[m_frame])[index].p0.z;
-            normalizeVector(v1);
+    // Ancestors of a leaf are scattered before it in the array, so only
+    // transfer the boxes that were actually refitted
+    std::vector<int> boxes;
+    for (int i(0); i < static_cast<int>(refitted.size()); ++i)
+        if (refitted[i] != 0)
+            boxes.push_back(i);
+    addDirtyRanges(m_dirtyBoxes, boxes);
+    m_wideBVHNodes.clear();
+    if (m_compressedBoxes)
+    {
+        // Quantized children depend on the bounds of their parent
+        compressBoxes();
+        m_dirtyBoxes.assign(1, make_vec2i(0, m_nbActiveBoxes[m_frame]));
+    }
+    m_primitivesTransfered = false;
+    LOG_INFO(3, "Refitted " << moved.size() << " primitives and " << leaves.size() << " leaves");
+}
 
-            (m_primitives[m_frame])[index].n0 = crossProduct(v0, v1);
-            normalizeVector((m_primitives[m_frame])[index].n0);
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
-            break;
-        }
-        }
-        // min
-        m_minPos[m_frame].x = std::min(x0 * scale, m_minPos[m_frame].x);
-        m_minPos[m_frame].y = std::min(y0 * scale, m_minPos[m_frame].y);
-        m_minPos[m_frame].z = std::min(z0 * scale, m_minPos[m_frame].z);
+/*
+________________________________________________________________________________
 
-        // max
-        m_maxPos[m_frame].x = std::max(x0 * scale, m_maxPos[m_frame].x);
-        m_maxPos[m_frame].y = std::max(y0 * scale, m_maxPos[m_frame].y);
-        m_maxPos[m_frame].z = std::max(z0 * scale, m_maxPos[m_frame].z);
-    }
-    else
+Builds the dynamic hierarchy from the surface area heuristic hierarchy that was
+just built. Nodes and leaves are numbered like the flattened hierarchy, and
+leaves own the slots they were built with
+________________________________________________________________________________
+*/
+void GPUKernel::buildDynamicBVH()
+{
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    const BVHNodeContainer &nodes = m_bvhNodes[m_frame];
+    const std::vector<int> &slots = m_bvhPrimitives[m_frame];
+    const int nbNodes = static_cast<int>(nodes.size());
+    tree.nodes.resize(nbNodes);
+    tree.flatNodes.resize(nbNodes);
+    tree.freeNodes.clear();
+    tree.freeBlocks.clear();
+    tree.pending.clear();
+    tree.dirtySlots.clear();
+    tree.leaves.assign(m_primitives[m_frame].size() + m_instances.size(), -1);
+    tree.root = (nbNodes == 0) ? -1 : 0;
+    tree.nbReferences = static_cast<int>(slots.size());
+    tree.nbSlots = static_cast<int>(slots.size());
+
+    double cost(0.0);
+#pragma omp parallel for reduction(+ : cost)
+    for (int i = 0; i < nbNodes; ++i)
     {
-        LOG_ERROR("GPUKernel::setPrimitive: Out of bounds (" << index << "/" << NB_MAX_PRIMITIVES << ")");
+        const CPUBVHNode &flat = nodes[i];
+        CPUDynamicBVHNode &node = tree.nodes[i];
+        node.parameters[0] = flat.parameters[0];
+        node.parameters[1] = flat.parameters[1];
+        node.nbNodes = flat.indexForNextBox;
+        node.flatIndex = i;
+        tree.flatNodes[i] = i;
+        if (flat.nbPrimitives != 0)
+        {
+            node.children[0] = -1;
+            node.children[1] = -1;
+            node.startIndex = flat.startIndex;
+            node.nbPrimitives = flat.nbPrimitives;
+            node.capacity = flat.nbPrimitives;
+            for (int p = flat.startIndex; p < flat.startIndex + flat.nbPrimitives; ++p)
+                tree.leaves[slots[p]] = i;
+        }
+        else
+        {
+            // Children only write their own parent
+            node.children[0] = i + 1;
+            node.children[1] = i + 1 + nodes[i + 1].indexForNextBox;
+            node.startIndex = 0;
+            node.nbPrimitives = 0;
+            node.capacity = 0;
+            tree.nodes[node.children[0]].parent = i;
+            tree.nodes[node.children[1]].parent = i;
+        }
+        cost += dynamicNodeCost(node);
     }
+    if (tree.root != -1)
+        tree.nodes[tree.root].parent = -1;
+
+    tree.cost = cost;
+    const float area = (tree.root == -1) ? 0.f : boxHalfArea(tree.nodes[0].parameters[0], tree.nodes[0].parameters[1]);
+    tree.builtCost = (area > 0.f) ? static_cast<float>(cost / area) : 0.f;
 }
 
-void GPUKernel::setPrimitiveIsMovable(const int &index, bool movable)
+int GPUKernel::allocateDynamicNode()
 {
-    if (index >= 0 && index < m_primitives[m_frame].size())
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    if (tree.freeNodes.empty())
     {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
-        primitive.movable = movable;
+        tree.nodes.push_back(CPUDynamicBVHNode());
+        return static_cast<int>(tree.nodes.size()) - 1;
     }
+    const int index = tree.freeNodes.back();
+    tree.freeNodes.pop_back();
+    return index;
 }
 
-void GPUKernel::setPrimitiveBellongsToModel(const int &index, bool bellongsToModel)
+// Returns the first slot of a block of unused slots. Released blocks of the
+// same size are reused, and the slots grow by chunks to keep the size of the
+// GPU buffer of primitives stable
+int GPUKernel::allocateDynamicSlots(const int nbSlots)
 {
-    if (index >= 0 && index < m_primitives[m_frame].size())
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    std::vector<int> &slots = m_bvhPrimitives[m_frame];
+    if (nbSlots < static_cast<int>(tree.freeBlocks.size()) && !tree.freeBlocks[nbSlots].empty())
     {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
-        primitive.belongsToModel = bellongsToModel;
+        const int start = tree.freeBlocks[nbSlots].back();
+        tree.freeBlocks[nbSlots].pop_back();
+        return start;
     }
+    const int start = tree.nbSlots;
+    tree.nbSlots += nbSlots;
+    if (tree.nbSlots > static_cast<int>(slots.size()))
+        slots.resize(std::max(tree.nbSlots, static_cast<int>(slots.size() + slots.size() / DYNAMIC_BVH_SPARE_SLOTS)),
+                     -1);
+    return start;
 }
 
-void GPUKernel::setPrimitiveTextureCoordinates(const unsigned int index, const vec2f& vt0, const vec2f& vt1, const vec2f& vt2)
+void GPUKernel::releaseDynamicSlots(const int start, const int nbSlots)
 {
-    if (index < m_primitives[m_frame].size())
+    std::vector<std::vector<int>> &freeBlocks = m_dynamicBVH[m_frame].freeBlocks;
+    if (nbSlots >= static_cast<int>(freeBlocks.size()))
+        freeBlocks.resize(nbSlots + 1);
+    freeBlocks[nbSlots].push_back(start);
+}
+
+// Recomputes the bounds of a leaf from its references
+void GPUKernel::refitDynamicLeaf(const int index)
+{
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    CPUDynamicBVHNode &node = tree.nodes[index];
+    const std::vector<int> &slots = m_bvhPrimitives[m_frame];
+    tree.cost -= dynamicNodeCost(node);
+    resetBounds(node.parameters);
+    for (int p = node.startIndex; p < node.startIndex + node.nbPrimitives; ++p)
     {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
-        primitive.vt0 = vt0;
-        primitive.vt1 = vt1;
-        primitive.vt2 = vt2;
+        vec3f corners[2];
+        getReferenceBounds(slots[p], corners[0], corners[1]);
+        growBounds(node.parameters, corners[0], corners[1]);
     }
+    node.flatIndex = -1;
+    tree.cost += dynamicNodeCost(node);
 }
 
-void GPUKernel::setPrimitiveNormals(int unsigned index, vec3f n0, vec3f n1, vec3f n2)
+// Refits and rotates the nodes from the given one up to the root, which are
+// all flattened again
+void GPUKernel::refitDynamicAncestors(const int index)
 {
-    if (index < m_primitives[m_frame].size())
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    for (int i = index; i != -1; i = tree.nodes[i].parent)
     {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
-        normalizeVector(n0);
-        primitive.n0 = n0;
-        normalizeVector(n1);
-        primitive.n1 = n1;
-        normalizeVector(n2);
-        primitive.n2 = n2;
+        refitDynamicNode(tree, i);
+        rotateDynamicNode(tree, i);
     }
 }
 
-unsigned int GPUKernel::getPrimitiveAt(int x, int y)
+/*
+________________________________________________________________________________
+
+Inserts a reference in the dynamic hierarchy. The hierarchy is walked down
+towards the node whose cost increases the least, the reference being either
+added to a leaf that has room for it, or paired with a node under a new parent.
+Children are only visited when the lower bound of their cost beats pairing with
+the current node (Bittner et al.)
+________________________________________________________________________________
+*/
+void GPUKernel::insertDynamicReference(const int reference)
 {
-    LOG_INFO(3, "GPUKernel::getPrimitiveAt(" << x << "," << y << ")");
-    unsigned int returnValue = -1;
-    unsigned int index = y * m_sceneInfo.size.x + x;
-    if (index < static_cast<unsigned int>(m_sceneInfo.size.x * m_sceneInfo.size.y))
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    std::vector<int> &slots = m_bvhPrimitives[m_frame];
+    vec3f bounds[2];
+    getReferenceBounds(reference, bounds[0], bounds[1]);
+    const float area = boxHalfArea(bounds[0], bounds[1]);
+    ++tree.nbReferences;
+
+    int index = tree.root;
+    bool addToLeaf(false);
+    float inherited(0.f); // Cost increase of the ancestors
+    while (index != -1)
+    {
+        const CPUDynamicBVHNode &node = tree.nodes[index];
+        const float nodeArea = boxHalfArea(node.parameters[0], node.parameters[1]);
+        const float mergedArea =
+            boxHalfArea(min2(node.parameters[0], bounds[0]), max2(node.parameters[1], bounds[1]));
+        const float pairCost = SAH_TRAVERSAL_COST * mergedArea + SAH_INTERSECTION_COST * area + inherited;
+        if (node.children[0] == -1)
+        {
+            const float leafCost =
+                SAH_INTERSECTION_COST * (mergedArea * (node.nbPrimitives + 1) - nodeArea * node.nbPrimitives) +
+                inherited;
+            addToLeaf = (node.nbPrimitives < DYNAMIC_BVH_MAX_PRIMITIVES_PER_LEAF && leafCost <= pairCost);
+            break;
+        }
+
+        const float childInherited = inherited + SAH_TRAVERSAL_COST * (mergedArea - nodeArea);
+        float childCosts[2];
+        for (int c(0); c < 2; ++c)
+        {
+            const CPUDynamicBVHNode &child = tree.nodes[node.children[c]];
+            const float childArea = boxHalfArea(child.parameters[0], child.parameters[1]);
+            const float grownArea =
+                boxHalfArea(min2(child.parameters[0], bounds[0]), max2(child.parameters[1], bounds[1]));
+            childCosts[c] = childInherited + SAH_INTERSECTION_COST * area +
+                            ((child.children[0] == -1) ? 0.f : SAH_TRAVERSAL_COST * (grownArea - childArea));
+        }
+        const int best = (childCosts[0] <= childCosts[1]) ? 0 : 1;
+        if (pairCost <= childCosts[best])
+            break;
+        inherited = childInherited;
+        index = node.children[best];
+    }
+
+    if (addToLeaf)
+    {
+        // Leaves without room left in their block move to a block twice as large
+        CPUDynamicBVHNode *leaf = &tree.nodes[index];
+        if (leaf->nbPrimitives == leaf->capacity)
+        {
+            const int capacity = std::min(2 * leaf->capacity, DYNAMIC_BVH_MAX_PRIMITIVES_PER_LEAF);
+            const int start = allocateDynamicSlots(capacity);
+            for (int p(0); p < leaf->nbPrimitives; ++p)
+            {
+                slots[start + p] = slots[leaf->startIndex + p];
+                slots[leaf->startIndex + p] = -1;
+                tree.dirtySlots.push_back(start + p);
+                tree.dirtySlots.push_back(leaf->startIndex + p);
+            }
+            releaseDynamicSlots(leaf->startIndex, leaf->capacity);
+            leaf->startIndex = start;
+            leaf->capacity = capacity;
+        }
+        const int slot = leaf->startIndex + leaf->nbPrimitives;
+        slots[slot] = reference;
+        tree.dirtySlots.push_back(slot);
+        tree.leaves[reference] = index;
+        tree.cost -= dynamicNodeCost(*leaf);
+        ++leaf->nbPrimitives;
+        growBounds(leaf->parameters, bounds[0], bounds[1]);
+        leaf->flatIndex = -1;
+        tree.cost += dynamicNodeCost(*leaf);
+        refitDynamicAncestors(leaf->parent);
+        return;
+    }
+
+    // New leaf, paired with the node under a new parent
+    const int start = allocateDynamicSlots(1);
+    const int leafIndex = allocateDynamicNode();
+    CPUDynamicBVHNode &leaf = tree.nodes[leafIndex];
+    leaf.parameters[0] = bounds[0];
+    leaf.parameters[1] = bounds[1];
+    leaf.children[0] = -1;
+    leaf.children[1] = -1;
+    leaf.startIndex = start;
+    leaf.nbPrimitives = 1;
+    leaf.capacity = 1;
+    leaf.nbNodes = 1;
+    leaf.flatIndex = -1;
+    slots[start] = reference;
+    tree.dirtySlots.push_back(start);
+    tree.leaves[reference] = leafIndex;
+    tree.cost += dynamicNodeCost(leaf);
+    if (index == -1)
+    {
+        leaf.parent = -1;
+        tree.root = leafIndex;
+        return;
+    }
+
+    const int parentIndex = allocateDynamicNode();
+    CPUDynamicBVHNode &parent = tree.nodes[parentIndex];
+    const int grandparent = tree.nodes[index].parent;
+    parent.parent = grandparent;
+    parent.children[0] = index;
+    parent.children[1] = leafIndex;
+    parent.startIndex = 0;
+    parent.nbPrimitives = 0;
+    parent.capacity = 0;
+    resetBounds(parent.parameters);
+    tree.nodes[index].parent = parentIndex;
+    tree.nodes[leafIndex].parent = parentIndex;
+    if (grandparent == -1)
+        tree.root = parentIndex;
+    else
     {
-        returnValue = m_hPrimitivesXYIds[index].x;
+        CPUDynamicBVHNode &node = tree.nodes[grandparent];
+        node.children[(node.children[0] == index) ? 0 : 1] = parentIndex;
     }
-    return returnValue;
+    tree.cost += dynamicNodeCost(parent);
+    refitDynamicAncestors(parentIndex);
 }
 
-bool GPUKernel::updateBoundingBox(CPUBoundingBox &box)
+/*
+________________________________________________________________________________
+
+Removes a reference from the dynamic hierarchy. The last reference of its leaf
+takes its slot. Empty leaves are removed with their parent, the sibling taking
+the place of the parent
+________________________________________________________________________________
+*/
+void GPUKernel::removeDynamicReference(const int reference)
 {
-    LOG_INFO(3, "GPUKernel::updateBoundingBox()");
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    std::vector<int> &slots = m_bvhPrimitives[m_frame];
+    const int index = tree.leaves[reference];
+    tree.leaves[reference] = -1;
+    --tree.nbReferences;
+
+    CPUDynamicBVHNode &leaf = tree.nodes[index];
+    int slot = leaf.startIndex;
+    while (slots[slot] != reference)
+        ++slot;
+    const int last = leaf.startIndex + leaf.nbPrimitives - 1;
+    slots[slot] = slots[last];
+    slots[last] = -1;
+    tree.dirtySlots.push_back(slot);
+    tree.dirtySlots.push_back(last);
+    tree.cost -= dynamicNodeCost(leaf);
+    --leaf.nbPrimitives;
+    tree.cost += dynamicNodeCost(leaf);
+    if (leaf.nbPrimitives != 0)
+    {
+        refitDynamicLeaf(index);
+        refitDynamicAncestors(leaf.parent);
+        return;
+    }
 
-    bool result(false);
+    releaseDynamicSlots(leaf.startIndex, leaf.capacity);
+    tree.freeNodes.push_back(index);
+    const int parent = leaf.parent;
+    if (parent == -1)
+    {
+        tree.root = -1;
+        return;
+    }
 
-    // Process box size
-    vec3f corner0;
-    vec3f corner1;
+    const CPUDynamicBVHNode &node = tree.nodes[parent];
+    const int sibling = node.children[(node.children[0] == index) ? 1 : 0];
+    const int grandparent = node.parent;
+    tree.cost -= dynamicNodeCost(node);
+    tree.freeNodes.push_back(parent);
+    tree.nodes[sibling].parent = grandparent;
+    if (grandparent == -1)
+    {
+        tree.root = sibling;
+        return;
+    }
+    CPUDynamicBVHNode &ancestor = tree.nodes[grandparent];
+    ancestor.children[(ancestor.children[0] == parent) ? 0 : 1] = sibling;
+    refitDynamicAncestors(grandparent);
+}
 
-    box.parameters[0].x = 1000000;
-    box.parameters[0].y = 1000000;
-    box.parameters[0].z = 1000000;
-    box.parameters[1].x = -1000000;
-    box.parameters[1].y = -1000000;
-    box.parameters[1].z = -1000000;
+/*
+________________________________________________________________________________
 
-    for (const auto &p : box.primitives)
-    {
-        CPUPrimitive &primitive = (m_primitives[m_frame])[p];
-        result = (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f);
-        switch (primitive.type)
-        {
-        case ptTriangle:
+Updates the dynamic hierarchy with the references added, removed or moved
+since the previous update, and streams the flattened hierarchy. Boxes of
+unchanged subtrees and primitives of unchanged slots stay in the GPU buffers,
+and only modified ranges are transfered. Returns false when the hierarchy has
+to be rebuilt instead: no hierarchy yet, renumbered references, added or
+removed lights, too many unused slots, or a cost too far from the one of the
+built hierarchy
+________________________________________________________________________________
+*/
+bool GPUKernel::updateBVHBoxes()
+{
+    CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+    BVHStreamInfo &info = m_bvhStreamInfo[m_frame];
+    const PrimitiveContainer &primitives = m_primitives[m_frame];
+    const std::vector<unsigned char> &removedPrimitives = m_removedPrimitives[m_frame];
+    const int nbPrimitives = static_cast<int>(primitives.size());
+    const int nbReferences = nbPrimitives + static_cast<int>(m_instances.size());
+    const int nbKnownReferences = static_cast<int>(tree.leaves.size());
+
+    // Instances are referenced after the primitives, adding primitives renumbers them
+    if (tree.nodes.empty() || nbReferences < nbKnownReferences ||
+        (!m_instances.empty() && nbReferences != nbKnownReferences))
+        return false;
+
+    const auto start = std::chrono::steady_clock::now();
+    const bool streamed = (m_streamedFrame == m_frame && !info.primitives.empty());
+    std::vector<int> references(tree.pending);
+    tree.pending.clear();
+    for (int i(nbKnownReferences); i < nbReferences; ++i)
+        references.push_back(i);
+    std::vector<int> lights;
+    for (int i(0); i < static_cast<int>(info.moved.size()); ++i)
+        if (info.moved[i] != 0)
         {
-            corner0 = min3(primitive.p0, primitive.p1, primitive.p2);
-            corner1 = max3(primitive.p0, primitive.p1, primitive.p2);
-            break;
+            if (i < info.nbLights)
+                lights.push_back(i);
+            else
+                references.push_back(info.primitives[i]);
         }
-        case ptCylinder:
+    std::sort(references.begin(), references.end());
+    references.erase(std::unique(references.begin(), references.end()), references.end());
+    tree.leaves.resize(nbReferences, -1);
+
+    // Lights are not part of the hierarchy, and are only moved in place
+    std::vector<int> inserted;
+    std::vector<int> removed;
+    std::vector<int> moved;
+    for (const auto reference : references)
+    {
+        const bool isRemoved =
+            (reference < static_cast<int>(removedPrimitives.size()) && removedPrimitives[reference] != 0);
+        const bool isLight =
+            (reference < nbPrimitives && m_hMaterials[primitives[reference].materialId].innerIllumination.x != 0.f);
+        if (tree.leaves[reference] != -1)
         {
-            corner0 = min2(primitive.p0, primitive.p1);
-            corner1 = max2(primitive.p0, primitive.p1);
-            break;
+            if (isRemoved)
+                removed.push_back(reference);
+            else if (isLight)
+                return false;
+            else
+                moved.push_back(reference);
         }
-        default:
+        else if (isLight || (isRemoved && reference < static_cast<int>(info.slots.size()) &&
+                             info.slots[reference] != -1 && info.slots[reference] < info.nbLights))
+            return false;
+        else if (!isRemoved)
+            inserted.push_back(reference);
+    }
+
+    // Large changes are better handled by a new hierarchy
+    if (inserted.size() > DYNAMIC_BVH_MAX_INSERTIONS * tree.nbReferences)
+        return false;
+
+    // Many moved references are refitted, the topology being kept
+    if (moved.size() > DYNAMIC_BVH_MAX_REINSERTIONS)
+    {
+        refitBoxes();
+        double cost(0.0);
+        const int nbFlatNodes = static_cast<int>(tree.flatNodes.size());
+#pragma omp parallel for reduction(+ : cost)
+        for (int i = 0; i < nbFlatNodes; ++i)
         {
-            corner0 = primitive.p0;
-            corner1 = primitive.p0;
-            break;
+            CPUDynamicBVHNode &node = tree.nodes[tree.flatNodes[i]];
+            node.parameters[0] = m_hBoundingBoxes[1 + i].parameters[0];
+            node.parameters[1] = m_hBoundingBoxes[1 + i].parameters[1];
+            m_bvhNodes[m_frame][i].parameters[0] = node.parameters[0];
+            m_bvhNodes[m_frame][i].parameters[1] = node.parameters[1];
+            cost += dynamicNodeCost(node);
         }
+        tree.cost = cost;
+        moved.clear();
+        lights.clear();
+    }
+
+    for (const auto reference : removed)
+        removeDynamicReference(reference);
+    for (const auto reference : moved)
+    {
+        removeDynamicReference(reference);
+        insertDynamicReference(reference);
+    }
+    for (const auto reference : inserted)
+        insertDynamicReference(reference);
+
+    if (tree.root != -1)
+    {
+        const CPUDynamicBVHNode &root = tree.nodes[tree.root];
+        const float area = boxHalfArea(root.parameters[0], root.parameters[1]);
+        if (area > 0.f && tree.cost / area > DYNAMIC_BVH_MAX_COST_RATIO * tree.builtCost)
+        {
+            LOG_INFO(3, "Dynamic BVH cost " << tree.cost / area << " exceeds " << tree.builtCost << ", rebuilding");
+            return false;
         }
+    }
+    const std::vector<int> &slots = m_bvhPrimitives[m_frame];
+    if (slots.size() - tree.nbReferences > DYNAMIC_BVH_MAX_UNUSED_SLOTS * slots.size())
+    {
+        LOG_INFO(3, "Dynamic BVH uses " << tree.nbReferences << " slots out of " << slots.size() << ", rebuilding");
+        return false;
+    }
 
-        vec4f p0, p1;
-        p0.x = (corner0.x <= corner1.x) ? corner0.x : corner1.x;
-        p0.y = (corner0.y <= corner1.y) ? corner0.y : corner1.y;
-        p0.z = (corner0.z <= corner1.z) ? corner0.z : corner1.z;
-        p1.x = (corner0.x > corner1.x) ? corner0.x : corner1.x;
-        p1.y = (corner0.y > corner1.y) ? corner0.y : corner1.y;
-        p1.z = (corner0.z > corner1.z) ? corner0.z : corner1.z;
+    BVHNodeContainer nodes;
+    std::vector<int> flatNodes;
+    std::vector<BVHNodeCopy> copies;
+    if (!flattenDynamicBVH(tree, m_bvhNodes[m_frame], nodes, flatNodes, copies))
+        return false;
+
+    // Streamed meshes follow the boxes and primitives of the scene, which
+    // would move them
+    const int boxOffset = 1;
+    const int primitiveOffset = info.nbLights;
+    const int nbNodes = static_cast<int>(nodes.size());
+    const int nbGPUPrimitives = primitiveOffset + static_cast<int>(slots.size());
+    if (!streamed || !m_meshes.empty() || boxOffset + nbNodes > static_cast<int>(NB_MAX_BOXES) ||
+        nbGPUPrimitives > static_cast<int>(NB_MAX_PRIMITIVES))
+    {
+        m_bvhNodes[m_frame].swap(nodes);
+        tree.flatNodes.swap(flatNodes);
+#pragma omp parallel for
+        for (int i = 0; i < nbNodes; ++i)
+            tree.nodes[tree.flatNodes[i]].flatIndex = i;
+        streamDataToGPU();
+        return true;
+    }
 
-        switch (primitive.type)
+    // Boxes of unchanged subtrees are copied, the gaps between them are the
+    // boxes of modified nodes
+    std::vector<BoundingBox> boxes(nbNodes);
+    for (const auto &copy : copies)
+    {
+#pragma omp parallel for
+        for (int i = 0; i < copy.nbNodes; ++i)
         {
-        case ptCylinder:
-        case ptSphere:
-        case ptCone:
+            BoundingBox &box = boxes[copy.destination + i];
+            box = m_hBoundingBoxes[boxOffset + copy.source + i];
+            if (box.nbPrimitives == 0)
+                box.startIndex += copy.depthOffset;
+        }
+    }
+    int next(0);
+    for (size_t c(0); c <= copies.size(); ++c)
+    {
+        const int end = (c < copies.size()) ? copies[c].destination : nbNodes;
+        for (int i(next); i < end; ++i)
         {
-            p0.x -= primitive.size.x;
-            p0.y -= primitive.size.x;
-            p0.z -= primitive.size.x;
-
-            p1.x += primitive.size.x;
-            p1.y += primitive.size.x;
-            p1.z += primitive.size.x;
-            break;
+            const CPUBVHNode &node = nodes[i];
+            BoundingBox &box = boxes[i];
+            memset(&box, 0, sizeof(BoundingBox));
+            box.parameters[0] = node.parameters[0];
+            box.parameters[1] = node.parameters[1];
+            box.indexForNextBox.x = node.indexForNextBox;
+            box.nbPrimitives = node.nbPrimitives;
+            box.startIndex = (node.nbPrimitives != 0) ? primitiveOffset + node.startIndex : node.depth;
+            m_maxPrimitivesPerBox = std::max(m_maxPrimitivesPerBox, static_cast<size_t>(node.nbPrimitives));
         }
-        default:
+        if (c < copies.size())
+            next = copies[c].destination + copies[c].nbNodes;
+    }
+    std::copy(boxes.begin(), boxes.end(), m_hBoundingBoxes + boxOffset);
+
+    // Boxes are transfered in ranges: gaps, and copies that moved
+    next = 0;
+    for (size_t c(0); c <= copies.size(); ++c)
+    {
+        const int end = (c < copies.size()) ? copies[c].destination : nbNodes;
+        if (next < end)
+            addDirtyRange(m_dirtyBoxes, boxOffset + next, boxOffset + end);
+        if (c < copies.size())
         {
-            p0.x -= primitive.size.x;
-            p0.y -= primitive.size.y;
-            p0.z -= primitive.size.z;
-            p1.x += primitive.size.x;
-            p1.y += primitive.size.y;
-            p1.z += primitive.size.z;
-            break;
+            const BVHNodeCopy &copy = copies[c];
+            if (copy.source != copy.destination || copy.depthOffset != 0)
+                addDirtyRange(m_dirtyBoxes, boxOffset + copy.destination,
+                              boxOffset + copy.destination + copy.nbNodes);
+            next = copy.destination + copy.nbNodes;
         }
+    }
+    collapseDirtyRanges(m_dirtyBoxes);
+
+    // Modified slots are streamed again. Slots of references are released
+    // first, since references may have moved from one modified slot to another
+    std::vector<int> &dirtySlots = tree.dirtySlots;
+    std::sort(dirtySlots.begin(), dirtySlots.end());
+    dirtySlots.erase(std::unique(dirtySlots.begin(), dirtySlots.end()), dirtySlots.end());
+    info.primitives.resize(nbGPUPrimitives, -1);
+    info.copies.resize(nbGPUPrimitives, -1);
+    info.moved.assign(nbGPUPrimitives, 0);
+    info.leaves.resize(nbGPUPrimitives, 0);
+    info.slots.resize(nbReferences, -1);
+    info.parents.assign(boxOffset + nbNodes, -1);
+    for (const auto slot : dirtySlots)
+    {
+        const int reference = info.primitives[primitiveOffset + slot];
+        if (reference != -1 && info.slots[reference] == primitiveOffset + slot)
+            info.slots[reference] = -1;
+    }
+#pragma omp parallel for
+    for (int i = 0; i < static_cast<int>(dirtySlots.size()); ++i)
+    {
+        const int gpuIndex = primitiveOffset + dirtySlots[i];
+        const int reference = slots[dirtySlots[i]];
+        info.primitives[gpuIndex] = reference;
+        if (reference != -1)
+        {
+            info.slots[reference] = gpuIndex;
+            streamReferenceToGPU(reference, gpuIndex);
         }
+    }
+    std::vector<int> dirtyPrimitives(lights);
+    for (const auto slot : dirtySlots)
+        dirtyPrimitives.push_back(primitiveOffset + slot);
+    if (nbGPUPrimitives > m_nbActivePrimitives[m_frame])
+        addDirtyRange(m_dirtyPrimitives, m_nbActivePrimitives[m_frame], nbGPUPrimitives);
+    addDirtyRanges(m_dirtyPrimitives, dirtyPrimitives);
+
+    // Lights moved in place
+    for (const auto index : lights)
+    {
+        streamReferenceToGPU(info.primitives[index], index);
+        const vec3f &location = primitives[info.primitives[index]].p0;
+        m_lightInformation[index].location = make_vec3f(location.x, location.y, location.z);
+    }
+    if (!lights.empty())
+        buildLightTree();
 
-        if (p0.x < box.parameters[0].x)
-            box.parameters[0].x = p0.x;
-        if (p0.y < box.parameters[0].y)
-            box.parameters[0].y = p0.y;
-        if (p0.z < box.parameters[0].z)
-            box.parameters[0].z = p0.z;
-        if (p1.x > box.parameters[1].x)
-            box.parameters[1].x = p1.x;
-        if (p1.y > box.parameters[1].y)
-            box.parameters[1].y = p1.y;
-        if (p1.z > box.parameters[1].z)
-            box.parameters[1].z = p1.z;
+#pragma omp parallel for
+    for (int i = 0; i < nbNodes; ++i)
+    {
+        const CPUBVHNode &node = nodes[i];
+        if (node.nbPrimitives != 0)
+            for (int p = node.startIndex; p < node.startIndex + node.nbPrimitives; ++p)
+                info.leaves[primitiveOffset + p] = boxOffset + i;
+        else
+        {
+            const int end = std::min(i + node.indexForNextBox, nbNodes);
+            for (int child = i + 1; child < end; child += nodes[child].indexForNextBox)
+                info.parents[boxOffset + child] = boxOffset + i;
+        }
     }
 
-    box.center.x = (box.parameters[0].x + box.parameters[1].x) / 2.f;
-    box.center.y = (box.parameters[0].y + box.parameters[1].y) / 2.f;
-    box.center.z = (box.parameters[0].z + box.parameters[1].z) / 2.f;
-    // LOG_INFO(1,"Box
-    // Center="<<box.center.x<<","<<box.center.y<<","<<box.center.z);
-    return result;
+    m_bvhNodes[m_frame].swap(nodes);
+    tree.flatNodes.swap(flatNodes);
+#pragma omp parallel for
+    for (int i = 0; i < nbNodes; ++i)
+        tree.nodes[tree.flatNodes[i]].flatIndex = i;
+    tree.dirtySlots.clear();
+
+    m_nbActiveBoxes[m_frame] = boxOffset + nbNodes;
+    m_nbTopLevelBoxes = m_nbActiveBoxes[m_frame];
+    m_nbActivePrimitives[m_frame] = nbGPUPrimitives;
+    m_wideBVHNodes.clear();
+    if (m_compressedBoxes)
+    {
+        compressBoxes();
+        m_dirtyBoxes.assign(1, make_vec2i(0, m_nbActiveBoxes[m_frame]));
+    }
+    m_primitivesTransfered = false;
+    const double elapsed =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO(3, "Dynamic BVH: " << inserted.size() << " inserted, " << removed.size() << " removed, "
+                                << moved.size() << " moved, " << copies.size() << " subtrees kept, " << elapsed
+                                << " ms");
+    return true;
 }
 
-bool GPUKernel::updateOutterBoundingBox(CPUBoundingBox &outterBox, const int depth)
+void GPUKernel::setCompressedBoxes(const bool value)
 {
-    LOG_INFO(3, "GPUKernel::updateOutterBoundingBox()");
+    m_compressedBoxes = value;
+    if (m_streamedFrame != m_frame)
+        return;
 
-    bool result(false);
+    if (m_compressedBoxes)
+        compressBoxes();
+    else
+        m_hCompressedBoxes.clear();
+    m_dirtyBoxes.assign(1, make_vec2i(0, m_nbActiveBoxes[m_frame]));
+    m_primitivesTransfered = false;
+}
 
-    // Reset box size
-    outterBox.parameters[0].x = m_sceneInfo.viewDistance;
-    outterBox.parameters[0].y = m_sceneInfo.viewDistance;
-    outterBox.parameters[0].z = m_sceneInfo.viewDistance;
-    outterBox.parameters[1].x = -m_sceneInfo.viewDistance;
-    outterBox.parameters[1].y = -m_sceneInfo.viewDistance;
-    outterBox.parameters[1].z = -m_sceneInfo.viewDistance;
+/*
+________________________________________________________________________________
 
-    LOG_INFO(3, "OutterBox: (" << outterBox.center.x << "," << outterBox.center.y << "," << outterBox.center.z << "),("
-                               << outterBox.indexForNextBox << "," << outterBox.primitives.size() << "),("
-                               << outterBox.parameters[0].x << "," << outterBox.parameters[0].y << ","
-                               << outterBox.parameters[0].z << "),(" << outterBox.parameters[1].x << ","
-                               << outterBox.parameters[1].y << "," << outterBox.parameters[1].z << ")");
+Quantizes the streamed hierarchy into m_hCompressedBoxes. Boxes are encoded in
+depth-first order, relative to the decoded box of their parent, which is the
+last box encoded at the previous depth. Boxes at depth 0 are encoded relative
+to a frame enclosing all of them. The array is left empty if the hierarchy
+cannot be encoded, or is deeper than COMPRESSED_BOXES_TREE_DEPTH, in which case
+regular boxes are used
+________________________________________________________________________________
+*/
+void GPUKernel::compressBoxes()
+{
+    m_hCompressedBoxes.clear();
+    if (m_accelerationStructure == asGrid)
+    {
+        LOG_INFO(1, "Compressed boxes require a bounding volume hierarchy");
+        return;
+    }
+    if (!m_instances.empty())
+    {
+        // Boxes of meshes are expressed in object space, and not nested in
+        // the boxes of the scene
+        LOG_INFO(1, "Compressed boxes do not support instances");
+        return;
+    }
 
-    // Process box size
-    for (const auto &p : outterBox.primitives)
+    // Box 0 spans the whole view distance to hold the lights. It is encoded
+    // with the bounds of the lights so that it does not stretch the frame
+    const BVHStreamInfo &info = m_bvhStreamInfo[m_frame];
+    vec3f lights[2];
+    resetBounds(lights);
+    for (int i(0); i < info.nbLights; ++i)
     {
-        try
-        {
-            CPUBoundingBox &box = (m_boundingBoxes[m_frame][depth])[p];
-            if (outterBox.parameters[0].x > box.parameters[0].x)
-                outterBox.parameters[0].x = box.parameters[0].x;
-            if (outterBox.parameters[0].y > box.parameters[0].y)
-                outterBox.parameters[0].y = box.parameters[0].y;
-            if (outterBox.parameters[0].z > box.parameters[0].z)
-                outterBox.parameters[0].z = box.parameters[0].z;
-            if (outterBox.parameters[1].x < box.parameters[1].x)
-                outterBox.parameters[1].x = box.parameters[1].x;
-            if (outterBox.parameters[1].y < box.parameters[1].y)
-                outterBox.parameters[1].y = box.parameters[1].y;
-            if (outterBox.parameters[1].z < box.parameters[1].z)
-                outterBox.parameters[1].z = box.parameters[1].z;
-        }
-        catch (...)
+        vec3f corners[2];
+        getPrimitiveBounds(m_primitives[m_frame][info.primitives[i]], corners[0], corners[1]);
+        growBounds(lights, corners[0], corners[1]);
+    }
+
+    // Depth of each box, from the skip indices of its ancestors
+    const int nbBoxes = m_nbActiveBoxes[m_frame];
+    std::vector<unsigned char> depths(nbBoxes);
+    std::vector<int> ends;
+    vec3f frame[2];
+    resetBounds(frame);
+    for (int i(0); i < nbBoxes; ++i)
+    {
+        const BoundingBox &box = m_hBoundingBoxes[i];
+        while (!ends.empty() && ends.back() <= i)
+            ends.pop_back();
+        if (ends.size() >= COMPRESSED_BOXES_TREE_DEPTH || box.nbPrimitives > 0xFFFF ||
+            box.indexForNextBox.x > 0xFFFFFF)
         {
-            LOG_ERROR("Ca chie grave dans les boites!");
+            LOG_ERROR("Box " << i << " cannot be compressed");
+            return;
         }
+        depths[i] = static_cast<unsigned char>(ends.size());
+        if (box.indexForNextBox.x > 1)
+            ends.push_back(i + box.indexForNextBox.x);
+        if (i == 0)
+            growBounds(frame, lights[0], lights[1]);
+        else if (depths[i] == 0)
+            growBounds(frame, box.parameters[0], box.parameters[1]);
     }
-    outterBox.center.x = (outterBox.parameters[0].x + outterBox.parameters[1].x) / 2.f;
-    outterBox.center.y = (outterBox.parameters[0].y + outterBox.parameters[1].y) / 2.f;
-    outterBox.center.z = (outterBox.parameters[0].z + outterBox.parameters[1].z) / 2.f;
+    if (frame[0].x > frame[1].x)
+        frame[0] = frame[1] = make_vec3f();
 
-    return result;
+    m_hCompressedBoxes.resize(COMPRESSED_BOXES_HEADER_SIZE + nbBoxes);
+    const float header[8] = {frame[0].x, frame[0].y, frame[0].z, 0.f, frame[1].x, frame[1].y, frame[1].z, 0.f};
+    memcpy(&m_hCompressedBoxes[0], header, sizeof(header));
+
+    vec3f ancestors[2 * COMPRESSED_BOXES_TREE_DEPTH];
+    for (int i(0); i < nbBoxes; ++i)
+    {
+        const BoundingBox &box = m_hBoundingBoxes[i];
+        CompressedBoundingBox &node = m_hCompressedBoxes[COMPRESSED_BOXES_HEADER_SIZE + i];
+        const int depth = depths[i];
+        const vec3f *parent = (depth == 0) ? frame : &ancestors[2 * (depth - 1)];
+        const vec3f *parameters = box.parameters;
+        if (i == 0)
+            parameters = (info.nbLights != 0) ? lights : frame;
+        quantizeBox(parent, parameters, node, &ancestors[2 * depth]);
+        node.nbPrimitives = static_cast<unsigned short>(box.nbPrimitives);
+        node.startIndex = static_cast<unsigned int>(box.startIndex);
+        node.indexForNextBox =
+            static_cast<unsigned int>(box.indexForNextBox.x) | (static_cast<unsigned int>(depth) << 24);
+    }
+    LOG_INFO(3, "Compressed " << nbBoxes << " boxes from " << nbBoxes * sizeof(BoundingBox) << " to "
+                              << m_hCompressedBoxes.size() * sizeof(CompressedBoundingBox) << " bytes");
 }
 
-void GPUKernel::resetBoxes(bool resetPrimitives)
+// CPU decoder of quantized boxes. Boxes must be visited in depth-first order,
+// ancestors holding the decoded corners of the last box visited at each depth
+BoundingBox GPUKernel::decompressBox(const int index, vec3f *ancestors) const
 {
-    if (resetPrimitives)
-        for (int i(0); i < m_boundingBoxes[m_frame][0].size(); ++i)
-            resetBox(m_boundingBoxes[m_frame][0][i], resetPrimitives);
-    else
-        m_boundingBoxes[m_frame][0].clear();
+    const CompressedBoundingBox &node = m_hCompressedBoxes[COMPRESSED_BOXES_HEADER_SIZE + index];
+    const unsigned int depth = node.indexForNextBox >> 24;
+    vec3f frame[2];
+    if (depth == 0)
+    {
+        float header[8];
+        memcpy(header, &m_hCompressedBoxes[0], sizeof(header));
+        frame[0] = make_vec3f(header[0], header[1], header[2]);
+        frame[1] = make_vec3f(header[4], header[5], header[6]);
+    }
+    dequantizeBox((depth == 0) ? frame : &ancestors[2 * (depth - 1)], node, &ancestors[2 * depth]);
+
+    BoundingBox box;
+    box.parameters[0] = ancestors[2 * depth];
+    box.parameters[1] = ancestors[2 * depth + 1];
+    box.nbPrimitives = node.nbPrimitives;
+    box.startIndex = node.startIndex;
+    box.indexForNextBox = make_vec2i(node.indexForNextBox & 0xFFFFFF, 0);
+    return box;
 }
 
-void GPUKernel::resetBox(CPUBoundingBox &box, bool resetPrimitives)
+void GPUKernel::buildWideBVH()
 {
-    LOG_INFO(3, "GPUKernel::resetBox(" << resetPrimitives << ")");
-    if (resetPrimitives)
+    m_wideBVHNodes.clear();
+    const int nbBoxes = m_nbTopLevelBoxes;
+    if (nbBoxes == 0)
+        return;
+
+    // Boxes at depth 0 are the children of the root
+    std::vector<int> roots;
+    for (int i(0); i < nbBoxes; i += m_hBoundingBoxes[i].indexForNextBox.x)
+        roots.push_back(i);
+    m_wideBVHNodes.reserve(nbBoxes / (WIDE_BVH_WIDTH - 1) + 1);
+    collapseWideBVHNode(m_hBoundingBoxes, roots, m_wideBVHNodes);
+
+    // Children of the nodes must contain the boxes below them, or traversals
+    // would cull leaves that rays hit
+    vec3f bounds[2];
+    resetBounds(bounds);
+    const int nbErrors = checkWideBVHChild(m_hBoundingBoxes, m_wideBVHNodes, 0, bounds);
+    if (nbErrors != 0)
     {
-        box.primitives.clear();
-        box.indexForNextBox = 1;
+        LOG_ERROR("Wide hierarchy: " << nbErrors << " children do not contain their boxes");
     }
-    box.parameters[0].x = m_sceneInfo.viewDistance;
-    box.parameters[0].y = m_sceneInfo.viewDistance;
-    box.parameters[0].z = m_sceneInfo.viewDistance;
-    box.parameters[1].x = -m_sceneInfo.viewDistance;
-    box.parameters[1].y = -m_sceneInfo.viewDistance;
-    box.parameters[1].z = -m_sceneInfo.viewDistance;
+    LOG_INFO(3, "Collapsed " << nbBoxes << " boxes into " << m_wideBVHNodes.size() << " nodes of "
+                             << WIDE_BVH_WIDTH << " children");
 }
 
-int GPUKernel::processBoxes(const int boxSize, bool simulate)
+void GPUKernel::initWideBVHTraversal(WideBVHTraversal &traversal, const vec3f &origin, const vec3f &direction) const
 {
-    vec4f boxSteps;
-    boxSteps.x = (m_maxPos[m_frame].x - m_minPos[m_frame].x) / boxSize;
-    boxSteps.y = (m_maxPos[m_frame].y - m_minPos[m_frame].y) / boxSize;
-    boxSteps.z = (m_maxPos[m_frame].z - m_minPos[m_frame].z) / boxSize;
-
-    boxSteps.x = (boxSteps.x == 0.f) ? 1 : boxSteps.x;
-    boxSteps.y = (boxSteps.y == 0.f) ? 1 : boxSteps.y;
-    boxSteps.z = (boxSteps.z == 0.f) ? 1 : boxSteps.z;
-
-    std::map<unsigned int, unsigned int> primitivesPerBox;
-
-    // Add primitives to boxes
-    unsigned int p = 0;
-    size_t maxPrimitivesPerBox = 0;
-    for (const auto &prim : m_primitives[m_frame])
+    traversal.origin = origin;
+    traversal.invDirection = make_vec3f(1.f / direction.x, 1.f / direction.y, 1.f / direction.z);
+    traversal.signs[0] = (traversal.invDirection.x < 0.f) ? 1 : 0;
+    traversal.signs[1] = (traversal.invDirection.y < 0.f) ? 1 : 0;
+    traversal.signs[2] = (traversal.invDirection.z < 0.f) ? 1 : 0;
+    traversal.stackSize = 0;
+    traversal.nbVisitedNodes = 0;
+    if (!m_wideBVHNodes.empty())
     {
-        auto &primitive = prim.second;
+        traversal.stack[0] = 0;
+        traversal.distances[0] = 0.f;
+        traversal.stackSize = 1;
+    }
+}
 
-        const auto &center = primitive.p0;
-        unsigned int X = static_cast<int>((center.x - m_minPos[m_frame].x) / boxSteps.x);
-        unsigned int Y = static_cast<int>((center.y - m_minPos[m_frame].y) / boxSteps.y);
-        unsigned int Z = static_cast<int>((center.z - m_minPos[m_frame].z) / boxSteps.z);
-        unsigned int B = 1 + 1000 * (X * boxSize * boxSize + Y * boxSize + Z);
+/*
+________________________________________________________________________________
 
-        if (simulate)
-            if (primitivesPerBox.find(B) == primitivesPerBox.end())
-                primitivesPerBox[B] = 0;
-            else
-                primitivesPerBox[B]++;
-        else
-        {
-            if (primitivesPerBox.find(B) == primitivesPerBox.end())
+Returns the next leaf box hit by the ray, or -1 when the traversal is over.
+Children are pushed farthest first, so that leaves come out in front-to-back
+order. Callers shorten tmax as they find intersections, which culls the
+remaining nodes
+________________________________________________________________________________
+*/
+int GPUKernel::nextWideBVHLeaf(WideBVHTraversal &traversal, const float tmax) const
+{
+    while (traversal.stackSize > 0)
+    {
+        --traversal.stackSize;
+        const int entry = traversal.stack[traversal.stackSize];
+        if (traversal.distances[traversal.stackSize] > tmax)
+            continue;
+        if (entry < 0)
+            return -1 - entry;
+
+        ++traversal.nbVisitedNodes;
+        const CPUWideBVHNode &node = m_wideBVHNodes[entry];
+        float distances[WIDE_BVH_WIDTH];
+        const int mask = intersectWideBVHNode(node, traversal, tmax, distances);
+        int hits[WIDE_BVH_WIDTH];
+        int nbHits = 0;
+        for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+            if (mask & (1 << i))
             {
-                // Create Box B since it does not exist yet
-                CPUBoundingBox box;
-                memset(&box, 0, sizeof(CPUBoundingBox));
-                box.parameters[0].x = m_sceneInfo.viewDistance;
-                box.parameters[0].y = m_sceneInfo.viewDistance;
-                box.parameters[0].z = m_sceneInfo.viewDistance;
-                box.parameters[1].x = -m_sceneInfo.viewDistance;
-                box.parameters[1].y = -m_sceneInfo.viewDistance;
-                box.parameters[1].z = -m_sceneInfo.viewDistance;
-                box.indexForNextBox = 1;
-                m_boundingBoxes[m_frame][0].insert(std::make_pair(B, box));
+                // Insertion sort, farthest first
+                int j = nbHits++;
+                while (j > 0 && distances[hits[j - 1]] < distances[i])
+                {
+                    hits[j] = hits[j - 1];
+                    --j;
+                }
+                hits[j] = i;
             }
+        for (int i = 0; i < nbHits; ++i)
+        {
+            traversal.stack[traversal.stackSize] = node.children[hits[i]];
+            traversal.distances[traversal.stackSize] = distances[hits[i]];
+            ++traversal.stackSize;
+        }
+    }
+    return -1;
+}
 
-            // Lights
-            if (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f)
-            {
-                // Lights are added to first box of higher level
-                m_boundingBoxes[m_frame][m_treeDepth][0].primitives.push_back(p);
-                LOG_INFO(3, "[" << m_treeDepth << "] Lamp " << p << " added (" << primitive.p0.x << ","
-                                << primitive.p0.y << "," << primitive.p0.z << " " << m_nbActiveLamps[m_frame] << "/"
-                                << NB_MAX_LAMPS << "), Material ID=" << primitive.materialId);
-            }
-            else
-            {
-                // LOG_INFO(3, "Adding primitive to box " << B);
-                m_boundingBoxes[m_frame][0][B].primitives.push_back(p);
-                if (m_boundingBoxes[m_frame][0][B].primitives.size() > maxPrimitivesPerBox)
-                    maxPrimitivesPerBox = m_boundingBoxes[m_frame][0][B].primitives.size();
+/*
+________________________________________________________________________________
+
+Traverses the streamed hierarchy on the CPU with the primary rays of the
+current camera, with regular, quantized and wide boxes. Only boxes are tested,
+so that the measure reflects the memory traffic of the traversal itself
+________________________________________________________________________________
+*/
+void GPUKernel::benchmarkBoxes()
+{
+    if (m_streamedFrame != m_frame)
+    {
+        LOG_INFO(1, "Boxes benchmark requires streamed boxes");
+        return;
+    }
+    if (m_hCompressedBoxes.empty())
+        compressBoxes();
+    if (m_wideBVHNodes.empty())
+        buildWideBVH();
+
+    // Rays are spread over the whole image, the way the standard renderer does
+    const int width = std::max(1, m_sceneInfo.size.x);
+    const int height = std::max(1, m_sceneInfo.size.y);
+    const int stride = static_cast<int>(ceil(sqrt(static_cast<double>(width * height) / BENCHMARK_MAX_RAYS)));
+    const int nbColumns = (width + stride - 1) / stride;
+    const int nbRays = nbColumns * ((height + stride - 1) / stride);
+    const float ratio = static_cast<float>(width) / static_cast<float>(height);
+    const vec3f cosAngles = make_vec3f(cos(m_angles.x), cos(m_angles.y), cos(m_angles.z));
+    const vec3f sinAngles = make_vec3f(sin(m_angles.x), sin(m_angles.y), sin(m_angles.z));
+    const vec3f rotationCenter = make_vec3f();
+    const int nbBoxes = m_nbTopLevelBoxes;
+
+    // Cache misses are counted by a second pass, so that simulating caches
+    // does not slow down the timed one. Wide boxes are walked by their own
+    // traversal, and are only timed
+    const char *layouts[] = {"Regular boxes", "Compressed boxes", "Wide boxes"};
+    const size_t boxSizes[] = {sizeof(BoundingBox), sizeof(CompressedBoundingBox), sizeof(CPUWideBVHNode)};
+    for (int layout(0); layout < 3; ++layout)
+    {
+        if (layout == 1 && m_hCompressedBoxes.empty())
+            continue;
+        double elapsed(0.0);
+        long long nbVisitedBoxes = 0;
+        long long nbTestedPrimitives = 0;
+        long long nbCacheMisses = 0;
+        for (int pass(0); pass < ((layout == 2) ? 1 : 2); ++pass)
+        {
+            const bool simulateCache = (pass == 1);
+            const auto start = std::chrono::steady_clock::now();
+#pragma omp parallel reduction(+ : nbVisitedBoxes, nbTestedPrimitives, nbCacheMisses)
+            {
+                // Rays of a thread share the cache of its core
+                CacheSimulator cache;
+#pragma omp for
+                for (int i = 0; i < nbRays; ++i)
+                {
+                    const int x = (i % nbColumns) * stride;
+                    const int y = (i / nbColumns) * stride;
+                    vec3f origin = m_viewPos;
+                    vec3f target = m_viewDir;
+                    target.x -= ratio * m_angles.w / width * (x - width / 2);
+                    target.y += m_angles.w / height * (y - height / 2);
+                    rotateVector(origin, rotationCenter, cosAngles, sinAngles);
+                    rotateVector(target, rotationCenter, cosAngles, sinAngles);
+                    const vec3f invDirection = make_vec3f(1.f / (target.x - origin.x), 1.f / (target.y - origin.y),
+                                                          1.f / (target.z - origin.z));
+
+                    if (layout == 2)
+                    {
+                        WideBVHTraversal traversal;
+                        initWideBVHTraversal(traversal, origin,
+                                             make_vec3f(target.x - origin.x, target.y - origin.y, target.z - origin.z));
+                        int leaf;
+                        while ((leaf = nextWideBVHLeaf(traversal, m_sceneInfo.viewDistance)) != -1)
+                            nbTestedPrimitives += m_hBoundingBoxes[leaf].nbPrimitives;
+                        nbVisitedBoxes += traversal.nbVisitedNodes;
+                        continue;
+                    }
+
+                    vec3f ancestors[2 * COMPRESSED_BOXES_TREE_DEPTH];
+                    int b = 0;
+                    while (b < nbBoxes)
+                    {
+                        const BoundingBox box = (layout == 0) ? m_hBoundingBoxes[b] : decompressBox(b, ancestors);
+                        // Quantized nodes follow the header of the root frame
+                        if (simulateCache && layout == 0)
+                            nbCacheMisses += cache.access(&m_hBoundingBoxes[b], sizeof(BoundingBox));
+                        else if (simulateCache)
+                            nbCacheMisses += cache.access(&m_hCompressedBoxes[COMPRESSED_BOXES_HEADER_SIZE + b],
+                                                          sizeof(CompressedBoundingBox));
+                        else
+                            ++nbVisitedBoxes;
+                        if (rayBoxIntersection(box.parameters, origin, invDirection, m_sceneInfo.viewDistance))
+                        {
+                            if (simulateCache && box.nbPrimitives != 0)
+                                nbCacheMisses +=
+                                    cache.access(&m_hPrimitives[box.startIndex], box.nbPrimitives * sizeof(Primitive));
+                            else if (!simulateCache)
+                                nbTestedPrimitives += box.nbPrimitives;
+                            ++b;
+                        }
+                        else
+                            b += box.indexForNextBox.x;
+                    }
+                }
             }
+            if (!simulateCache)
+                elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
         }
-        ++p;
+        std::stringstream misses;
+        if (layout != 2)
+            misses << static_cast<double>(nbCacheMisses) / nbRays << " cache misses/ray, ";
+        LOG_INFO(1, layouts[layout] << ": " << nbVisitedBoxes * boxSizes[layout] / nbRays << " bytes/ray, "
+                                    << static_cast<double>(nbTestedPrimitives) / nbRays << " primitives/ray, "
+                                    << misses.str() << (elapsed > 0.0 ? nbRays / elapsed / 1e6 : 0.0) << " Mrays/s");
     }
-
-    // Now update box sizes
-    if (!simulate)
-        for (auto &box : m_boundingBoxes[m_frame][0])
-            updateBoundingBox(box.second);
-
-    LOG_INFO(3, "Maximum number of primitives per box=" << maxPrimitivesPerBox << " for level 0");
-    return static_cast<int>(maxPrimitivesPerBox);
+    if (!m_compressedBoxes)
+        m_hCompressedBoxes.clear();
 }
 
-int GPUKernel::processOutterBoxes(const int boxSize, const int boundingBoxesDepth)
+int GPUKernel::compactBoxes(bool reconstructBoxes)
 {
-    LOG_INFO(3, "processOutterBoxes(" << boxSize << "," << boundingBoxesDepth << ")");
-    vec4f boxSteps;
-    boxSteps.x = (m_maxPos[m_frame].x - m_minPos[m_frame].x) / boxSize;
-    boxSteps.y = (m_maxPos[m_frame].y - m_minPos[m_frame].y) / boxSize;
-    boxSteps.z = (m_maxPos[m_frame].z - m_minPos[m_frame].z) / boxSize;
-
-    boxSteps.x = (boxSteps.x == 0.f) ? 1 : boxSteps.x;
-    boxSteps.y = (boxSteps.y == 0.f) ? 1 : boxSteps.y;
-    boxSteps.z = (boxSteps.z == 0.f) ? 1 : boxSteps.z;
+    LOG_INFO(3, "GPUKernel::compactBoxes (" << (reconstructBoxes ? "true" : "false") << ")");
 
-    // Create boxes in Rubik's cube mode :-)
-    size_t maxPrimitivesPerBox(0);
-    for (const auto &box : m_boundingBoxes[m_frame][boundingBoxesDepth - 1])
+    // While a hierarchy is built in the background, the streamed one is only
+    // refitted, and reconstructions are postponed until the build completes
+    swapBackgroundBuild();
+    if (m_backgroundBuild && m_backgroundBuild->frame == m_frame)
     {
-        const auto &center = box.second.center;
-        int X = static_cast<int>((center.x - m_minPos[m_frame].x) / boxSteps.x);
-        int Y = static_cast<int>((center.y - m_minPos[m_frame].y) / boxSteps.y);
-        int Z = static_cast<int>((center.z - m_minPos[m_frame].z) / boxSteps.z);
-        int B = (X * boxSize * boxSize + Y * boxSize + Z);
-
-        B++; // Index 0 is used to store lights, so we start storing primitives
-             // from index 1
-
-        // Box B
-        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[0].x = m_sceneInfo.viewDistance;
-        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[0].y = m_sceneInfo.viewDistance;
-        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[0].z = m_sceneInfo.viewDistance;
-        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[1].x = -m_sceneInfo.viewDistance;
-        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[1].y = -m_sceneInfo.viewDistance;
-        m_boundingBoxes[m_frame][boundingBoxesDepth][B].parameters[1].z = -m_sceneInfo.viewDistance;
-        m_boundingBoxes[m_frame][boundingBoxesDepth][B].primitives.push_back(box.first);
-        if (m_boundingBoxes[m_frame][boundingBoxesDepth][B].primitives.size() > maxPrimitivesPerBox)
-            maxPrimitivesPerBox = m_boundingBoxes[m_frame][boundingBoxesDepth][B].primitives.size();
+        if (reconstructBoxes)
+            m_backgroundBuildRequested = true;
+        refitBoxes();
+        return static_cast<int>(m_nbActiveBoxes[m_frame]);
     }
-    LOG_INFO(3, "Depth " << boundingBoxesDepth << ": " << m_boundingBoxes[m_frame][boundingBoxesDepth].size()
-                         << " created");
 
-    // Now update box sizes
-    for (auto &box : m_boundingBoxes[m_frame][boundingBoxesDepth])
-        updateOutterBoundingBox(box.second, boundingBoxesDepth - 1);
+    // Dynamic hierarchies are updated in place, unless they have to be rebuilt
+    if (m_accelerationStructure == asDynamic)
+    {
+        if (updateBVHBoxes())
+            return static_cast<int>(m_nbActiveBoxes[m_frame]);
+        reconstructBoxes = true;
+    }
 
-    LOG_INFO(3, "Maximum number of sub-boxes per box=" << maxPrimitivesPerBox << " for level " << boundingBoxesDepth);
-    return static_cast<int>(maxPrimitivesPerBox);
-}
+    // Hierarchies only need their bounds to be updated when primitives move
+    if (!reconstructBoxes && m_accelerationStructure != asGrid)
+    {
+        refitBoxes();
+        return static_cast<int>(m_nbActiveBoxes[m_frame]);
+    }
 
-int GPUKernel::compactBoxes(bool reconstructBoxes)
-{
-    LOG_INFO(3, "GPUKernel::compactBoxes (" << (reconstructBoxes ? "true" : "false") << ")");
+    // The streamed hierarchy is rendered until the new one is built
+    if (m_backgroundBuilds && m_accelerationStructure != asGrid && !m_backgroundBuild && m_streamedFrame == m_frame &&
+        !m_bvhNodes[m_frame].empty())
+    {
+        startBackgroundBuild();
+        return static_cast<int>(m_nbActiveBoxes[m_frame]);
+    }
 
     // First box of highest level is dedicated to light sources
     m_primitivesTransfered = false;
-    if (reconstructBoxes)
+    const auto buildStart = std::chrono::steady_clock::now();
+    if (reconstructBoxes && m_accelerationStructure != asGrid)
     {
+        const int maxPrimitivesPerBox = processBVHBoxes();
+        LOG_INFO(1, "Primitives.........: " << m_primitives[m_frame].size());
+        LOG_INFO(1, "BVH nodes..........: " << m_bvhNodes[m_frame].size());
+        LOG_INFO(1, "Primitives per leaf: " << maxPrimitivesPerBox);
+    }
+    else if (reconstructBoxes)
+    {
+        if (!m_instances.empty())
+            LOG_INFO(1, "Instances require a bounding volume hierarchy, they are ignored by the grid");
         resetBox(m_boundingBoxes[m_frame][m_treeDepth][0], true);
         int gridGranularity(2);
         int gridDivider(4);
@@ -1079,6 +4086,12 @@ int GPUKernel::compactBoxes(bool reconstructBoxes)
 
     LOG_INFO(3, "Streaming data to GPU");
     streamDataToGPU();
+    if (reconstructBoxes)
+    {
+        m_boxesBuildTime =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+        LOG_INFO(1, "Build time.........: " << m_boxesBuildTime << " ms");
+    }
     return static_cast<int>(m_nbActiveBoxes[m_frame]);
 }
 
@@ -1087,6 +4100,7 @@ void GPUKernel::recursiveDataStreamToGPU(const int depth, std::vector<long> &ele
     LOG_INFO(3, "RecursiveDataStreamToGPU(" << depth << ")");
     LOG_INFO(3, "Depth " << depth << " contains " << elements.size() << " boxes");
 
+
     size_t c = 0;
     for (const auto &element : elements)
     {
@@ -1117,20 +4131,7 @@ void GPUKernel::recursiveDataStreamToGPU(const int depth, std::vector<long> &ele
                     // Prepare primitives for GPU
                     if ((*itp) < NB_MAX_PRIMITIVES)
                     {
-                        CPUPrimitive &primitive = (m_primitives[m_frame])[*itp];
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].index = (*itp);
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].type = primitive.type;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].p0 = primitive.p0;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].p1 = primitive.p1;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].p2 = primitive.p2;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].n0 = primitive.n0;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].n1 = primitive.n1;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].n2 = primitive.n2;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].size = primitive.size;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].materialId = primitive.materialId;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].vt0 = primitive.vt0;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].vt1 = primitive.vt1;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].vt2 = primitive.vt2;
+                        streamPrimitiveToGPU((m_primitives[m_frame])[*itp], *itp, m_nbActivePrimitives[m_frame]);
                         ++m_nbActivePrimitives[m_frame];
                     }
                     ++itp;
@@ -1161,103 +4162,56 @@ void GPUKernel::streamDataToGPU()
     m_nbActiveLamps[m_frame] = 0;
     m_maxPrimitivesPerBox = 0;
 
-    // Build boxes tree recursively
-    int maxDepth(m_treeDepth);
-    LOG_INFO(3, "Processing " << m_boundingBoxes[m_frame][maxDepth].size() << " master boxes");
-    BoxContainer::iterator itob = m_boundingBoxes[m_frame][maxDepth].begin();
-    while (itob != m_boundingBoxes[m_frame][maxDepth].end())
+    if (m_accelerationStructure != asGrid)
+        streamBVHToGPU();
+    else
     {
-        // Create Box
-        CPUBoundingBox &box = (*itob).second;
-        int boxIndex = m_nbActiveBoxes[m_frame];
-        LOG_INFO(3, "==> Box " << boxIndex << " Depth [" << maxDepth << "] ++");
-        m_hBoundingBoxes[boxIndex].parameters[0] = box.parameters[0];
-        m_hBoundingBoxes[boxIndex].parameters[1] = box.parameters[1];
-        m_hBoundingBoxes[boxIndex].nbPrimitives = 0;
-        m_hBoundingBoxes[boxIndex].startIndex = maxDepth;
-
-        if (itob == m_boundingBoxes[m_frame][maxDepth].begin())
-        {
-            LOG_INFO(3, "Box 0 of higher level (" << 0 << ") contains ligths");
-            m_lightInformationSize = 0;
-            m_hBoundingBoxes[boxIndex].parameters[0].x = -m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[0].y = -m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[0].z = -m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[1].x = m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[1].y = m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[1].z = m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].nbPrimitives = static_cast<int>(box.primitives.size());
-            m_hBoundingBoxes[boxIndex].startIndex = 0;
-            std::vector<long>::const_iterator itp = box.primitives.begin();
-            while (itp != box.primitives.end())
+        // Build boxes tree recursively
+        int maxDepth(m_treeDepth);
+        LOG_INFO(3, "Processing " << m_boundingBoxes[m_frame][maxDepth].size() << " master boxes");
+        BoxContainer::iterator itob = m_boundingBoxes[m_frame][maxDepth].begin();
+        while (itob != m_boundingBoxes[m_frame][maxDepth].end())
+        {
+            // Create Box
+            CPUBoundingBox &box = (*itob).second;
+            int boxIndex = m_nbActiveBoxes[m_frame];
+            LOG_INFO(3, "==> Box " << boxIndex << " Depth [" << maxDepth << "] ++");
+            m_hBoundingBoxes[boxIndex].parameters[0] = box.parameters[0];
+            m_hBoundingBoxes[boxIndex].parameters[1] = box.parameters[1];
+            m_hBoundingBoxes[boxIndex].nbPrimitives = 0;
+            m_hBoundingBoxes[boxIndex].startIndex = maxDepth;
+
+            if (itob == m_boundingBoxes[m_frame][maxDepth].begin())
             {
-                // Add the primitive
-                CPUPrimitive &primitive = (m_primitives[m_frame])[*itp];
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].index = (*itp);
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].type = primitive.type;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].p0 = primitive.p0;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].p1 = primitive.p1;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].p2 = primitive.p2;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].n0 = primitive.n0;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].n1 = primitive.n1;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].n2 = primitive.n2;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].size = primitive.size;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].materialId = primitive.materialId;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].vt0 = primitive.vt0;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].vt1 = primitive.vt1;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].vt2 = primitive.vt2;
-                ++m_nbActivePrimitives[m_frame];
-
-                // Add light information related to primitive
-                Material &material = m_hMaterials[primitive.materialId];
-                LightInformation lightInformation;
-                LOG_INFO(3, "LightInformation " << (*itp) << ", MaterialId=" << primitive.materialId);
-                lightInformation.primitiveId = (*itp);
-                lightInformation.materialId = primitive.materialId;
-
-                lightInformation.location.x = primitive.p0.x;
-                lightInformation.location.y = primitive.p0.y;
-                lightInformation.location.z = primitive.p0.z;
-
-                lightInformation.color.x = material.color.x;
-                lightInformation.color.y = material.color.y;
-                lightInformation.color.z = material.color.z;
-                lightInformation.color.w = material.innerIllumination.x;
-
-                m_lightInformation[m_lightInformationSize] = lightInformation;
-
-                LOG_INFO(3, "Adding Light Information: " << m_lightInformation[m_lightInformationSize].primitiveId
-                                                         << "," << m_lightInformation[m_lightInformationSize].materialId
-                                                         << ":" << m_lightInformation[m_lightInformationSize].location.x
-                                                         << "," << m_lightInformation[m_lightInformationSize].location.y
-                                                         << "," << m_lightInformation[m_lightInformationSize].location.z
-                                                         << " " << m_lightInformation[m_lightInformationSize].color.x
-                                                         << "," << m_lightInformation[m_lightInformationSize].color.y
-                                                         << "," << m_lightInformation[m_lightInformationSize].color.z
-                                                         << " " << m_lightInformation[m_lightInformationSize].color.w);
-
-                m_hLamps[m_nbActiveLamps[m_frame]] = *itp;
-                ++m_nbActiveLamps[m_frame];
-                ++m_lightInformationSize;
-                ++itp;
+                LOG_INFO(3, "Box 0 of higher level (" << 0 << ") contains ligths");
+                streamLightsToGPU(box, boxIndex);
             }
-        }
 
-        ++m_nbActiveBoxes[m_frame];
+            ++m_nbActiveBoxes[m_frame];
 
-        // Recursively populate flattened tree representation
-        if (maxDepth > 0)
-            recursiveDataStreamToGPU(maxDepth - 1, box.primitives);
+            // Recursively populate flattened tree representation
+            if (maxDepth > 0)
+                recursiveDataStreamToGPU(maxDepth - 1, box.primitives);
 
-        m_hBoundingBoxes[boxIndex].indexForNextBox.x = m_nbActiveBoxes[m_frame] - boxIndex;
-        LOG_INFO(3, "Master Primitive (" << box.parameters[0].x << "," << box.parameters[0].y << ","
-                                         << box.parameters[0].z << "),(" << box.parameters[1].x << ","
-                                         << box.parameters[1].y << "," << box.parameters[1].z << "),"
-                                         << m_hBoundingBoxes[boxIndex].indexForNextBox.x);
-        ++itob;
+            m_hBoundingBoxes[boxIndex].indexForNextBox.x = m_nbActiveBoxes[m_frame] - boxIndex;
+            LOG_INFO(3, "Master Primitive (" << box.parameters[0].x << "," << box.parameters[0].y << ","
+                                             << box.parameters[0].z << "),(" << box.parameters[1].x << ","
+                                             << box.parameters[1].y << "," << box.parameters[1].z << "),"
+                                             << m_hBoundingBoxes[boxIndex].indexForNextBox.x);
+            ++itob;
+        }
+        m_nbTopLevelBoxes = m_nbActiveBoxes[m_frame];
     }
 
     LOG_INFO(3, "Max primitives per box: " << m_maxPrimitivesPerBox);
+    m_streamedFrame = m_frame;
+    m_dirtyBoxes.assign(1, make_vec2i(0, m_nbActiveBoxes[m_frame]));
+    m_dirtyPrimitives.assign(1, make_vec2i(0, m_nbActivePrimitives[m_frame]));
+    m_wideBVHNodes.clear();
+    if (m_compressedBoxes)
+        compressBoxes();
+    else
+        m_hCompressedBoxes.clear();
 
     // Build global illumination structures
     // buildLightInformationFromTexture(4);
@@ -1265,10 +4219,20 @@ void GPUKernel::streamDataToGPU()
     // Done
     LOG_INFO(3, "Compacted " << m_nbActiveBoxes[m_frame] << " boxes, " << m_nbActivePrimitives[m_frame]
                              << " primitives and " << m_nbActiveLamps[m_frame] << " lamps");
-    if (m_nbActivePrimitives[m_frame] != m_primitives[m_frame].size())
+    size_t nbPrimitives = m_primitives[m_frame].size();
+    if (m_accelerationStructure != asGrid)
+    {
+        // Hierarchies also stream instances, copies of references split by
+        // spatial splits, and the primitives of meshes
+        nbPrimitives = m_bvhStreamInfo[m_frame].nbLights + m_bvhPrimitives[m_frame].size();
+        if (!m_instances.empty())
+            for (const auto &mesh : m_meshes)
+                nbPrimitives += mesh.primitives.size();
+    }
+    if (m_nbActivePrimitives[m_frame] != nbPrimitives)
     {
         LOG_ERROR("Lost primitives on the way for frame " << m_frame << "... " << m_nbActivePrimitives[m_frame]
-                                                          << "!=" << m_primitives[m_frame].size());
+                                                          << "!=" << nbPrimitives);
     }
 
     for (int i(0); i < m_nbActiveBoxes[m_frame]; ++i)
@@ -1280,9 +4244,345 @@ void GPUKernel::streamDataToGPU()
     }
 }
 
+void GPUKernel::streamBVHToGPU()
+{
+    LOG_INFO(3, "GPUKernel::streamBVHToGPU");
+
+    // Box 0 contains the lights
+    const CPUBoundingBox &lights = m_boundingBoxes[m_frame][m_treeDepth][0];
+    streamLightsToGPU(lights, 0);
+    m_hBoundingBoxes[0].indexForNextBox.x = 1;
+    ++m_nbActiveBoxes[m_frame];
+
+    // Nodes are already in depth-first order, with skip indices
+    const BVHNodeContainer &nodes = m_bvhNodes[m_frame];
+    int nbNodes = static_cast<int>(nodes.size());
+    if (m_nbActiveBoxes[m_frame] + nbNodes > static_cast<int>(NB_MAX_BOXES))
+    {
+        LOG_ERROR("Too many boxes (" << m_nbActiveBoxes[m_frame] + nbNodes << "/" << NB_MAX_BOXES << ")");
+        nbNodes = NB_MAX_BOXES - m_nbActiveBoxes[m_frame];
+    }
+
+    // Primitives of the hierarchy are streamed in leaf order, right after the
+    // lights, so that leaves are contiguous ranges of the GPU buffer
+    const std::vector<int> &bvhPrimitives = m_bvhPrimitives[m_frame];
+    const int primitiveOffset = m_nbActivePrimitives[m_frame];
+    int nbPrimitives = primitiveOffset;
+    if (m_accelerationStructure == asDynamic)
+        nbPrimitives += static_cast<int>(bvhPrimitives.size());
+    for (int i(0); i < nbNodes; ++i)
+        if (nodes[i].nbPrimitives != 0)
+        {
+            nbPrimitives = std::max(nbPrimitives, primitiveOffset + nodes[i].startIndex + nodes[i].nbPrimitives);
+            m_maxPrimitivesPerBox = std::max(m_maxPrimitivesPerBox, static_cast<size_t>(nodes[i].nbPrimitives));
+        }
+
+    // Meshes follow the hierarchy of the scene. They are streamed first so
+    // that instances know where the boxes of their mesh are
+    const int boxOffset = m_nbActiveBoxes[m_frame];
+    const vec2i meshes = streamMeshesToGPU(boxOffset + nbNodes, nbPrimitives);
+
+    // Keep track of where primitives and boxes are streamed so that the
+    // hierarchy can be refitted when primitives move
+    BVHStreamInfo &info = m_bvhStreamInfo[m_frame];
+    if (std::find(info.moved.begin(), info.moved.end(), 1) != info.moved.end())
+        info.clipped = false;
+    info.primitives.assign(nbPrimitives, -1);
+    info.leaves.assign(nbPrimitives, 0);
+    info.parents.assign(boxOffset + nbNodes, -1);
+    info.slots.assign(m_primitives[m_frame].size() + m_instances.size(), -1);
+    info.copies.assign(nbPrimitives, -1);
+    info.moved.assign(nbPrimitives, 0);
+    info.nbLights = static_cast<int>(lights.primitives.size());
+    for (int i(0); i < static_cast<int>(lights.primitives.size()); ++i)
+    {
+        info.primitives[i] = static_cast<int>(lights.primitives[i]);
+        info.slots[lights.primitives[i]] = i;
+    }
+
+#pragma omp parallel for
+    for (int i = 0; i < nbNodes; ++i)
+    {
+        const CPUBVHNode &node = nodes[i];
+        const int boxIndex = boxOffset + i;
+        BoundingBox &box = m_hBoundingBoxes[boxIndex];
+        box.indexForNextBox.x = node.indexForNextBox;
+        if (node.nbPrimitives != 0)
+        {
+            // Leaf bounds are computed from the primitives, which may have been
+            // transformed since the hierarchy was built
+            box.nbPrimitives = node.nbPrimitives;
+            box.startIndex = primitiveOffset + node.startIndex;
+            resetBounds(box.parameters);
+            for (int p = node.startIndex; p < node.startIndex + node.nbPrimitives; ++p)
+            {
+                const int gpuIndex = primitiveOffset + p;
+                const int index = bvhPrimitives[p];
+                streamReferenceToGPU(index, gpuIndex);
+                info.primitives[gpuIndex] = index;
+                info.leaves[gpuIndex] = boxIndex;
+                vec3f corners[2];
+                getReferenceBounds(index, corners[0], corners[1]);
+                growBounds(box.parameters, corners[0], corners[1]);
+            }
+            if (info.clipped)
+            {
+                box.parameters[0] = max2(box.parameters[0], node.parameters[0]);
+                box.parameters[1] = min2(box.parameters[1], node.parameters[1]);
+            }
+        }
+        else
+        {
+            box.nbPrimitives = 0;
+            box.startIndex = node.depth;
+            const int end = std::min(i + node.indexForNextBox, nbNodes);
+            for (int child = i + 1; child < end; child += nodes[child].indexForNextBox)
+                info.parents[boxOffset + child] = boxIndex;
+        }
+    }
+    m_nbActiveBoxes[m_frame] += nbNodes;
+    m_nbActivePrimitives[m_frame] = nbPrimitives;
+
+    // References split by spatial splits are streamed in several leaves.
+    // Slots point to their first copy, and copies are chained from there
+    for (int i(nbPrimitives - 1); i >= primitiveOffset; --i)
+    {
+        const int reference = info.primitives[i];
+        if (reference == -1)
+            continue;
+        info.copies[i] = info.slots[reference];
+        info.slots[reference] = i;
+    }
+
+    // Children follow their parent, so a reverse walk refits them first
+    for (int i(m_nbActiveBoxes[m_frame] - 1); i >= boxOffset; --i)
+        if (m_hBoundingBoxes[i].nbPrimitives == 0)
+            refitBox(i);
+
+    m_nbTopLevelBoxes = m_nbActiveBoxes[m_frame];
+    m_nbActiveBoxes[m_frame] += meshes.x;
+    m_nbActivePrimitives[m_frame] += meshes.y;
+    m_dynamicBVH[m_frame].dirtySlots.clear();
+}
+
+void GPUKernel::streamLightsToGPU(const CPUBoundingBox &box, const int boxIndex)
+{
+    m_lightInformationSize = 0;
+    m_lightInformation.clear();
+    m_lightInformation.reserve(2 * box.primitives.size());
+    m_hLamps.resize(m_nbActiveLamps[m_frame] + box.primitives.size());
+    m_hBoundingBoxes[boxIndex].parameters[0].x = -m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[0].y = -m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[0].z = -m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[1].x = m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[1].y = m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[1].z = m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].nbPrimitives = static_cast<int>(box.primitives.size());
+    m_hBoundingBoxes[boxIndex].startIndex = m_nbActivePrimitives[m_frame];
+    std::vector<long>::const_iterator itp = box.primitives.begin();
+    while (itp != box.primitives.end())
+    {
+        // Add the primitive
+        CPUPrimitive &primitive = (m_primitives[m_frame])[*itp];
+        streamPrimitiveToGPU(primitive, *itp, m_nbActivePrimitives[m_frame]);
+        ++m_nbActivePrimitives[m_frame];
+
+        // Add light information related to primitive
+        Material &material = m_hMaterials[primitive.materialId];
+        LightInformation lightInformation;
+        LOG_INFO(3, "LightInformation " << (*itp) << ", MaterialId=" << primitive.materialId);
+        lightInformation.primitiveId = (*itp);
+        lightInformation.materialId = primitive.materialId;
+
+        lightInformation.location.x = primitive.p0.x;
+        lightInformation.location.y = primitive.p0.y;
+        lightInformation.location.z = primitive.p0.z;
+
+        lightInformation.color.x = material.color.x;
+        lightInformation.color.y = material.color.y;
+        lightInformation.color.z = material.color.z;
+        lightInformation.color.w = material.innerIllumination.x;
+
+        m_lightInformation.push_back(lightInformation);
+
+        LOG_INFO(3, "Adding Light Information: " << m_lightInformation[m_lightInformationSize].primitiveId << ","
+                                                 << m_lightInformation[m_lightInformationSize].materialId << ":"
+                                                 << m_lightInformation[m_lightInformationSize].location.x << ","
+                                                 << m_lightInformation[m_lightInformationSize].location.y << ","
+                                                 << m_lightInformation[m_lightInformationSize].location.z << " "
+                                                 << m_lightInformation[m_lightInformationSize].color.x << ","
+                                                 << m_lightInformation[m_lightInformationSize].color.y << ","
+                                                 << m_lightInformation[m_lightInformationSize].color.z << " "
+                                                 << m_lightInformation[m_lightInformationSize].color.w);
+
+        m_hLamps[m_nbActiveLamps[m_frame]] = *itp;
+        ++m_nbActiveLamps[m_frame];
+        ++m_lightInformationSize;
+        ++itp;
+    }
+    buildLightTree();
+}
+
+/*
+________________________________________________________________________________
+
+Builds the hierarchy used by kernels to pick the light shading an intersection.
+Nodes are appended to m_lightInformation after the lights, the root being
+m_lightInformationSize. Inner nodes store their bounding sphere in location and
+color.x, the power of their lights in color.w, and their children in
+primitiveId and materialId. Children below m_lightInformationSize are lights
+________________________________________________________________________________
+*/
+void GPUKernel::buildLightTree()
+{
+    m_lightInformation.resize(m_lightInformationSize);
+    if (m_lightInformationSize < 2)
+        return;
+
+    std::vector<int> lights(m_lightInformationSize);
+    for (int i(0); i < m_lightInformationSize; ++i)
+        lights[i] = i;
+    m_lightInformation.reserve(2 * m_lightInformationSize - 1);
+    buildLightSubtree(m_lightInformation, lights, 0, lights.size());
+    LOG_INFO(3, "Light hierarchy: " << m_lightInformationSize << " lights, "
+                                    << m_lightInformation.size() - m_lightInformationSize << " nodes");
+}
+
+void GPUKernel::streamPrimitiveToGPU(const CPUPrimitive &primitive, const long index, const int gpuIndex)
+{
+    // Prepare primitive for GPU
+    Primitive &gpuPrimitive = m_hPrimitives[gpuIndex];
+    gpuPrimitive.index = index;
+    gpuPrimitive.type = primitive.type;
+    gpuPrimitive.p0 = primitive.p0;
+    gpuPrimitive.p1 = primitive.p1;
+    gpuPrimitive.p2 = primitive.p2;
+    gpuPrimitive.n0 = primitive.n0;
+    gpuPrimitive.n1 = primitive.n1;
+    gpuPrimitive.n2 = primitive.n2;
+    gpuPrimitive.size = primitive.size;
+    gpuPrimitive.materialId = primitive.materialId;
+    gpuPrimitive.vt0 = primitive.vt0;
+    gpuPrimitive.vt1 = primitive.vt1;
+    gpuPrimitive.vt2 = primitive.vt2;
+}
+
+/*
+________________________________________________________________________________
+
+Streams a primitive or an instance. Instances hold the transformation from
+world to object space in p0-p2 (rows), the one from object to world space in
+n0-n2 (rows), the object origin in size, and the first box and number of boxes
+of their mesh in vt0. vt1.x is set when the material of the instance replaces
+the ones of the mesh
+________________________________________________________________________________
+*/
+void GPUKernel::streamReferenceToGPU(const int reference, const int gpuIndex)
+{
+    const int nbPrimitives = static_cast<int>(m_primitives[m_frame].size());
+    if (reference < nbPrimitives)
+    {
+        streamPrimitiveToGPU(m_primitives[m_frame][reference], reference, gpuIndex);
+        return;
+    }
+
+    const CPUInstance &instance = m_instances[reference - nbPrimitives];
+    const CPUMesh &mesh = m_meshes[instance.mesh];
+    const vec3f *axes = instance.axes;
+    const vec3f rows[3] = {crossProduct(axes[1], axes[2]), crossProduct(axes[2], axes[0]),
+                           crossProduct(axes[0], axes[1])};
+    const float determinant = dotProduct(axes[0], rows[0]);
+    const float inverse = (determinant != 0.f) ? 1.f / determinant : 0.f;
+    const bool streamed = instance.mesh < static_cast<int>(m_meshBoxes.size()) && m_meshBoxes[instance.mesh] != -1;
+    const bool overridden = (instance.materialId != MATERIAL_NONE);
+
+    Primitive &gpuPrimitive = m_hPrimitives[gpuIndex];
+    memset(&gpuPrimitive, 0, sizeof(Primitive));
+    gpuPrimitive.index = -1; // Instances cannot be selected
+    gpuPrimitive.type = ptInstance;
+    gpuPrimitive.p0 = make_vec3f(rows[0].x * inverse, rows[0].y * inverse, rows[0].z * inverse);
+    gpuPrimitive.p1 = make_vec3f(rows[1].x * inverse, rows[1].y * inverse, rows[1].z * inverse);
+    gpuPrimitive.p2 = make_vec3f(rows[2].x * inverse, rows[2].y * inverse, rows[2].z * inverse);
+    gpuPrimitive.n0 = make_vec3f(axes[0].x, axes[1].x, axes[2].x);
+    gpuPrimitive.n1 = make_vec3f(axes[0].y, axes[1].y, axes[2].y);
+    gpuPrimitive.n2 = make_vec3f(axes[0].z, axes[1].z, axes[2].z);
+    gpuPrimitive.size = instance.position;
+    gpuPrimitive.materialId = overridden ? instance.materialId : mesh.primitives[0].materialId;
+    if (streamed)
+        gpuPrimitive.vt0 = make_vec2f(static_cast<float>(m_meshBoxes[instance.mesh]),
+                                      static_cast<float>(mesh.nodes.size()));
+    gpuPrimitive.vt1 = make_vec2f(overridden ? 1.f : 0.f);
+}
+
+/*
+________________________________________________________________________________
+
+Streams the hierarchies of meshes after the boxes of the scene, behind a box
+that no ray intersects so that traversals of the scene skip them. Kernels walk
+the boxes of a mesh in object space when a ray hits one of its instances.
+Returns the number of boxes and primitives streamed
+________________________________________________________________________________
+*/
+vec2i GPUKernel::streamMeshesToGPU(const int boxIndex, const int primitiveIndex)
+{
+    m_meshBoxes.assign(m_meshes.size(), -1);
+    if (m_instances.empty())
+        return make_vec2i();
+
+    int nbBoxes(1);
+    int nbPrimitives(0);
+    for (const auto &mesh : m_meshes)
+    {
+        nbBoxes += static_cast<int>(mesh.nodes.size());
+        nbPrimitives += static_cast<int>(mesh.primitives.size());
+    }
+    if (boxIndex + nbBoxes > static_cast<int>(NB_MAX_BOXES) ||
+        primitiveIndex + nbPrimitives > static_cast<int>(NB_MAX_PRIMITIVES))
+    {
+        LOG_ERROR("Too many boxes or primitives to stream meshes (" << boxIndex + nbBoxes << "/" << NB_MAX_BOXES
+                                                                   << ", " << primitiveIndex + nbPrimitives << "/"
+                                                                   << NB_MAX_PRIMITIVES << ")");
+        return make_vec2i();
+    }
+
+    BoundingBox &container = m_hBoundingBoxes[boxIndex];
+    resetBounds(container.parameters);
+    container.nbPrimitives = 0;
+    container.startIndex = 0;
+    container.indexForNextBox = make_vec2i(nbBoxes);
+
+    int box = boxIndex + 1;
+    int primitive = primitiveIndex;
+    for (size_t m(0); m < m_meshes.size(); ++m)
+    {
+        const CPUMesh &mesh = m_meshes[m];
+        m_meshBoxes[m] = box;
+        for (const auto &node : mesh.nodes)
+        {
+            BoundingBox &gpuBox = m_hBoundingBoxes[box];
+            gpuBox.parameters[0] = node.parameters[0];
+            gpuBox.parameters[1] = node.parameters[1];
+            gpuBox.nbPrimitives = node.nbPrimitives;
+            gpuBox.startIndex = (node.nbPrimitives != 0) ? primitive + node.startIndex : node.depth;
+            gpuBox.indexForNextBox = make_vec2i(node.indexForNextBox);
+            ++box;
+        }
+        for (const auto &meshPrimitive : mesh.primitives)
+        {
+            streamPrimitiveToGPU(meshPrimitive, -1, primitive);
+            ++primitive;
+        }
+    }
+    LOG_INFO(3, "Streamed " << m_meshes.size() << " meshes: " << nbBoxes << " boxes, " << nbPrimitives
+                            << " primitives");
+    return make_vec2i(nbBoxes, nbPrimitives);
+}
+
 void GPUKernel::resetFrame()
 {
     LOG_INFO(3, "Resetting frame " << m_frame);
+    if (m_backgroundBuild && m_backgroundBuild->frame == m_frame)
+        cancelBackgroundBuild();
     memset(&m_translation, 0, sizeof(vec4f));
     memset(&m_rotation, 0, sizeof(vec4f));
 
@@ -1292,6 +4592,11 @@ void GPUKernel::resetFrame()
         m_boundingBoxes[m_frame][i].clear();
 
     m_boundingBoxes[m_frame][0].clear();
+    m_bvhNodes[m_frame].clear();
+    m_bvhPrimitives[m_frame].clear();
+    m_bvhStreamInfo[m_frame] = BVHStreamInfo();
+    m_dynamicBVH[m_frame] = CPUDynamicBVH();
+    m_removedPrimitives[m_frame].clear();
     m_nbActiveBoxes[m_frame] = 0;
     LOG_INFO(3, "Nb Boxes: " << m_boundingBoxes[m_frame][0].size());
 
@@ -1350,10 +4655,58 @@ void GPUKernel::resetAll()
 
 void GPUKernel::displayBoxesInfo()
 {
-    for (unsigned int i(0); i <= m_boundingBoxes[m_frame][0].size(); ++i)
+    const char *structures[] = {"Grid", "SAH BVH", "Linear BVH", "Spatial split BVH", "Dynamic BVH"};
+    LOG_INFO(1, "Acceleration struct: " << structures[m_accelerationStructure]);
+    LOG_INFO(1, "Build time.........: " << m_boxesBuildTime << " ms");
+    LOG_INFO(1, "Nodes..............: " << m_nbActiveBoxes[m_frame]);
+    size_t nbLeaves = m_boundingBoxes[m_frame][0].size();
+    if (m_accelerationStructure != asGrid)
+    {
+        nbLeaves = 0;
+        for (const auto &node : m_bvhNodes[m_frame])
+            if (node.nbPrimitives != 0)
+                ++nbLeaves;
+    }
+    LOG_INFO(1, "Leaves.............: " << nbLeaves);
+    if (m_accelerationStructure == asSAH || m_accelerationStructure == asSBVH ||
+        m_accelerationStructure == asDynamic)
+    {
+        // Area shared by siblings, relative to the root. Rays crossing it visit
+        // both children
+        const BVHNodeContainer &nodes = m_bvhNodes[m_frame];
+        float overlap(0.f);
+        for (size_t i(0); i < nodes.size(); ++i)
+            if (nodes[i].nbPrimitives == 0 && nodes[i].indexForNextBox > 1)
+            {
+                const CPUBVHNode &left = nodes[i + 1];
+                const CPUBVHNode &right = nodes[i + 1 + left.indexForNextBox];
+                const vec3f corner0 = max2(left.parameters[0], right.parameters[0]);
+                const vec3f corner1 = min2(left.parameters[1], right.parameters[1]);
+                if (corner0.x < corner1.x && corner0.y < corner1.y && corner0.z < corner1.z)
+                    overlap += boxHalfArea(corner0, corner1);
+            }
+        const float area = nodes.empty() ? 0.f : boxHalfArea(nodes[0].parameters[0], nodes[0].parameters[1]);
+        LOG_INFO(1, "Children overlap...: " << (area > 0.f ? overlap / area : 0.f));
+    }
+    if (m_accelerationStructure == asSBVH)
+    {
+        const size_t nbReferences =
+            m_primitives[m_frame].size() + m_instances.size() - m_bvhStreamInfo[m_frame].nbLights;
+        LOG_INFO(1, "Split references...: " << m_bvhPrimitives[m_frame].size() - nbReferences);
+    }
+    if (m_accelerationStructure == asDynamic)
+    {
+        const CPUDynamicBVH &tree = m_dynamicBVH[m_frame];
+        LOG_INFO(1, "Used slots.........: " << tree.nbReferences << "/" << m_bvhPrimitives[m_frame].size());
+    }
+    LOG_INFO(1, "Primitives per leaf: " << m_maxPrimitivesPerBox);
+    LOG_INFO(1, "Compressed boxes...: " << (m_hCompressedBoxes.empty() ? "No" : "Yes"));
+    LOG_INFO(1, "Instances..........: " << m_instances.size() << " (" << m_meshes.size() << " meshes)");
+
+    for (const auto &b : m_boundingBoxes[m_frame][0])
     {
-        CPUBoundingBox &box = m_boundingBoxes[m_frame][0][i];
-        LOG_INFO(3, "Box " << i);
+        const CPUBoundingBox &box = b.second;
+        LOG_INFO(3, "Box " << b.first);
         LOG_INFO(3, "- # of primitives: " << box.primitives.size());
         LOG_INFO(3, "- Corners 1      : " << box.parameters[0].x << "," << box.parameters[0].y << ","
                                           << box.parameters[0].z);
@@ -1390,6 +4743,40 @@ void GPUKernel::rotatePrimitives(const vec3f &rotationCenter, const vec4f &angle
     sinAngles.y = sin(angles.y);
     sinAngles.z = sin(angles.z);
 
+    BVHStreamInfo &info = m_bvhStreamInfo[m_frame];
+    if (m_accelerationStructure != asGrid && !info.primitives.empty())
+    {
+        // Streamed primitives are transformed in place, and flagged so that
+        // the next call to compactBoxes(false) refits the hierarchy. Lights
+        // are not transformed. Instances are rotated with their axes
+        const int nbPrimitives = static_cast<int>(m_primitives[m_frame].size());
+        const vec3f zeroCenter = make_vec3f();
+#pragma omp parallel for
+        for (int i = info.nbLights; i < static_cast<int>(info.primitives.size()); ++i)
+        {
+            // References split by spatial splits are transformed once, from
+            // their first copy. Unused slots of dynamic hierarchies are skipped
+            if (info.primitives[i] == -1 || info.slots[info.primitives[i]] != i)
+                continue;
+            if (info.primitives[i] >= nbPrimitives)
+            {
+                CPUInstance &instance = m_instances[info.primitives[i] - nbPrimitives];
+                for (int axis = 0; axis < 3; ++axis)
+                    rotateVector(instance.axes[axis], zeroCenter, cosAngles, sinAngles);
+                rotateVector(instance.position, rotationCenter, cosAngles, sinAngles);
+                info.moved[i] = 1;
+                continue;
+            }
+            CPUPrimitive &primitive = m_primitives[m_frame][info.primitives[i]];
+            if (primitive.movable && primitive.type != ptCamera)
+            {
+                rotatePrimitive(primitive, rotationCenter, cosAngles, sinAngles);
+                info.moved[i] = 1;
+            }
+        }
+        return;
+    }
+
 #pragma omp parallel
     for (BoxContainer::iterator itb = m_boundingBoxes[m_frame][0].begin(); itb != m_boundingBoxes[m_frame][0].end();
          ++itb)
@@ -1463,6 +4850,47 @@ void GPUKernel::translatePrimitives(const vec3f &translation)
 {
     LOG_INFO(3, "GPUKernel::translatePrimitives (" << m_boundingBoxes[m_frame][0].size() << ")");
     m_primitivesTransfered = false;
+
+    BVHStreamInfo &info = m_bvhStreamInfo[m_frame];
+    if (m_accelerationStructure != asGrid && !info.primitives.empty())
+    {
+        const int nbPrimitives = static_cast<int>(m_primitives[m_frame].size());
+#pragma omp parallel for
+        for (int i = info.nbLights; i < static_cast<int>(info.primitives.size()); ++i)
+        {
+            // References split by spatial splits are transformed once, from
+            // their first copy. Unused slots of dynamic hierarchies are skipped
+            if (info.primitives[i] == -1 || info.slots[info.primitives[i]] != i)
+                continue;
+            if (info.primitives[i] >= nbPrimitives)
+            {
+                CPUInstance &instance = m_instances[info.primitives[i] - nbPrimitives];
+                instance.position.x += translation.x;
+                instance.position.y += translation.y;
+                instance.position.z += translation.z;
+                info.moved[i] = 1;
+                continue;
+            }
+            CPUPrimitive &primitive = m_primitives[m_frame][info.primitives[i]];
+            if (primitive.movable && primitive.type != ptCamera)
+            {
+                primitive.p0.x += translation.x;
+                primitive.p0.y += translation.y;
+                primitive.p0.z += translation.z;
+
+                primitive.p1.x += translation.x;
+                primitive.p1.y += translation.y;
+                primitive.p1.z += translation.z;
+
+                primitive.p2.x += translation.x;
+                primitive.p2.y += translation.y;
+                primitive.p2.z += translation.z;
+                info.moved[i] = 1;
+            }
+        }
+        return;
+    }
+
     for (BoxContainer::iterator itb = m_boundingBoxes[m_frame][0].begin(); itb != m_boundingBoxes[m_frame][0].end();
          ++itb)
     {
@@ -1518,12 +4946,11 @@ void GPUKernel::morphPrimitives()
         LOG_INFO(3, "Morphing frame " << frame << ", " << m_primitives[0].size() << " primitives");
         setFrame(frame);
         resetFrame();
-        PrimitiveContainer::iterator it2 = m_primitives[m_nbFrames - 1].begin();
-        for (PrimitiveContainer::iterator it1 = m_primitives[0].begin();
-             it1 != m_primitives[0].end() && it2 != m_primitives[m_nbFrames - 1].end(); ++it1)
+        const size_t nbPrimitives = std::min(m_primitives[0].size(), m_primitives[m_nbFrames - 1].size());
+        for (size_t p(0); p < nbPrimitives; ++p)
         {
-            CPUPrimitive &primitive1((*it1).second);
-            CPUPrimitive &primitive2((*it2).second);
+            const CPUPrimitive &primitive1(m_primitives[0][p]);
+            const CPUPrimitive &primitive2(m_primitives[m_nbFrames - 1][p]);
             vec3f p0, p1, p2;
             vec3f n0, n1, n2;
             vec3f size;
@@ -1564,10 +4991,25 @@ void GPUKernel::morphPrimitives()
             setPrimitiveTextureCoordinates(i, primitive1.vt0, primitive1.vt1, primitive1.vt2);
 
             setPrimitiveIsMovable(i, primitive1.movable);
+        }
 
-            ++it2;
+        if (m_accelerationStructure != asGrid && !m_bvhNodes[0].empty() &&
+            m_primitives[m_frame].size() == m_primitives[0].size())
+        {
+            // Morphed frames share the topology of the first one, only their
+            // bounds differ, and these are computed when streamed to the GPU
+            for (int i(0); i < BOUNDING_BOXES_TREE_DEPTH; ++i)
+                m_boundingBoxes[m_frame][i] = m_boundingBoxes[0][i];
+            m_bvhNodes[m_frame] = m_bvhNodes[0];
+            m_bvhPrimitives[m_frame] = m_bvhPrimitives[0];
+            m_dynamicBVH[m_frame] = m_dynamicBVH[0];
+            m_removedPrimitives[m_frame] = m_removedPrimitives[0];
+            m_bvhStreamInfo[m_frame].clipped = false;
+            m_primitivesTransfered = false;
+            streamDataToGPU();
         }
-        compactBoxes(true);
+        else
+            compactBoxes(true);
     }
 }
 
@@ -1576,10 +5018,9 @@ void GPUKernel::scalePrimitives(float scale, unsigned int from, unsigned int to)
     LOG_INFO(3, "GPUKernel::scalePrimitives(" << from << "->" << to << ")");
     m_primitivesTransfered = false;
 
-    PrimitiveContainer::iterator it = (m_primitives[m_frame]).begin();
-    while (it != (m_primitives[m_frame]).end())
+    for (unsigned int p(0); p < m_primitives[m_frame].size(); ++p)
     {
-        CPUPrimitive &primitive((*it).second);
+        CPUPrimitive &primitive(m_primitives[m_frame][p]);
         primitive.p0.x *= scale;
         primitive.p0.y *= scale;
         primitive.p0.z *= scale;
@@ -1595,7 +5036,7 @@ void GPUKernel::scalePrimitives(float scale, unsigned int from, unsigned int to)
         primitive.size.x *= scale;
         primitive.size.y *= scale;
         primitive.size.z *= scale;
-        ++it;
+        invalidatePrimitive(p);
     }
 }
 
@@ -1674,7 +5115,7 @@ void GPUKernel::rotatePrimitive(CPUPrimitive &primitive, const vec3f &rotationCe
 vec4f GPUKernel::getPrimitiveCenter(unsigned int index)
 {
     vec4f center = make_vec4f();
-    if (index <= m_primitives[m_frame].size())
+    if (index < m_primitives[m_frame].size())
     {
         center.x = (m_primitives[m_frame])[index].p0.x;
         center.y = (m_primitives[m_frame])[index].p0.y;
@@ -1685,7 +5126,7 @@ vec4f GPUKernel::getPrimitiveCenter(unsigned int index)
 
 void GPUKernel::getPrimitiveOtherCenter(unsigned int index, vec3f &center)
 {
-    if (index <= m_primitives[m_frame].size())
+    if (index < m_primitives[m_frame].size())
         center = (m_primitives[m_frame])[index].p1;
 }
 
@@ -1693,12 +5134,13 @@ void GPUKernel::setPrimitiveCenter(unsigned int index, const vec3f &center)
 {
     m_primitivesTransfered = false;
 
-    // TODO, Box needs to be updated
-    if (index <= m_primitives[m_frame].size())
+    // TODO, Box needs to be updated in grid mode. Hierarchies are refitted by compactBoxes(false)
+    if (index < m_primitives[m_frame].size())
     {
         (m_primitives[m_frame])[index].p0.x = center.x;
         (m_primitives[m_frame])[index].p0.y = center.y;
         (m_primitives[m_frame])[index].p0.z = center.z;
+        invalidatePrimitive(index);
     }
 }
 
@@ -1738,12 +5180,125 @@ int GPUKernel::addRectangle(float x, float y, float z, float w, float h, float d
     return returnValue;
 }
 
+/*
+________________________________________________________________________________
+
+Meshes are built once, with the surface area heuristic, and never refitted.
+Their primitives are reordered in leaf order so that leaves are contiguous
+ranges of primitives, as they are once streamed to the GPU
+________________________________________________________________________________
+*/
+int GPUKernel::createMesh(const unsigned int from)
+{
+    LOG_INFO(3, "GPUKernel::createMesh(" << from << ")");
+    PrimitiveContainer &primitives = m_primitives[m_frame];
+    if (from >= primitives.size())
+    {
+        LOG_ERROR("GPUKernel::createMesh: No primitives from " << from << " (" << primitives.size() << ")");
+        return -1;
+    }
+
+    CPUMesh mesh;
+    resetBounds(mesh.parameters);
+    std::vector<BVHReference> references(primitives.size() - from);
+    for (size_t i(0); i < references.size(); ++i)
+    {
+        BVHReference &reference = references[i];
+        reference.index = static_cast<long>(from + i);
+        getPrimitiveBounds(primitives[reference.index], reference.parameters[0], reference.parameters[1]);
+        reference.center = make_vec3f((reference.parameters[0].x + reference.parameters[1].x) / 2.f,
+                                      (reference.parameters[0].y + reference.parameters[1].y) / 2.f,
+                                      (reference.parameters[0].z + reference.parameters[1].z) / 2.f);
+        growBounds(mesh.parameters, reference.parameters[0], reference.parameters[1]);
+    }
+
+    std::vector<int> order;
+    buildBVH(references, false, mesh.nodes, order);
+    mesh.primitives.reserve(order.size());
+    for (const auto index : order)
+        mesh.primitives.push_back(primitives[index]);
+    primitives.resize(from);
+
+    // The hierarchy of the scene may refer to the primitives of the mesh, it
+    // is rebuilt by the next call to compactBoxes(true)
+    for (int i(0); i < BOUNDING_BOXES_TREE_DEPTH; ++i)
+        m_boundingBoxes[m_frame][i].clear();
+    m_bvhNodes[m_frame].clear();
+    m_bvhPrimitives[m_frame].clear();
+    m_bvhStreamInfo[m_frame] = BVHStreamInfo();
+    m_dynamicBVH[m_frame] = CPUDynamicBVH();
+    if (m_removedPrimitives[m_frame].size() > from)
+        m_removedPrimitives[m_frame].resize(from);
+    m_primitivesTransfered = false;
+
+    m_meshes.push_back(mesh);
+    LOG_INFO(3, "Mesh " << m_meshes.size() - 1 << ": " << mesh.primitives.size() << " primitives, "
+                        << mesh.nodes.size() << " nodes");
+    return static_cast<int>(m_meshes.size() - 1);
+}
+
+int GPUKernel::createStaticGeometry(const unsigned int from)
+{
+    LOG_INFO(3, "GPUKernel::createStaticGeometry(" << from << ")");
+    if (!supportsInstances())
+    {
+        LOG_INFO(1, "Instances are not supported, static geometry is kept in the frame");
+        return -1;
+    }
+    const int mesh = createMesh(from);
+    if (mesh == -1)
+        return -1;
+    return addInstance(mesh, make_vec3f(0.f, 0.f, 0.f), make_vec3f(0.f, 0.f, 0.f), make_vec3f(1.f, 1.f, 1.f));
+}
+
+int GPUKernel::addInstance(const int mesh, const vec3f &position, const vec3f &angles, const vec3f &scale,
+                           const int materialId)
+{
+    LOG_INFO(3, "GPUKernel::addInstance(" << mesh << ")");
+    if (mesh < 0 || mesh >= static_cast<int>(m_meshes.size()))
+    {
+        LOG_ERROR("GPUKernel::addInstance: Invalid mesh " << mesh << " (" << m_meshes.size() << ")");
+        return -1;
+    }
+    CPUInstance instance;
+    memset(&instance, 0, sizeof(CPUInstance));
+    instance.mesh = mesh;
+    m_instances.push_back(instance);
+    const int index = static_cast<int>(m_instances.size() - 1);
+    setInstance(index, position, angles, scale, materialId);
+    return index;
+}
+
+void GPUKernel::setInstance(const int index, const vec3f &position, const vec3f &angles, const vec3f &scale,
+                            const int materialId)
+{
+    if (index < 0 || index >= static_cast<int>(m_instances.size()))
+    {
+        LOG_ERROR("GPUKernel::setInstance: Out of bounds (" << index << "/" << m_instances.size() << ")");
+        return;
+    }
+    const vec3f cosAngles = make_vec3f(cos(angles.x), cos(angles.y), cos(angles.z));
+    const vec3f sinAngles = make_vec3f(sin(angles.x), sin(angles.y), sin(angles.z));
+    const vec3f zeroCenter = make_vec3f();
+    CPUInstance &instance = m_instances[index];
+    instance.axes[0] = make_vec3f(scale.x, 0.f, 0.f);
+    instance.axes[1] = make_vec3f(0.f, scale.y, 0.f);
+    instance.axes[2] = make_vec3f(0.f, 0.f, scale.z);
+    for (int axis(0); axis < 3; ++axis)
+        rotateVector(instance.axes[axis], zeroCenter, cosAngles, sinAngles);
+    instance.position = position;
+    instance.materialId = materialId;
+    invalidatePrimitive(static_cast<unsigned int>(m_primitives[m_frame].size() + index));
+    m_primitivesTransfered = false;
+}
+
 void GPUKernel::setPrimitiveMaterial(unsigned int index, int materialId)
 {
     LOG_INFO(3, "GPUKernel::setPrimitiveMaterial(" << index << "," << materialId << ")");
-    if (index <= m_primitives[m_frame].size())
+    if (index < m_primitives[m_frame].size())
     {
         (m_primitives[m_frame])[index].materialId = materialId;
+        invalidatePrimitive(index);
         // TODO: updateLight( index );
     }
 }
@@ -1752,7 +5307,7 @@ int GPUKernel::getPrimitiveMaterial(unsigned int index)
 {
     LOG_INFO(3, "GPUKernel::getPrimitiveMaterial(" << index << ")");
     unsigned int returnValue(-1);
-    if (index <= m_primitives[m_frame].size())
+    if (index < m_primitives[m_frame].size())
     {
         returnValue = (m_primitives[m_frame])[index].materialId;
     }
@@ -2164,6 +5719,7 @@ void GPUKernel::reorganizeLights()
 {
     LOG_INFO(1, "GPUKernel::reorganizeLights()");
     LOG_INFO(1, "Nb Primitives: " << m_boundingBoxes[m_frame][0].size())
+    m_lightInformation.resize(m_lightInformationSize);
     BoxContainer::iterator it = m_boundingBoxes[m_frame][0].begin();
     while (it != m_boundingBoxes[m_frame][0].end())
     {
@@ -2206,17 +5762,13 @@ void GPUKernel::reorganizeLights()
                         lightInformation.color.z = material.color.z;
                         lightInformation.color.w = 0.f; // not used
 
-                        LOG_INFO(3, "Lamp " << m_lightInformation[m_lightInformationSize].primitiveId << ","
-                                            << m_lightInformation[m_lightInformationSize].materialId << ":"
-                                            << m_lightInformation[m_lightInformationSize].location.x << ","
-                                            << m_lightInformation[m_lightInformationSize].location.y << ","
-                                            << m_lightInformation[m_lightInformationSize].location.z << " "
-                                            << m_lightInformation[m_lightInformationSize].color.x << ","
-                                            << m_lightInformation[m_lightInformationSize].color.y << ","
-                                            << m_lightInformation[m_lightInformationSize].color.z << " "
-                                            << m_lightInformation[m_lightInformationSize].color.w);
-
-                        m_lightInformation[m_nbActiveLamps[m_frame] + m_lightInformationSize] = lightInformation;
+                        LOG_INFO(3, "Lamp " << lightInformation.primitiveId << "," << lightInformation.materialId
+                                            << ":" << lightInformation.location.x << ","
+                                            << lightInformation.location.y << "," << lightInformation.location.z
+                                            << " " << lightInformation.color.x << "," << lightInformation.color.y
+                                            << "," << lightInformation.color.z << " " << lightInformation.color.w);
+
+                        m_lightInformation.push_back(lightInformation);
                         m_lightInformationSize++;
                     }
                 }
@@ -2225,6 +5777,7 @@ void GPUKernel::reorganizeLights()
         }
         ++it;
     }
+    buildLightTree();
     LOG_INFO(3, "Reorganized " << m_lightInformationSize << " Lights");
 }
 
@@ -2481,7 +6034,7 @@ void GPUKernel::saveBitmapToFile(const std::string &filename, BitmapBuffer *bitm
 
 int GPUKernel::getLight(int index)
 {
-    if (index <= m_nbActiveLamps[m_frame])
+    if (index >= 0 && index < m_nbActiveLamps[m_frame])
     {
         LOG_INFO(3, "getLight(" << index << ")=" << m_hLamps[index]);
         return m_hLamps[index];
@@ -2712,19 +6265,12 @@ void GPUKernel::setPointSize(const float pointSize)
 void GPUKernel::render_begin(const float timer)
 {
     LOG_INFO(3, "GPUKernel::render_begin");
+
+    // Hierarchies built in the background are swapped in between two frames
+    swapBackgroundBuild();
     LOG_INFO(3, "Scene size: " << m_sceneInfo.size.x << "x" << m_sceneInfo.size.y);
 
-    // Random
-    const size_t size = m_sceneInfo.size.x * m_sceneInfo.size.y;
     m_sceneInfo.timestamp = rand() % 10000;
-    if (!m_randomsTransfered || m_sceneInfo.pathTracingIteration % 50 == 1)
-    {
-        m_randomsTransfered = false;
-        srand(static_cast<int>(time(0)));
-#pragma omp parallel for
-        for (int i = 0; i < size; ++i)
-            m_hRandoms[i] = 0.000005f * (rand() % 2000 - 1000);
-    }
 
 #ifdef USE_OCULUS
     if (m_oculus && m_sensorFusion && m_sensorFusion->IsAttachedToSensor())
@@ -2846,6 +6392,13 @@ void GPUKernel::generateScreenshot(const std::string &filename, const unsigned i
         }
         break;
         }
+
+        // With adaptive sampling, stop as soon as every pixel has converged
+        if (m_samplingThreshold > 0.f && i > NB_MAX_ITERATIONS && getNbActivePixels() == 0)
+        {
+            LOG_INFO(1, "All pixels converged after " << i + 1 << " frames");
+            break;
+        }
     }
     m_sceneInfo = bakSceneInfo;
     LOG_INFO(1, "Screenshot successfully generated!");
@@ -72,9 +72,132 @@ struct CPUBoundingBox
     long indexForNextBox;
 };
 
+// Node of a bounding volume hierarchy, stored in depth-first order. Leaves
+// refer to a range of the primitives of the hierarchy, in leaf order
+struct CPUBVHNode
+{
+    vec3f parameters[2];
+    int startIndex;      // First primitive of the leaf
+    int nbPrimitives;    // Number of primitives of the leaf, 0 for inner nodes
+    int depth;           // Depth of the node in the hierarchy
+    int indexForNextBox; // Number of nodes in the subtree, including this one
+};
+
+// Width of the hierarchy used by CPU traversals. It does not depend on the
+// instruction set the library is compiled for: nodes are tested with AVX when
+// the processor supports it, and in two halves with SSE otherwise
+const int WIDE_BVH_WIDTH = 8;
+
+// Node of a wide bounding volume hierarchy, collapsed from the streamed boxes
+// so that CPU traversals test all children at once. Corners are stored per
+// axis, with one lane per child
+struct CPUWideBVHNode
+{
+    float parameters[2][3][WIDE_BVH_WIDTH]; // Bottom-Left and Top-Right corners of the children
+    int children[WIDE_BVH_WIDTH];           // Index of an inner node, or -1 - index of a leaf box
+};
+
+// State of a front-to-back traversal of the wide hierarchy
+struct WideBVHTraversal
+{
+    vec3f origin;
+    vec3f invDirection;
+    int signs[3];
+    int stack[BOUNDING_BOXES_TREE_DEPTH * WIDE_BVH_WIDTH];
+    float distances[BOUNDING_BOXES_TREE_DEPTH * WIDE_BVH_WIDTH];
+    int stackSize;
+    int nbVisitedNodes;
+};
+
+// Primitives and lamps are identified by their position in their container.
+// Pointers to primitives are invalidated when primitives are added
 typedef std::map<unsigned int, CPUBoundingBox> BoxContainer;
-typedef std::map<unsigned int, CPUPrimitive> PrimitiveContainer;
-typedef std::map<unsigned int, Lamp> LampContainer;
+typedef std::vector<CPUPrimitive> PrimitiveContainer;
+typedef std::vector<Lamp> LampContainer;
+typedef std::vector<CPUBVHNode> BVHNodeContainer;
+
+// Primitives built once into their own hierarchy, and placed in the scene by
+// instances. Primitives and boxes are expressed in object space
+struct CPUMesh
+{
+    PrimitiveContainer primitives; // Primitives of the hierarchy, in leaf order
+    BVHNodeContainer nodes;
+    vec3f parameters[2];           // Bounds of the mesh
+};
+
+// Placement of a mesh in the scene
+struct CPUInstance
+{
+    int mesh;
+    vec3f axes[3];  // Object axes in world space, including the scale
+    vec3f position; // Object origin in world space
+    int materialId; // Material replacing the ones of the mesh, MATERIAL_NONE to keep them
+};
+
+typedef std::vector<CPUMesh> MeshContainer;
+typedef std::vector<CPUInstance> InstanceContainer;
+
+// Links between streamed primitives and boxes, used to refit hierarchies.
+// Instances are referenced after the primitives, instance i being the
+// reference m_primitives.size() + i. Spatial splits may stream a reference in
+// several leaves, its copies being chained from its first GPU primitive
+struct BVHStreamInfo
+{
+    std::vector<int> primitives;            // Reference of each GPU primitive of the scene hierarchy
+    std::vector<int> leaves;                // Box containing each GPU primitive
+    std::vector<int> parents;               // Parent of each box, -1 for top level boxes
+    std::vector<int> slots;                 // First GPU primitive of each reference, -1 if not streamed
+    std::vector<int> copies;                // Next GPU primitive with the same reference, -1 if none
+    std::vector<unsigned char> moved;       // GPU primitives modified since the last refit
+    int nbLights;                           // Lights are the first GPU primitives
+    bool clipped;                           // Leaves are bounded by references clipped by spatial splits
+};
+
+// Node of a hierarchy updated in place when references are inserted or
+// removed. Leaves own a block of slots of the primitives of the hierarchy, the
+// first nbPrimitives of which are used
+struct CPUDynamicBVHNode
+{
+    vec3f parameters[2];
+    int parent;       // -1 for the root
+    int children[2];  // -1 for leaves
+    int startIndex;   // First slot of a leaf
+    int nbPrimitives; // Used slots of a leaf, 0 for inner nodes
+    int capacity;     // Slots owned by a leaf
+    int nbNodes;      // Number of nodes in the subtree, including this one
+    int flatIndex;    // Position in the flattened hierarchy, -1 if the subtree changed since it was flattened
+};
+
+// Hierarchy of the scene in dynamic mode. The primitives of the hierarchy are
+// the slots of its leaves, and its nodes are flattened again after each
+// update, unchanged subtrees being copied from the previous flattening
+struct CPUDynamicBVH
+{
+    std::vector<CPUDynamicBVHNode> nodes;     // Empty when the hierarchy has to be built
+    std::vector<int> freeNodes;               // Released nodes
+    std::vector<std::vector<int>> freeBlocks; // First slot of released blocks, by size
+    std::vector<int> leaves;                  // Leaf of each reference, -1 if not in the hierarchy
+    std::vector<int> flatNodes;               // Node of each flattened node
+    std::vector<int> pending;                 // References to insert, update or remove at the next update
+    std::vector<int> dirtySlots;              // Slots modified since the hierarchy was streamed
+    int root;                                 // -1 when every reference was removed
+    int nbReferences;                         // References in the hierarchy
+    int nbSlots;                              // Slots owned by blocks, the following ones are spare
+    double cost;                              // Surface area heuristic cost, not normalized by the area of the root
+    float builtCost;                          // Normalized cost of the hierarchy when it was built
+};
+
+// Hierarchy built from a snapshot of the scene, defined in GPUKernel.cpp
+struct BVHBuildTask;
+
+enum AccelerationStructure
+{
+    asGrid = 0,   // Uniform grid of boxes, built level by level ("Rubik's cube" mode)
+    asSAH = 1,    // Bounding volume hierarchy built with the surface area heuristic
+    asLBVH = 2,   // Bounding volume hierarchy built from Morton codes, for per-frame rebuilds
+    asSBVH = 3,   // Surface area heuristic hierarchy with spatial splits, for long thin primitives
+    asDynamic = 4 // Surface area heuristic hierarchy updated in place when primitives are added or removed
+};
 
 class SOLR_API GPUKernel
 {
@@ -103,6 +226,18 @@ public:
     void generateScreenshot(const std::string &filename, const unsigned int width, const unsigned int height,
                             const unsigned int quality);
 
+    // Relative error below which progressive rendering stops sampling a pixel
+    // (0 disables adaptive sampling). Pixels still being sampled are counted by
+    // getNbActivePixels, -1 meaning that the engine does not track them
+    void setSamplingThreshold(const float value) { m_samplingThreshold = value; }
+    float getSamplingThreshold() { return m_samplingThreshold; }
+    virtual int getNbActivePixels() { return -1; }
+
+    // Random numbers of stochastic effects (soft shadows, depth of field,
+    // global illumination). Sobol sequences converge faster over iterations
+    void setSampler(const SamplerType value) { m_sampler = value; }
+    SamplerType getSampler() { return m_sampler; }
+
 public:
     // ---------- Primitives ----------
     int addPrimitive(PrimitiveType type, bool belongsToModel = false);
@@ -112,6 +247,10 @@ public:
     void setPrimitive(const int &index, float x0, float y0, float z0, float x1, float y1, float z1, float x2, float y2,
                       float z2, float w, float h, float d, int materialId);
     unsigned int getPrimitiveAt(int x, int y);
+    // Leaves a primitive out of hierarchies, its index remaining valid. Setting
+    // the primitive again puts it back. Dynamic hierarchies are updated by the
+    // next call to compactBoxes, other ones when they are rebuilt
+    void removePrimitive(const int index);
     void setPrimitiveIsMovable(const int &index, bool movable);
     void setPrimitiveBellongsToModel(const int &index, bool bellongsToModel);
 
@@ -163,6 +302,29 @@ public:
 
     int addRectangle(float x, float y, float z, float w, float h, float d, int materialId);
 
+public:
+    // ---------- Instances ----------
+    // Moves the last primitives, from the given index, into a new mesh.
+    // Meshes are only rendered through instances, and require a bounding
+    // volume hierarchy
+    int createMesh(const unsigned int from);
+    int addInstance(const int mesh, const vec3f &position, const vec3f &angles, const vec3f &scale,
+                    const int materialId = MATERIAL_NONE);
+    void setInstance(const int index, const vec3f &position, const vec3f &angles, const vec3f &scale,
+                     const int materialId = MATERIAL_NONE);
+    // Moves the last primitives of the current frame into a mesh placed once
+    // in the scene. Instances are shared by all frames, so static geometry is
+    // stored and built once instead of being copied in every frame. Lights are
+    // not sampled from meshes and should remain primitives of the frames.
+    // Returns -1, leaving the primitives in the frame, when the engine does not
+    // support instances
+    int createStaticGeometry(const unsigned int from);
+    // Instances are traversed by the kernels of the engine with the current
+    // acceleration structure
+    virtual bool supportsInstances() { return m_accelerationStructure != asGrid; }
+    unsigned int getNbMeshes() { return static_cast<unsigned int>(m_meshes.size()); }
+    unsigned int getNbInstances() { return static_cast<unsigned int>(m_instances.size()); }
+
 public:
     // ---------- Materials ----------
     int addMaterial();
@@ -302,10 +464,30 @@ public:
 
 public:
     int compactBoxes(bool reconstructBoxes);
+    int compactFrames();
     void streamDataToGPU();
+    void refitBoxes();
     void displayBoxesInfo();
     void resetBoxes(bool resetPrimitives);
 
+    // Acceleration structure built by the next call to compactBoxes(true)
+    void setAccelerationStructure(const AccelerationStructure value) { m_accelerationStructure = value; }
+    AccelerationStructure getAccelerationStructure() { return m_accelerationStructure; }
+
+    // Hierarchies rebuilt by compactBoxes(true) are built by a background
+    // thread, the previous one being rendered until the new one is swapped in
+    void setBackgroundBuilds(const bool value);
+    bool getBackgroundBuilds() { return m_backgroundBuilds; }
+
+    // Quantized bounding boxes, only available with bounding volume hierarchies
+    void setCompressedBoxes(const bool value);
+    bool getCompressedBoxes() { return m_compressedBoxes; }
+    void benchmarkBoxes();
+
+    // Front-to-back traversal of the wide hierarchy built by buildWideBVH()
+    void initWideBVHTraversal(WideBVHTraversal &traversal, const vec3f &origin, const vec3f &direction) const;
+    int nextWideBVHLeaf(WideBVHTraversal &traversal, const float tmax) const;
+
     void setPrimitivesTransfered(const bool value) { m_primitivesTransfered = value; }
 
 public:
@@ -320,14 +502,50 @@ protected:
     bool updateBoundingBox(CPUBoundingBox &box);
     bool updateOutterBoundingBox(CPUBoundingBox &box, const int depth);
     void resetBox(CPUBoundingBox &box, bool resetPrimitives);
+    void getPrimitiveBounds(const CPUPrimitive &primitive, vec3f &corner0, vec3f &corner1);
+    void getReferenceBounds(const int reference, vec3f &corner0, vec3f &corner1);
+
+    // Bounding volume hierarchies (SAH and linear)
+    int processBVHBoxes();
+    void snapshotBVH(BVHBuildTask &task, const bool copyPrimitives);
+    int installBVH(BVHBuildTask &task);
+    void startBackgroundBuild();
+    bool swapBackgroundBuild();
+    void cancelBackgroundBuild();
+    bool updateBVHBoxes();
+    void refitBox(const int index);
+    void compressBoxes();
+    BoundingBox decompressBox(const int index, vec3f *ancestors) const;
+
+    // Dynamic hierarchies
+    void buildDynamicBVH();
+    void insertDynamicReference(const int reference);
+    void removeDynamicReference(const int reference);
+    void refitDynamicLeaf(const int index);
+    void refitDynamicAncestors(const int index);
+    int allocateDynamicNode();
+    int allocateDynamicSlots(const int nbSlots);
+    void releaseDynamicSlots(const int start, const int nbSlots);
+
+    // Wide hierarchy for CPU traversals, built from the streamed boxes
+    void buildWideBVH();
+    void invalidatePrimitive(const unsigned int index);
 
     void recursiveDataStreamToGPU(const int depth, std::vector<long> &elements);
+    void streamBVHToGPU();
+    void streamLightsToGPU(const CPUBoundingBox &box, const int boxIndex);
+    void buildLightTree();
+    void streamPrimitiveToGPU(const CPUPrimitive &primitive, const long index, const int gpuIndex);
+    void streamReferenceToGPU(const int reference, const int gpuIndex);
+    vec2i streamMeshesToGPU(const int boxIndex, const int primitiveIndex);
 
 protected:
     // GPU
     BoundingBox *m_hBoundingBoxes;
+    std::vector<CompressedBoundingBox> m_hCompressedBoxes; // Quantized copy of m_hBoundingBoxes
+    std::vector<CPUWideBVHNode> m_wideBVHNodes;            // Wide copy of m_hBoundingBoxes, built on demand
     Primitive *m_hPrimitives;
-    int *m_hLamps;
+    std::vector<int> m_hLamps;
     Material *m_hMaterials;
 
     // Textures
@@ -335,7 +553,6 @@ protected:
     std::map<int, std::string> m_textureFilenames;
 
     // Scene
-    RandomBuffer *m_hRandoms;
     PrimitiveXYIdBuffer *m_hPrimitivesXYIds;
 
     // Acceleration structures
@@ -344,8 +561,9 @@ protected:
     int m_nbActiveLamps[NB_MAX_FRAMES];
     int m_nbActiveMaterials;
     int m_nbActiveTextures;
-    int m_lightInformationSize;
+    int m_lightInformationSize; // Lights at the beginning of m_lightInformation, followed by their hierarchy
     size_t m_maxPrimitivesPerBox;
+    double m_boxesBuildTime; // Milliseconds spent in the last reconstruction
     bool m_doneWithAdding;
     int m_addingIndex;
     
@@ -371,7 +589,6 @@ protected:
     bool m_primitivesTransfered;
     bool m_materialsTransfered;
     bool m_texturesTransfered;
-    bool m_randomsTransfered;
     // Scene Size
     vec3f m_minPos[NB_MAX_FRAMES];
     vec3f m_maxPos[NB_MAX_FRAMES];
@@ -399,9 +616,28 @@ protected:
 protected:
     // CPU
     BoxContainer m_boundingBoxes[NB_MAX_FRAMES][BOUNDING_BOXES_TREE_DEPTH];
+    BVHNodeContainer m_bvhNodes[NB_MAX_FRAMES];
+    std::vector<int> m_bvhPrimitives[NB_MAX_FRAMES]; // Primitives of the hierarchy in leaf order, -1 if unused
+    BVHStreamInfo m_bvhStreamInfo[NB_MAX_FRAMES];
+    CPUDynamicBVH m_dynamicBVH[NB_MAX_FRAMES];
+    std::vector<unsigned char> m_removedPrimitives[NB_MAX_FRAMES]; // Primitives left out of hierarchies
+    int m_streamedFrame;                  // Frame currently held by m_hBoundingBoxes and m_hPrimitives
+    std::vector<vec2i> m_dirtyBoxes;      // Ranges of boxes modified since the last transfer
+    std::vector<vec2i> m_dirtyPrimitives; // Ranges of primitives modified since the last transfer
+    AccelerationStructure m_accelerationStructure;
+    bool m_compressedBoxes;
+    float m_samplingThreshold;
+    SamplerType m_sampler;
+    bool m_backgroundBuilds;
+    BVHBuildTask *m_backgroundBuild; // Running or finished background build, 0 if none
+    bool m_backgroundBuildRequested; // The scene changed since the background build started
     PrimitiveContainer m_primitives[NB_MAX_FRAMES];
     LampContainer m_lamps[NB_MAX_FRAMES];
-    LightInformation *m_lightInformation;
+    MeshContainer m_meshes;
+    InstanceContainer m_instances;      // Shared by all frames
+    std::vector<int> m_meshBoxes;       // First streamed box of each mesh
+    int m_nbTopLevelBoxes;              // Streamed boxes of the scene, followed by the ones of meshes
+    std::vector<LightInformation> m_lightInformation;
 
 protected:
     int m_optimalNbOfBoxes;
@@ -1,4 +1,4 @@
-﻿/* Copyright (c) 2011-2014, Cyrille Favreau
+/* Copyright (c) 2011-2014, Cyrille Favreau
  * All rights reserved. Do not distribute without permission.
  * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
  *
@@ -19,9 +19,19 @@
  */
 
 // System
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <math.h>
-#include <stdlib.h>
+#include <mutex>
+#include <sstream>
+#include <string.h>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // OpenGL
 #ifdef __APPLE__
@@ -31,2639 +41,1184 @@
 #endif
 
 // Project
-#ifdef USE_CUDA
-#include "../cuda/CudaDataTypes.h"
-#endif
-
-#ifdef USE_OPENCL
-#include "../opencl/types.h"
-#endif
-
 #include <Consts.h>
 #include <Logging.h>
+#include <types.h>
 
 #include "CPUKernel.h"
 
-//#define PHOTON_ENERGY
-#define GRADIANT_BACKGROUND
-
+// The kernels of the OpenCL engine, compiled as C++. Luminance constants of
+// the kernels differ from the host ones
+#undef STANDARD_LUNINANCE_STRENGTH
+#undef SKYBOX_LUNINANCE_STRENGTH
+#define COMPRESSED_BOXES
+#include "OpenCLTypes.h"
 namespace solr
 {
-CPUKernel::CPUKernel()
-    : GPUKernel()
-    , m_postProcessingBuffer(0)
+namespace cpu
 {
+#include "../opencl/RayTracer.cl"
 }
-
-CPUKernel::~CPUKernel(void)
-{
-    if (m_postProcessingBuffer)
-        delete m_postProcessingBuffer;
 }
 
-// ________________________________________________________________________________
-void CPUKernel::saturateVector(FLOAT4 &v)
-{
-    v.x = (v.x < 0.f) ? 0.f : v.x;
-    v.y = (v.y < 0.f) ? 0.f : v.y;
-    v.z = (v.z < 0.f) ? 0.f : v.z;
-    v.w = (v.w < 0.f) ? 0.f : v.w;
-
-    v.x = (v.x > 1.f) ? 1.f : v.x;
-    v.y = (v.y > 1.f) ? 1.f : v.y;
-    v.z = (v.z > 1.f) ? 1.f : v.z;
-    v.w = (v.w > 1.f) ? 1.f : v.w;
-}
+// Kernel constants shadowing the host ones
+#undef ALIGNMENT
+#undef CONST
+#undef MAXDEPTH
+#undef NB_MAX_MATERIALS
+#undef BOUNDING_BOXES_TREE_DEPTH
+#undef COMPRESSED_BOXES_HEADER_SIZE
+#undef COMPRESSED_BOXES_TREE_DEPTH
+#undef COMPRESSED_BOXES_QUANTIZATION_STEPS
+#undef gColorDepth
+#undef MATERIAL_NONE
+#undef TEXTURE_NONE
+#undef TEXTURE_MANDELBROT
+#undef TEXTURE_JULIA
+#undef MAX_BITMAP_WIDTH
+#undef MAX_BITMAP_HEIGHT
+#undef MAX_BITMAP_SIZE
+#undef vectorReflection
 
-// ________________________________________________________________________________
-Vertex CPUKernel::crossProduct(const Vertex &b, const Vertex &c)
+namespace solr
 {
-    Vertex a;
-    a.x = b.y * c.z - b.z * c.y;
-    a.y = b.z * c.x - b.x * c.z;
-    a.z = b.x * c.y - b.y * c.x;
-    return a;
+// Host buffers are handed to the kernels as they are, both sides must agree
+// on the layout of every structure
+static_assert(sizeof(SceneInfo) == sizeof(cpu::SceneInfo), "SceneInfo layout mismatch");
+static_assert(sizeof(PostProcessingInfo) == sizeof(cpu::PostProcessingInfo), "PostProcessingInfo layout mismatch");
+static_assert(sizeof(PostProcessingBuffer) == sizeof(cpu::PostProcessingBuffer), "PostProcessingBuffer layout mismatch");
+static_assert(sizeof(BoundingBox) == sizeof(cpu::BoundingBox), "BoundingBox layout mismatch");
+static_assert(sizeof(CompressedBoundingBox) == sizeof(cpu::CompressedBoundingBox),
+              "CompressedBoundingBox layout mismatch");
+static_assert(sizeof(Primitive) == sizeof(cpu::Primitive), "Primitive layout mismatch");
+static_assert(sizeof(LightInformation) == sizeof(cpu::LightInformation), "LightInformation layout mismatch");
+static_assert(sizeof(Material) == sizeof(cpu::Material), "Material layout mismatch");
+static_assert(sizeof(PrimitiveXYIdBuffer) == sizeof(cpu::PrimitiveXYIdBuffer), "PrimitiveXYIdBuffer layout mismatch");
+static_assert(sizeof(vec4f) == sizeof(cpu::float4), "vec4f layout mismatch");
+
+template <typename T, typename U>
+static T *toKernel(U *buffer)
+{
+    return reinterpret_cast<T *>(buffer);
 }
 
-float CPUKernel::vectorLength(const Vertex &v)
+template <typename T, typename U>
+static const T &toKernel(const U &value)
 {
-    return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+    return *reinterpret_cast<const T *>(&value);
 }
 
-float CPUKernel::dot(const Vertex &v1, const Vertex &v2)
+const int DEFAULT_TILE_SIZE = 16;
+
+// Tiles owned by a thread. The owner pops tiles from the back, thieves take
+// them from the front, where the tiles farthest from the ones being rendered
+// by the owner are. When the cost of tiles is known from the previous pass,
+// queues are sorted by cost, and thieves take the most expensive tile left
+struct TileQueue
 {
-    return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
-}
+    std::mutex mutex;
+    std::deque<int> tiles;
+};
 
-Vertex CPUKernel::normalize(const Vertex &v)
+static bool popTile(TileQueue &queue, int &tile)
 {
-    Vertex returnValue;
-    float len = vectorLength(v);
-    returnValue.x = v.x / len;
-    returnValue.y = v.y / len;
-    returnValue.z = v.z / len;
-    return returnValue;
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tiles.empty())
+        return false;
+    tile = queue.tiles.back();
+    queue.tiles.pop_back();
+    return true;
 }
 
-/*
-________________________________________________________________________________
-incident  : le vecteur normal inverse a la direction d'incidence de la source
-lumineuse
-normal    : la normale a l'interface orientee dans le materiau ou se propage le
-rayon incident
-reflected : le vecteur normal reflechi
-________________________________________________________________________________
-*/
-void CPUKernel::vectorReflection(Vertex &r, const Vertex &i, const Vertex &n)
+static bool stealTile(std::vector<TileQueue> &queues, const int thief, const float *tileCosts, int &tile)
 {
-    r.x = i.x - 2.f * dot(i, n) * n.x;
-    r.y = i.y - 2.f * dot(i, n) * n.y;
-    r.z = i.z - 2.f * dot(i, n) * n.z;
+    const int nbQueues = static_cast<int>(queues.size());
+    if (tileCosts)
+    {
+        // Expensive tiles rendered last would leave the other threads idle
+        int victim = -1;
+        float maxCost = -1.f;
+        for (int i = 1; i < nbQueues; ++i)
+        {
+            const int queue = (thief + i) % nbQueues;
+            std::lock_guard<std::mutex> lock(queues[queue].mutex);
+            if (!queues[queue].tiles.empty() && tileCosts[queues[queue].tiles.back()] > maxCost)
+            {
+                maxCost = tileCosts[queues[queue].tiles.back()];
+                victim = queue;
+            }
+        }
+        if (victim != -1)
+        {
+            std::lock_guard<std::mutex> lock(queues[victim].mutex);
+            if (!queues[victim].tiles.empty())
+            {
+                tile = queues[victim].tiles.back();
+                queues[victim].tiles.pop_back();
+                return true;
+            }
+        }
+    }
+    for (int i = 1; i < nbQueues; ++i)
+    {
+        TileQueue &queue = queues[(thief + i) % nbQueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tiles.empty())
+        {
+            tile = queue.tiles.front();
+            queue.tiles.pop_front();
+            return true;
+        }
+    }
+    return false;
 }
 
 /*
 ________________________________________________________________________________
-incident: le vecteur norm? inverse ? la direction d?incidence de la source
-lumineuse
-n1      : index of refraction of original medium
-n2      : index of refraction of new medium
+
+Primitives of the leaves tested against a ray in blocks of PRIMITIVE_BLOCK,
+their geometry being stored by component. Each test is the rejection part of
+sphereIntersection, triangleIntersection or cylinderIntersection, without
+square roots and with a margin for rounding, so that the primitives it
+rejects would also be rejected by the kernels. Other types are always
+candidates. Candidates go through the complete intersection functions, and
+intersectionWithPrimitives keeps the closest hit
 ________________________________________________________________________________
 */
-void CPUKernel::vectorRefraction(Vertex &refracted, const Vertex incident, const float n1, const Vertex normal,
-                                 const float n2)
+const int PRIMITIVE_BLOCK = 8;
+const float PRIMITIVE_MARGIN = 1e-4f;
+
+// Components are padded with a block of empty primitives, for blocks starting
+// at the end of the last leaf
+static void storePrimitiveComponents(const cpu::Primitive *primitives, const int nbPrimitives,
+                                     std::vector<float> &components)
 {
-    refracted = incident;
-    if (n1 != n2 && n2 != 0.f)
+    const int stride = nbPrimitives + PRIMITIVE_BLOCK;
+    components.assign(cpu::pcCount * stride, 0.f);
+    float *c = &components[0];
+    for (int i = 0; i < stride; ++i)
+        c[cpu::pcType * stride + i] = -1.f;
+    for (int i = 0; i < nbPrimitives; ++i)
     {
-        float r = n1 / n2;
-        float cosI = dot(incident, normal);
-        float cosT2 = 1.f - r * r * (1.f - cosI * cosI);
-        refracted.x = r * incident.x + (r * cosI - sqrt(fabs(cosT2))) * normal.x;
-        refracted.y = r * incident.y + (r * cosI - sqrt(fabs(cosT2))) * normal.y;
-        refracted.z = r * incident.z + (r * cosI - sqrt(fabs(cosT2))) * normal.z;
+        const cpu::Primitive &primitive = primitives[i];
+        c[cpu::pcType * stride + i] = static_cast<float>(primitive.type);
+        c[cpu::pcP0x * stride + i] = primitive.p0.x;
+        c[cpu::pcP0y * stride + i] = primitive.p0.y;
+        c[cpu::pcP0z * stride + i] = primitive.p0.z;
+        c[cpu::pcP0w * stride + i] = primitive.p0.w;
+        c[cpu::pcP1x * stride + i] = primitive.p1.x;
+        c[cpu::pcP1y * stride + i] = primitive.p1.y;
+        c[cpu::pcP1z * stride + i] = primitive.p1.z;
+        c[cpu::pcP2x * stride + i] = primitive.p2.x;
+        c[cpu::pcP2y * stride + i] = primitive.p2.y;
+        c[cpu::pcP2z * stride + i] = primitive.p2.z;
+        c[cpu::pcN1x * stride + i] = primitive.n1.x;
+        c[cpu::pcN1y * stride + i] = primitive.n1.y;
+        c[cpu::pcN1z * stride + i] = primitive.n1.z;
+        c[cpu::pcSizeX * stride + i] = primitive.size.x;
+        c[cpu::pcSizeY * stride + i] = primitive.size.y;
     }
 }
 
-/*
-________________________________________________________________________________
-__v : Vector to rotate
-__c : Center of rotations
-__a : m_angles
-________________________________________________________________________________
-*/
-void CPUKernel::vectorRotation(Vertex &v, const Vertex &rotationCenter, const Vertex &m_angles)
+enum PrimitiveTest
+{
+    ptestNone,
+    ptestSphere,
+    ptestTriangle,
+    ptestCylinder
+};
+
+// Test run by the kernels for a primitive of the given type. Environment
+// spheres are tested as planes by shadow rays
+static inline int primitiveTest(const int type, const int extended, const int environment)
 {
-    Vertex cosAngles, sinAngles;
-
-    cosAngles.x = cos(m_angles.x);
-    cosAngles.y = cos(m_angles.y);
-    cosAngles.z = cos(m_angles.z);
-
-    sinAngles.x = sin(m_angles.x);
-    sinAngles.y = sin(m_angles.y);
-    sinAngles.z = sin(m_angles.z);
-
-    // Rotate Center
-    Vertex vector;
-    vector.x = v.x - rotationCenter.x;
-    vector.y = v.y - rotationCenter.y;
-    vector.z = v.z - rotationCenter.z;
-    Vertex result = vector;
-
-    /* X axis */
-    result.y = vector.y * cosAngles.x - vector.z * sinAngles.x;
-    result.z = vector.y * sinAngles.x + vector.z * cosAngles.x;
-    vector = result;
-    result = vector;
-
-    /* Y axis */
-    result.z = vector.z * cosAngles.y - vector.x * sinAngles.y;
-    result.x = vector.z * sinAngles.y + vector.x * cosAngles.y;
-    vector = result;
-    result = vector;
-
-    /* Z axis */
-    result.x = vector.x * cosAngles.z - vector.y * sinAngles.z;
-    result.y = vector.x * sinAngles.z + vector.y * cosAngles.z;
-
-    v.x = result.x + rotationCenter.x;
-    v.y = result.y + rotationCenter.y;
-    v.z = result.z + rotationCenter.z;
+    const int tested = (type >= 0) & (type != ptInstance);
+    const int sphere = extended & ((type == ptSphere) | (environment & (type == ptEnvironment)));
+    const int triangle = (extended ^ 1) | (type == ptTriangle);
+    const int cylinder = extended & (type == ptCylinder);
+    return tested * (sphere * ptestSphere + triangle * ptestTriangle + cylinder * ptestCylinder);
 }
 
-/*
-________________________________________________________________________________
+// Rejections of a primitive by a ray, 1 when the kernels would miss it. The
+// origin of the ray is given relative to p0 of the primitive. Spheres take the
+// normalized direction, a being twice its squared length
+static inline int sphereMiss(const float cx, const float cy, const float cz, const float cw, const float dx,
+                             const float dy, const float dz, const float dw, const float a, const float radius)
+{
+    const float b = 2.f * (cx * dx + cy * dy + cz * dz + cw * dw);
+    const float c = (cx * cx + cy * cy + cz * cz + cw * cw) - radius * radius;
+    const float ac = 2.f * a * c;
+    const float d = b * b - ac;
+    return (a == 0.f) | (d <= -PRIMITIVE_MARGIN * (b * b + std::fabs(ac)));
+}
 
-Compute ray attributes
-________________________________________________________________________________
-*/
-void CPUKernel::computeRayAttributes(Ray &ray)
+// Hits beyond the edge p1p2 are always rejected by the kernels when the
+// epsilon is positive
+static inline float maxBarycentricSum(const float epsilon)
 {
-    ray.inv_direction.x = ray.direction.x != 0.f ? 1.f / ray.direction.x : 1.f;
-    ray.inv_direction.y = ray.direction.y != 0.f ? 1.f / ray.direction.y : 1.f;
-    ray.inv_direction.z = ray.direction.z != 0.f ? 1.f / ray.direction.z : 1.f;
-    ray.signs.x = (ray.inv_direction.x < 0);
-    ray.signs.y = (ray.inv_direction.y < 0);
-    ray.signs.z = (ray.inv_direction.z < 0);
+    return (epsilon > 0.f) ? 1.f + 2.f * PRIMITIVE_MARGIN : 1e30f;
 }
 
-void CPUKernel::juliaSet(const Primitive &primitive, const float x, const float y, FLOAT4 &color)
+static inline int triangleMiss(const float tx, const float ty, const float tz, const float dx, const float dy,
+                               const float dz, const float e1x, const float e1y, const float e1z, const float e3x,
+                               const float e3y, const float e3z, const float epsilon, const float maxSum)
 {
-    Material &material = m_hMaterials[primitive.materialId];
-    float W = (float)material.textureMapping.x;
-    float H = (float)material.textureMapping.y;
-
-    // pick some values for the constant c, this determines the shape of the Julia
-    // Set
-    float cRe = -0.7f + 0.4f * sinf(m_sceneInfo.misc.y / 1500.f);
-    float cIm = 0.27015f + 0.4f * cosf(m_sceneInfo.misc.y / 2000.f);
-
-    // calculate the initial real and imaginary part of z, based on the pixel
-    // location and zoom and position values
-    float newRe = 1.5f * (x - W / 2.f) / (0.5f * W);
-    float newIm = (y - H / 2.f) / (0.5f * H);
-    // i will represent the number of iterations
-    int n;
-    // start the iteration process
-    float maxIterations = 40.f + m_sceneInfo.pathTracingIteration;
-    for (n = 0; n < maxIterations; n++)
-    {
-        // remember value of previous iteration
-        float oldRe = newRe;
-        float oldIm = newIm;
-        // the actual iteration, the real and imaginary part are calculated
-        newRe = oldRe * oldRe - oldIm * oldIm + cRe;
-        newIm = 2.f * oldRe * oldIm + cIm;
-        // if the point is outside the circle with radius 2: stop
-        if ((newRe * newRe + newIm * newIm) > 4.f)
-            break;
-    }
-    // use color model conversion to get rainbow palette, make brightness black if
-    // maxIterations reached
-    // color.x += newRe/4.f;
-    // color.z += newIm/4.f;
-    color.x = 1.f - color.x * (n / maxIterations);
-    color.y = 1.f - color.y * (n / maxIterations);
-    color.z = 1.f - color.z * (n / maxIterations);
-    color.w = 1.f - (n / maxIterations);
+    // Möller-Trumbore
+    const float px = dy * e3z - dz * e3y, py = dz * e3x - dx * e3z, pz = dx * e3y - dy * e3x;
+    const float det = e1x * px + e1y * py + e1z * pz;
+    const float qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+    const float a = (tx * px + ty * py + tz * pz) / det;
+    const float b = (dx * qx + dy * qy + dz * qz) / det;
+    const float t = (e3x * qx + e3y * qy + e3z * qz) / det;
+    return (std::fabs(det) < 0.5f * epsilon) | (a < -PRIMITIVE_MARGIN) | (a > 1.f + PRIMITIVE_MARGIN) |
+           (b < -PRIMITIVE_MARGIN) | (b > 1.f + PRIMITIVE_MARGIN) | (a + b > maxSum) | (t < -PRIMITIVE_MARGIN);
+}
+
+// Rays parallel to the axis, or passing farther than the radius
+static inline int cylinderMiss(const float tx, const float ty, const float tz, const float dx, const float dy,
+                               const float dz, const float n1x, const float n1y, const float n1z, const float radius,
+                               const float epsilon)
+{
+    const float nx = dy * n1z - dz * n1y, ny = dz * n1x - dx * n1z, nz = dx * n1y - dy * n1x;
+    const float nn = nx * nx + ny * ny + nz * nz;
+    const float d = tx * nx + ty * ny + tz * nz;
+    return (nn < 0.999f * epsilon * epsilon) | ((radius >= 0.f) & (d * d > 1.001f * radius * radius * nn));
 }
 
-void CPUKernel::mandelbrotSet(const Primitive &primitive, const float x, const float y, FLOAT4 &color)
+// Lanes are combined with bitwise operators rather than branches, for the
+// loops to be vectorized
+static unsigned int blockCandidates(const float *components, const int stride, const int first,
+                                    const cpu::Ray &ray, const bool extendedGeometry, const bool shadows,
+                                    const float epsilon)
 {
-    Material &material = m_hMaterials[primitive.materialId];
-    float W = (float)material.textureMapping.x;
-    float H = (float)material.textureMapping.y;
-
-    float MinRe = -2.f;
-    float MaxRe = 1.f;
-    float MinIm = -1.2f;
-    float MaxIm = MinIm + (MaxRe - MinRe) * H / W;
-    float Re_factor = (MaxRe - MinRe) / (W - 1.f);
-    float Im_factor = (MaxIm - MinIm) / (H - 1.f);
-    float maxIterations = (float)(NB_MAX_ITERATIONS + m_sceneInfo.pathTracingIteration);
-
-    float c_im = MaxIm - y * Im_factor;
-    float c_re = MinRe + x * Re_factor;
-    float Z_re = c_re;
-    float Z_im = c_im;
-    bool isInside = true;
-    unsigned n;
-    for (n = 0; isInside && n < maxIterations; ++n)
+    const int B = PRIMITIVE_BLOCK;
+    auto component = [&](const cpu::PrimitiveComponent c) { return components + c * stride + first; };
+    const float *type = component(cpu::pcType);
+    const float *p0x = component(cpu::pcP0x);
+    const float *p0y = component(cpu::pcP0y);
+    const float *p0z = component(cpu::pcP0z);
+
+    const int extended = extendedGeometry ? 1 : 0;
+    const int environment = shadows ? 0 : 1;
+    int test[B];
+    for (int l = 0; l < B; ++l)
+        test[l] = primitiveTest(static_cast<int>(type[l]), extended, environment);
+    int tests = 0;
+    for (int l = 0; l < B; ++l)
+        tests |= 1 << test[l];
+
+    int rejected[B] = {0};
+    const float ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+    const float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+    if (tests & (1 << ptestSphere))
     {
-        float Z_re2 = Z_re * Z_re;
-        float Z_im2 = Z_im * Z_im;
-        if (Z_re2 + Z_im2 > 4.f)
+        const float *p0w = component(cpu::pcP0w);
+        const float *radius = component(cpu::pcSizeX);
+        const cpu::float4 dir = cpu::normalize(ray.direction);
+        const float a = 2.f * cpu::dot(dir, dir);
+        for (int l = 0; l < B; ++l)
         {
-            isInside = false;
+            const int miss = sphereMiss(ox - p0x[l], oy - p0y[l], oz - p0z[l], ray.origin.w - p0w[l], dir.x, dir.y,
+                                        dir.z, dir.w, a, radius[l]);
+            rejected[l] |= (test[l] == ptestSphere) & miss;
         }
-        Z_im = 2.f * Z_re * Z_im + c_im;
-        Z_re = Z_re2 - Z_im2 + c_re;
     }
-
-    color.x = 1.f - color.x * (n / maxIterations);
-    color.y = 1.f - color.y * (n / maxIterations);
-    color.z = 1.f - color.z * (n / maxIterations);
-    color.w = 1.f - (n / maxIterations);
-}
-
-/*
-________________________________________________________________________________
-
-Sphere texture Mapping
-________________________________________________________________________________
-*/
-FLOAT4 CPUKernel::sphereUVMapping(const Primitive &primitive, const Vertex &intersection)
-{
-    Material &material = m_hMaterials[primitive.materialId];
-    FLOAT4 result = material.color;
-
-#if 0
-   Vertex d;
-   d.x = primitive.p0.x-intersection.x;
-   d.y = primitive.p0.y-intersection.y;
-   d.z = primitive.p0.z-intersection.z;
-   d = normalize(d);
-
-   int u = int(primitive.size.x * (0.5f - atan2f(d.z, d.x) / 2.f*PI));
-   int v = int(primitive.size.y * (0.5f - 2.f*(asinf(d.y) / 2.f*PI)));
-#else
-    float len, U, V;
-    float z = intersection.z;
-    len = sqrt(intersection.x * intersection.x + intersection.y * intersection.y + intersection.z * intersection.z);
-    if (len > 0.0f)
+    if (tests & (1 << ptestTriangle))
     {
-        if (intersection.x == 0.0f && intersection.y == 0.0f)
+        const float *p1x = component(cpu::pcP1x);
+        const float *p1y = component(cpu::pcP1y);
+        const float *p1z = component(cpu::pcP1z);
+        const float *p2x = component(cpu::pcP2x);
+        const float *p2y = component(cpu::pcP2y);
+        const float *p2z = component(cpu::pcP2z);
+        const float maxSum = maxBarycentricSum(epsilon);
+        for (int l = 0; l < B; ++l)
         {
-            U = 0.f;
+            const int miss = triangleMiss(ox - p0x[l], oy - p0y[l], oz - p0z[l], dx, dy, dz, p1x[l] - p0x[l],
+                                          p1y[l] - p0y[l], p1z[l] - p0z[l], p2x[l] - p0x[l], p2y[l] - p0y[l],
+                                          p2z[l] - p0z[l], epsilon, maxSum);
+            rejected[l] |= (test[l] == ptestTriangle) & miss;
         }
-        else
+    }
+    if (tests & (1 << ptestCylinder))
+    {
+        const float *n1x = component(cpu::pcN1x);
+        const float *n1y = component(cpu::pcN1y);
+        const float *n1z = component(cpu::pcN1z);
+        const float *radius = component(cpu::pcSizeY);
+        for (int l = 0; l < B; ++l)
         {
-            U = (1.f - atan2(intersection.x, intersection.y) / PI) / 2.f;
+            const int miss = cylinderMiss(ox - p0x[l], oy - p0y[l], oz - p0z[l], dx, dy, dz, n1x[l], n1y[l], n1z[l],
+                                          radius[l], epsilon);
+            rejected[l] |= (test[l] == ptestCylinder) & miss;
         }
-
-        z /= len;
-        V = 1.f - acos(z) / PI;
     }
 
-    int u = static_cast<int>(material.textureMapping.x * U);
-    int v = static_cast<int>(material.textureMapping.y * V);
-#endif
+    unsigned int candidates = 0;
+    for (int l = 0; l < B; ++l)
+        candidates |= static_cast<unsigned int>(rejected[l] ^ 1) << l;
+    return candidates;
+}
 
-    if (material.textureMapping.x != 0)
-        u = u % material.textureMapping.x;
-    if (material.textureMapping.y != 0)
-        v = v % material.textureMapping.y;
-    if (u >= 0 && u < material.textureMapping.x && v >= 0 && v < material.textureMapping.y)
-    {
-        int textureId = material.textureMapping.z;
-        int A = (v * material.textureMapping.x + u) * material.textureMapping.w;
-        int B = m_hTextures[textureId].size.x * m_hTextures[textureId].size.y * m_hTextures[textureId].size.z;
-        int index = A % B;
-        BitmapBuffer r = m_hTextures[textureId].buffer[index];
-        BitmapBuffer g = m_hTextures[textureId].buffer[index + 1];
-        BitmapBuffer b = m_hTextures[textureId].buffer[index + 2];
-        result.x = r / 256.f;
-        result.y = g / 256.f;
-        result.z = b / 256.f;
-    }
-    return result;
+namespace cpu
+{
+template <typename SceneInfo, typename Ray>
+unsigned int primitiveCandidates(const SceneInfo *sceneInfo, const Ray *ray, const int first, const int count,
+                                 const bool shadows)
+{
+    const PrimitiveComponents &components = primitiveComponents();
+    if (components.components == 0 || first < 0 || first + count > components.stride - PRIMITIVE_BLOCK)
+        return 0xFFFFFFFF;
+
+    unsigned int candidates = 0;
+    for (int block = 0; block < count; block += PRIMITIVE_BLOCK)
+        candidates |= blockCandidates(components.components, components.stride, first + block, *ray,
+                                      (*sceneInfo).extendedGeometry != 0, shadows, (*sceneInfo).geometryEpsilon)
+                      << block;
+    return candidates;
+}
+}
+
+// Wide hierarchy traversed by rays that are not traced in packets, set while
+// the rendering kernels run. Kernels walk the boxes when it is not set
+struct WideHierarchy
+{
+    const GPUKernel *kernel;
+    const cpu::BoundingBox *boxes;
+};
+
+static WideHierarchy &wideHierarchy()
+{
+    static WideHierarchy hierarchy = {0, 0};
+    return hierarchy;
+}
+
+static WideBVHTraversal &wideTraversal()
+{
+    static thread_local WideBVHTraversal traversal;
+    return traversal;
+}
+
+namespace cpu
+{
+template <typename Ray>
+bool wideRay(const Ray *ray)
+{
+    const WideHierarchy &hierarchy = wideHierarchy();
+    if (hierarchy.kernel == 0)
+        return false;
+    hierarchy.kernel->initWideBVHTraversal(wideTraversal(),
+                                           make_vec3f((*ray).origin.x, (*ray).origin.y, (*ray).origin.z),
+                                           make_vec3f((*ray).direction.x, (*ray).direction.y, (*ray).direction.z));
+    return true;
+}
+
+// Leaves are tested again by the kernels, with their own box intersection
+template <typename BoundingBox>
+bool wideLeaf(const float tmax, BoundingBox *box)
+{
+    const WideHierarchy &hierarchy = wideHierarchy();
+    const int leaf = hierarchy.kernel->nextWideBVHLeaf(wideTraversal(), tmax);
+    if (leaf == -1)
+        return false;
+    (*box) = hierarchy.boxes[leaf];
+    (*box).indexForNextBox.x = 1;
+    return true;
+}
 }
 
 /*
 ________________________________________________________________________________
 
-Triangle texture Mapping
+Traverses the boxes with a packet of W rays, built like in
+intersectionWithPrimitives. Rays are stored by component, so that each box is
+tested against all of them with SIMD instructions, with the arithmetic of
+boxIntersection. The packet goes down boxes hit by any of its rays, and keeps
+track of the rays still active at each depth. Leaves are recorded with the
+mask of the rays reaching them, and their primitives are tested against all the
+rays of the packet with the tests of blockCandidates, lanes being rays rather
+than primitives. Kernels only intersect the candidates of these leaves
 ________________________________________________________________________________
 */
-FLOAT4 CPUKernel::triangleUVMapping(const Primitive &primitive, const Vertex &intersection, const Vertex &areas)
+template <int W>
+struct PacketRays
 {
-    Material &material = m_hMaterials[primitive.materialId];
-    FLOAT4 result = material.color;
-
-    Vertex T;
-    T.x = (primitive.vt0.x * areas.x + primitive.vt1.x * areas.y + primitive.vt2.x * areas.z) /
-          (areas.x + areas.y + areas.z);
-    T.y = (primitive.vt0.y * areas.x + primitive.vt1.y * areas.y + primitive.vt2.y * areas.z) /
-          (areas.x + areas.y + areas.z);
-    T.z = (primitive.vt0.z * areas.x + primitive.vt1.z * areas.y + primitive.vt2.z * areas.z) /
-          (areas.x + areas.y + areas.z);
-
-    int u = int(T.x * material.textureMapping.x);
-    int v = int(T.y * material.textureMapping.y);
-
-    u = u % material.textureMapping.x;
-    v = v % material.textureMapping.y;
+    float ox[W], oy[W], oz[W], ow[W];
+    float dx[W], dy[W], dz[W];
+    // Normalized direction, for spheres, and twice its squared length
+    float nx[W], ny[W], nz[W], nw[W], na[W];
+    float ix[W], iy[W], iz[W];
+    int sx[W], sy[W], sz[W];
+};
+
+// Primary rays are never shadow rays
+template <int W>
+static void packetPrimitiveCandidates(const cpu::SceneInfo &sceneInfo, const PacketRays<W> &rays, const int first,
+                                      const int count, unsigned int *candidates)
+{
+    const cpu::PrimitiveComponents &components = cpu::primitiveComponents();
+    if (components.components == 0 || first < 0 || first + count > components.stride - PRIMITIVE_BLOCK)
+    {
+        for (int i = 0; i < count; ++i)
+            candidates[i] = 0xFFFFFFFF;
+        return;
+    }
 
-    if (u >= 0 && u < material.textureMapping.x && v >= 0 && v < material.textureMapping.y)
+    const int stride = components.stride;
+    const int extended = sceneInfo.extendedGeometry ? 1 : 0;
+    const float epsilon = sceneInfo.geometryEpsilon;
+    const float maxSum = maxBarycentricSum(epsilon);
+    for (int i = 0; i < count; ++i)
     {
-        switch (material.textureMapping.z)
+        const float *c = components.components + first + i;
+        const float p0x = c[cpu::pcP0x * stride], p0y = c[cpu::pcP0y * stride], p0z = c[cpu::pcP0z * stride];
+        int miss[W];
+        switch (primitiveTest(static_cast<int>(c[cpu::pcType * stride]), extended, 1))
         {
-        case TEXTURE_MANDELBROT:
-            mandelbrotSet(primitive, static_cast<float>(u), static_cast<float>(v), result);
+        case ptestSphere:
+        {
+            const float p0w = c[cpu::pcP0w * stride], radius = c[cpu::pcSizeX * stride];
+            for (int l = 0; l < W; ++l)
+                miss[l] = sphereMiss(rays.ox[l] - p0x, rays.oy[l] - p0y, rays.oz[l] - p0z, rays.ow[l] - p0w,
+                                     rays.nx[l], rays.ny[l], rays.nz[l], rays.nw[l], rays.na[l], radius);
             break;
-        case TEXTURE_JULIA:
-            juliaSet(primitive, static_cast<float>(u), static_cast<float>(v), result);
+        }
+        case ptestTriangle:
+        {
+            const float e1x = c[cpu::pcP1x * stride] - p0x, e1y = c[cpu::pcP1y * stride] - p0y,
+                        e1z = c[cpu::pcP1z * stride] - p0z;
+            const float e3x = c[cpu::pcP2x * stride] - p0x, e3y = c[cpu::pcP2y * stride] - p0y,
+                        e3z = c[cpu::pcP2z * stride] - p0z;
+            for (int l = 0; l < W; ++l)
+                miss[l] = triangleMiss(rays.ox[l] - p0x, rays.oy[l] - p0y, rays.oz[l] - p0z, rays.dx[l], rays.dy[l],
+                                       rays.dz[l], e1x, e1y, e1z, e3x, e3y, e3z, epsilon, maxSum);
             break;
-        default:
+        }
+        case ptestCylinder:
         {
-            int textureId = material.textureMapping.z;
-            int A = (v * material.textureMapping.x + u) * material.textureMapping.w;
-            int B = m_hTextures[textureId].size.x * m_hTextures[textureId].size.y * m_hTextures[textureId].size.z;
-            int index = A % B;
-            BitmapBuffer r = m_hTextures[textureId].buffer[index];
-            BitmapBuffer g = m_hTextures[textureId].buffer[index + 1];
-            BitmapBuffer b = m_hTextures[textureId].buffer[index + 2];
-            result.x = r / 256.f;
-            result.y = g / 256.f;
-            result.z = b / 256.f;
+            const float n1x = c[cpu::pcN1x * stride], n1y = c[cpu::pcN1y * stride], n1z = c[cpu::pcN1z * stride];
+            const float radius = c[cpu::pcSizeY * stride];
+            for (int l = 0; l < W; ++l)
+                miss[l] = cylinderMiss(rays.ox[l] - p0x, rays.oy[l] - p0y, rays.oz[l] - p0z, rays.dx[l], rays.dy[l],
+                                       rays.dz[l], n1x, n1y, n1z, radius, epsilon);
+            break;
         }
+        default:
+            for (int l = 0; l < W; ++l)
+                miss[l] = 0;
+            break;
         }
+
+        unsigned int mask = 0;
+        for (int l = 0; l < W; ++l)
+            mask |= static_cast<unsigned int>(miss[l] ^ 1) << l;
+        candidates[i] = mask;
     }
-    return result;
 }
 
-/*
-________________________________________________________________________________
-
-Cube texture mapping
-________________________________________________________________________________
-*/
-FLOAT4 CPUKernel::cubeMapping(const Primitive &primitive, const Vertex &intersection)
+template <int W>
+static int tracePacket(const cpu::SceneInfo &sceneInfo, cpu::BoundingBox *boxes, const int nbBoxes,
+                       const cpu::Ray *rays, const int nbRays, cpu::PacketBox *leaves,
+                       std::vector<unsigned int> &candidates)
 {
-    Material &material = m_hMaterials[primitive.materialId];
-    FLOAT4 result = material.color;
-
-#ifdef USE_KINECT
-    if (primitive.type == ptCamera)
+    PacketRays<W> p;
+    for (int l = 0; l < W; ++l)
     {
-        int x = static_cast<int>((intersection.x - primitive.p0.x + primitive.size.x) * material.textureMapping.x);
-        int y = static_cast<int>(KINECT_COLOR_HEIGHT -
-                                 (intersection.y - primitive.p0.y + primitive.size.y) * material.textureMapping.y);
-
-        x = (x + KINECT_COLOR_WIDTH) % KINECT_COLOR_WIDTH;
-        y = (y + KINECT_COLOR_HEIGHT) % KINECT_COLOR_HEIGHT;
-
-        if (x >= 0 && x < KINECT_COLOR_WIDTH && y >= 0 && y < KINECT_COLOR_HEIGHT)
-        {
-            int index = (y * KINECT_COLOR_WIDTH + x) * KINECT_COLOR_DEPTH;
-            index = index % (material.textureMapping.x * material.textureMapping.y * material.textureMapping.w);
-            BitmapBuffer r = m_hTextures[material.textureMapping.z].buffer[index + 2];
-            BitmapBuffer g = m_hTextures[material.textureMapping.z].buffer[index + 1];
-            BitmapBuffer b = m_hTextures[material.textureMapping.z].buffer[index];
-            result.x = r / 256.f;
-            result.y = g / 256.f;
-            result.z = b / 256.f;
-        }
+        // Extra lanes repeat the first ray, and are ignored
+        cpu::Ray r;
+        r.origin = rays[(l < nbRays) ? l : 0].origin;
+        r.direction = rays[(l < nbRays) ? l : 0].direction - r.origin;
+        cpu::computeRayAttributes(&r);
+        const cpu::float4 dir = cpu::normalize(r.direction);
+        p.ox[l] = r.origin.x;
+        p.oy[l] = r.origin.y;
+        p.oz[l] = r.origin.z;
+        p.ow[l] = r.origin.w;
+        p.dx[l] = r.direction.x;
+        p.dy[l] = r.direction.y;
+        p.dz[l] = r.direction.z;
+        p.nx[l] = dir.x;
+        p.ny[l] = dir.y;
+        p.nz[l] = dir.z;
+        p.nw[l] = dir.w;
+        p.na[l] = 2.f * cpu::dot(dir, dir);
+        p.ix[l] = r.inv_direction.x;
+        p.iy[l] = r.inv_direction.y;
+        p.iz[l] = r.inv_direction.z;
+        p.sx[l] = r.signs.x;
+        p.sy[l] = r.signs.y;
+        p.sz[l] = r.signs.z;
     }
-    else
-#endif // USE_KINECT
+    const float t1 = sceneInfo.viewDistance;
+
+    // Boxes are flattened in depth-first order, the descendants of a box
+    // being the boxes it skips when missed
+    int ends[BOUNDING_BOXES_TREE_DEPTH];
+    unsigned int masks[BOUNDING_BOXES_TREE_DEPTH];
+    int depth = 0;
+
+    int nbLeaves = 0;
+    int nbCandidates = 0;
+    cpu::float4 ancestors[2 * COMPRESSED_BOXES_TREE_DEPTH];
+    int i = 0;
+    while (i < nbBoxes)
     {
-        int u = ((primitive.type == ptCheckboard) || (primitive.type == ptXZPlane) || (primitive.type == ptXYPlane))
-                    ? static_cast<int>(intersection.x - primitive.p0.x + primitive.size.x)
-                    : static_cast<int>(intersection.z - primitive.p0.z + primitive.size.z);
-
-        int v = ((primitive.type == ptCheckboard) || (primitive.type == ptXZPlane))
-                    ? static_cast<int>(intersection.z + primitive.p0.z + primitive.size.z)
-                    : static_cast<int>(intersection.y - primitive.p0.y + primitive.size.y);
+        while (depth > 0 && i >= ends[depth - 1])
+            --depth;
+        const unsigned int activeLanes = (depth > 0) ? masks[depth - 1] : (1u << nbRays) - 1;
+
+        const cpu::BoundingBox box = cpu::fetchBox(&sceneInfo, boxes, i, ancestors);
+        const cpu::float4 lower = box.parameters[0];
+        const cpu::float4 upper = box.parameters[1];
+        int hit[W];
+        for (int l = 0; l < W; ++l)
+        {
+            float tmin = ((p.sx[l] ? upper.x : lower.x) - p.ox[l]) * p.ix[l];
+            float tmax = ((p.sx[l] ? lower.x : upper.x) - p.ox[l]) * p.ix[l];
+            const float tymin = ((p.sy[l] ? upper.y : lower.y) - p.oy[l]) * p.iy[l];
+            const float tymax = ((p.sy[l] ? lower.y : upper.y) - p.oy[l]) * p.iy[l];
+            const bool hitY = !((tmin > tymax) || (tymin > tmax));
+            tmin = (tymin > tmin) ? tymin : tmin;
+            tmax = (tymax < tmax) ? tymax : tmax;
+            const float tzmin = ((p.sz[l] ? upper.z : lower.z) - p.oz[l]) * p.iz[l];
+            const float tzmax = ((p.sz[l] ? lower.z : upper.z) - p.oz[l]) * p.iz[l];
+            const bool hitZ = !((tmin > tzmax) || (tzmin > tmax));
+            tmin = (tzmin > tmin) ? tzmin : tmin;
+            tmax = (tzmax < tmax) ? tzmax : tmax;
+            hit[l] = (hitY && hitZ && tmin < t1 && tmax > 0.f) ? 1 : 0;
+        }
 
-        u = u % material.textureMapping.x;
-        v = v % material.textureMapping.y;
+        unsigned int mask = 0;
+        for (int l = 0; l < W; ++l)
+            mask |= static_cast<unsigned int>(hit[l]) << l;
+        mask &= activeLanes;
 
-        if (u >= 0 && u < material.textureMapping.x && v >= 0 && v < material.textureMapping.x)
+        if (mask == 0)
         {
-            switch (material.textureMapping.z)
-            {
-            case TEXTURE_MANDELBROT:
-                mandelbrotSet(primitive, static_cast<float>(u), static_cast<float>(v), result);
-                break;
-            case TEXTURE_JULIA:
-                juliaSet(primitive, static_cast<float>(u), static_cast<float>(v), result);
-                break;
-            default:
-            {
-                int textureId = material.textureMapping.z;
-                int A = (v * material.textureMapping.x + u) * material.textureMapping.w;
-                int B = m_hTextures[textureId].size.x * m_hTextures[textureId].size.y * m_hTextures[textureId].size.z;
-                int index = A % B;
-                BitmapBuffer r = m_hTextures[textureId].buffer[index];
-                BitmapBuffer g = m_hTextures[textureId].buffer[index + 1];
-                BitmapBuffer b = m_hTextures[textureId].buffer[index + 2];
-                result.x = r / 256.f;
-                result.y = g / 256.f;
-                result.z = b / 256.f;
-            }
-            break;
-            }
+            i += box.indexForNextBox.x;
+            continue;
+        }
+        if (box.nbPrimitives > 0)
+        {
+            cpu::PacketBox &leaf = leaves[nbLeaves++];
+            leaf.corners[0] = lower;
+            leaf.corners[1] = upper;
+            leaf.startIndex = box.startIndex;
+            leaf.nbPrimitives = box.nbPrimitives;
+            leaf.mask = mask;
+            leaf.firstCandidate = nbCandidates;
+            if (nbCandidates + box.nbPrimitives > static_cast<int>(candidates.size()))
+                candidates.resize(2 * (nbCandidates + box.nbPrimitives));
+            packetPrimitiveCandidates<W>(sceneInfo, p, box.startIndex, box.nbPrimitives, &candidates[nbCandidates]);
+            nbCandidates += box.nbPrimitives;
+        }
+        if (box.indexForNextBox.x > 1 && depth < static_cast<int>(BOUNDING_BOXES_TREE_DEPTH))
+        {
+            ends[depth] = i + box.indexForNextBox.x;
+            masks[depth] = mask;
+            ++depth;
         }
+        ++i;
     }
-    return result;
+    return nbLeaves;
 }
 
-bool CPUKernel::wireFrameMapping(float x, float y, int width, const Primitive &primitive)
+// Packets are as wide as the SIMD registers of the processor. Wider variants
+// are compiled for their instruction set, and selected at runtime
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SOLR_PACKET_TARGETS
+__attribute__((target("avx512f"), flatten)) static int tracePacket16(
+    const cpu::SceneInfo &sceneInfo, cpu::BoundingBox *boxes, const int nbBoxes, const cpu::Ray *rays,
+    const int nbRays, cpu::PacketBox *leaves, std::vector<unsigned int> &candidates)
 {
-    int X = static_cast<int>(fabs(x));
-    int Y = static_cast<int>(fabs(y));
-    int A = 100; // TODO
-    int B = 100; // TODO
-    return (X % A <= width) || (Y % B <= width);
+    return tracePacket<16>(sceneInfo, boxes, nbBoxes, rays, nbRays, leaves, candidates);
 }
 
-/*
-________________________________________________________________________________
-
-Box intersection
-________________________________________________________________________________
-*/
-bool CPUKernel::boxIntersection(const BoundingBox &box, const Ray &ray, const float &t0, const float &t1)
+__attribute__((target("avx2"), flatten)) static int tracePacket8(
+    const cpu::SceneInfo &sceneInfo, cpu::BoundingBox *boxes, const int nbBoxes, const cpu::Ray *rays,
+    const int nbRays, cpu::PacketBox *leaves, std::vector<unsigned int> &candidates)
 {
-    float tmin, tmax, tymin, tymax, tzmin, tzmax;
-
-    tmin = (box.parameters[ray.signs.x].x - ray.origin.x) * ray.inv_direction.x;
-    tmax = (box.parameters[1 - ray.signs.x].x - ray.origin.x) * ray.inv_direction.x;
-    tymin = (box.parameters[ray.signs.y].y - ray.origin.y) * ray.inv_direction.y;
-    tymax = (box.parameters[1 - ray.signs.y].y - ray.origin.y) * ray.inv_direction.y;
-
-    if ((tmin > tymax) || (tymin > tmax))
-        return false;
-
-    if (tymin > tmin)
-        tmin = tymin;
-    if (tymax < tmax)
-        tmax = tymax;
-    tzmin = (box.parameters[ray.signs.z].z - ray.origin.z) * ray.inv_direction.z;
-    tzmax = (box.parameters[1 - ray.signs.z].z - ray.origin.z) * ray.inv_direction.z;
-
-    if ((tmin > tzmax) || (tzmin > tmax))
-        return false;
-
-    if (tzmin > tmin)
-        tmin = tzmin;
-    if (tzmax < tmax)
-        tmax = tzmax;
-    return ((tmin < t1) && (tmax > t0));
+    return tracePacket<8>(sceneInfo, boxes, nbBoxes, rays, nbRays, leaves, candidates);
 }
+#endif
 
-/*
-________________________________________________________________________________
+static int defaultPacketWidth()
+{
+#ifdef SOLR_PACKET_TARGETS
+    if (__builtin_cpu_supports("avx512f"))
+        return 16;
+    if (__builtin_cpu_supports("avx2"))
+        return 8;
+#endif
+    return 4;
+}
 
-Ellipsoid intersection
-________________________________________________________________________________
-*/
-bool CPUKernel::ellipsoidIntersection(const Primitive &ellipsoid, const Ray &ray, Vertex &intersection, Vertex &normal,
-                                      float &shadowIntensity, bool &back)
+static int tracePacket(const cpu::SceneInfo &sceneInfo, cpu::BoundingBox *boxes, const int nbBoxes,
+                       const cpu::Ray *rays, const int nbRays, cpu::PacketBox *leaves,
+                       std::vector<unsigned int> &candidates)
 {
-    // Shadow intensity
-    shadowIntensity = 1.f;
-
-    // solve the equation sphere-ray to find the intersections
-    Vertex O_C;
-    O_C.x = ray.origin.x - ellipsoid.p0.x;
-    O_C.y = ray.origin.y - ellipsoid.p0.y;
-    O_C.z = ray.origin.z - ellipsoid.p0.z;
-    Vertex dir = normalize(ray.direction);
-
-    float a = ((dir.x * dir.x) / (ellipsoid.size.x * ellipsoid.size.x)) +
-              ((dir.y * dir.y) / (ellipsoid.size.y * ellipsoid.size.y)) +
-              ((dir.z * dir.z) / (ellipsoid.size.z * ellipsoid.size.z));
-    float b = ((2.f * O_C.x * dir.x) / (ellipsoid.size.x * ellipsoid.size.x)) +
-              ((2.f * O_C.y * dir.y) / (ellipsoid.size.y * ellipsoid.size.y)) +
-              ((2.f * O_C.z * dir.z) / (ellipsoid.size.z * ellipsoid.size.z));
-    float c = ((O_C.x * O_C.x) / (ellipsoid.size.x * ellipsoid.size.x)) +
-              ((O_C.y * O_C.y) / (ellipsoid.size.y * ellipsoid.size.y)) +
-              ((O_C.z * O_C.z) / (ellipsoid.size.z * ellipsoid.size.z)) - 1.f;
-
-    float d = ((b * b) - (4.f * a * c));
-    if (d < 0.f || a == 0.f || b == 0.f || c == 0.f)
-    {
-        return false;
-    }
-    d = sqrt(d);
-
-    float t1 = (-b + d) / (2.f * a);
-    float t2 = (-b - d) / (2.f * a);
-
-    if (t1 <= EPSILON && t2 <= EPSILON)
-        return false;                        // both intersections are behind the ray m_viewPos
-    back = (t1 <= EPSILON || t2 <= EPSILON); // If only one intersection (t>0)
-                                             // then we are inside the sphere and
-                                             // the intersection is at the back of
-                                             // the sphere
-
-    float t = 0.f;
-    if (t1 <= EPSILON)
-        t = t2;
-    else if (t2 <= EPSILON)
-        t = t1;
-    else
-        t = (t1 < t2) ? t1 : t2;
-
-    if (t < EPSILON)
-        return false; // Too close to intersection
-    intersection.x = ray.origin.x + t * dir.x;
-    intersection.y = ray.origin.y + t * dir.y;
-    intersection.z = ray.origin.z + t * dir.z;
-
-    normal.x = intersection.x - ellipsoid.p0.x;
-    normal.y = intersection.y - ellipsoid.p0.y;
-    normal.z = intersection.z - ellipsoid.p0.z;
-    normal.x = 2.f * normal.x / (ellipsoid.size.x * ellipsoid.size.x);
-    normal.y = 2.f * normal.y / (ellipsoid.size.y * ellipsoid.size.y);
-    normal.z = 2.f * normal.z / (ellipsoid.size.z * ellipsoid.size.z);
-
-    normal.x *= (back) ? -1.f : 1.f;
-    normal.y *= (back) ? -1.f : 1.f;
-    normal.z *= (back) ? -1.f : 1.f;
-    normal = normalize(normal);
-    return true;
+#ifdef SOLR_PACKET_TARGETS
+    static const int simdWidth = defaultPacketWidth();
+    if (nbRays > 8 && simdWidth >= 16)
+        return tracePacket16(sceneInfo, boxes, nbBoxes, rays, nbRays, leaves, candidates);
+    if (nbRays > 4 && nbRays <= 8 && simdWidth >= 8)
+        return tracePacket8(sceneInfo, boxes, nbBoxes, rays, nbRays, leaves, candidates);
+#endif
+    if (nbRays > 8)
+        return tracePacket<16>(sceneInfo, boxes, nbBoxes, rays, nbRays, leaves, candidates);
+    if (nbRays > 4)
+        return tracePacket<8>(sceneInfo, boxes, nbBoxes, rays, nbRays, leaves, candidates);
+    return tracePacket<4>(sceneInfo, boxes, nbBoxes, rays, nbRays, leaves, candidates);
 }
 
 /*
 ________________________________________________________________________________
 
-Sphere intersection
+Primary rays of pixels rendered one after the other, traced in a packet
+before the kernel runs for these pixels. Rays returns the number of primary
+rays of a pixel, and fills them the way the kernel builds them. Kernels find their rays
+among the ones of their pixel by comparing origins and directions, so a ray
+built differently simply traverses the boxes on its own
 ________________________________________________________________________________
 */
-bool CPUKernel::sphereIntersection(const Primitive &sphere, const Ray &ray, Vertex &intersection, Vertex &normal,
-                                   float &shadowIntensity, bool &back)
+template <typename Rays>
+struct PrimaryRayPackets
 {
-    // solve the equation sphere-ray to find the intersections
-    Vertex O_C;
-    O_C.x = ray.origin.x - sphere.p0.x;
-    O_C.y = ray.origin.y - sphere.p0.y;
-    O_C.z = ray.origin.z - sphere.p0.z;
-    Vertex dir = normalize(ray.direction);
-
-    float a = 2.f * dot(dir, dir);
-    float b = 2.f * dot(O_C, dir);
-    float c = dot(O_C, O_C) - (sphere.size.x * sphere.size.x);
-    float d = b * b - 2.f * a * c;
-
-    if (d <= 0.f || a == 0.f)
-        return false;
-    float r = sqrt(d);
-    float t1 = (-b - r) / a;
-    float t2 = (-b + r) / a;
-
-    if (t1 <= EPSILON && t2 <= EPSILON)
-        return false;                        // both intersections are behind the ray m_viewPos
-    back = (t1 <= EPSILON || t2 <= EPSILON); // If only one intersection (t>0)
-                                             // then we are inside the sphere and
-                                             // the intersection is at the back of
-                                             // the sphere
-
-    float t = 0.f;
-    if (t1 <= EPSILON)
-        t = t2;
-    else if (t2 <= EPSILON)
-        t = t1;
-    else
-        t = (t1 < t2) ? t1 : t2;
-
-    if (t < EPSILON)
-        return false; // Too close to intersection
-    intersection.x = ray.origin.x + t * dir.x;
-    intersection.y = ray.origin.y + t * dir.y;
-    intersection.z = ray.origin.z + t * dir.z;
-
-    // TO REMOVE - For Charts only
-    // if( intersection.y < sphere.p0.y ) return false;
-
-    if (m_hMaterials[sphere.materialId].attributes.y == 0)
-    {
-        // Compute normal vector
-        normal.x = intersection.x - sphere.p0.x;
-        normal.y = intersection.y - sphere.p0.y;
-        normal.z = intersection.z - sphere.p0.z;
-    }
-    else
+    const cpu::SceneInfo *sceneInfo;
+    cpu::BoundingBox *boxes;
+    int nbBoxes;
+    int raysPerPixel;
+    bool streamed;
+    Rays rays;
+
+    void operator()(const int *pixels, const int nbPixels) const
     {
-        // Procedural texture
-        Vertex newCenter;
-        newCenter.x = sphere.p0.x + 0.008f * sphere.size.x * cos(m_sceneInfo.misc.y + intersection.x);
-        newCenter.y = sphere.p0.y + 0.008f * sphere.size.y * sin(m_sceneInfo.misc.y + intersection.y);
-        newCenter.z = sphere.p0.z + 0.008f * sphere.size.z * sin(cos(m_sceneInfo.misc.y + intersection.z));
-        normal.x = intersection.x - newCenter.x;
-        normal.y = intersection.y - newCenter.y;
-        normal.z = intersection.z - newCenter.z;
-    }
-    normal.x *= (back) ? -1.f : 1.f;
-    normal.y *= (back) ? -1.f : 1.f;
-    normal.z *= (back) ? -1.f : 1.f;
-    normal = normalize(normal);
-
-    shadowIntensity = 1.f;
-// Shadow management
-/*
-r = dot(dir,normal);
-shadowIntensity = (m_hMaterials[sphere.materialId].transparency != 0.f) ?
-(1.f-fabs(r)) : 1.f;
-*/
+        static thread_local std::vector<cpu::PacketBox> leaves;
+        static thread_local std::vector<unsigned int> candidates;
+        cpu::RayPacket &packet = cpu::currentPacket();
+        packet.nbRays = 0;
+        packet.nbBoxes = 0;
+
+        cpu::Ray primaryRays[cpu::MAX_PACKET_RAYS];
+        for (int i = 0; i < nbPixels; ++i)
+        {
+            packet.pixelRays[i] = packet.nbRays;
+            packet.nbRays += rays(pixels[i] % (*sceneInfo).size.x, pixels[i] / (*sceneInfo).size.x,
+                                  &primaryRays[packet.nbRays]);
+        }
+        packet.pixelRays[nbPixels] = packet.nbRays;
+        if (packet.nbRays < 2 || nbBoxes == 0)
+        {
+            packet.nbRays = 0;
+            return;
+        }
 
-#if EXTENDED_FEATURES
-    // Power textures
-    if (m_hMaterials[sphere.materialId].textureInfo.y != TEXTURE_NONE &&
-        m_hMaterials[sphere.materialId].transparency != 0)
-    {
-        Vertex color = sphereUVMapping(sphere, m_hMaterials, textures, intersection, timer);
-        return ((color.x + color.y + color.z) >= m_sceneInfo.transparentColor);
+        for (int i = 0; i < packet.nbRays; ++i)
+        {
+            packet.origins[i] = primaryRays[i].origin;
+            packet.directions[i] = primaryRays[i].direction;
+        }
+        if (static_cast<int>(leaves.size()) < nbBoxes)
+            leaves.resize(nbBoxes);
+        packet.boxes = &leaves[0];
+        packet.nbBoxes =
+            tracePacket(*sceneInfo, boxes, nbBoxes, primaryRays, packet.nbRays, &leaves[0], candidates);
+        packet.candidates = candidates.empty() ? 0 : &candidates[0];
     }
-#endif // 0
+};
 
-    return true;
+template <typename Rays>
+static PrimaryRayPackets<Rays> primaryRayPackets(const cpu::SceneInfo &sceneInfo, cpu::BoundingBox *boxes,
+                                                 const int nbBoxes, const int raysPerPixel, const Rays &rays)
+{
+    // Rendered boxes need the traversal of every ray
+    const int packetRaysPerPixel = sceneInfo.renderBoxes ? 0 : raysPerPixel;
+    PrimaryRayPackets<Rays> packets = {&sceneInfo, boxes, nbBoxes, packetRaysPerPixel, true, rays};
+    return packets;
 }
 
+// Kernels without packets of primary rays. Streamed kernels are the ones
+// rendering the frame
+struct NoPackets
+{
+    int raysPerPixel;
+    bool streamed;
+    void operator()(const int *, const int) const {}
+};
+
 /*
 ________________________________________________________________________________
 
-Cylinder intersection
+Runs a kernel for every pixel of the frame. The cost of a pixel depends on
+what it sees (sky, glass, etc), so instead of a static split of the frame,
+tiles are dealt in contiguous ranges to the threads, and threads running out
+of tiles steal from the others. Primary rays of streamed kernels are traced in
+packets
 ________________________________________________________________________________
 */
-bool CPUKernel::cylinderIntersection(const Primitive &cylinder, const Ray &ray, Vertex &intersection, Vertex &normal,
-                                     float &shadowIntensity, bool &back)
+template <typename Kernel>
+void CPUKernel::runKernel(const Kernel &kernel)
 {
-    back = false;
-    Vertex center;
-    center.x = (cylinder.p0.x + cylinder.p1.x) / 2.f;
-    center.y = (cylinder.p0.y + cylinder.p1.y) / 2.f;
-    center.z = (cylinder.p0.z + cylinder.p1.z) / 2.f;
-    Vertex O_C;
-    O_C.x = ray.origin.x - center.x;
-    O_C.y = ray.origin.y - center.y;
-    O_C.z = ray.origin.z - center.z;
-    Vertex dir = ray.direction;
-    Vertex n = crossProduct(dir, cylinder.n1);
-
-    float ln = vectorLength(n);
-
-    // Parallel? (?)
-    if ((ln < EPSILON) && (ln > -EPSILON))
-        return false;
-
-    n = normalize(n);
-
-    float d = fabs(dot(O_C, n));
-    if (d > cylinder.size.y)
-        return false;
-
-    Vertex O = crossProduct(O_C, cylinder.n1);
-    float t = -dot(O, n) / ln;
-    O = normalize(crossProduct(n, cylinder.n1));
-    float s = fabs(sqrtf(cylinder.size.x * cylinder.size.x - d * d) / dot(dir, O));
-
-    float in = t - s;
-    float out = t + s;
+    const NoPackets packets = {0, false};
+    runKernel(kernel, packets);
+}
 
-    if (in < -EPSILON)
+template <typename Kernel, typename Packets>
+void CPUKernel::runKernel(const Kernel &kernel, const Packets &packets)
+{
+    const vec2i size = m_sceneInfo.size;
+    const int tileSize = (m_tileSize > 0) ? m_tileSize : DEFAULT_TILE_SIZE;
+    const int nbTilesX = (size.x + tileSize - 1) / tileSize;
+    const int nbTiles = nbTilesX * ((size.y + tileSize - 1) / tileSize);
+    if (nbTiles == 0)
+        return;
+
+#ifdef _OPENMP
+    int nbThreads = (m_nbThreads > 0) ? m_nbThreads : omp_get_max_threads();
+#else
+    int nbThreads = 1;
+#endif
+    nbThreads = std::min(nbThreads, nbTiles);
+
+    // Pixels whose primary rays are traced together
+    const int packetWidth = std::min(m_packetWidth, static_cast<int>(cpu::MAX_PACKET_RAYS));
+    const bool tracePackets = packets.raysPerPixel > 0 && packetWidth >= 2 * packets.raysPerPixel;
+    const int span = tracePackets ? packetWidth / packets.raysPerPixel : tileSize * tileSize;
+
+    // Pixels that converged are left out of the tiles of rendering kernels, so
+    // that stolen tiles are the ones that are still noisy
+    const bool adaptiveSampling = packets.streamed && m_samplingThreshold > 0.f &&
+                                  m_sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS;
+
+    // Rendering kernels start with the tiles that were the most expensive
+    // during the previous pass, which was most likely rendering the same frame
+    const bool recordCosts = packets.streamed;
+    if (recordCosts && static_cast<int>(m_tileCosts.size()) != nbTiles)
+        m_tileCosts.assign(nbTiles, 0.f);
+    const float *tileCosts = (recordCosts && m_sceneInfo.pathTracingIteration != 0) ? &m_tileCosts[0] : 0;
+
+    std::vector<TileQueue> queues(nbThreads);
+    for (int i = 0; i < nbThreads; ++i)
     {
-        if (out < -EPSILON)
-            return false;
-        else
-        {
-            t = out;
-            back = true;
-        }
+        for (int tile = i * nbTiles / nbThreads; tile < (i + 1) * nbTiles / nbThreads; ++tile)
+            queues[i].tiles.push_back(tile);
+        if (tileCosts)
+            std::sort(queues[i].tiles.begin(), queues[i].tiles.end(),
+                      [tileCosts](const int a, const int b) { return tileCosts[a] < tileCosts[b]; });
     }
-    else
+
+    std::atomic<int> remainingTiles(nbTiles);
+    std::atomic<int> stolenTiles(0);
+    // Time spent by each thread on its tiles, the spread between threads
+    // showing how well the work is balanced
+    std::vector<double> busyTimes(nbThreads, 0.0);
+#pragma omp parallel num_threads(nbThreads)
     {
-        if (out < -EPSILON)
-        {
-            t = in;
-        }
-        else
+#ifdef _OPENMP
+        const int thread = omp_get_thread_num();
+#else
+        const int thread = 0;
+#endif
+        std::vector<int> pixels;
+        while (remainingTiles > 0)
         {
-            if (in < out)
-                t = in;
-            else
+            int tile;
+            if (!popTile(queues[thread], tile))
             {
-                t = out;
-                back = true;
+                if (!stealTile(queues, thread, tileCosts, tile))
+                {
+                    // Last tiles are being rendered by other threads
+                    std::this_thread::yield();
+                    continue;
+                }
+                ++stolenTiles;
             }
 
-            if (t < 0.f)
-                return false;
-
-            // Calculate intersection point
-            intersection.x = ray.origin.x + t * dir.x;
-            intersection.y = ray.origin.y + t * dir.y;
-            intersection.z = ray.origin.z + t * dir.z;
-
-            Vertex HB1;
-            HB1.x = intersection.x - cylinder.p0.x;
-            HB1.y = intersection.y - cylinder.p0.y;
-            HB1.z = intersection.z - cylinder.p0.z;
-            Vertex HB2;
-            HB2.x = intersection.x - cylinder.p1.x;
-            HB2.y = intersection.y - cylinder.p1.y;
-            HB2.z = intersection.z - cylinder.p1.z;
-
-            float scale1 = dot(HB1, cylinder.n1);
-            float scale2 = dot(HB2, cylinder.n1);
-
-            // Cylinder length
-            if (scale1 < EPSILON || scale2 > EPSILON)
-                return false;
-
-            if (m_hMaterials[cylinder.materialId].attributes.y == 1)
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            const int x0 = (tile % nbTilesX) * tileSize;
+            const int y0 = (tile / nbTilesX) * tileSize;
+            const int x1 = std::min(x0 + tileSize, size.x);
+            const int y1 = std::min(y0 + tileSize, size.y);
+            pixels.clear();
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    if (!adaptiveSampling || m_postProcessingBuffer[y * size.x + x].sceneInfo.y == 0.f)
+                        pixels.push_back(y * size.x + x);
+
+            const int nbTilePixels = static_cast<int>(pixels.size());
+            for (int i = 0; i < nbTilePixels; i += span)
             {
-                // Procedural texture
-                Vertex newCenter;
-                newCenter.x =
-                    cylinder.p0.x + 0.01f * cylinder.size.x * cos(m_sceneInfo.misc.y / 100.f + intersection.x);
-                newCenter.y =
-                    cylinder.p0.y + 0.01f * cylinder.size.y * sin(m_sceneInfo.misc.y / 100.f + intersection.y);
-                newCenter.z =
-                    cylinder.p0.z + 0.01f * cylinder.size.z * sin(cos(m_sceneInfo.misc.y / 100.f + intersection.z));
-                HB1.x = intersection.x - newCenter.x;
-                HB1.y = intersection.y - newCenter.y;
-                HB1.z = intersection.z - newCenter.z;
+                const int nbSpanPixels = std::min(span, nbTilePixels - i);
+                if (tracePackets)
+                    packets(&pixels[i], nbSpanPixels);
+                for (int j = i; j < i + nbSpanPixels; ++j)
+                {
+                    cpu::globalId(0) = pixels[j] % size.x;
+                    cpu::globalId(1) = pixels[j] / size.x;
+                    if (tracePackets)
+                        cpu::currentPacket().pixel = j - i;
+                    kernel();
+                }
             }
-
-            Vertex HB;
-            HB.x = HB1.x - cylinder.n1.x * scale1;
-            HB.y = HB1.y - cylinder.n1.y * scale1;
-            HB.z = HB1.z - cylinder.n1.z * scale1;
-            normal = normalize(HB);
-
-            shadowIntensity = 1.f;
-            /*
-            // Shadow management
-            dir = normalize(dir);
-            float r = dot(dir,normal);
-            shadowIntensity = (m_hMaterials[cylinder.materialId].transparency != 0.f)
-            ? (1.f-fabs(r)) : 1.f;
-            */
-            return true;
+            const double tileTime =
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            busyTimes[thread] += tileTime;
+            if (recordCosts)
+                m_tileCosts[tile] = static_cast<float>(tileTime);
+            --remainingTiles;
         }
+        // Packets are only valid for the kernel they were traced for
+        cpu::currentPacket().nbRays = 0;
     }
-    return false;
+    double totalBusyTime = 0.0;
+    double maxBusyTime = 0.0;
+    for (int i = 0; i < nbThreads; ++i)
+    {
+        totalBusyTime += busyTimes[i];
+        maxBusyTime = std::max(maxBusyTime, busyTimes[i]);
+    }
+    LOG_INFO(3, "Tiles: " << nbTiles << " on " << nbThreads << " threads, " << stolenTiles << " stolen, busiest thread "
+                          << maxBusyTime << " ms for an average of " << totalBusyTime / nbThreads << " ms");
 }
 
-/*
-________________________________________________________________________________
+CPUKernel::CPUKernel()
+    : GPUKernel()
+    , m_tileSize(DEFAULT_TILE_SIZE)
+    , m_nbThreads(0)
+    , m_packetWidth(defaultPacketWidth())
+    , m_wideBVH(true)
+{
+    LOG_INFO(3, "CPUKernel::CPUKernel");
+    m_occupancyParameters.x = 1; // Devices
+    m_occupancyParameters.y = 1; // Streams per device
+}
 
-Checkboard intersection
-________________________________________________________________________________
-*/
-bool CPUKernel::planeIntersection(const Primitive &primitive, const Ray &ray, Vertex &intersection, Vertex &normal,
-                                  float &shadowIntensity, bool reverse)
+CPUKernel::~CPUKernel()
+{
+    LOG_INFO(3, "CPUKernel::~CPUKernel");
+}
+
+void CPUKernel::initBuffers()
+{
+    LOG_INFO(3, "CPUKernel::initBuffers");
+    GPUKernel::initBuffers();
+    m_postProcessingBuffer.resize(MAX_BITMAP_SIZE);
+}
+
+void CPUKernel::queryDevice()
+{
+    LOG_INFO(1, getGPUDescription());
+}
+
+std::string CPUKernel::getGPUDescription()
 {
-    bool collision = false;
+    std::stringstream s;
+    s << "CPU";
+#ifdef _OPENMP
+    s << " (" << omp_get_max_threads() << " threads)";
+#endif
+    return s.str();
+}
 
-    float reverted = reverse ? -1.f : 1.f;
-    normal = primitive.n0;
-    switch (primitive.type)
+void CPUKernel::render_begin(const float timer)
+{
+    GPUKernel::render_begin(timer);
+    if (!m_refresh)
+        return;
+
+    const int nbBoxes = m_nbActiveBoxes[m_frame];
+    const int nbPrimitives = m_nbActivePrimitives[m_frame];
+    int nbLamps = m_nbActiveLamps[m_frame];
+    LOG_INFO(3, "Data sizes [" << m_frame << "]: " << nbBoxes << ", " << nbPrimitives << ", "
+                               << m_lightInformationSize << ", " << nbLamps);
+
+    // Kernels read host buffers directly, only textures and the components of
+    // primitives need to be gathered
+    const size_t nbComponents = cpu::pcCount * (nbPrimitives + PRIMITIVE_BLOCK);
+    if (!m_primitivesTransfered || m_primitiveComponents.size() != nbComponents)
+        storePrimitiveComponents(toKernel<cpu::Primitive>(m_hPrimitives), nbPrimitives, m_primitiveComponents);
+    m_dirtyBoxes.clear();
+    m_dirtyPrimitives.clear();
+    m_primitivesTransfered = true;
+
+    if (!m_materialsTransfered)
     {
-    case ptMagicCarpet:
-    case ptCheckboard:
+        realignTexturesAndMaterials();
+        m_materialsTransfered = true;
+    }
+
+    if (!m_texturesTransfered)
     {
-        intersection.y = primitive.p0.y;
-        float y = ray.origin.y - primitive.p0.y;
-        if (reverted * ray.origin.y < 0.f && reverted * ray.origin.y > reverted * primitive.p0.y)
-        {
-            intersection.x = ray.origin.x + y * ray.direction.x / -ray.direction.y;
-            intersection.z = ray.origin.z + y * ray.direction.z / -ray.direction.y;
-            collision = fabs(intersection.x - primitive.p0.x) < primitive.size.x &&
-                        fabs(intersection.z - primitive.p0.z) < primitive.size.z;
-        }
-        break;
+        int totalSize(0);
+        for (int i(0); i < m_nbActiveTextures; ++i)
+            totalSize += m_hTextures[i].size.x * m_hTextures[i].size.y * m_hTextures[i].size.z;
+        LOG_INFO(3, "Total texture size: " << totalSize << " bytes");
+
+        m_textures.assign(totalSize, 0);
+        for (int i(0); i < m_nbActiveTextures; ++i)
+            if (m_hTextures[i].buffer != 0)
+                memcpy(&m_textures[m_hTextures[i].offset], m_hTextures[i].buffer,
+                       m_hTextures[i].size.x * m_hTextures[i].size.y * m_hTextures[i].size.z);
+        m_texturesTransfered = true;
     }
-    case ptXZPlane:
+
+    SceneInfo sceneInfo = m_sceneInfo;
+    if (m_sceneInfo.draftMode && m_sceneInfo.pathTracingIteration == 0)
+        sceneInfo.graphicsLevel = glNoShading;
+    const bool compressedBoxes = m_compressedBoxes && !m_hCompressedBoxes.empty();
+    sceneInfo.compressedBoxes = compressedBoxes ? 1 : 0;
+    sceneInfo.samplingThreshold = m_samplingThreshold;
+    sceneInfo.sampler = m_sampler;
+
+    // Kernel arguments
+    const cpu::int2 &occupancy = toKernel<cpu::int2>(m_occupancyParameters);
+    const cpu::SceneInfo &kSceneInfo = toKernel<cpu::SceneInfo>(sceneInfo);
+    const cpu::PostProcessingInfo &kPostProcessingInfo = toKernel<cpu::PostProcessingInfo>(m_postProcessingInfo);
+    cpu::BoundingBox *boxes = compressedBoxes ? toKernel<cpu::BoundingBox>(&m_hCompressedBoxes[0])
+                                              : toKernel<cpu::BoundingBox>(m_hBoundingBoxes);
+    cpu::Primitive *primitives = toKernel<cpu::Primitive>(m_hPrimitives);
+    cpu::LightInformation *lightInformation =
+        m_lightInformation.empty() ? 0 : toKernel<cpu::LightInformation>(&m_lightInformation[0]);
+    const int lightInformationSize = m_lightInformationSize;
+    cpu::Material *materials = toKernel<cpu::Material>(m_hMaterials);
+    cpu::BitmapBuffer *textures = m_textures.empty() ? 0 : &m_textures[0];
+    const cpu::float4 &origin = toKernel<cpu::float4>(m_viewPos);
+    const cpu::float4 &direction = toKernel<cpu::float4>(m_viewDir);
+    const cpu::float4 &angles = toKernel<cpu::float4>(m_angles);
+    cpu::PostProcessingBuffer *postProcessingBuffer = toKernel<cpu::PostProcessingBuffer>(&m_postProcessingBuffer[0]);
+    cpu::PrimitiveXYIdBuffer *primitiveXYIds = toKernel<cpu::PrimitiveXYIdBuffer>(m_hPrimitivesXYIds);
+    cpu::BitmapBuffer *bitmap = m_bitmap;
+
+    // Primary rays of a pixel, built with the functions used by the kernels
+    const int width = sceneInfo.size.x;
+    auto anaglyphRays = [&](const int x, const int y, cpu::Ray *rays) {
+        rays[0] = cpu::anaglyphEyeRay(&kSceneInfo, primitiveXYIds, x, y, origin, direction, angles, true);
+        rays[1] = cpu::anaglyphEyeRay(&kSceneInfo, primitiveXYIds, x, y, origin, direction, angles, false);
+        return 2;
+    };
+    auto visionRays = [&](const int x, const int y, cpu::Ray *rays) {
+        return cpu::visionEyeRay(&kSceneInfo, primitiveXYIds, x, y, origin, direction, angles, rays) ? 1 : 0;
+    };
+    auto standardRays = [&](const int x, const int y, cpu::Ray *rays) {
+        const int index = y * width + x;
+        rays[0] = cpu::standardPrimaryRay(&kSceneInfo, &kPostProcessingInfo, postProcessingBuffer, index, x, y, 0,
+                                          origin, direction, angles, kSceneInfo.pathTracingIteration % 4);
+        return 1;
+    };
+    auto antialiasedRays = [&](const int x, const int y, cpu::Ray *rays) {
+        const int index = y * width + x;
+        if (postProcessingBuffer[index].sceneInfo.z == 0.f)
+            return 0;
+        for (int i = 0; i < 4; ++i)
+            rays[i] = cpu::standardPrimaryRay(&kSceneInfo, &kPostProcessingInfo, postProcessingBuffer, index, x, y, 0,
+                                              origin, direction, angles, i);
+        return 4;
+    };
+
+    const NoPackets streamed = {0, true};
+    const cpu::PrimitiveComponents primitiveComponents = {&m_primitiveComponents[0], nbPrimitives + PRIMITIVE_BLOCK};
+    cpu::primitiveComponents() = primitiveComponents;
+    ++cpu::occluderFrame();
+
+    // The wide hierarchy is built from regular boxes, and dropped whenever they
+    // change. Grid boxes are not nested, and visiting them front-to-back changes
+    // the closest hits found. Rendered boxes need the walk of every box
+    const bool wideBVH =
+        m_wideBVH && m_accelerationStructure != asGrid && !compressedBoxes && !sceneInfo.renderBoxes;
+    if (wideBVH && m_wideBVHNodes.empty())
+        buildWideBVH();
+    const WideHierarchy hierarchy = {(wideBVH && !m_wideBVHNodes.empty()) ? this : 0,
+                                     toKernel<cpu::BoundingBox>(m_hBoundingBoxes)};
+    wideHierarchy() = hierarchy;
+
+    LOG_INFO(3, "Running default rendering kernel");
+    switch (sceneInfo.cameraType)
     {
-        float y = ray.origin.y - primitive.p0.y;
-        if (reverted * ray.origin.y < 0.f && reverted * ray.origin.y > reverted * primitive.p0.y)
-        {
-            intersection.x = ray.origin.x + y * ray.direction.x / -ray.direction.y;
-            intersection.y = primitive.p0.y;
-            intersection.z = ray.origin.z + y * ray.direction.z / -ray.direction.y;
-            collision = fabs(intersection.x - primitive.p0.x) < primitive.size.x &&
-                        fabs(intersection.z - primitive.p0.z) < primitive.size.z;
-            if (m_hMaterials[primitive.materialId].attributes.z == 2) // Wireframe
-                collision &= wireFrameMapping(intersection.x, intersection.z,
-                                              m_hMaterials[primitive.materialId].attributes.w, primitive);
-        }
-        if (!collision && reverted * ray.origin.y > 0.f && reverted * ray.origin.y < reverted * primitive.p0.y)
-        {
-            normal.x = -normal.x;
-            normal.y = -normal.y;
-            normal.z = -normal.z;
-            intersection.x = ray.origin.x + y * ray.direction.x / -ray.direction.y;
-            intersection.y = primitive.p0.y;
-            intersection.z = ray.origin.z + y * ray.direction.z / -ray.direction.y;
-            collision = fabs(intersection.x - primitive.p0.x) < primitive.size.x &&
-                        fabs(intersection.z - primitive.p0.z) < primitive.size.z;
-            if (m_hMaterials[primitive.materialId].attributes.z == 2) // Wireframe
-                collision &= wireFrameMapping(intersection.x, intersection.z,
-                                              m_hMaterials[primitive.materialId].attributes.w, primitive);
-        }
+    case ctAnaglyph:
+        runKernel(
+            [&]() {
+                cpu::k_anaglyphRenderer(occupancy, 0, 0, boxes, nbBoxes, primitives, nbPrimitives, lightInformation,
+                                        lightInformationSize, nbLamps, materials, textures, origin,
+                                        direction, angles, kSceneInfo, kPostProcessingInfo, postProcessingBuffer,
+                                        primitiveXYIds);
+            },
+            primaryRayPackets(kSceneInfo, boxes, nbBoxes, 2, anaglyphRays));
+        break;
+    case ctVR:
+        runKernel(
+            [&]() {
+                cpu::k_3DVisionRenderer(occupancy, 0, 0, boxes, nbBoxes, primitives, nbPrimitives, lightInformation,
+                                        lightInformationSize, nbLamps, materials, textures, origin,
+                                        direction, angles, kSceneInfo, kPostProcessingInfo, postProcessingBuffer,
+                                        primitiveXYIds);
+            },
+            primaryRayPackets(kSceneInfo, boxes, nbBoxes, 1, visionRays));
+        break;
+    case ctPanoramic:
+        runKernel(
+            [&]() {
+                cpu::k_fishEyeRenderer(occupancy, 0, 0, boxes, nbBoxes, primitives, nbPrimitives, lightInformation,
+                                       lightInformationSize, nbLamps, materials, textures, origin, direction,
+                                       angles, kSceneInfo, kPostProcessingInfo, postProcessingBuffer, primitiveXYIds);
+            },
+            streamed);
+        break;
+    case ctVolumeRendering:
+        runKernel(
+            [&]() {
+                cpu::k_volumeRenderer(occupancy, 0, 0, boxes, nbBoxes, primitives, nbPrimitives, lightInformation,
+                                      lightInformationSize, nbLamps, materials, textures, origin, direction,
+                                      angles, kSceneInfo, kPostProcessingInfo, postProcessingBuffer, primitiveXYIds);
+            },
+            streamed);
+        break;
+    case ctAntialiazed:
+        // One sample per pixel, then supersampling of the edges only
+        runKernel(
+            [&]() {
+                cpu::k_standardRenderer(occupancy, 0, 0, boxes, nbBoxes, primitives, nbPrimitives, lightInformation,
+                                        lightInformationSize, nbLamps, materials, textures, origin,
+                                        direction, angles, kSceneInfo, kPostProcessingInfo, postProcessingBuffer,
+                                        primitiveXYIds);
+            },
+            primaryRayPackets(kSceneInfo, boxes, nbBoxes, 1, standardRays));
+        runKernel([&]() { cpu::k_antialiasingEdges(occupancy, kSceneInfo, primitiveXYIds, postProcessingBuffer); });
+        runKernel(
+            [&]() {
+                cpu::k_antialiasingRenderer(occupancy, 0, 0, boxes, nbBoxes, primitives, nbPrimitives,
+                                            lightInformation, lightInformationSize, nbLamps, materials, textures,
+                                            origin, direction, angles, kSceneInfo, kPostProcessingInfo,
+                                            postProcessingBuffer, primitiveXYIds);
+            },
+            primaryRayPackets(kSceneInfo, boxes, nbBoxes, 4, antialiasedRays));
+        break;
+    default:
+        runKernel(
+            [&]() {
+                cpu::k_standardRenderer(occupancy, 0, 0, boxes, nbBoxes, primitives, nbPrimitives, lightInformation,
+                                        lightInformationSize, nbLamps, materials, textures, origin,
+                                        direction, angles, kSceneInfo, kPostProcessingInfo, postProcessingBuffer,
+                                        primitiveXYIds);
+            },
+            primaryRayPackets(kSceneInfo, boxes, nbBoxes, 1, standardRays));
         break;
     }
-    case ptYZPlane:
+    LOG_INFO(3, "Rendering kernel done");
+    cpu::primitiveComponents().components = 0;
+    wideHierarchy().kernel = 0;
+
+    // --------------------------------------------------------------------------------
+    // Post processing
+    // --------------------------------------------------------------------------------
+    LOG_INFO(3, "Running Post-Processing kernel");
+    switch (m_postProcessingInfo.type)
     {
-        float x = ray.origin.x - primitive.p0.x;
-        if (reverted * ray.origin.x < 0.f && reverted * ray.origin.x > reverted * primitive.p0.x)
-        {
-            intersection.x = primitive.p0.x;
-            intersection.y = ray.origin.y + x * ray.direction.y / -ray.direction.x;
-            intersection.z = ray.origin.z + x * ray.direction.z / -ray.direction.x;
-            collision = fabs(intersection.y - primitive.p0.y) < primitive.size.y &&
-                        fabs(intersection.z - primitive.p0.z) < primitive.size.z;
-            if (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f)
-            {
-                // Chessboard like Lights
-                collision &= int(fabs(intersection.z)) % 4000 < 2000 && int(fabs(intersection.y)) % 4000 < 2000;
-            }
-            if (m_hMaterials[primitive.materialId].attributes.z == 2) // Wireframe
-                collision &= wireFrameMapping(intersection.y, intersection.z,
-                                              m_hMaterials[primitive.materialId].attributes.w, primitive);
-        }
-        if (!collision && reverted * ray.origin.x > 0.f && reverted * ray.origin.x < reverted * primitive.p0.x)
-        {
-            normal.x = -normal.x;
-            normal.y = -normal.y;
-            normal.z = -normal.z;
-            intersection.x = primitive.p0.x;
-            intersection.y = ray.origin.y + x * ray.direction.y / -ray.direction.x;
-            intersection.z = ray.origin.z + x * ray.direction.z / -ray.direction.x;
-            collision = fabs(intersection.y - primitive.p0.y) < primitive.size.y &&
-                        fabs(intersection.z - primitive.p0.z) < primitive.size.z;
-            if (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f)
-            {
-                // Chessboard like Lights
-                collision &= int(fabs(intersection.z)) % 4000 < 2000 && int(fabs(intersection.y)) % 4000 < 2000;
-            }
-            if (m_hMaterials[primitive.materialId].attributes.z == 2) // Wireframe
-                collision &= wireFrameMapping(intersection.y, intersection.z,
-                                              m_hMaterials[primitive.materialId].attributes.w, primitive);
-        }
-        break;
-    }
-    case ptXYPlane:
-    case ptCamera:
-    {
-        float z = ray.origin.z - primitive.p0.z;
-        if (reverted * ray.origin.z < 0.f && reverted * ray.origin.z > reverted * primitive.p0.z)
-        {
-            intersection.z = primitive.p0.z;
-            intersection.x = ray.origin.x + z * ray.direction.x / -ray.direction.z;
-            intersection.y = ray.origin.y + z * ray.direction.y / -ray.direction.z;
-            collision = fabs(intersection.x - primitive.p0.x) < primitive.size.x &&
-                        fabs(intersection.y - primitive.p0.y) < primitive.size.y;
-            if (m_hMaterials[primitive.materialId].attributes.z == 2) // Wireframe
-                collision &= wireFrameMapping(intersection.x, intersection.y,
-                                              m_hMaterials[primitive.materialId].attributes.w, primitive);
-        }
-        if (!collision && reverted * ray.origin.z > 0.f && reverted * ray.origin.z < reverted * primitive.p0.z)
-        {
-            normal.x = -normal.x;
-            normal.y = -normal.y;
-            normal.z = -normal.z;
-            intersection.z = primitive.p0.z;
-            intersection.x = ray.origin.x + z * ray.direction.x / -ray.direction.z;
-            intersection.y = ray.origin.y + z * ray.direction.y / -ray.direction.z;
-            collision = fabs(intersection.x - primitive.p0.x) < primitive.size.x &&
-                        fabs(intersection.y - primitive.p0.y) < primitive.size.y;
-            if (m_hMaterials[primitive.materialId].attributes.z == 2) // Wireframe
-                collision &= wireFrameMapping(intersection.x, intersection.y,
-                                              m_hMaterials[primitive.materialId].attributes.w, primitive);
-        }
-        break;
-    }
-    }
-
-    if (collision)
-    {
-        // Shadow intensity
-        shadowIntensity = 1.f; // m_sceneInfo.shadowIntensity*(1.f-m_hMaterials[primitive.materialId].transparency);
-
-        FLOAT4 color = m_hMaterials[primitive.materialId].color;
-        if (primitive.type == ptCamera || m_hMaterials[primitive.materialId].textureMapping.z != TEXTURE_NONE)
-        {
-            color = cubeMapping(primitive, intersection);
-            shadowIntensity = color.w;
-        }
-
-        if ((color.x + color.y + color.z) / 3.f >= m_sceneInfo.transparentColor)
-        {
-            collision = false;
-        }
-    }
-    return collision;
-}
-
-/*
-________________________________________________________________________________
-
-Triangle intersection
-________________________________________________________________________________
-*/
-bool CPUKernel::triangleIntersection(const Primitive &triangle, const Ray &ray, Vertex &intersection, Vertex &normal,
-                                     Vertex &areas, float &shadowIntensity, bool &back)
-{
-    back = false;
-    // Reject rays using the barycentric coordinates of
-    // the intersection point with respect to T.
-    Vertex E01 = {triangle.p1.x - triangle.p0.x, triangle.p1.y - triangle.p0.y, triangle.p1.z - triangle.p0.z};
-    Vertex E03 = {triangle.p2.x - triangle.p0.x, triangle.p2.y - triangle.p0.y, triangle.p2.z - triangle.p0.z};
-    Vertex P = crossProduct(ray.direction, E03);
-    float det = dot(E01, P);
-
-    if (fabs(det) < EPSILON)
-        return false;
-
-    Vertex T = {ray.origin.x - triangle.p0.x, ray.origin.y - triangle.p0.y, ray.origin.z - triangle.p0.z};
-    float a = dot(T, P) / det;
-    if (a < 0.f || a > 1.f)
-        return false;
-
-    Vertex Q = crossProduct(T, E01);
-    float b = dot(ray.direction, Q) / det;
-    if (b < 0.f || b > 1.f)
-        return false;
-
-    // Reject rays using the barycentric coordinates of
-    // the intersection point with respect to T′.
-    if ((a + b) > 1.f)
-    {
-        Vertex E23 = {triangle.p0.x - triangle.p1.x, triangle.p0.y - triangle.p1.y, triangle.p0.z - triangle.p1.z};
-        Vertex E21 = {triangle.p1.x - triangle.p1.x, triangle.p1.y - triangle.p1.y, triangle.p1.z - triangle.p1.z};
-        Vertex P_ = crossProduct(ray.direction, E21);
-        float det_ = dot(E23, P_);
-        if (fabs(det_) < EPSILON)
-            return false;
-        Vertex T_ = {ray.origin.x - triangle.p2.x, ray.origin.y - triangle.p2.y, ray.origin.z - triangle.p2.z};
-        float a_ = dot(T_, P_) / det_;
-        if (a_ < 0.f)
-            return false;
-        Vertex Q_ = crossProduct(T_, E23);
-        float b_ = dot(ray.direction, Q_) / det_;
-        if (b_ < 0.f)
-            return false;
-    }
-
-    // Compute the ray parameter of the intersection
-    // point.
-    float t = dot(E03, Q) / det;
-    if (t < 0)
-        return false;
-
-    // Intersection
-    intersection.x = ray.origin.x + t * ray.direction.x;
-    intersection.y = ray.origin.y + t * ray.direction.y;
-    intersection.z = ray.origin.z + t * ray.direction.z;
-
-    // Normal
-    normal = triangle.n0;
-    Vertex v0 = {triangle.p0.x - intersection.x, triangle.p0.y - intersection.y, triangle.p0.z - intersection.z};
-    Vertex v1 = {triangle.p1.x - intersection.x, triangle.p1.y - intersection.y, triangle.p1.z - intersection.z};
-    Vertex v2 = {triangle.p2.x - intersection.x, triangle.p2.y - intersection.y, triangle.p2.z - intersection.z};
-
-    areas.x = 0.5f * vectorLength(crossProduct(v1, v2));
-    areas.y = 0.5f * vectorLength(crossProduct(v0, v2));
-    areas.z = 0.5f * vectorLength(crossProduct(v0, v1));
-
-    normal.x =
-        (triangle.n0.x * areas.x + triangle.n1.x * areas.y + triangle.n2.x * areas.z) / (areas.x + areas.y + areas.z);
-    normal.y =
-        (triangle.n0.y * areas.x + triangle.n1.y * areas.y + triangle.n2.y * areas.z) / (areas.x + areas.y + areas.z);
-    normal.z =
-        (triangle.n0.z * areas.x + triangle.n1.z * areas.y + triangle.n2.z * areas.z) / (areas.x + areas.y + areas.z);
-    normal = normalize(normal);
-
-    Vertex dir = normalize(ray.direction);
-    float r = dot(dir, normal);
-
-    if (r > 0.f)
-    {
-        normal.x *= -1.f;
-        normal.y *= -1.f;
-        normal.z *= -1.f;
-    }
-
-    // Shadow management
-    shadowIntensity = 1.f;
-    return true;
-}
-
-/*
-________________________________________________________________________________
-
-Intersections with primitives
-________________________________________________________________________________
-*/
-bool CPUKernel::intersectionWithPrimitives(const Ray &ray, const int &iteration, int &closestPrimitive,
-                                           Vertex &closestIntersection, Vertex &closestNormal, Vertex &closestAreas,
-                                           FLOAT4 &colorBox, bool &back, const int currentMaterialId)
-{
-    bool intersections = false;
-    float minDistance = m_sceneInfo.viewDistance / (iteration + 1);
-
-    Ray r;
-    r.origin = ray.origin;
-    r.direction.x = ray.direction.x - ray.origin.x;
-    r.direction.y = ray.direction.y - ray.origin.y;
-    r.direction.z = ray.direction.z - ray.origin.z;
-    computeRayAttributes(r);
-
-    Vertex intersection = {0.f, 0.f, 0.f};
-    Vertex normal = {0.f, 0.f, 0.f};
-    bool i = false;
-    float shadowIntensity = 0.f;
-
-    int cptBoxes = 0;
-    while (cptBoxes < m_nbActiveBoxes[m_frame])
-    {
-        BoundingBox &box = m_hBoundingBoxes[cptBoxes];
-        if (boxIntersection(box, r, 0.f, minDistance))
-        {
-            // Intersection with Box
-            if (m_sceneInfo.renderBoxes != 0)
-            {
-                colorBox.x += m_hMaterials[box.startIndex % NB_MAX_MATERIALS].color.x / 50.f;
-                colorBox.y += m_hMaterials[box.startIndex % NB_MAX_MATERIALS].color.y / 50.f;
-                colorBox.z += m_hMaterials[box.startIndex % NB_MAX_MATERIALS].color.z / 50.f;
-            }
-            else
-            {
-                // Intersection with primitive within boxes
-                for (int cptPrimitives = 0; cptPrimitives < box.nbPrimitives; ++cptPrimitives)
-                {
-                    Primitive &primitive = m_hPrimitives[box.startIndex + cptPrimitives];
-                    Material &material = m_hMaterials[primitive.materialId];
-                    if (material.attributes.x == 0 ||
-                        (material.attributes.x == 1 && currentMaterialId != primitive.materialId)) // !!!! TEST SHALL BE
-                                                                                                   // REMOVED TO
-                                                                                                   // INCREASE
-                                                                                                   // TRANSPARENCY
-                                                                                                   // QUALITY !!!
-                    {
-                        Vertex areas = {0.f, 0.f, 0.f};
-                        i = false;
-                        switch (primitive.type)
-                        {
-                        case ptEnvironment:
-                        case ptSphere:
-                        {
-                            i = sphereIntersection(primitive, r, intersection, normal, shadowIntensity, back);
-                            break;
-                        }
-                        case ptCylinder:
-                        {
-                            i = cylinderIntersection(primitive, r, intersection, normal, shadowIntensity, back);
-                            break;
-                        }
-                        case ptEllipsoid:
-                        {
-                            i = ellipsoidIntersection(primitive, r, intersection, normal, shadowIntensity, back);
-                            break;
-                        }
-                        case ptTriangle:
-                        {
-                            back = false;
-                            i = triangleIntersection(primitive, r, intersection, normal, areas, shadowIntensity, back);
-                            break;
-                        }
-                        default:
-                        {
-                            back = false;
-                            i = planeIntersection(primitive, r, intersection, normal, shadowIntensity, false);
-                            break;
-                        }
-                        }
-
-                        Vertex d;
-                        d.x = intersection.x - r.origin.x;
-                        d.y = intersection.y - r.origin.y;
-                        d.z = intersection.z - r.origin.z;
-                        float distance = vectorLength(d);
-                        if (i && distance > EPSILON && distance < minDistance)
-                        {
-                            // Only keep intersection with the closest object
-                            minDistance = distance;
-                            closestPrimitive = box.startIndex + cptPrimitives;
-                            closestIntersection = intersection;
-                            closestNormal = normal;
-                            closestAreas = areas;
-                            intersections = true;
-                        }
-                    }
-                }
-            }
-            ++cptBoxes;
-        }
-        else
-        {
-            cptBoxes += box.indexForNextBox.x;
-        }
-    }
-    return intersections;
-}
-
-/*
-________________________________________________________________________________
-
-Convert Vertex into OpenGL RGB color
-________________________________________________________________________________
-*/
-void CPUKernel::makeColor(FLOAT4 &color, int index)
-{
-    int mdc_index = index * gColorDepth;
-    color.x = (color.x > 1.f) ? 1.f : color.x;
-    color.y = (color.y > 1.f) ? 1.f : color.y;
-    color.z = (color.z > 1.f) ? 1.f : color.z;
-
-    switch (m_sceneInfo.misc.x)
-    {
-    case otOpenGL:
-    {
-        // OpenGL
-        m_bitmap[mdc_index] = (char)(color.x * 255.f);     // Red
-        m_bitmap[mdc_index + 1] = (char)(color.y * 255.f); // Green
-        m_bitmap[mdc_index + 2] = (char)(color.z * 255.f); // Blue
-        break;
-    }
-    case otDelphi:
-    {
-        // Delphi
-        m_bitmap[mdc_index] = (char)(color.z * 255.f);     // Blue
-        m_bitmap[mdc_index + 1] = (char)(color.y * 255.f); // Green
-        m_bitmap[mdc_index + 2] = (char)(color.x * 255.f); // Red
-        break;
-    }
-    case otJPEG:
-    {
-        mdc_index = (m_sceneInfo.size.x * m_sceneInfo.size.y - index) * gColorDepth;
-        // JPEG
-        m_bitmap[mdc_index + 2] = (char)(color.z * 255.f); // Blue
-        m_bitmap[mdc_index + 1] = (char)(color.y * 255.f); // Green
-        m_bitmap[mdc_index] = (char)(color.x * 255.f);     // Red
-        break;
-    }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Shadows computation
-We do not consider the object from which the ray is launched...
-This object cannot shadow itself !
-
-We now have to find the intersection between the considered object and the ray
-which m_viewPos is the considered 3D Vertex and which direction is defined by
-the
-light source center.
-.
-. * Lamp                     Ray = m_viewPos -> Light Source Center
-.  \
-.   \##
-.   #### object
-.    ##
-.      \
-.       \  m_viewPos
-.--------O-------
-.
-@return 1.f when pixel is in the shades
-
-________________________________________________________________________________
-*/
-float CPUKernel::processShadows(const Vertex &lampCenter, const Vertex &m_viewPos, const int &objectId,
-                                const int &iteration, FLOAT4 &color)
-{
-    float result = 0.f;
-    int cptBoxes = 0;
-    color.x = 0.f;
-    color.y = 0.f;
-    color.z = 0.f;
-    int it = -1;
-    Ray r;
-    r.origin = m_viewPos;
-    r.direction.x = lampCenter.x - m_viewPos.x;
-    r.direction.y = lampCenter.y - m_viewPos.y;
-    r.direction.z = lampCenter.z - m_viewPos.z;
-    computeRayAttributes(r);
-
-    while (result < m_sceneInfo.shadowIntensity && cptBoxes < m_nbActiveBoxes[m_frame])
-    {
-        BoundingBox &box = m_hBoundingBoxes[cptBoxes];
-        if (boxIntersection(box, r, 0.f, m_sceneInfo.viewDistance))
-        {
-            int cptPrimitives = 0;
-            while (result < m_sceneInfo.shadowIntensity && cptPrimitives < box.nbPrimitives)
-            {
-                Vertex intersection = {0.f, 0.f, 0.f};
-                Vertex normal = {0.f, 0.f, 0.f};
-                Vertex areas = {0.f, 0.f, 0.f};
-                float shadowIntensity = 0.f;
-
-                Primitive &primitive = m_hPrimitives[box.startIndex + cptPrimitives];
-                if (primitive.index != objectId && m_hMaterials[primitive.materialId].attributes.x == 0)
-                {
-                    bool hit = false;
-                    bool back;
-                    switch (primitive.type)
-                    {
-                    case ptSphere:
-                        hit = sphereIntersection(primitive, r, intersection, normal, shadowIntensity, back);
-                        break;
-                    case ptEllipsoid:
-                        hit = ellipsoidIntersection(primitive, r, intersection, normal, shadowIntensity, back);
-                        break;
-                    case ptCylinder:
-                        hit = cylinderIntersection(primitive, r, intersection, normal, shadowIntensity, back);
-                        break;
-                    case ptTriangle:
-                        hit = triangleIntersection(primitive, r, intersection, normal, areas, shadowIntensity, back);
-                        break;
-                    case ptCamera:
-                        hit = false;
-                        break;
-                    default:
-                        hit = planeIntersection(primitive, r, intersection, normal, shadowIntensity, false);
-                        break;
-                    }
-
-                    if (hit)
-                    {
-                        Vertex O_I;
-                        O_I.x = intersection.x - r.origin.x;
-                        O_I.y = intersection.y - r.origin.y;
-                        O_I.z = intersection.z - r.origin.z;
-
-                        Vertex O_L;
-                        O_L.x = r.direction.x;
-                        O_L.y = r.direction.y;
-                        O_L.z = r.direction.z;
-
-                        float l = vectorLength(O_I);
-                        if (l > EPSILON && l < vectorLength(O_L))
-                        {
-                            float ratio = shadowIntensity * m_sceneInfo.shadowIntensity;
-                            if (m_hMaterials[primitive.materialId].transparency != 0.f)
-                            {
-                                O_L = normalize(O_L);
-                                float a = fabs(dot(O_L, normal));
-                                float r = (m_hMaterials[primitive.materialId].transparency == 0.f)
-                                              ? 1.f
-                                              : (1.f - 0.8f * m_hMaterials[primitive.materialId].transparency);
-                                ratio *= r * a;
-                                // Shadow color
-                                color.x += ratio * (0.3f - 0.3f * m_hMaterials[primitive.materialId].color.x);
-                                color.y += ratio * (0.3f - 0.3f * m_hMaterials[primitive.materialId].color.y);
-                                color.z += ratio * (0.3f - 0.3f * m_hMaterials[primitive.materialId].color.z);
-                            }
-                            result += ratio;
-                        }
-                        it++;
-                    }
-                }
-                cptPrimitives++;
-            }
-        }
-        cptBoxes++;
-    }
-    result = (result > m_sceneInfo.shadowIntensity) ? m_sceneInfo.shadowIntensity : result;
-    result = (result < 0.f) ? 0.f : result;
-    return result;
-}
-
-/*
-________________________________________________________________________________
-
-Intersection Shader
-________________________________________________________________________________
-*/
-FLOAT4 CPUKernel::intersectionShader(const Primitive &primitive, const Vertex &intersection, const Vertex &areas)
-{
-    FLOAT4 colorAtIntersection = m_hMaterials[primitive.materialId].color;
-    colorAtIntersection.w = 0.f; // w attribute is used to dtermine light intensity of the material
-
-    switch (primitive.type)
-    {
-    case ptCylinder:
-    {
-        if (m_hMaterials[primitive.materialId].textureMapping.z != TEXTURE_NONE)
-        {
-            colorAtIntersection = sphereUVMapping(primitive, intersection);
-        }
+    case ppe_depthOfField:
+        runKernel([&]() {
+            cpu::k_depthOfField(occupancy, kSceneInfo, kPostProcessingInfo, postProcessingBuffer, bitmap);
+        });
         break;
-    }
-    case ptEnvironment:
-    case ptSphere:
-    case ptEllipsoid:
-    {
-        if (m_hMaterials[primitive.materialId].textureMapping.z != TEXTURE_NONE)
-        {
-            colorAtIntersection = sphereUVMapping(primitive, intersection);
-        }
+    case ppe_ambientOcclusion:
+        runKernel([&]() {
+            cpu::k_ambientOcclusion(occupancy, kSceneInfo, kPostProcessingInfo, postProcessingBuffer, bitmap);
+        });
         break;
-    }
-    case ptCheckboard:
-    {
-        if (m_hMaterials[primitive.materialId].textureMapping.z != TEXTURE_NONE)
-        {
-            colorAtIntersection = cubeMapping(primitive, intersection);
-        }
-        else
-        {
-            int x = static_cast<int>(m_sceneInfo.viewDistance + ((intersection.x - primitive.p0.x) / primitive.size.x));
-            int z = static_cast<int>(m_sceneInfo.viewDistance + ((intersection.z - primitive.p0.z) / primitive.size.x));
-            if (x % 2 == 0)
-            {
-                if (z % 2 == 0)
-                {
-                    colorAtIntersection.x = 1.f - colorAtIntersection.x;
-                    colorAtIntersection.y = 1.f - colorAtIntersection.y;
-                    colorAtIntersection.z = 1.f - colorAtIntersection.z;
-                }
-            }
-            else
-            {
-                if (z % 2 != 0)
-                {
-                    colorAtIntersection.x = 1.f - colorAtIntersection.x;
-                    colorAtIntersection.y = 1.f - colorAtIntersection.y;
-                    colorAtIntersection.z = 1.f - colorAtIntersection.z;
-                }
-            }
-        }
+    case ppe_radiosity:
+        runKernel([&]() {
+            cpu::k_radiosity(occupancy, kSceneInfo, kPostProcessingInfo, primitiveXYIds, postProcessingBuffer, bitmap);
+        });
         break;
-    }
-    case ptXYPlane:
-    case ptYZPlane:
-    case ptXZPlane:
-    case ptCamera:
-    {
-        if (m_hMaterials[primitive.materialId].textureMapping.z != TEXTURE_NONE)
-        {
-            colorAtIntersection = cubeMapping(primitive, intersection);
-        }
+    case ppe_filter:
+        runKernel([&]() {
+            cpu::k_filter(occupancy, kSceneInfo, kPostProcessingInfo, postProcessingBuffer, bitmap);
+        });
         break;
-    }
-    case ptTriangle:
-    {
-        if (m_hMaterials[primitive.materialId].textureMapping.z != TEXTURE_NONE)
-        {
-            colorAtIntersection = triangleUVMapping(primitive, intersection, areas);
-        }
+    default:
+        runKernel([&]() { cpu::k_default(occupancy, kSceneInfo, postProcessingBuffer, bitmap); });
         break;
     }
-    }
-    return colorAtIntersection;
+    LOG_INFO(3, "Post-Processing Kernel done");
+    m_refresh = (m_sceneInfo.pathTracingIteration < m_sceneInfo.maxPathTracingIterations);
 }
 
-/*
-________________________________________________________________________________
-
-Primitive shader
-________________________________________________________________________________
-*/
-FLOAT4 CPUKernel::primitiveShader(const Vertex &m_viewPos, const Vertex &normal, const int &objectId,
-                                  const Vertex &intersection, const Vertex &areas, const int &iteration,
-                                  FLOAT4 &refractionFromColor, float &shadowIntensity, FLOAT4 &totalBlinn,
-                                  LightInformation *pathTracingInformation, const int pathTracingInformationSize,
-                                  const bool isLightRay)
+void CPUKernel::render_end()
 {
-    Primitive primitive = m_hPrimitives[objectId];
-    FLOAT4 color = m_hMaterials[primitive.materialId].color;
-    FLOAT4 lampsColor = {0.f, 0.f, 0.f, 0.f};
-
-    // Lamp Impact
-    shadowIntensity = 0.f;
+    if (m_sceneInfo.frameBufferType != 0)
+        return;
 
-    if (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f ||
-        m_hMaterials[primitive.materialId].attributes.z == 2)
-    {
-        // Wireframe returns constant color
-        return color;
-    }
-
-    if (m_hMaterials[primitive.materialId].attributes.z == 1)
-    {
-        // Sky box returns color with constant lightning
-        return intersectionShader(primitive, intersection, areas);
-    }
-
-    if (m_sceneInfo.graphicsLevel > 0)
-    {
-        color.x *= m_hMaterials[primitive.materialId].innerIllumination.x;
-        color.y *= m_hMaterials[primitive.materialId].innerIllumination.x;
-        color.z *= m_hMaterials[primitive.materialId].innerIllumination.x;
-
-        bool processStdLigths(pathTracingInformationSize == 0);
-        // if( !processStdLigths ) LOG_INFO(1,"pathTracingInformationSize=" <<
-        // pathTracingInformationSize << " (" << pathTracingInformation[0].color.x
-        // << "," << pathTracingInformation[0].color.y << "," <<
-        // pathTracingInformation[0].color.z);
-
-        int nbLamps = processStdLigths ? m_lightInformationSize : pathTracingInformationSize;
-
-        for (int cpt = 0; cpt < nbLamps; ++cpt)
-        {
-            int cptLamp = cpt;
-            LightInformation &li = (processStdLigths ? m_lightInformation[cptLamp] : pathTracingInformation[cptLamp]);
-
-            if (li.attribute.x != primitive.index)
-            {
-                Vertex center = li.location;
-
-                // randomize lamp center
-                if (li.attribute.x >= 0 && li.attribute.x < m_nbActivePrimitives[m_frame])
-                {
-                    Primitive &lamp = m_hPrimitives[li.attribute.x];
-                    int t = 3 * m_sceneInfo.misc.y;
-                    t = t % (m_sceneInfo.size.x * m_sceneInfo.size.y - 3);
-                    center.x += m_hMaterials[lamp.materialId].innerIllumination.y * m_hRandoms[t] *
-                                m_sceneInfo.pathTracingIteration / float(m_sceneInfo.maxPathTracingIterations);
-                    center.y += m_hMaterials[lamp.materialId].innerIllumination.y * m_hRandoms[t + 1] *
-                                m_sceneInfo.pathTracingIteration / float(m_sceneInfo.maxPathTracingIterations);
-                    center.z += m_hMaterials[lamp.materialId].innerIllumination.y * m_hRandoms[t + 2] *
-                                m_sceneInfo.pathTracingIteration / float(m_sceneInfo.maxPathTracingIterations);
-                }
-
-                FLOAT4 shadowColor = {0.f, 0.f, 0.f, 0.f};
-                if (m_sceneInfo.graphicsLevel > 3 && iteration < 4 &&
-                    m_hMaterials[primitive.materialId].innerIllumination.x == 0.f)
-                {
-                    shadowIntensity = processShadows(center, intersection, li.attribute.x, iteration, shadowColor);
-                }
-
-                if (m_sceneInfo.graphicsLevel > 0)
-                {
-                    Vertex lightRay;
-                    lightRay.x = center.x - intersection.x;
-                    lightRay.y = center.y - intersection.y;
-                    lightRay.z = center.z - intersection.z;
-
-                    lightRay = normalize(lightRay);
-                    // --------------------------------------------------------------------------------
-                    // Lambert
-                    // --------------------------------------------------------------------------------
-                    float lambert = (m_postProcessingInfo.type == ppe_ambientOcclusion) ? 0.6f : dot(normal, lightRay);
-                    // Transparent m_hMaterials are lighted on both sides but the amount
-                    // of light received by the "dark side"
-                    // depends on the transparency rate.
-                    lambert *= (lambert < 0.f) ? -m_hMaterials[primitive.materialId].transparency : lambert;
-                    lambert *= li.color.w;
-                    lambert *= (1.f - shadowIntensity);
-
-                    // Lighted object, not in the shades
-                    lampsColor.x += lambert * li.color.x * li.color.w - shadowColor.x;
-                    lampsColor.y += lambert * li.color.y * li.color.w - shadowColor.y;
-                    lampsColor.z += lambert * li.color.z * li.color.w - shadowColor.z;
-
-                    if (m_sceneInfo.graphicsLevel > 1 && shadowIntensity < m_sceneInfo.shadowIntensity)
-                    {
-                        // --------------------------------------------------------------------------------
-                        // Blinn - Phong
-                        // --------------------------------------------------------------------------------
-                        Vertex viewRay;
-                        viewRay.x = intersection.x - m_viewPos.x;
-                        viewRay.y = intersection.y - m_viewPos.y;
-                        viewRay.z = intersection.z - m_viewPos.z;
-                        viewRay = normalize(viewRay);
-
-                        Vertex blinnDir;
-                        blinnDir.x = lightRay.x - viewRay.x;
-                        blinnDir.y = lightRay.y - viewRay.y;
-                        blinnDir.z = lightRay.z - viewRay.z;
-
-                        float temp = sqrt(dot(blinnDir, blinnDir));
-                        if (temp != 0.f)
-                        {
-                            // Specular reflection
-                            blinnDir.x = (1.f / temp) * blinnDir.x;
-                            blinnDir.y = (1.f / temp) * blinnDir.y;
-                            blinnDir.z = (1.f / temp) * blinnDir.z;
-
-                            float blinnTerm = dot(blinnDir, normal);
-                            blinnTerm = (blinnTerm < 0.f) ? 0.f : blinnTerm;
-
-                            blinnTerm = m_hMaterials[primitive.materialId].specular.x *
-                                        pow(blinnTerm, m_hMaterials[primitive.materialId].specular.y);
-
-                            totalBlinn.x += li.color.x * li.color.w * blinnTerm;
-                            totalBlinn.y += li.color.y * li.color.w * blinnTerm;
-                            totalBlinn.z += li.color.z * li.color.w * blinnTerm;
-                        }
-                    }
-                }
-            }
-
-            // Final color
-            FLOAT4 intersectionColor = intersectionShader(primitive, intersection, areas);
-
-            // Light impact on material
-            color.x += intersectionColor.x * lampsColor.x;
-            color.y += intersectionColor.y * lampsColor.y;
-            color.z += intersectionColor.z * lampsColor.z;
-
-            // Saturate color
-            saturateVector(color);
-
-            refractionFromColor = intersectionColor; // Refraction depending on color;
-            saturateVector(totalBlinn);
-        }
-    }
-    return color;
-}
-
-/*
-________________________________________________________________________________
+    ::glEnable(GL_TEXTURE_2D);
+    ::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    ::glTexImage2D(GL_TEXTURE_2D, 0, gColorDepth, m_sceneInfo.size.x, m_sceneInfo.size.y, 0, GL_RGB, GL_UNSIGNED_BYTE,
+                   m_bitmap);
 
-Calculate the reflected vector
-
-^ Normal to object surface (N)
-Reflection (O_R)  |
-\ |  Eye (O_E)
-\| /
-----------------O--------------- Object surface
-closestIntersection
-
-==============================================================================
-colours
-------------------------------------------------------------------------------
-We now have to know the colour of this intersection
-Color_from_object will compute the amount of light received by the
-intersection Vertex and  will also compute the shadows.
-The resulted color is stored in result.
-The first parameter is the closest object to the intersection (following
-the ray). It can  be considered as a light source if its inner light rate
-is > 0.
-________________________________________________________________________________
-*/
-FLOAT4 CPUKernel::launchRay(const Ray &ray, Vertex &intersection, float &depthOfField, INT4 &primitiveXYId,
-                            LightInformation *pathTracingInformation, int &pathTracingInformationSize, bool isLightRay)
-{
-    FLOAT4 intersectionColor = {0.f, 0.f, 0.f, 0.f};
-
-    Vertex closestIntersection = {0.f, 0.f, 0.f};
-    Vertex normal = {0.f, 0.f, 0.f};
-    int closestPrimitive = 0;
-    bool carryon = true;
-    Ray rayOrigin = ray;
-    float initialRefraction = 1.f;
-    int iteration = 0;
-    primitiveXYId.x = -1;
-    int currentMaterialId = -2;
-
-    // TODO
-    float colorContributions[NB_MAX_ITERATIONS];
-    FLOAT4 colors[NB_MAX_ITERATIONS];
-    memset(&colorContributions[0], 0, sizeof(float) * NB_MAX_ITERATIONS);
-    memset(&colors[0], 0, sizeof(FLOAT4) * NB_MAX_ITERATIONS);
-
-    FLOAT4 recursiveBlinn = {0.f, 0.f, 0.f, 0.f};
-
-    // Variable declarations
-    float shadowIntensity = 0.f;
-    FLOAT4 refractionFromColor;
-    Vertex reflectedTarget;
-    FLOAT4 colorBox = {0.f, 0.f, 0.f, 0.f};
-    bool back = false;
-
-#ifdef PHOTON_ENERGY
-    // Photon energy
-    float photonDistance = m_sceneInfo.viewDistance;
-    float previousTransparency = 1.f;
-#endif // PHOTON_ENERGY
-
-    // Reflected rays
-    int reflectedRays = -1;
-    Ray reflectedRay;
-    float reflectedRatio;
-
-    FLOAT4 rBlinn = {0.f, 0.f, 0.f, 0.f};
-    int currentMaxIteration =
-        (m_sceneInfo.graphicsLevel < 3) ? 1 : m_sceneInfo.nbRayIterations + m_sceneInfo.pathTracingIteration;
-    currentMaxIteration = (currentMaxIteration > NB_MAX_ITERATIONS) ? NB_MAX_ITERATIONS : currentMaxIteration;
-
-#ifdef PHOTON_ENERGY
-    while (iteration < currentMaxIteration && carryon && photonDistance > 0.f)
-#else
-    while (iteration < currentMaxIteration && carryon)
-#endif // PHOTON_ENERGY
+    if (m_sceneInfo.cameraType == ctVR)
     {
-        Vertex areas = {0.f, 0.f, 0.f};
-        // If no intersection with lamps detected. Now compute intersection with
-        // Primitives
-        if (carryon)
-        {
-            carryon = intersectionWithPrimitives(rayOrigin, iteration, closestPrimitive, closestIntersection, normal,
-                                                 areas, colorBox, back, currentMaterialId);
-        }
+        float step = 0.1f;
+        float halfStep = 1.f;
+        float scale = 2.f;
 
-        if (carryon)
+        for (int a(0); a < 2; ++a)
         {
-            currentMaterialId = m_hPrimitives[closestPrimitive].materialId;
-
-            if (iteration == 0)
-            {
-                colors[iteration].x = 0.f;
-                colors[iteration].y = 0.f;
-                colors[iteration].z = 0.f;
-                colors[iteration].w = 0.f;
-                colorContributions[iteration] = 1.f;
-
-                intersection = closestIntersection;
-                primitiveXYId.x = m_hPrimitives[closestPrimitive].index;
-            }
-
-#ifdef PHOTON_ENERGY
-            // Photon
-            Vertex d;
-            d.x = closestIntersection.x - rayOrigin.origin.x;
-            d.y = closestIntersection.y - rayOrigin.origin.y;
-            d.z = closestIntersection.z - rayOrigin.origin.z;
-            photonDistance -= vectorLength(d) * (2.f - previousTransparency);
-            previousTransparency = back ? 1.f : m_hMaterials[m_hPrimitives[closestPrimitive].materialId].transparency;
-#endif // PHOTON_ENERGY
-
-            // Get object color
-            colors[iteration] = primitiveShader(rayOrigin.origin, normal, closestPrimitive, closestIntersection, areas,
-                                                iteration, refractionFromColor, shadowIntensity, rBlinn,
-                                                pathTracingInformation, pathTracingInformationSize, isLightRay);
-
-            if (isLightRay)
-            {
-                // Accumulate Path tracing information
-                pathTracingInformation[iteration].location = closestIntersection;
-                pathTracingInformation[iteration].attribute.x = closestPrimitive;
-                pathTracingInformation[iteration].color = colors[iteration];
-                pathTracingInformation[iteration].color.w = 1.f;
-                // LOG_INFO(1,"CI[" << iteration << "]=" <<
-                // pathTracingInformation[iteration].color.x << "," <<
-                // pathTracingInformation[iteration].color.y << "," <<
-                // pathTracingInformation[iteration].color.z << "," <<
-                // pathTracingInformation[iteration].color.w);
-            }
-
-            // ----------
-            // Refraction
-            // ----------
+            vec2f center = make_vec2f((a == 0) ? -0.5f : 0.5f, 0.f);
+            float b = (a == 0) ? 0.f : 0.5f;
 
-            if (m_hMaterials[m_hPrimitives[closestPrimitive].materialId].transparency != 0.f)
+            for (float x(0); x < 1; x += step)
             {
-                // Replace the normal using the intersection color
-                // r,g,b become x,y,z... What the fuck!!
-                if (m_hMaterials[m_hPrimitives[closestPrimitive].materialId].textureMapping.z != TEXTURE_NONE)
+                for (float y(0); y < 1; y += step)
                 {
-                    normal.x *= (colors[iteration].x - 0.5f);
-                    normal.y *= (colors[iteration].y - 0.5f);
-                    normal.z *= (colors[iteration].z - 0.5f);
-                }
-
-                // Back of the object? If so, reset refraction to 1.f (air)
-                float refraction = back ? 1.f : m_hMaterials[m_hPrimitives[closestPrimitive].materialId].refraction;
+                    const vec2f p0 = make_vec2f(scale * x - halfStep, scale * y - halfStep);
+                    const vec2f p1 = make_vec2f(scale * (x + step) - halfStep, scale * y - halfStep);
+                    const vec2f p2 = make_vec2f(scale * (x + step) - halfStep, scale * (y + step) - halfStep);
+                    const vec2f p3 = make_vec2f(scale * x - halfStep, scale * (y + step) - halfStep);
 
-                // Actual refraction
-                Vertex O_E;
-                O_E.x = rayOrigin.origin.x - closestIntersection.x;
-                O_E.y = rayOrigin.origin.y - closestIntersection.y;
-                O_E.z = rayOrigin.origin.z - closestIntersection.z;
-                O_E = normalize(O_E);
-                vectorRefraction(rayOrigin.direction, O_E, refraction, normal, initialRefraction);
+                    const float d0 = 1.f - (p0.x * p0.x + p0.y * p0.y) * m_distortion;
+                    const float d1 = 1.f - (p1.x * p1.x + p1.y * p1.y) * m_distortion;
+                    const float d2 = 1.f - (p2.x * p2.x + p2.y * p2.y) * m_distortion;
+                    const float d3 = 1.f - (p3.x * p3.x + p3.y * p3.y) * m_distortion;
 
-                reflectedTarget.x = closestIntersection.x - rayOrigin.direction.x;
-                reflectedTarget.y = closestIntersection.y - rayOrigin.direction.y;
-                reflectedTarget.z = closestIntersection.z - rayOrigin.direction.z;
+                    ::glBegin(GL_QUADS);
+                    ::glTexCoord2f(1.f - (b + (x / 2.f)), y);
+                    ::glVertex3f(center.x + 0.5f * p0.x * d0, center.y + p0.y * d0, 0.f);
 
-                colorContributions[iteration] = m_hMaterials[m_hPrimitives[closestPrimitive].materialId].transparency;
+                    ::glTexCoord2f(1.f - (b + (x + step) / 2.f), y);
+                    ::glVertex3f(center.x + 0.5f * p1.x * d1, center.y + p1.y * d1, 0.f);
 
-                // Prepare next ray
-                initialRefraction = refraction;
+                    ::glTexCoord2f(1.f - (b + (x + step) / 2.f), y + step);
+                    ::glVertex3f(center.x + 0.5f * p2.x * d2, center.y + p2.y * d2, 0.f);
 
-                if (reflectedRays == -1 && m_hMaterials[m_hPrimitives[closestPrimitive].materialId].reflection != 0.f)
-                {
-                    vectorReflection(reflectedRay.direction, O_E, normal);
-                    Vertex rt;
-                    rt.x = closestIntersection.x - reflectedRay.direction.x;
-                    rt.y = closestIntersection.y - reflectedRay.direction.y;
-                    rt.z = closestIntersection.z - reflectedRay.direction.z;
-
-                    reflectedRay.origin.x = closestIntersection.x + rt.x * 0.00001f;
-                    reflectedRay.origin.y = closestIntersection.y + rt.y * 0.00001f;
-                    reflectedRay.origin.z = closestIntersection.z + rt.z * 0.00001f;
-
-                    reflectedRay.direction = rt;
-                    reflectedRatio = m_hMaterials[m_hPrimitives[closestPrimitive].materialId].reflection;
-                    reflectedRays = iteration;
-                }
-            }
-            else
-            {
-                // ----------
-                // Reflection
-                // ----------
-                if (m_hMaterials[m_hPrimitives[closestPrimitive].materialId].reflection != 0.f)
-                {
-                    Vertex O_E;
-                    O_E.x = rayOrigin.origin.x - closestIntersection.x;
-                    O_E.y = rayOrigin.origin.y - closestIntersection.y;
-                    O_E.z = rayOrigin.origin.z - closestIntersection.z;
-                    vectorReflection(rayOrigin.direction, O_E, normal);
-
-                    reflectedTarget.x = closestIntersection.x - rayOrigin.direction.x;
-                    reflectedTarget.y = closestIntersection.y - rayOrigin.direction.y;
-                    reflectedTarget.z = closestIntersection.z - rayOrigin.direction.z;
-                    colorContributions[iteration] = m_hMaterials[m_hPrimitives[closestPrimitive].materialId].reflection;
-                }
-                else
-                {
-                    colorContributions[iteration] = 1.f;
-                    carryon = false;
+                    ::glTexCoord2f(1.f - (b + (x / 2.f)), y + step);
+                    ::glVertex3f(center.x + 0.5f * p3.x * d3, center.y + p3.y * d3, 0.f);
+                    ::glEnd();
                 }
             }
-
-            // Contribute to final color
-            recursiveBlinn.x += rBlinn.x;
-            recursiveBlinn.y += rBlinn.y;
-            recursiveBlinn.z += rBlinn.z;
-
-            rayOrigin.origin.x = closestIntersection.x + reflectedTarget.x * 0.00001f;
-            rayOrigin.origin.y = closestIntersection.y + reflectedTarget.y * 0.00001f;
-            rayOrigin.origin.z = closestIntersection.z + reflectedTarget.z * 0.00001f;
-            rayOrigin.direction = reflectedTarget;
-
-            // Noise management
-            if (m_sceneInfo.pathTracingIteration != 0 &&
-                m_hMaterials[m_hPrimitives[closestPrimitive].materialId].color.w != 0.f)
-            {
-                // Randomize view
-                float ratio = m_hMaterials[m_hPrimitives[closestPrimitive].materialId].color.w;
-                ratio *= (m_hMaterials[m_hPrimitives[closestPrimitive].materialId].transparency == 0.f) ? 1000.f : 1.f;
-                int rindex = 3 * m_sceneInfo.misc.y + m_sceneInfo.pathTracingIteration;
-                rindex = rindex % (m_sceneInfo.size.x * m_sceneInfo.size.y);
-                rayOrigin.direction.x += m_hRandoms[rindex] * ratio;
-                rayOrigin.direction.y += m_hRandoms[rindex + 1] * ratio;
-                rayOrigin.direction.z += m_hRandoms[rindex + 2] * ratio;
-            }
         }
-        else
-        {
-#ifdef GRADIANT_BACKGROUND
-            // Background
-            Vertex normal = {0.f, 1.f, 0.f};
-            Vertex dir;
-            dir.x = rayOrigin.direction.x - rayOrigin.origin.x;
-            dir.y = rayOrigin.direction.y - rayOrigin.origin.y;
-            dir.z = rayOrigin.direction.z - rayOrigin.origin.z;
-            dir = normalize(dir);
-            float angle = 0.5f * fabs(dot(normal, dir));
-            angle = (angle > 1.f) ? 1.f : angle;
-            colors[iteration].x = (1.f - angle) * m_sceneInfo.backgroundColor.x;
-            colors[iteration].y = (1.f - angle) * m_sceneInfo.backgroundColor.y;
-            colors[iteration].z = (1.f - angle) * m_sceneInfo.backgroundColor.z;
-#else
-            colors[iteration] = m_sceneInfo.backgroundColor;
-#endif // GRADIANT_BACKGROUND
-            colorContributions[iteration] = 1.f;
-        }
-        ++iteration;
-    }
-
-    if (isLightRay)
-    {
-        pathTracingInformationSize = iteration;
     }
-
-    if (m_sceneInfo.graphicsLevel >= 3 && reflectedRays != -1) // TODO: Draft mode should only test
-                                                               // "m_sceneInfo.pathTracingIteration==iteration"
+    else
     {
-        Vertex areas = {0.f, 0.f, 0.f};
-        // TODO: Dodgy implementation
-        if (intersectionWithPrimitives(reflectedRay, reflectedRays, closestPrimitive, closestIntersection, normal,
-                                       areas, colorBox, back, currentMaterialId))
-        {
-            FLOAT4 color = primitiveShader(reflectedRay.origin, normal, closestPrimitive, closestIntersection, areas,
-                                           reflectedRays, refractionFromColor, shadowIntensity, rBlinn,
-                                           pathTracingInformation, pathTracingInformationSize, isLightRay);
-
-            colors[reflectedRays].x += color.x * reflectedRatio;
-            colors[reflectedRays].y += color.y * reflectedRatio;
-            colors[reflectedRays].z += color.z * reflectedRatio;
-        }
-    }
+        ::glBegin(GL_QUADS);
+        ::glTexCoord2f(1.f, 0.f);
+        ::glVertex3f(-1.f, -1.f, 0.f);
 
-    if (!isLightRay)
-    {
-        for (int i = iteration - 2; i >= 0; --i)
-        {
-            colors[i].x = colors[i].x * (1.f - colorContributions[i]) + colors[i + 1].x * colorContributions[i];
-            colors[i].y = colors[i].y * (1.f - colorContributions[i]) + colors[i + 1].y * colorContributions[i];
-            colors[i].z = colors[i].z * (1.f - colorContributions[i]) + colors[i + 1].z * colorContributions[i];
-        }
-        intersectionColor = colors[0];
-        intersectionColor.x += recursiveBlinn.x;
-        intersectionColor.y += recursiveBlinn.y;
-        intersectionColor.z += recursiveBlinn.z;
-
-        intersection = closestIntersection;
-
-        Primitive &primitive = m_hPrimitives[closestPrimitive];
-        Vertex l;
-        l.x = intersection.x - ray.origin.x;
-        l.y = intersection.y - ray.origin.y;
-        l.z = intersection.z - ray.origin.z;
-        float len = vectorLength(l);
-        if (m_hMaterials[primitive.materialId].attributes.z == 0) // Wireframe
-        {
-#ifdef PHOTON_ENERGY
-            // --------------------------------------------------
-            // Photon energy
-            // --------------------------------------------------
-            intersectionColor.x *= (photonDistance > 0.f) ? (photonDistance / m_sceneInfo.viewDistance) : 0.f;
-            intersectionColor.y *= (photonDistance > 0.f) ? (photonDistance / m_sceneInfo.viewDistance) : 0.f;
-            intersectionColor.z *= (photonDistance > 0.f) ? (photonDistance / m_sceneInfo.viewDistance) : 0.f;
-#endif // PHOTON_ENERGY
-
-            // --------------------------------------------------
-            // Fog
-            // --------------------------------------------------
-            // intersectionColor += m_hRandoms[((int)len + m_sceneInfo.misc.y)%100];
-
-            // --------------------------------------------------
-            // Background color
-            // --------------------------------------------------
-            float D1 = m_sceneInfo.viewDistance * 0.95f;
-            if (m_sceneInfo.misc.z == 1 && len > D1)
-            {
-                float D2 = m_sceneInfo.viewDistance * 0.05f;
-                float a = len - D1;
-                float b = 1.f - (a / D2);
-                intersectionColor.x = intersectionColor.x * b + m_sceneInfo.backgroundColor.x * (1.f - b);
-                intersectionColor.y = intersectionColor.y * b + m_sceneInfo.backgroundColor.y * (1.f - b);
-                intersectionColor.z = intersectionColor.z * b + m_sceneInfo.backgroundColor.z * (1.f - b);
-            }
-        }
-        depthOfField = (len - depthOfField) / m_sceneInfo.viewDistance;
+        ::glTexCoord2f(0.f, 0.f);
+        ::glVertex3f(1.f, -1.f, 0.f);
 
-        // Primitive information
-        primitiveXYId.y = iteration;
+        ::glTexCoord2f(0.f, 1.f);
+        ::glVertex3f(1.f, 1.f, 0.f);
 
-        // Depth of field
-        intersectionColor.x -= colorBox.x;
-        intersectionColor.y -= colorBox.y;
-        intersectionColor.z -= colorBox.z;
-        saturateVector(intersectionColor);
+        ::glTexCoord2f(1.f, 1.f);
+        ::glVertex3f(-1.f, 1.f, 0.f);
+        ::glEnd();
     }
-
-    return intersectionColor;
+    ::glDisable(GL_TEXTURE_2D);
 }
 
-/*
-________________________________________________________________________________
-
-Standard renderer
-________________________________________________________________________________
-*/
-void CPUKernel::k_standardRenderer()
+int CPUKernel::getNbActivePixels()
 {
-    int x;
-    Vertex intersection;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y = 0; y < m_sceneInfo.size.y; ++y)
-        {
-            int index = y * m_sceneInfo.size.x + x;
-
-            float dof = m_postProcessingInfo.param1;
-
-            LightInformation pathTracingInformation[NB_MAX_ITERATIONS];
-            int pathTracingInformationSize(0);
-
-            Ray ray;
-            ray.origin = m_viewPos;
-            ray.direction = m_viewDir;
-
-            Vertex rotationCenter = {0.f, 0.f, 0.f};
-            bool antialiasingActivated = (m_sceneInfo.misc.w == 2);
-            bool pathTracing(m_sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS &&
-                             m_sceneInfo.pathTracingIteration % 2 == 0);
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-            {
-                m_postProcessingBuffer[index].x = 0.f;
-                m_postProcessingBuffer[index].y = 0.f;
-                m_postProcessingBuffer[index].z = 0.f;
-                m_postProcessingBuffer[index].w = 0.f;
-            }
-            else
-            {
-                if (pathTracing)
-                {
-                    Ray lightRay;
-                    lightRay.origin = m_lightInformation[0].location;
-                    lightRay.direction = lightRay.origin;
-
-                    int rindex = 3 * (index + m_sceneInfo.pathTracingIteration + m_sceneInfo.misc.y);
-                    rindex = rindex % (m_sceneInfo.size.x * m_sceneInfo.size.y - 3);
-                    lightRay.direction.x += 1000.f * m_hRandoms[rindex] * m_postProcessingInfo.param1;
-                    lightRay.direction.y += 1000.f * m_hRandoms[rindex + 1] * m_postProcessingInfo.param1;
-                    lightRay.direction.z += 1000.f * m_hRandoms[rindex + 2] * m_postProcessingInfo.param1;
-
-                    // Launch light ray
-                    launchRay(lightRay, intersection, dof, m_hPrimitivesXYIds[index], pathTracingInformation,
-                              pathTracingInformationSize, true);
-                }
-
-                /*
-                // Path Tracing
-                int rindex = 3*(index+m_sceneInfo.misc.y) + 5000;
-                          rindex = rindex%(m_sceneInfo.size.x*m_sceneInfo.size.y-3);
-                  ray.origin.x += m_hRandoms[rindex
-                ]*m_postProcessingBuffer[index].w*m_postProcessingInfo.param1;
-                  ray.origin.y +=
-                m_hRandoms[rindex+1]*m_postProcessingBuffer[index].w*m_postProcessingInfo.param1;
-                  ray.origin.z +=
-                m_hRandoms[rindex+2]*m_postProcessingBuffer[index].w*m_postProcessingInfo.param1;
-
-                rindex = 3*(index+m_sceneInfo.misc.y);
-                          rindex = rindex%(m_sceneInfo.size.x*m_sceneInfo.size.y-3);
-                  ray.direction.x += m_hRandoms[rindex
-                ]*m_postProcessingBuffer[index].w*m_postProcessingInfo.param1;
-                  ray.direction.y +=
-                m_hRandoms[rindex+1]*m_postProcessingBuffer[index].w*m_postProcessingInfo.param1;
-                  ray.direction.z +=
-                m_hRandoms[rindex+2]*m_postProcessingBuffer[index].w*m_postProcessingInfo.param1;
-                */
-            }
-
-            if (!pathTracing)
-            {
-                if (m_sceneInfo.misc.w == 1) // Isometric 3D
-                {
-                    ray.direction.x = ray.origin.z * 0.001f * (float)(x - (m_sceneInfo.size.x / 2));
-                    ray.direction.y = -ray.origin.z * 0.001f * (float)(y - (m_sceneInfo.size.y / 2));
-                    ray.origin.x = ray.direction.x;
-                    ray.origin.y = ray.direction.y;
-                }
-                else
-                {
-                    float ratio = (float)m_sceneInfo.size.x / (float)m_sceneInfo.size.y;
-                    FLOAT2 step;
-                    step.x = ratio * 6400.f / (float)m_sceneInfo.size.x;
-                    step.y = 6400.f / (float)m_sceneInfo.size.y;
-                    ray.direction.x = ray.direction.x - step.x * (float)(x - (m_sceneInfo.size.x / 2));
-                    ray.direction.y = ray.direction.y + step.y * (float)(y - (m_sceneInfo.size.y / 2));
-                }
-                vectorRotation(ray.origin, rotationCenter, m_angles);
-                vectorRotation(ray.direction, rotationCenter, m_angles);
-            }
-
-            // Antialisazing
-            FLOAT2 AArotatedGrid[4] = {{3.f, 5.f}, {5.f, -3.f}, {-3.f, -5.f}, {-5.f, 3.f}};
-
-            if (m_sceneInfo.pathTracingIteration > m_hPrimitivesXYIds[index].y &&
-                m_sceneInfo.pathTracingIteration > 0 && m_sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-                break;
-
-            FLOAT4 color = {0.f, 0.f, 0.f, 0.f};
-            if (antialiasingActivated)
-            {
-                Ray r = ray;
-                for (int I = 0; I < 4; ++I)
-                {
-                    r.direction.x = ray.origin.x + AArotatedGrid[I].x;
-                    r.direction.y = ray.origin.y + AArotatedGrid[I].y;
-                    FLOAT4 c = launchRay(r, intersection, dof, m_hPrimitivesXYIds[index], pathTracingInformation,
-                                         pathTracingInformationSize);
-                    color.x += c.x;
-                    color.y += c.y;
-                    color.z += c.z;
-                }
-            }
-
-            // Launch Eye Ray
-            FLOAT4 c = launchRay(ray, intersection, dof, m_hPrimitivesXYIds[index], pathTracingInformation,
-                                 pathTracingInformationSize);
-
-            color.x += c.x;
-            color.y += c.y;
-            color.z += c.z;
-
-            if (antialiasingActivated)
-            {
-                color.x /= 5.f;
-                color.y /= 5.f;
-                color.z /= 5.f;
-            }
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-            {
-                m_postProcessingBuffer[index].w = dof;
-            }
-
-            if (m_sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-            {
-                m_postProcessingBuffer[index].x = color.x;
-                m_postProcessingBuffer[index].y = color.y;
-                m_postProcessingBuffer[index].z = color.z;
-            }
-            else
-            {
-                m_postProcessingBuffer[index].x += color.x;
-                m_postProcessingBuffer[index].y += color.y;
-                m_postProcessingBuffer[index].z += color.z;
-            }
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Standard renderer
-________________________________________________________________________________
-*/
-void CPUKernel::k_fishEyeRenderer()
-{
-    int x;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y = 0; y < m_sceneInfo.size.y; ++y)
-        {
-            FLOAT4 color = {0.f, 0.f, 0.f, 0.f};
-            int index = y * m_sceneInfo.size.x + x;
-            Ray ray;
-            ray.origin = m_viewPos;
-            ray.direction = m_viewDir;
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-            {
-                m_postProcessingBuffer[index].x = 0.f;
-                m_postProcessingBuffer[index].y = 0.f;
-                m_postProcessingBuffer[index].z = 0.f;
-                m_postProcessingBuffer[index].w = 0.f;
-            }
-            else
-            {
-                int rindex = 3 * (index + m_sceneInfo.misc.y) + 5000;
-                rindex = rindex % (m_sceneInfo.size.x * m_sceneInfo.size.y - 3);
-                ray.origin.x +=
-                    m_hRandoms[rindex] * m_postProcessingBuffer[index].w *
-                    m_postProcessingInfo
-                        .param1; //*float(sceneInfo.pathTracingIteration)/float(sceneInfo.maxPathTracingIterations);
-                ray.origin.y +=
-                    m_hRandoms[rindex + 1] * m_postProcessingBuffer[index].w *
-                    m_postProcessingInfo
-                        .param1; //*float(sceneInfo.pathTracingIteration)/float(sceneInfo.maxPathTracingIterations);
-                ray.origin.z +=
-                    m_hRandoms[rindex + 2] * m_postProcessingBuffer[index].w *
-                    m_postProcessingInfo
-                        .param1; //*float(sceneInfo.pathTracingIteration)/float(sceneInfo.maxPathTracingIterations);
-
-                rindex = 3 * (index + m_sceneInfo.misc.y);
-                rindex = rindex % (m_sceneInfo.size.x * m_sceneInfo.size.y - 3);
-                ray.direction.x +=
-                    m_hRandoms[rindex] * m_postProcessingBuffer[index].w *
-                    m_postProcessingInfo
-                        .param1; //*float(sceneInfo.pathTracingIteration)/float(sceneInfo.maxPathTracingIterations);
-                ray.direction.y +=
-                    m_hRandoms[rindex + 1] * m_postProcessingBuffer[index].w *
-                    m_postProcessingInfo
-                        .param1; //*float(sceneInfo.pathTracingIteration)/float(sceneInfo.maxPathTracingIterations);
-                ray.direction.z +=
-                    m_hRandoms[rindex + 2] * m_postProcessingBuffer[index].w *
-                    m_postProcessingInfo
-                        .param1; //*float(sceneInfo.pathTracingIteration)/float(sceneInfo.maxPathTracingIterations);
-            }
-
-            float dof = m_postProcessingInfo.param1;
-            Vertex intersection;
-
-            // Normal Y axis
-            FLOAT2 step;
-            step.y = 6400.f / (float)m_sceneInfo.size.y;
-            ray.origin.y = ray.origin.y + step.y * (float)(y - (m_sceneInfo.size.y / 2));
-
-            // 360° X axis
-            step.x = 2.f * PI / static_cast<float>(m_sceneInfo.size.x);
-            step.y = 2.f * PI / static_cast<float>(m_sceneInfo.size.y);
-
-            Vertex fishEyeAngles = {0.f, 0.f, 0.f};
-            fishEyeAngles.y = m_angles.y + step.x * (float)x;
-            // fishEyeAngles.x = m_angles.x + step.y*(float)y;
-
-            vectorRotation(ray.direction, ray.origin, fishEyeAngles);
-
-            // vectorRotation( ray.origin,    rotationCenter, m_angles );
-            // vectorRotation( ray.direction, rotationCenter, m_angles );
-
-            if (m_sceneInfo.pathTracingIteration > m_hPrimitivesXYIds[index].y &&
-                m_sceneInfo.pathTracingIteration > 0 && m_sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-                break;
-
-            LightInformation pathTracingInformation[NB_MAX_ITERATIONS];
-            int pathTracingInformationSize = 0;
-            color = launchRay(ray, intersection, dof, m_hPrimitivesXYIds[index], pathTracingInformation,
-                              pathTracingInformationSize);
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-            {
-                m_postProcessingBuffer[index].w = dof;
-            }
-
-            if (m_sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-            {
-                m_postProcessingBuffer[index].x = color.x;
-                m_postProcessingBuffer[index].y = color.y;
-                m_postProcessingBuffer[index].z = color.z;
-            }
-            else
-            {
-                m_postProcessingBuffer[index].x += color.x;
-                m_postProcessingBuffer[index].y += color.y;
-                m_postProcessingBuffer[index].z += color.z;
-            }
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Anaglyph Renderer
-________________________________________________________________________________
-*/
-void CPUKernel::k_anaglyphRenderer()
-{
-    int x;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y(0); y < m_sceneInfo.size.y; ++y)
-        {
-            int index = y * m_sceneInfo.size.x + x;
-            Vertex rotationCenter = {0.f, 0.f, 0.f};
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-            {
-                m_postProcessingBuffer[index].x = 0.f;
-                m_postProcessingBuffer[index].y = 0.f;
-                m_postProcessingBuffer[index].z = 0.f;
-                m_postProcessingBuffer[index].w = 0.f;
-            }
-
-            float dof = m_postProcessingInfo.param1;
-            Vertex intersection;
-            Ray eyeRay;
-
-            float ratio = (float)m_sceneInfo.size.x / (float)m_sceneInfo.size.y;
-            FLOAT2 step;
-            step.x = 4.f * ratio * 6400.f / (float)m_sceneInfo.size.x;
-            step.y = 4.f * 6400.f / (float)m_sceneInfo.size.y;
-
-            // Left eye
-            eyeRay.origin.x = m_viewPos.x + m_sceneInfo.width3DVision;
-            eyeRay.origin.y = m_viewPos.y;
-            eyeRay.origin.z = m_viewPos.z;
-
-            eyeRay.direction.x = m_viewDir.x - step.x * (float)(x - (m_sceneInfo.size.x / 2));
-            eyeRay.direction.y = m_viewDir.y + step.y * (float)(y - (m_sceneInfo.size.y / 2));
-            eyeRay.direction.z = m_viewDir.z;
-
-            vectorRotation(eyeRay.origin, rotationCenter, m_angles);
-            vectorRotation(eyeRay.direction, rotationCenter, m_angles);
-
-            LightInformation pathTracingInformation[NB_MAX_ITERATIONS];
-            int pathTracingInformationSize = 0;
-            FLOAT4 colorLeft = launchRay(eyeRay, intersection, dof, m_hPrimitivesXYIds[index], pathTracingInformation,
-                                         pathTracingInformationSize);
-
-            // Right eye
-            eyeRay.origin.x = m_viewPos.x - m_sceneInfo.width3DVision;
-            eyeRay.origin.y = m_viewPos.y;
-            eyeRay.origin.z = m_viewPos.z;
-
-            eyeRay.direction.x = m_viewDir.x - step.x * (float)(x - (m_sceneInfo.size.x / 2));
-            eyeRay.direction.y = m_viewDir.y + step.y * (float)(y - (m_sceneInfo.size.y / 2));
-            eyeRay.direction.z = m_viewDir.z;
-
-            vectorRotation(eyeRay.origin, rotationCenter, m_angles);
-            vectorRotation(eyeRay.direction, rotationCenter, m_angles);
-            FLOAT4 colorRight = launchRay(eyeRay, intersection, dof, m_hPrimitivesXYIds[index], pathTracingInformation,
-                                          pathTracingInformationSize);
-
-            float r1 = colorLeft.x * 0.299f + colorLeft.y * 0.587f + colorLeft.z * 0.114f;
-            float b1 = 0.f;
-            float g1 = 0.f;
-
-            float r2 = 0.f;
-            float g2 = colorRight.y;
-            float b2 = colorRight.z;
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-                m_postProcessingBuffer[index].w = dof;
-            if (m_sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-            {
-                m_postProcessingBuffer[index].x = r1 + r2;
-                m_postProcessingBuffer[index].y = g1 + g2;
-                m_postProcessingBuffer[index].z = b1 + b2;
-            }
-            else
-            {
-                m_postProcessingBuffer[index].x += r1 + r2;
-                m_postProcessingBuffer[index].y += g1 + g2;
-                m_postProcessingBuffer[index].z += b1 + b2;
-            }
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-3D Vision Renderer
-________________________________________________________________________________
-*/
-void CPUKernel::k_3DVisionRenderer()
-{
-    int x;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y(0); y < m_sceneInfo.size.y; ++y)
-        {
-            int index = y * m_sceneInfo.size.x + x;
-
-            Vertex rotationCenter = {0.f, 0.f, 0.f};
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-            {
-                m_postProcessingBuffer[index].x = 0.f;
-                m_postProcessingBuffer[index].y = 0.f;
-                m_postProcessingBuffer[index].z = 0.f;
-                m_postProcessingBuffer[index].w = 0.f;
-            }
-
-            float dof = m_postProcessingInfo.param1;
-            Vertex intersection;
-            int halfWidth = m_sceneInfo.size.x / 2;
-
-            float ratio = (float)m_sceneInfo.size.x / (float)m_sceneInfo.size.y;
-            FLOAT2 step;
-            step.x = ratio * 6400.f / (float)m_sceneInfo.size.x;
-            step.y = 6400.f / (float)m_sceneInfo.size.y;
-
-            Ray eyeRay;
-            if (x < halfWidth)
-            {
-                // Left eye
-                eyeRay.origin.x = m_viewPos.x + m_sceneInfo.width3DVision;
-                eyeRay.origin.y = m_viewPos.y;
-                eyeRay.origin.z = m_viewPos.z;
-
-                eyeRay.direction.x = m_viewDir.x - step.x * (float)(x - (m_sceneInfo.size.x / 2) + halfWidth / 2);
-                eyeRay.direction.y = m_viewDir.y + step.y * (float)(y - (m_sceneInfo.size.y / 2));
-                eyeRay.direction.z = m_viewDir.z;
-            }
-            else
-            {
-                // Right eye
-                eyeRay.origin.x = m_viewPos.x - m_sceneInfo.width3DVision;
-                eyeRay.origin.y = m_viewPos.y;
-                eyeRay.origin.z = m_viewPos.z;
-
-                eyeRay.direction.x = m_viewDir.x - step.x * (float)(x - (m_sceneInfo.size.x / 2) - halfWidth / 2);
-                eyeRay.direction.y = m_viewDir.y + step.y * (float)(y - (m_sceneInfo.size.y / 2));
-                eyeRay.direction.z = m_viewDir.z;
-            }
-
-            vectorRotation(eyeRay.origin, rotationCenter, m_angles);
-            vectorRotation(eyeRay.direction, rotationCenter, m_angles);
-
-            LightInformation pathTracingInformation[NB_MAX_ITERATIONS];
-            int pathTracingInformationSize = 0;
-            FLOAT4 color = launchRay(eyeRay, intersection, dof, m_hPrimitivesXYIds[index], pathTracingInformation,
-                                     pathTracingInformationSize);
-
-            if (m_sceneInfo.pathTracingIteration == 0)
-                m_postProcessingBuffer[index].w = dof;
-            if (m_sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-            {
-                m_postProcessingBuffer[index].x = color.x;
-                m_postProcessingBuffer[index].y = color.y;
-                m_postProcessingBuffer[index].z = color.z;
-            }
-            else
-            {
-                m_postProcessingBuffer[index].x += color.x;
-                m_postProcessingBuffer[index].y += color.y;
-                m_postProcessingBuffer[index].z += color.z;
-            }
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Post Processing Effect: Default
-________________________________________________________________________________
-*/
-void CPUKernel::k_default()
-{
-    int x;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y(0); y < m_sceneInfo.size.y; ++y)
-        {
-            int index = y * m_sceneInfo.size.x + x;
-            FLOAT4 localColor = m_postProcessingBuffer[index];
-
-            if (m_sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-            {
-                localColor.x /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-                localColor.y /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-                localColor.z /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-            }
-
-            makeColor(localColor, index);
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Post Processing Effect: Depth of field
-________________________________________________________________________________
-*/
-void CPUKernel::k_depthOfField()
-{
-    int x;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y(0); y < m_sceneInfo.size.y; ++y)
-        {
-            int index = y * m_sceneInfo.size.x + x;
-            float depth = m_postProcessingInfo.param2 * m_postProcessingBuffer[index].w;
-            int wh = m_sceneInfo.size.x * m_sceneInfo.size.y;
-
-            FLOAT4 localColor = {0.f, 0.f, 0.f};
-            for (int i = 0; i < m_postProcessingInfo.param3; ++i)
-            {
-                int ix = i % wh;
-                int iy = (i + m_sceneInfo.size.x) % wh;
-                int xx = x + static_cast<int>(depth * m_hRandoms[ix] * 0.5f);
-                int yy = y + static_cast<int>(depth * m_hRandoms[iy] * 0.5f);
-                if (xx >= 0 && xx < m_sceneInfo.size.x && yy >= 0 && yy < m_sceneInfo.size.y)
-                {
-                    int localIndex = yy * m_sceneInfo.size.x + xx;
-                    if (localIndex >= 0 && localIndex < wh)
-                    {
-                        localColor.x += m_postProcessingBuffer[localIndex].x;
-                        localColor.y += m_postProcessingBuffer[localIndex].y;
-                        localColor.z += m_postProcessingBuffer[localIndex].z;
-                    }
-                }
-                else
-                {
-                    localColor.x += m_postProcessingBuffer[index].x;
-                    localColor.y += m_postProcessingBuffer[index].y;
-                    localColor.z += m_postProcessingBuffer[index].z;
-                }
-            }
-            localColor.x /= m_postProcessingInfo.param3;
-            localColor.y /= m_postProcessingInfo.param3;
-            localColor.z /= m_postProcessingInfo.param3;
-
-            if (m_sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-            {
-                localColor.x /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-                localColor.y /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-                localColor.z /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-            }
-
-            localColor.w = 1.f;
-
-            makeColor(localColor, index);
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Post Processing Effect: Ambiant Occlusion
-________________________________________________________________________________
-*/
-void CPUKernel::k_ambiantOcclusion()
-{
-    int x;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y(0); y < m_sceneInfo.size.y; ++y)
-        {
-            int index = y * m_sceneInfo.size.x + x;
-            float occ = 0.f;
-            FLOAT4 localColor = m_postProcessingBuffer[index];
-            float depth = localColor.w;
-
-            const int step = 16;
-            for (int X = -step; X < step; X += 2)
-            {
-                for (int Y = -step; Y < step; Y += 2)
-                {
-                    int xx = x + X;
-                    int yy = y + Y;
-                    if (xx >= 0 && xx < m_sceneInfo.size.x && yy >= 0 && yy < m_sceneInfo.size.y)
-                    {
-                        int localIndex = yy * m_sceneInfo.size.x + xx;
-                        if (m_postProcessingBuffer[localIndex].w >= depth)
-                        {
-                            occ += 1.f;
-                        }
-                    }
-                    else
-                        occ += 1.f;
-                }
-            }
-            // occ /= float((2*step)*(2*step));
-            occ /= float(step * step);
-            occ += 0.3f; // Ambient light
-            localColor.x *= occ;
-            localColor.y *= occ;
-            localColor.z *= occ;
-
-            if (m_sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-            {
-                localColor.x /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-                localColor.y /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-                localColor.z /= (float)(m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
-            }
-
-            saturateVector(localColor);
-            localColor.w = 1.f;
-
-            makeColor(localColor, index);
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Post Processing Effect: Radiosity
-________________________________________________________________________________
-*/
-void CPUKernel::k_radiosity()
-{
-    int x;
-#pragma omp parallel for
-    for (x = 0; x < m_sceneInfo.size.x; ++x)
-    {
-        for (int y(0); y < m_sceneInfo.size.y; ++y)
-        {
-            int index = y * m_sceneInfo.size.x + x;
-            int wh = m_sceneInfo.size.x * m_sceneInfo.size.y;
-
-            int div = (m_sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-                          ? (m_sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1)
-                          : 1;
-
-            FLOAT4 localColor = {0.f, 0.f, 0.f};
-            for (int i = 0; i < m_postProcessingInfo.param3; ++i)
-            {
-                int ix = (i + m_sceneInfo.pathTracingIteration) % wh;
-                int iy = (i + m_sceneInfo.size.x) % wh;
-                int xx = x + static_cast<int>(m_hRandoms[ix] * m_postProcessingInfo.param2 / 10.f);
-                int yy = y + static_cast<int>(m_hRandoms[iy] * m_postProcessingInfo.param2 / 10.f);
-                localColor.x += m_postProcessingBuffer[index].x;
-                localColor.y += m_postProcessingBuffer[index].y;
-                localColor.z += m_postProcessingBuffer[index].z;
-                if (xx >= 0 && xx < m_sceneInfo.size.x && yy >= 0 && yy < m_sceneInfo.size.y)
-                {
-                    int localIndex = yy * m_sceneInfo.size.x + xx;
-                    localColor.x +=
-                        (localIndex >= 0 && localIndex < wh) ? div * m_hPrimitivesXYIds[localIndex].z / 255 : 0.f;
-                    localColor.y +=
-                        (localIndex >= 0 && localIndex < wh) ? div * m_hPrimitivesXYIds[localIndex].z / 255 : 0.f;
-                    localColor.z +=
-                        (localIndex >= 0 && localIndex < wh) ? div * m_hPrimitivesXYIds[localIndex].z / 255 : 0.f;
-                }
-            }
-            localColor.x /= m_postProcessingInfo.param3;
-            localColor.y /= m_postProcessingInfo.param3;
-            localColor.z /= m_postProcessingInfo.param3;
-
-            localColor.x /= div;
-            localColor.y /= div;
-            localColor.z /= div;
-
-            localColor.w = 1.f;
-
-            makeColor(localColor, index);
-        }
-    }
-}
-
-/*
-________________________________________________________________________________
-
-Post Processing Effect: Radiosity
-________________________________________________________________________________
-*/
-void CPUKernel::k_oneColor()
-{
-}
-/*
-________________________________________________________________________________
-
-Kernel launcher
-________________________________________________________________________________
-*/
-void CPUKernel::render_begin(const float timer)
-{
-    GPUKernel::render_begin(timer);
-    if (m_postProcessingBuffer == 0)
-    {
-        m_postProcessingBuffer = new FLOAT4[m_sceneInfo.size.x * m_sceneInfo.size.y];
-    }
-
-    switch (m_sceneInfo.renderingType)
-    {
-    case vtAnaglyph:
-        k_anaglyphRenderer();
-        break;
-    case vt3DVision:
-        k_3DVisionRenderer();
-        break;
-    case vtFishEye:
-        k_fishEyeRenderer();
-        break;
-    default:
-        k_standardRenderer();
-        break;
-    }
-
-    switch (m_postProcessingInfo.type)
-    {
-    case ppe_depthOfField:
-        k_depthOfField();
-        break;
-    case ppe_ambientOcclusion:
-        k_ambiantOcclusion();
-        break;
-    case ppe_radiosity:
-        k_radiosity();
-        break;
-    case ppe_filter:
-        k_oneColor();
-        break;
-    default:
-        k_default();
-        break;
-    }
-}
-
-void CPUKernel::render_end()
-{
-    if (m_sceneInfo.misc.x == 0)
-    {
-        ::glEnable(GL_TEXTURE_2D);
-        ::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        ::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        ::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        ::glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-        ::glTexImage2D(GL_TEXTURE_2D, 0, 3, m_sceneInfo.size.x, m_sceneInfo.size.y, 0, GL_RGB, GL_UNSIGNED_BYTE,
-                       m_bitmap);
-        ::glBegin(GL_QUADS);
-        ::glTexCoord2f(1.f, 1.f);
-        ::glVertex3f(-1.f, 1.f, 0.f);
-        ::glTexCoord2f(0.f, 1.f);
-        ::glVertex3f(1.f, 1.f, 0.f);
-        ::glTexCoord2f(0.f, 0.f);
-        ::glVertex3f(1.f, -1.f, 0.f);
-        ::glTexCoord2f(1.f, 0.f);
-        ::glVertex3f(-1.f, -1.f, 0.f);
-        ::glEnd();
-        ::glDisable(GL_TEXTURE_2D);
-    }
+    const int nbPixels = m_sceneInfo.size.x * m_sceneInfo.size.y;
+    int nbActivePixels = 0;
+    for (int i = 0; i < nbPixels; ++i)
+        if (m_postProcessingBuffer[i].sceneInfo.y == 0.f)
+            ++nbActivePixels;
+    return nbActivePixels;
 }
 }
@@ -22,89 +22,86 @@
 
 #include "../GPUKernel.h"
 
+#include <vector>
+
 namespace solr
 {
+/*
+________________________________________________________________________________
+
+CPU engine. Runs the kernels of the OpenCL engine, compiled as C++, on the host
+buffers of GPUKernel. Frames are split into square tiles, distributed across
+OpenMP threads. Each thread owns a queue of tiles, and steals tiles from the
+queues of other threads once its own is empty. Tiles that were the most
+expensive during the previous pass are rendered first. Primary rays of neighbouring
+pixels are traced together through the bounding boxes, in SIMD packets. Other
+rays traverse a wide hierarchy, all children of a node being tested at once.
+Primitives of the leaves reached by a ray are first tested in SIMD blocks, and
+only the ones the ray may hit go through the intersection functions of the
+kernels.
+With adaptive sampling, pixels that converged are left out of the tiles
+________________________________________________________________________________
+*/
 class SOLR_API CPUKernel : public GPUKernel
 {
 public:
     CPUKernel();
-    ~CPUKernel(void);
+    ~CPUKernel();
+
+    virtual void initBuffers();
+
+    virtual void setPlatformId(const int) {}
+    virtual void setDeviceId(const int) {}
+    virtual void setKernelFilename(const std::string &) {}
+
+public:
+    // ---------- Devices ----------
+    virtual void queryDevice();
+    virtual void recompileKernels() {}
 
 public:
     // ---------- Rendering ----------
     void render_begin(const float timer);
     void render_end();
+    int getNbActivePixels();
 
-protected:
-    // Vectors
-    void saturateVector(FLOAT4 &v);
-    Vertex crossProduct(const Vertex &b, const Vertex &c);
-    float vectorLength(const Vertex &v);
-    float dot(const Vertex &v1, const Vertex &v2);
-    Vertex normalize(const Vertex &v);
-    void vectorReflection(Vertex &r, const Vertex &i, const Vertex &n);
-    void vectorRefraction(Vertex &refracted, const Vertex incident, const float n1, const Vertex normal,
-                          const float n2);
-    void vectorRotation(Vertex &v, const Vertex &rotationCenter, const Vertex &angles);
-
-protected:
-    void computeRayAttributes(Ray &ray);
-
-    // Texture mapping
-    void juliaSet(const Primitive &primitive, const float x, const float y, FLOAT4 &color);
-    void mandelbrotSet(const Primitive &primitive, const float x, const float y, FLOAT4 &color);
-    FLOAT4 sphereUVMapping(const Primitive &primitive, const Vertex &intersection);
-    FLOAT4 triangleUVMapping(const Primitive &primitive, const Vertex &intersection, const Vertex &areas);
-    FLOAT4 cubeMapping(const Primitive &primitive, const Vertex &intersection);
-    bool wireFrameMapping(float x, float y, int width, const Primitive &primitive);
-
-protected:
-    // Intersections
-    bool boxIntersection(const BoundingBox &box, const Ray &ray, const float &t0, const float &t1);
-    bool ellipsoidIntersection(const Primitive &ellipsoid, const Ray &ray, Vertex &intersection, Vertex &normal,
-                               float &shadowIntensity, bool &back);
-    bool sphereIntersection(const Primitive &sphere, const Ray &ray, Vertex &intersection, Vertex &normal,
-                            float &shadowIntensity, bool &back);
-    bool cylinderIntersection(const Primitive &cylinder, const Ray &ray, Vertex &intersection, Vertex &normal,
-                              float &shadowIntensity, bool &back);
-    bool planeIntersection(const Primitive &primitive, const Ray &ray, Vertex &intersection, Vertex &normal,
-                           float &shadowIntensity, bool reverse);
-    bool triangleIntersection(const Primitive &triangle, const Ray &ray, Vertex &intersection, Vertex &normal,
-                              Vertex &areas, float &shadowIntensity, bool &back);
-    bool intersectionWithPrimitives(const Ray &ray, const int &iteration, int &closestPrimitive,
-                                    Vertex &closestIntersection, Vertex &closestNormal, Vertex &closestAreas,
-                                    FLOAT4 &colorBox, bool &back, const int currentMaterialId);
+public:
+    virtual std::string getGPUDescription();
 
-protected:
-    // Color management
-    void makeColor(FLOAT4 &color, int index);
-    float processShadows(const Vertex &lampCenter, const Vertex &origin, const int &objectId, const int &iteration,
-                         FLOAT4 &color);
-    FLOAT4 intersectionShader(const Primitive &primitive, const Vertex &intersection, const Vertex &areas);
-    FLOAT4 primitiveShader(const Vertex &origin, const Vertex &normal, const int &objectId, const Vertex &intersection,
-                           const Vertex &areas, const int &iteration, FLOAT4 &refractionFromColor,
-                           float &shadowIntensity, FLOAT4 &totalBlinn, LightInformation *pathTracingInformation,
-                           const int pathTracingInformationSize, const bool isLightRay);
+public:
+    // ---------- Scheduling ----------
+    void setTileSize(const int tileSize) { m_tileSize = tileSize; }
+    int getTileSize() const { return m_tileSize; }
+    // 0 uses all available threads
+    void setNbThreads(const int nbThreads) { m_nbThreads = nbThreads; }
+    int getNbThreads() const { return m_nbThreads; }
+    // Number of primary rays traced together. Defaults to the width of the
+    // widest SIMD instruction set of the processor, 0 disables packets
+    void setPacketWidth(const int packetWidth) { m_packetWidth = packetWidth; }
+    int getPacketWidth() const { return m_packetWidth; }
+    // Rays that are not traced in packets traverse the wide hierarchy
+    // collapsed from the boxes, instead of walking the boxes one by one
+    void setWideBVH(const bool wideBVH) { m_wideBVH = wideBVH; }
+    bool getWideBVH() const { return m_wideBVH; }
 
-protected:
-    // Rays
-    FLOAT4 launchRay(const Ray &ray, Vertex &intersection, float &depthOfField, INT4 &primitiveXYId,
-                     LightInformation *pathTracingInformation, int &pathTracingInformationSize,
-                     const bool lightRay = false);
+private:
+    template <typename Kernel>
+    void runKernel(const Kernel &kernel);
+    template <typename Kernel, typename Packets>
+    void runKernel(const Kernel &kernel, const Packets &packets);
 
-protected:
-    // Post processing
-    void k_standardRenderer();
-    void k_fishEyeRenderer();
-    void k_anaglyphRenderer();
-    void k_3DVisionRenderer();
-    void k_depthOfField();
-    void k_ambiantOcclusion();
-    void k_radiosity();
-    void k_oneColor();
-    void k_default();
+    int m_tileSize;
+    int m_nbThreads;
+    int m_packetWidth;
+    bool m_wideBVH;
 
-private:
-    FLOAT4 *m_postProcessingBuffer;
+    // Textures concatenated at the offsets computed by
+    // realignTexturesAndMaterials, as they are on devices
+    std::vector<BitmapBuffer> m_textures;
+    std::vector<PostProcessingBuffer> m_postProcessingBuffer;
+    // Geometry of the primitives, stored by component
+    std::vector<float> m_primitiveComponents;
+    // Render time of each tile during the previous pass, in milliseconds
+    std::vector<float> m_tileCosts;
 };
 }
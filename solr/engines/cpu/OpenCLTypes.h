@@ -0,0 +1,353 @@
+/* Copyright (c) 2011-2014, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+// OpenCL C types and built-in functions used by RayTracer.cl, so that the
+// kernels can be compiled as C++ by the CPU engine. Vector types have the
+// layout of their OpenCL counterparts, float3 and int3 occupying 16 bytes, so
+// that the buffers of GPUKernel can be used as they are transfered to devices
+
+#include <cmath>
+#include <cstddef>
+
+#define __kernel
+#define __global
+#define __local
+#define __constant const
+#define __private
+
+namespace solr
+{
+namespace cpu
+{
+typedef unsigned char uchar;
+typedef unsigned short ushort;
+typedef unsigned int uint;
+
+struct alignas(8) float2
+{
+    float x, y;
+};
+
+struct alignas(16) float3
+{
+    float x, y, z, w;
+};
+
+// Anonymous structures in unions are supported by all the compilers used to
+// build Sol-R, and give float4 its .xyz swizzle
+union alignas(16) float4 {
+    struct
+    {
+        float x, y, z, w;
+    };
+    float3 xyz;
+};
+
+struct alignas(8) int2
+{
+    int x, y;
+};
+
+struct alignas(16) int3
+{
+    int x, y, z, w;
+};
+
+struct alignas(16) int4
+{
+    int x, y, z, w;
+};
+
+inline float4 make_float4(const float x, const float y, const float z, const float w)
+{
+    float4 v = {{x, y, z, w}};
+    return v;
+}
+
+// Component-wise operators. The w component of float3 is padding, and is
+// carried along like the other ones
+#define SOLR_CPU_VECTOR_OPERATORS(T)                                                                     \
+    inline T operator+(T a, const T &b) { a.x += b.x; a.y += b.y; a.z += b.z; a.w += b.w; return a; }     \
+    inline T operator-(T a, const T &b) { a.x -= b.x; a.y -= b.y; a.z -= b.z; a.w -= b.w; return a; }     \
+    inline T operator*(T a, const T &b) { a.x *= b.x; a.y *= b.y; a.z *= b.z; a.w *= b.w; return a; }     \
+    inline T operator/(T a, const T &b) { a.x /= b.x; a.y /= b.y; a.z /= b.z; a.w /= b.w; return a; }     \
+    inline T operator*(T a, const float b) { a.x *= b; a.y *= b; a.z *= b; a.w *= b; return a; }          \
+    inline T operator*(const float a, T b) { return b * a; }                                              \
+    inline T operator/(T a, const float b) { a.x /= b; a.y /= b; a.z /= b; a.w /= b; return a; }          \
+    inline T operator-(T a) { a.x = -a.x; a.y = -a.y; a.z = -a.z; a.w = -a.w; return a; }                 \
+    inline T &operator+=(T &a, const T &b) { return a = a + b; }                                          \
+    inline T &operator-=(T &a, const T &b) { return a = a - b; }                                          \
+    inline T &operator*=(T &a, const T &b) { return a = a * b; }                                          \
+    inline T &operator*=(T &a, const float b) { return a = a * b; }                                       \
+    inline T &operator/=(T &a, const float b) { return a = a / b; }
+
+SOLR_CPU_VECTOR_OPERATORS(float3)
+SOLR_CPU_VECTOR_OPERATORS(float4)
+#undef SOLR_CPU_VECTOR_OPERATORS
+
+inline float2 operator+(float2 a, const float2 &b)
+{
+    a.x += b.x;
+    a.y += b.y;
+    return a;
+}
+
+inline float2 operator*(float2 a, const float b)
+{
+    a.x *= b;
+    a.y *= b;
+    return a;
+}
+
+inline float2 operator/(float2 a, const float b)
+{
+    a.x /= b;
+    a.y /= b;
+    return a;
+}
+
+// Scalar functions, in single precision like their OpenCL counterparts
+inline float fabs(const float a) { return std::fabs(a); }
+inline float sqrt(const float a) { return std::sqrt(a); }
+inline float pow(const float a, const float b) { return std::pow(a, b); }
+inline float sin(const float a) { return std::sin(a); }
+inline float cos(const float a) { return std::cos(a); }
+inline float asin(const float a) { return std::asin(a); }
+inline float atan2(const float a, const float b) { return std::atan2(a, b); }
+inline float half_sin(const float a) { return std::sin(a); }
+inline float half_cos(const float a) { return std::cos(a); }
+inline float min(const float a, const float b) { return (b < a) ? b : a; }
+inline float max(const float a, const float b) { return (a < b) ? b : a; }
+inline int min(const int a, const int b) { return (b < a) ? b : a; }
+inline int max(const int a, const int b) { return (a < b) ? b : a; }
+
+// Geometric functions. float4 ones include the w component, as in OpenCL
+inline float dot(const float3 &a, const float3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline float dot(const float4 &a, const float4 &b) { return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w; }
+inline float length(const float3 &a) { return std::sqrt(dot(a, a)); }
+inline float length(const float4 &a) { return std::sqrt(dot(a, a)); }
+
+template <typename T>
+inline T normalize(const T &a)
+{
+    const float l = length(a);
+    return (l == 0.f) ? a : a / l;
+}
+
+inline float3 cross(const float3 &a, const float3 &b)
+{
+    const float3 r = {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x, 0.f};
+    return r;
+}
+
+inline float4 cross(const float4 &a, const float4 &b)
+{
+    return make_float4(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x, 0.f);
+}
+
+// Work-item of the running kernel, set by the CPU engine before each call
+inline size_t &globalId(const unsigned int dimension)
+{
+    static thread_local size_t ids[2] = {0, 0};
+    return ids[dimension];
+}
+
+inline size_t get_global_id(const unsigned int dimension)
+{
+    return globalId(dimension);
+}
+
+// Primary rays of neighbouring pixels, traced in a packet by the CPU engine
+// before running the kernels. Leaves reached by rays of the packet are listed
+// in traversal order, with a mask of these rays. Primitives of the leaves are
+// tested against all the rays of the packet, each one getting the mask of the
+// rays that may hit it, from the first candidate of its leaf
+const int MAX_PACKET_RAYS = 16;
+
+struct PacketBox
+{
+    float4 corners[2];
+    int startIndex;
+    int nbPrimitives;
+    unsigned int mask;
+    int firstCandidate;
+};
+
+struct RayPacket
+{
+    int nbRays;
+    float4 origins[MAX_PACKET_RAYS];
+    float4 directions[MAX_PACKET_RAYS];
+    const PacketBox *boxes;
+    int nbBoxes;
+    const unsigned int *candidates;
+    // Rays of pixel p of the packet are in [pixelRays[p], pixelRays[p + 1]),
+    // pixel being the one the kernel is rendering
+    int pixelRays[MAX_PACKET_RAYS + 1];
+    int pixel;
+};
+
+inline RayPacket &currentPacket()
+{
+    static thread_local RayPacket packet;
+    return packet;
+}
+
+// Ray of the current packet with the given origin and direction, -1 if the
+// ray was not traced in the packet. Only the rays of the pixel being rendered
+// are compared
+inline int packetRay(const float4 &origin, const float4 &direction)
+{
+    const RayPacket &packet = currentPacket();
+    if (packet.nbRays == 0)
+        return -1;
+    for (int i = packet.pixelRays[packet.pixel]; i < packet.pixelRays[packet.pixel + 1]; ++i)
+        if (packet.origins[i].x == origin.x && packet.origins[i].y == origin.y &&
+            packet.origins[i].z == origin.z && packet.directions[i].x == direction.x &&
+            packet.directions[i].y == direction.y && packet.directions[i].z == direction.z)
+            return i;
+    return -1;
+}
+
+// Next leaf reached by the given ray of the packet, false once they have all
+// been visited. The cursor keeps track of the position in the list of leaves
+template <typename BoundingBox>
+inline bool packetLeaf(const int ray, int *cursor, BoundingBox *box)
+{
+    const RayPacket &packet = currentPacket();
+    while (*cursor < packet.nbBoxes && ((packet.boxes[*cursor].mask >> ray) & 1) == 0)
+        ++(*cursor);
+    if (*cursor == packet.nbBoxes)
+        return false;
+
+    const PacketBox &leaf = packet.boxes[(*cursor)++];
+    (*box).parameters[0] = leaf.corners[0];
+    (*box).parameters[1] = leaf.corners[1];
+    (*box).startIndex = leaf.startIndex;
+    (*box).nbPrimitives = leaf.nbPrimitives;
+    (*box).indexForNextBox.x = 1;
+    (*box).indexForNextBox.y = 0;
+    return true;
+}
+
+// Primitives of the last leaf returned by packetLeaf that the given ray of the
+// packet may hit, one bit per primitive from the given one of the leaf
+inline unsigned int packetCandidates(const int ray, const int cursor, const int first, const int count)
+{
+    const RayPacket &packet = currentPacket();
+    const unsigned int *masks = packet.candidates + packet.boxes[cursor - 1].firstCandidate + first;
+    unsigned int candidates = 0;
+    for (int i = 0; i < count; ++i)
+        candidates |= ((masks[i] >> ray) & 1u) << i;
+    return candidates;
+}
+
+// Leaves of the wide hierarchy hit by a ray, in front-to-back order, for the
+// rays that are not traced in packets. A thread runs one such traversal at a
+// time, since kernels do not nest them. Defined by the CPU engine, once the
+// types of the kernels are known
+template <typename Ray>
+bool wideRay(const Ray *ray);
+template <typename BoundingBox>
+bool wideLeaf(const float tmax, BoundingBox *box);
+
+// Geometry of the primitives stored by component, for the CPU engine to test
+// several primitives of a leaf against a ray at once. Component c of primitive
+// i is at c * stride + i, components being padded for the last primitives to
+// be tested in full blocks
+enum PrimitiveComponent
+{
+    pcType,
+    pcP0x,
+    pcP0y,
+    pcP0z,
+    pcP0w,
+    pcP1x,
+    pcP1y,
+    pcP1z,
+    pcP2x,
+    pcP2y,
+    pcP2z,
+    pcN1x,
+    pcN1y,
+    pcN1z,
+    pcSizeX,
+    pcSizeY,
+    pcCount
+};
+
+struct PrimitiveComponents
+{
+    const float *components;
+    int stride;
+};
+
+inline PrimitiveComponents &primitiveComponents()
+{
+    static PrimitiveComponents components = {0, 0};
+    return components;
+}
+
+// Defined by the CPU engine, once the types of the kernels are known
+template <typename SceneInfo, typename Ray>
+unsigned int primitiveCandidates(const SceneInfo *sceneInfo, const Ray *ray, const int first, const int count,
+                                 const bool shadows);
+
+// Last primitive found to occlude each lamp, per thread. Lamps share the
+// entries of the cache modulo its size, and entries of previous frames are
+// ignored, primitives having possibly changed since
+const int OCCLUDER_CACHE_SIZE = 256;
+
+struct CachedOccluder
+{
+    int frame;
+    int lamp;
+    int primitive;
+};
+
+inline int &occluderFrame()
+{
+    static int frame = 1;
+    return frame;
+}
+
+inline CachedOccluder &occluderEntry(const int lamp)
+{
+    static thread_local CachedOccluder entries[OCCLUDER_CACHE_SIZE];
+    return entries[lamp % OCCLUDER_CACHE_SIZE];
+}
+
+inline int cachedOccluder(const int lamp)
+{
+    const CachedOccluder &entry = occluderEntry(lamp);
+    return (entry.frame == occluderFrame() && entry.lamp == lamp) ? entry.primitive : -1;
+}
+
+inline void cacheOccluder(const int lamp, const int primitive)
+{
+    CachedOccluder &entry = occluderEntry(lamp);
+    entry.frame = occluderFrame();
+    entry.lamp = lamp;
+    entry.primitive = primitive;
+}
+}
+}
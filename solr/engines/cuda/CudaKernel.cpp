@@ -142,6 +142,7 @@ void CudaKernel::initializeDevice()
 #endif
                      );
     reshape_scene(m_occupancyParameters, m_sceneInfo);
+    m_randoms.clear();
 }
 
 void CudaKernel::resetBoxesAndPrimitives()
@@ -198,18 +199,25 @@ void CudaKernel::render_begin(const float timer)
         {
             LOG_INFO(3, "Transfering " << nbBoxes << " boxes, " << nbPrimitives << " primitives and " << nbLamps
                                        << " lamps");
-            h2d_scene(m_occupancyParameters, m_hBoundingBoxes, nbBoxes, m_hPrimitives, nbPrimitives, m_hLamps, nbLamps);
+            h2d_scene(m_occupancyParameters, m_hBoundingBoxes, nbBoxes, m_hPrimitives, nbPrimitives,
+                      m_hLamps.empty() ? 0 : &m_hLamps[0], nbLamps);
 
-            LOG_INFO(3, "Transfering " << m_lightInformationSize << " light elements");
-            h2d_lightInformation(m_occupancyParameters, m_lightInformation, m_lightInformationSize);
+            const int nbLightInformation = static_cast<int>(m_lightInformation.size());
+            LOG_INFO(3, "Transfering " << nbLightInformation << " light elements");
+            h2d_lightInformation(m_occupancyParameters, m_lightInformation.empty() ? 0 : &m_lightInformation[0],
+                                 nbLightInformation);
             m_primitivesTransfered = true;
         }
 
-        if (!m_randomsTransfered)
+        // CUDA kernels draw their random numbers from a buffer, refreshed every 50 iterations
+        if (m_randoms.empty() || m_sceneInfo.pathTracingIteration % 50 == 1)
         {
-            h2d_randoms(m_occupancyParameters, m_hRandoms);
+            m_randoms.resize(MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT);
+            srand(static_cast<int>(time(0)));
+            for (size_t i = 0; i < m_randoms.size(); ++i)
+                m_randoms[i] = 0.000005f * (rand() % 2000 - 1000);
+            h2d_randoms(m_occupancyParameters, &m_randoms[0]);
             LOG_INFO(3, "Transfering random numbers");
-            m_randomsTransfered = true;
         }
 
         if (!m_materialsTransfered)
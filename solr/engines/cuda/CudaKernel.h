@@ -39,6 +39,8 @@ public:
     virtual void setDeviceId(const int) {}
     virtual void setKernelFilename(const std::string&) {}
     virtual void recompileKernels() {}
+    // Kernels do not traverse instances, static geometry stays in the frames
+    virtual bool supportsInstances() { return false; }
 public:
     // ---------- Devices ----------
     void initializeDevice();
@@ -70,5 +72,8 @@ private:
     // Runtime kernel execution parameters
     vec4i m_blockSize;
     int m_sharedMemSize;
+
+    // Random numbers of the CUDA kernels
+    std::vector<RandomBuffer> m_randoms;
 };
 }
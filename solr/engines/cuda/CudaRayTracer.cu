@@ -31,9 +31,11 @@ BoundingBox* d_boundingBoxes[MAX_GPU_COUNT];
 Primitive* d_primitives[MAX_GPU_COUNT];
 #endif
 Lamp* d_lamps[MAX_GPU_COUNT];
+int d_nbAllocatedLamps[MAX_GPU_COUNT];
 Material* d_materials[MAX_GPU_COUNT];
 BitmapBuffer* d_textures[MAX_GPU_COUNT];
 LightInformation* d_lightInformation[MAX_GPU_COUNT];
+int d_nbAllocatedLightInformation[MAX_GPU_COUNT];
 RandomBuffer* d_randoms[MAX_GPU_COUNT];
 PostProcessingBuffer* d_postProcessingBuffer[MAX_GPU_COUNT];
 BitmapBuffer* d_bitmap[MAX_GPU_COUNT];
@@ -1459,6 +1461,7 @@ extern "C" void initialize_scene(int2 occupancyParameters, SceneInfo sceneInfo,
         // Lamps
         size = NB_MAX_LAMPS * sizeof(Lamp);
         checkCudaErrors(cudaMalloc((void**)&d_lamps[device], size));
+        d_nbAllocatedLamps[device] = NB_MAX_LAMPS;
         LOG_INFO(3, "d_lamps: " << size << " bytes");
         totalMemoryAllocation += size;
 
@@ -1471,6 +1474,7 @@ extern "C" void initialize_scene(int2 occupancyParameters, SceneInfo sceneInfo,
         // Light information
         size = NB_MAX_LIGHTINFORMATIONS * sizeof(LightInformation);
         checkCudaErrors(cudaMalloc((void**)&d_lightInformation[device], size));
+        d_nbAllocatedLightInformation[device] = NB_MAX_LIGHTINFORMATIONS;
         LOG_INFO(3, "d_lightInformation: " << size << " bytes");
         totalMemoryAllocation += size;
 
@@ -1515,9 +1519,11 @@ extern "C" void finalize_scene(int2 occupancyParameters
         FREECUDARESOURCE(d_primitives[device]);
 #endif
         FREECUDARESOURCE(d_lamps[device]);
+        d_nbAllocatedLamps[device] = 0;
         FREECUDARESOURCE(d_materials[device]);
         FREECUDARESOURCE(d_textures[device]);
         FREECUDARESOURCE(d_lightInformation[device]);
+        d_nbAllocatedLightInformation[device] = 0;
         FREECUDARESOURCE(d_randoms[device]);
         FREECUDARESOURCE(d_postProcessingBuffer[device]);
         FREECUDARESOURCE(d_bitmap[device]);
@@ -1549,8 +1555,17 @@ extern "C" void h2d_scene(int2 occupancyParameters, BoundingBox* boundingBoxes,
         checkCudaErrors(cudaMemcpyAsync(d_primitives[device], primitives, nbPrimitives * sizeof(Primitive),
                                         cudaMemcpyHostToDevice, d_streams[device][0]));
 #endif
-        checkCudaErrors(cudaMemcpyAsync(d_lamps[device], lamps, nbLamps * sizeof(Lamp), cudaMemcpyHostToDevice,
-                                        d_streams[device][0]));
+        if (nbLamps > d_nbAllocatedLamps[device])
+        {
+            // Lamps grow with the number of lights in the scene
+            checkCudaErrors(cudaStreamSynchronize(d_streams[device][0]));
+            FREECUDARESOURCE(d_lamps[device]);
+            checkCudaErrors(cudaMalloc((void**)&d_lamps[device], nbLamps * sizeof(Lamp)));
+            d_nbAllocatedLamps[device] = nbLamps;
+        }
+        if (nbLamps != 0)
+            checkCudaErrors(cudaMemcpyAsync(d_lamps[device], lamps, nbLamps * sizeof(Lamp), cudaMemcpyHostToDevice,
+                                            d_streams[device][0]));
     }
 }
 
@@ -1618,9 +1633,19 @@ extern "C" void h2d_lightInformation(int2 occupancyParameters, LightInformation*
     for (int device(0); device < occupancyParameters.x; ++device)
     {
         checkCudaErrors(cudaSetDevice(device));
-        checkCudaErrors(cudaMemcpyAsync(d_lightInformation[device], lightInformation,
-                                        lightInformationSize * sizeof(LightInformation), cudaMemcpyHostToDevice,
-                                        d_streams[device][0]));
+        if (lightInformationSize > d_nbAllocatedLightInformation[device])
+        {
+            // Light information holds the lights followed by their hierarchy
+            checkCudaErrors(cudaStreamSynchronize(d_streams[device][0]));
+            FREECUDARESOURCE(d_lightInformation[device]);
+            checkCudaErrors(cudaMalloc((void**)&d_lightInformation[device],
+                                       lightInformationSize * sizeof(LightInformation)));
+            d_nbAllocatedLightInformation[device] = lightInformationSize;
+        }
+        if (lightInformationSize != 0)
+            checkCudaErrors(cudaMemcpyAsync(d_lightInformation[device], lightInformation,
+                                            lightInformationSize * sizeof(LightInformation), cudaMemcpyHostToDevice,
+                                            d_streams[device][0]));
     }
 }
 
@@ -910,6 +910,85 @@ __device__ __INLINE__ float processShadows(const SceneInfo &sceneInfo, BoundingB
 /*
 ________________________________________________________________________________
 
+Light importance
+
+Lights are stored first in the light information buffer, followed by the nodes
+of their hierarchy. Nodes store the power of the lights they contain in color.w
+and the radius of their bounds in color.x. The importance is an estimate of the
+light received at the given position.
+________________________________________________________________________________
+*/
+__device__ __INLINE__ float lightImportance(LightInformation *lightInformation, const int &lightInformationSize,
+                                            const int &index, const vec3f &position)
+{
+    const LightInformation &light = lightInformation[index];
+    float power = light.color.w;
+    float radius = 0.f;
+    if (index < lightInformationSize)
+        power *= (light.color.x + light.color.y + light.color.z) / 3.f;
+    else
+        radius = light.color.x;
+    const vec3f delta = light.location - position;
+    const float distance = dot(delta, delta);
+    return power / max(distance, max(radius * radius, SOLR_EPSILON));
+}
+
+/*
+________________________________________________________________________________
+
+Light sampling
+
+Walks down the light hierarchy from its root. Once path tracing has started,
+children are picked randomly according to their importance and the returned
+weight compensates for the probability of the selected light, so that the
+accumulated frames converge to the contribution of all lights. Before that, the
+most important light is picked.
+________________________________________________________________________________
+*/
+__device__ __INLINE__ int sampleLight(const SceneInfo &sceneInfo, LightInformation *lightInformation,
+                                      const int &lightInformationSize, const vec3f &position, float u, float &weight)
+{
+    weight = 1.f;
+    if (lightInformationSize < 2)
+        return lightInformationSize - 1;
+
+    const bool stochastic = sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS;
+    float probability = 1.f;
+    int index = lightInformationSize;
+    while (index >= lightInformationSize)
+    {
+        const int left = lightInformation[index].primitiveId;
+        const int right = lightInformation[index].materialId;
+        const float leftImportance = lightImportance(lightInformation, lightInformationSize, left, position);
+        const float rightImportance = lightImportance(lightInformation, lightInformationSize, right, position);
+        const float total = leftImportance + rightImportance;
+        const float p = (total > 0.f) ? leftImportance / total : 0.5f;
+        if (stochastic)
+        {
+            if (u < p)
+            {
+                u /= p;
+                probability *= p;
+                index = left;
+            }
+            else
+            {
+                u = (u - p) / (1.f - p);
+                probability *= 1.f - p;
+                index = right;
+            }
+        }
+        else
+            index = (p >= 0.5f) ? left : right;
+    }
+    if (stochastic)
+        weight = 1.f / (max(probability, SOLR_EPSILON) * lightInformationSize);
+    return index;
+}
+
+/*
+________________________________________________________________________________
+
 Primitive shader
 ________________________________________________________________________________
 */
@@ -953,18 +1032,22 @@ __device__ __INLINE__ vec4f primitiveShader(
     if (sceneInfo.graphicsLevel > glNoShading)
     {
         closestColor *= material.innerIllumination.x;
-        for (int cpt = 0; cpt < lightInformationSize; ++cpt)
+        const int C = 1;
+        for (int cpt = 0; cpt < C; ++cpt)
         {
-            int cptLamp = (sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS)
-                              ? (sceneInfo.pathTracingIteration % lightInformationSize)
-                              : 0;
-            if (lightInformation[cptLamp].primitiveId != primitive.index)
+            int t = (index + sceneInfo.timestamp) % (MAX_BITMAP_SIZE - 3);
+
+            // Pick one lamp from the light hierarchy instead of scanning all of them
+            float lampWeight = 1.f;
+            const float u = min(max(randoms[t + 3] * 100.f + 0.5f, 0.f), 0.999f);
+            const int cptLamp =
+                sampleLight(sceneInfo, lightInformation, lightInformationSize, intersection, u, lampWeight);
+            if (cptLamp >= 0 && lightInformation[cptLamp].primitiveId != primitive.index)
             {
                 vec3f center;
                 // randomize lamp center
                 center = lightInformation[cptLamp].location;
 
-                int t = (index + sceneInfo.timestamp) % (MAX_BITMAP_SIZE - 3);
                 Material &m = materials[lightInformation[cptLamp].materialId];
                 if (sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS)
                 {
@@ -1024,6 +1107,7 @@ __device__ __INLINE__ vec4f primitiveShader(
                         lambert *= (1.f - shadowIntensity);
                         lambert += sceneInfo.backgroundColor.w;
                         lambert *= (1.f - photonEnergy);
+                        lambert *= lampWeight;
 
                         // Lighted object, not in the shades
                         lampsColor += lambert * lightInformation[cptLamp].color - shadowColor;
@@ -1045,6 +1129,7 @@ __device__ __INLINE__ vec4f primitiveShader(
 
                                 blinnTerm = specular.x * pow(blinnTerm, specular.y);
                                 blinnTerm *= (1.f - photonEnergy);
+                                blinnTerm *= lampWeight;
                                 totalBlinn +=
                                     lightInformation[cptLamp].color * lightInformation[cptLamp].color.w * blinnTerm;
 
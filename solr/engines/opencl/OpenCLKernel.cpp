@@ -199,22 +199,27 @@ OpenCLKernel::OpenCLKernel()
     , m_hContext(0)
     , m_hQueue(0)
     , m_hProgram(0)
+    , m_compressedProgram(false)
     , m_kAlignment(0)
     , m_kStandardRenderer(0)
     , m_kAnaglyphRenderer(0)
     , m_k3DVisionRenderer(0)
     , m_kFishEyeRenderer(0)
     , m_kVolumeRenderer(0)
+    , m_kAntialiasingEdges(0)
+    , m_kAntialiasingRenderer(0)
     , m_kDefault(0)
     , m_kDepthOfField(0)
     , m_kAmbientOcclusion(0)
     , m_kRadiosity(0)
     , m_kFilter(0)
     , _dPrimitives(0)
+    , m_nbAllocatedPrimitives(0)
     , m_dLamps(0)
+    , m_nbAllocatedLamps(0)
     , m_dLightInformation(0)
+    , m_nbAllocatedLightInformation(0)
     , m_dTextures(0)
-    , m_dRandoms(0)
     , m_dBitmap(0)
     , m_dPostProcessingBuffer(0)
     , m_dPrimitivesXYIds(0)
@@ -306,6 +311,11 @@ void OpenCLKernel::recompileKernels()
 #ifdef USE_KINECT
         compilationOptions += " -DUSE_KINECT";
 #endif
+        // Traversals only reserve the stack of decoded ancestors when the
+        // scene uses quantized boxes
+        m_compressedProgram = m_compressedBoxes && !m_hCompressedBoxes.empty();
+        if (m_compressedProgram)
+            compilationOptions += " -DCOMPRESSED_BOXES";
         LOG_INFO(1, "Building Program with " << compilationOptions);
         CHECKSTATUS(
             clBuildProgram(m_hProgram, 1, &m_devices[m_platform][m_device], compilationOptions.c_str(), &buildNotify, NULL));
@@ -352,6 +362,12 @@ void OpenCLKernel::recompileKernels()
         m_kVolumeRenderer = clCreateKernel(m_hProgram, "k_volumeRenderer", &status);
         CHECKSTATUS(status);
 
+        m_kAntialiasingEdges = clCreateKernel(m_hProgram, "k_antialiasingEdges", &status);
+        CHECKSTATUS(status);
+
+        m_kAntialiasingRenderer = clCreateKernel(m_hProgram, "k_antialiasingRenderer", &status);
+        CHECKSTATUS(status);
+
         LOG_INFO(1, "Rendering kernels created");
 
         // Post-processing kernels
@@ -402,8 +418,10 @@ void OpenCLKernel::initializeDevice()
     reshape();
     m_dBoundingBoxes = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(BoundingBox) * NB_MAX_BOXES, 0, &errorCode);
     m_dLamps = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Lamp) * NB_MAX_LAMPS, 0, &errorCode);
+    m_nbAllocatedLamps = NB_MAX_LAMPS;
     m_dLightInformation = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY,
                                          sizeof(LightInformation) * NB_MAX_LIGHTINFORMATIONS, 0, &errorCode);
+    m_nbAllocatedLightInformation = NB_MAX_LIGHTINFORMATIONS;
     m_dMaterials = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Material) * NB_MAX_MATERIALS, 0, &errorCode);
 
 #if USE_KINECT
@@ -448,6 +466,16 @@ void OpenCLKernel::releaseKernels()
         CHECKSTATUS(clReleaseKernel(m_kVolumeRenderer));
         m_kVolumeRenderer = 0;
     }
+    if (m_kAntialiasingEdges)
+    {
+        CHECKSTATUS(clReleaseKernel(m_kAntialiasingEdges));
+        m_kAntialiasingEdges = 0;
+    }
+    if (m_kAntialiasingRenderer)
+    {
+        CHECKSTATUS(clReleaseKernel(m_kAntialiasingRenderer));
+        m_kAntialiasingRenderer = 0;
+    }
 
     // Post processing kernels
     if (m_kDefault)
@@ -495,14 +523,21 @@ void OpenCLKernel::releaseDevice()
     if (_dPrimitives)
         CHECKSTATUS(clReleaseMemObject(_dPrimitives));
     _dPrimitives = 0;
+    m_nbAllocatedPrimitives = 0;
     if (m_dBoundingBoxes)
         CHECKSTATUS(clReleaseMemObject(m_dBoundingBoxes));
+    if (m_dLamps)
+        CHECKSTATUS(clReleaseMemObject(m_dLamps));
+    m_dLamps = 0;
+    m_nbAllocatedLamps = 0;
+    if (m_dLightInformation)
+        CHECKSTATUS(clReleaseMemObject(m_dLightInformation));
+    m_dLightInformation = 0;
+    m_nbAllocatedLightInformation = 0;
     if (m_dMaterials)
         CHECKSTATUS(clReleaseMemObject(m_dMaterials));
     if (m_dTextures)
         CHECKSTATUS(clReleaseMemObject(m_dTextures));
-    if (m_dRandoms)
-        CHECKSTATUS(clReleaseMemObject(m_dRandoms));
     if (m_dPostProcessingBuffer)
         CHECKSTATUS(clReleaseMemObject(m_dPostProcessingBuffer));
     if (m_dPrimitivesXYIds)
@@ -536,6 +571,10 @@ void OpenCLKernel::render_begin(const float timer)
     GPUKernel::render_begin(timer);
     if (m_refresh)
     {
+        const bool compressedBoxes = m_compressedBoxes && !m_hCompressedBoxes.empty();
+        if (compressedBoxes != m_compressedProgram)
+            recompileKernels();
+
         // CPU -> GPU Data transfers
         int nbBoxes = m_nbActiveBoxes[m_frame];
         int nbPrimitives = m_nbActivePrimitives[m_frame];
@@ -546,30 +585,70 @@ void OpenCLKernel::render_begin(const float timer)
 
         if (!m_primitivesTransfered)
         {
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dBoundingBoxes, CL_TRUE, 0, nbBoxes * sizeof(BoundingBox),
-                                             m_hBoundingBoxes, 0, NULL, NULL));
-
-            int errorCode;
-            if (_dPrimitives)
-                CHECKSTATUS(clReleaseMemObject(_dPrimitives));
-            _dPrimitives =
-                clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Primitive) * nbPrimitives, 0, &errorCode);
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, _dPrimitives, CL_TRUE, 0, nbPrimitives * sizeof(Primitive),
-                                             m_hPrimitives, 0, NULL, NULL));
-            CHECKSTATUS(
-                clEnqueueWriteBuffer(m_hQueue, m_dLamps, CL_TRUE, 0, nbLamps * sizeof(Lamp), m_hLamps, 0, NULL, NULL));
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dLightInformation, CL_TRUE, 0,
-                                             m_lightInformationSize * sizeof(LightInformation), m_lightInformation, 0,
-                                             NULL, NULL));
-            m_primitivesTransfered = true;
-        }
+            // Quantized boxes are always transfered as a whole, since the
+            // encoding of a box depends on its parent
+            if (compressedBoxes && !m_dirtyBoxes.empty())
+                CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dBoundingBoxes, CL_TRUE, 0,
+                                                 m_hCompressedBoxes.size() * sizeof(CompressedBoundingBox),
+                                                 &m_hCompressedBoxes[0], 0, NULL, NULL));
+
+            if (!_dPrimitives || nbPrimitives != m_nbAllocatedPrimitives)
+            {
+                if (!compressedBoxes)
+                    CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dBoundingBoxes, CL_TRUE, 0,
+                                                     nbBoxes * sizeof(BoundingBox), m_hBoundingBoxes, 0, NULL, NULL));
+
+                int errorCode;
+                if (_dPrimitives)
+                    CHECKSTATUS(clReleaseMemObject(_dPrimitives));
+                _dPrimitives =
+                    clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Primitive) * nbPrimitives, 0, &errorCode);
+                CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, _dPrimitives, CL_TRUE, 0,
+                                                 nbPrimitives * sizeof(Primitive), m_hPrimitives, 0, NULL, NULL));
+                m_nbAllocatedPrimitives = nbPrimitives;
+            }
+            else
+            {
+                // Only transfer boxes and primitives modified since the last transfer
+                if (!compressedBoxes)
+                    for (const auto &range : m_dirtyBoxes)
+                        CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dBoundingBoxes, CL_TRUE,
+                                                         range.x * sizeof(BoundingBox),
+                                                         (range.y - range.x) * sizeof(BoundingBox),
+                                                         m_hBoundingBoxes + range.x, 0, NULL, NULL));
+                for (const auto &range : m_dirtyPrimitives)
+                    CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, _dPrimitives, CL_TRUE, range.x * sizeof(Primitive),
+                                                     (range.y - range.x) * sizeof(Primitive), m_hPrimitives + range.x,
+                                                     0, NULL, NULL));
+            }
+            m_dirtyBoxes.clear();
+            m_dirtyPrimitives.clear();
 
-        if (!m_randomsTransfered)
-        {
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dRandoms, CL_TRUE, 0,
-                                             m_sceneInfo.size.x * m_sceneInfo.size.y * sizeof(RandomBuffer), m_hRandoms,
-                                             0, NULL, NULL));
-            m_randomsTransfered = true;
+            // Lamps and light information grow with the number of lights
+            const int nbLightInformation = static_cast<int>(m_lightInformation.size());
+            if (nbLamps > m_nbAllocatedLamps)
+            {
+                int errorCode;
+                CHECKSTATUS(clReleaseMemObject(m_dLamps));
+                m_dLamps = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Lamp) * nbLamps, 0, &errorCode);
+                m_nbAllocatedLamps = nbLamps;
+            }
+            if (nbLightInformation > m_nbAllocatedLightInformation)
+            {
+                int errorCode;
+                CHECKSTATUS(clReleaseMemObject(m_dLightInformation));
+                m_dLightInformation = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY,
+                                                     sizeof(LightInformation) * nbLightInformation, 0, &errorCode);
+                m_nbAllocatedLightInformation = nbLightInformation;
+            }
+            if (nbLamps != 0)
+                CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dLamps, CL_TRUE, 0, nbLamps * sizeof(Lamp), &m_hLamps[0],
+                                                 0, NULL, NULL));
+            if (nbLightInformation != 0)
+                CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dLightInformation, CL_TRUE, 0,
+                                                 nbLightInformation * sizeof(LightInformation), &m_lightInformation[0],
+                                                 0, NULL, NULL));
+            m_primitivesTransfered = true;
         }
 
         if (!m_materialsTransfered)
@@ -672,6 +751,9 @@ void OpenCLKernel::render_begin(const float timer)
         SceneInfo sceneInfo = m_sceneInfo;
         if (m_sceneInfo.draftMode && m_sceneInfo.pathTracingIteration == 0)
             sceneInfo.graphicsLevel = glNoShading;
+        sceneInfo.compressedBoxes = compressedBoxes ? 1 : 0;
+        sceneInfo.samplingThreshold = m_samplingThreshold;
+        sceneInfo.sampler = m_sampler;
 
         size_t szLocalWorkSize[] = {1, 1};
         size_t szGlobalWorkSize[] = {m_sceneInfo.size.x / szLocalWorkSize[0], m_sceneInfo.size.y / szLocalWorkSize[1]};
@@ -694,15 +776,14 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 9, sizeof(vec1i), (void *)&nbLamps));
             CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 10, sizeof(cl_mem), (void *)&m_dMaterials));
             CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 11, sizeof(cl_mem), (void *)&m_dTextures));
-            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 12, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 13, sizeof(vec4f), (void *)&m_viewPos));
-            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 14, sizeof(vec4f), (void *)&m_viewDir));
-            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 15, sizeof(vec4f), (void *)&m_angles));
-            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 16, sizeof(SceneInfo), (void *)&sceneInfo));
+            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 12, sizeof(vec4f), (void *)&m_viewPos));
+            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 13, sizeof(vec4f), (void *)&m_viewDir));
+            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 14, sizeof(vec4f), (void *)&m_angles));
+            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 15, sizeof(SceneInfo), (void *)&sceneInfo));
             CHECKSTATUS(
-                clSetKernelArg(m_kAnaglyphRenderer, 17, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
-            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 18, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 19, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+                clSetKernelArg(m_kAnaglyphRenderer, 16, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
+            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 17, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+            CHECKSTATUS(clSetKernelArg(m_kAnaglyphRenderer, 18, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
             CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kAnaglyphRenderer, 2, NULL, szGlobalWorkSize,
                                                szLocalWorkSize, 0, 0, 0));
             break;
@@ -721,15 +802,14 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 9, sizeof(vec1i), (void *)&nbLamps));
             CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 10, sizeof(cl_mem), (void *)&m_dMaterials));
             CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 11, sizeof(cl_mem), (void *)&m_dTextures));
-            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 12, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 13, sizeof(vec4f), (void *)&m_viewPos));
-            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 14, sizeof(vec4f), (void *)&m_viewDir));
-            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 15, sizeof(vec4f), (void *)&m_angles));
-            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 16, sizeof(SceneInfo), (void *)&sceneInfo));
+            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 12, sizeof(vec4f), (void *)&m_viewPos));
+            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 13, sizeof(vec4f), (void *)&m_viewDir));
+            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 14, sizeof(vec4f), (void *)&m_angles));
+            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 15, sizeof(SceneInfo), (void *)&sceneInfo));
             CHECKSTATUS(
-                clSetKernelArg(m_k3DVisionRenderer, 17, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
-            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 18, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 19, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+                clSetKernelArg(m_k3DVisionRenderer, 16, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
+            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 17, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+            CHECKSTATUS(clSetKernelArg(m_k3DVisionRenderer, 18, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
             CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_k3DVisionRenderer, 2, NULL, szGlobalWorkSize,
                                                szLocalWorkSize, 0, 0, 0));
             break;
@@ -748,15 +828,14 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 9, sizeof(vec1i), (void *)&nbLamps));
             CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 10, sizeof(cl_mem), (void *)&m_dMaterials));
             CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 11, sizeof(cl_mem), (void *)&m_dTextures));
-            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 12, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 13, sizeof(vec4f), (void *)&m_viewPos));
-            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 14, sizeof(vec4f), (void *)&m_viewDir));
-            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 15, sizeof(vec4f), (void *)&m_angles));
-            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 16, sizeof(SceneInfo), (void *)&sceneInfo));
+            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 12, sizeof(vec4f), (void *)&m_viewPos));
+            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 13, sizeof(vec4f), (void *)&m_viewDir));
+            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 14, sizeof(vec4f), (void *)&m_angles));
+            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 15, sizeof(SceneInfo), (void *)&sceneInfo));
             CHECKSTATUS(
-                clSetKernelArg(m_kFishEyeRenderer, 17, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
-            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 18, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 19, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+                clSetKernelArg(m_kFishEyeRenderer, 16, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
+            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 17, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+            CHECKSTATUS(clSetKernelArg(m_kFishEyeRenderer, 18, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
             CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kFishEyeRenderer, 2, NULL, szGlobalWorkSize, szLocalWorkSize,
                                                0, 0, 0));
             break;
@@ -775,15 +854,14 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 9, sizeof(vec1i), (void *)&nbLamps));
             CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 10, sizeof(cl_mem), (void *)&m_dMaterials));
             CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 11, sizeof(cl_mem), (void *)&m_dTextures));
-            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 12, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 13, sizeof(vec4f), (void *)&m_viewPos));
-            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 14, sizeof(vec4f), (void *)&m_viewDir));
-            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 15, sizeof(vec4f), (void *)&m_angles));
-            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 16, sizeof(SceneInfo), (void *)&sceneInfo));
+            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 12, sizeof(vec4f), (void *)&m_viewPos));
+            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 13, sizeof(vec4f), (void *)&m_viewDir));
+            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 14, sizeof(vec4f), (void *)&m_angles));
+            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 15, sizeof(SceneInfo), (void *)&sceneInfo));
             CHECKSTATUS(
-                clSetKernelArg(m_kVolumeRenderer, 17, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
-            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 18, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 19, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+                clSetKernelArg(m_kVolumeRenderer, 16, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
+            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 17, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+            CHECKSTATUS(clSetKernelArg(m_kVolumeRenderer, 18, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
             CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kVolumeRenderer, 2, NULL, szGlobalWorkSize, szLocalWorkSize,
                                                0, 0, 0));
             break;
@@ -802,20 +880,53 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 9, sizeof(vec1i), (void *)&nbLamps));
             CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 10, sizeof(cl_mem), (void *)&m_dMaterials));
             CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 11, sizeof(cl_mem), (void *)&m_dTextures));
-            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 12, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 13, sizeof(vec4f), (void *)&m_viewPos));
-            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 14, sizeof(vec4f), (void *)&m_viewDir));
-            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 15, sizeof(vec4f), (void *)&m_angles));
-            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 16, sizeof(SceneInfo), (void *)&sceneInfo));
+            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 12, sizeof(vec4f), (void *)&m_viewPos));
+            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 13, sizeof(vec4f), (void *)&m_viewDir));
+            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 14, sizeof(vec4f), (void *)&m_angles));
+            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 15, sizeof(SceneInfo), (void *)&sceneInfo));
             CHECKSTATUS(
-                clSetKernelArg(m_kStandardRenderer, 17, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
-            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 18, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 19, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+                clSetKernelArg(m_kStandardRenderer, 16, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
+            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 17, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+            CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 18, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
             CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kStandardRenderer, 2, NULL, szGlobalWorkSize,
                                                szLocalWorkSize, 0, 0, 0));
             break;
         }
         }
+
+        if (sceneInfo.cameraType == ctAntialiazed)
+        {
+            // Supersampling of the edges found in the primitive IDs and depths of the first samples
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingEdges, 0, sizeof(vec2i), (void *)&m_occupancyParameters));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingEdges, 1, sizeof(SceneInfo), (void *)&sceneInfo));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingEdges, 2, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingEdges, 3, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+            CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kAntialiasingEdges, 2, NULL, szGlobalWorkSize,
+                                               szLocalWorkSize, 0, 0, 0));
+
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 0, sizeof(vec2i), (void *)&m_occupancyParameters));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 1, sizeof(vec1i), (void *)&zero));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 2, sizeof(vec1i), (void *)&zero));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 3, sizeof(cl_mem), (void *)&m_dBoundingBoxes));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 4, sizeof(vec1i), (void *)&nbBoxes));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 5, sizeof(cl_mem), (void *)&_dPrimitives));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 6, sizeof(vec1i), (void *)&nbPrimitives));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 7, sizeof(cl_mem), (void *)&m_dLightInformation));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 8, sizeof(vec1i), (void *)&m_lightInformationSize));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 9, sizeof(vec1i), (void *)&nbLamps));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 10, sizeof(cl_mem), (void *)&m_dMaterials));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 11, sizeof(cl_mem), (void *)&m_dTextures));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 12, sizeof(vec4f), (void *)&m_viewPos));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 13, sizeof(vec4f), (void *)&m_viewDir));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 14, sizeof(vec4f), (void *)&m_angles));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 15, sizeof(SceneInfo), (void *)&sceneInfo));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 16, sizeof(PostProcessingInfo),
+                                       (void *)&m_postProcessingInfo));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 17, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+            CHECKSTATUS(clSetKernelArg(m_kAntialiasingRenderer, 18, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+            CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kAntialiasingRenderer, 2, NULL, szGlobalWorkSize,
+                                               szLocalWorkSize, 0, 0, 0));
+        }
         LOG_INFO(3, "Rendering kernel done");
 
         // --------------------------------------------------------------------------------
@@ -829,8 +940,7 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(clSetKernelArg(m_kDepthOfField, 1, sizeof(SceneInfo), (void *)&sceneInfo));
             CHECKSTATUS(clSetKernelArg(m_kDepthOfField, 2, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
             CHECKSTATUS(clSetKernelArg(m_kDepthOfField, 3, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_kDepthOfField, 4, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_kDepthOfField, 5, sizeof(cl_mem), (void *)&m_dBitmap));
+            CHECKSTATUS(clSetKernelArg(m_kDepthOfField, 4, sizeof(cl_mem), (void *)&m_dBitmap));
             CHECKSTATUS(
                 clEnqueueNDRangeKernel(m_hQueue, m_kDepthOfField, 2, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0));
             break;
@@ -840,8 +950,7 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(
                 clSetKernelArg(m_kAmbientOcclusion, 2, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
             CHECKSTATUS(clSetKernelArg(m_kAmbientOcclusion, 3, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_kAmbientOcclusion, 4, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_kAmbientOcclusion, 5, sizeof(cl_mem), (void *)&m_dBitmap));
+            CHECKSTATUS(clSetKernelArg(m_kAmbientOcclusion, 4, sizeof(cl_mem), (void *)&m_dBitmap));
             CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kAmbientOcclusion, 2, NULL, szGlobalWorkSize,
                                                szLocalWorkSize, 0, 0, 0));
             break;
@@ -851,8 +960,7 @@ void OpenCLKernel::render_begin(const float timer)
             CHECKSTATUS(clSetKernelArg(m_kRadiosity, 2, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
             CHECKSTATUS(clSetKernelArg(m_kRadiosity, 3, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
             CHECKSTATUS(clSetKernelArg(m_kRadiosity, 4, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
-            CHECKSTATUS(clSetKernelArg(m_kRadiosity, 5, sizeof(cl_mem), (void *)&m_dRandoms));
-            CHECKSTATUS(clSetKernelArg(m_kRadiosity, 6, sizeof(cl_mem), (void *)&m_dBitmap));
+            CHECKSTATUS(clSetKernelArg(m_kRadiosity, 5, sizeof(cl_mem), (void *)&m_dBitmap));
             CHECKSTATUS(
                 clEnqueueNDRangeKernel(m_hQueue, m_kRadiosity, 2, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0));
             break;
@@ -980,6 +1088,20 @@ void OpenCLKernel::render_end()
     }
 }
 
+int OpenCLKernel::getNbActivePixels()
+{
+    // Convergence flags are kept with the accumulated samples, on the device
+    const size_t nbPixels = m_sceneInfo.size.x * m_sceneInfo.size.y;
+    std::vector<PostProcessingBuffer> postProcessingBuffer(nbPixels);
+    CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dPostProcessingBuffer, CL_TRUE, 0,
+                                    nbPixels * sizeof(PostProcessingBuffer), &postProcessingBuffer[0], 0, NULL, NULL));
+    int nbActivePixels = 0;
+    for (size_t i = 0; i < nbPixels; ++i)
+        if (postProcessingBuffer[i].sceneInfo.y == 0.f)
+            ++nbActivePixels;
+    return nbActivePixels;
+}
+
 void OpenCLKernel::initBuffers()
 {
     LOG_INFO(3, "OpenCLKernel::initBuffers");
@@ -1007,8 +1129,6 @@ void OpenCLKernel::reshape()
 {
     LOG_INFO(3, "OpenCLKernel::reshape");
     GPUKernel::reshape();
-    if (m_dRandoms)
-        CHECKSTATUS(clReleaseMemObject(m_dRandoms));
     if (m_dPostProcessingBuffer)
         CHECKSTATUS(clReleaseMemObject(m_dPostProcessingBuffer));
     if (m_dPrimitivesXYIds)
@@ -1019,7 +1139,6 @@ void OpenCLKernel::reshape()
     int errorCode;
     m_dBitmap = clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, MAX_BITMAP_SIZE * sizeof(BitmapBuffer) * gColorDepth, 0,
                                &errorCode);
-    m_dRandoms = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, MAX_BITMAP_SIZE * sizeof(RandomBuffer), 0, &errorCode);
     m_dPostProcessingBuffer =
         clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, MAX_BITMAP_SIZE * sizeof(PostProcessingBuffer), 0, &errorCode);
     m_dPrimitivesXYIds =
@@ -71,6 +71,7 @@ public:
     // ---------- Rendering ----------
     void render_begin(const float timer);
     void render_end();
+    int getNbActivePixels();
 
 public:
     virtual std::string getGPUDescription();
@@ -104,6 +105,7 @@ private:
 
 private:
     cl_program m_hProgram;
+    bool m_compressedProgram; // Program was built with COMPRESSED_BOXES
 
     // Test kernels
     cl_kernel m_kAlignment;
@@ -114,6 +116,8 @@ private:
     cl_kernel m_k3DVisionRenderer;
     cl_kernel m_kFishEyeRenderer;
     cl_kernel m_kVolumeRenderer;
+    cl_kernel m_kAntialiasingEdges;
+    cl_kernel m_kAntialiasingRenderer;
 
     // Post processing kernels
     cl_kernel m_kDefault;
@@ -125,11 +129,13 @@ private:
 private:
     cl_mem m_dBoundingBoxes;
     cl_mem _dPrimitives;
+    int m_nbAllocatedPrimitives;
     cl_mem m_dLamps;
+    int m_nbAllocatedLamps;
     cl_mem m_dLightInformation;
+    int m_nbAllocatedLightInformation;
     cl_mem m_dMaterials;
     cl_mem m_dTextures;
-    cl_mem m_dRandoms;
     cl_mem m_dBitmap;
     cl_mem m_dPostProcessingBuffer;
     cl_mem m_dPrimitivesXYIds;
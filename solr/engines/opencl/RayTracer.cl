@@ -25,10 +25,55 @@
 #define ALIGNMENT
 #endif
 
+// Vector literals. The CPU engine compiles this file as C++, where they are
+// built by a function
+#ifdef __OPENCL_VERSION__
+#define make_float4(x, y, z, w) (float4)(x, y, z, w)
+#endif
+
+// Leaves reached by primary rays, traced in packets by the CPU engine before
+// running the kernels (see engines/cpu/OpenCLTypes.h). Devices traverse the
+// boxes for every ray
+#ifdef __OPENCL_VERSION__
+#define packetRay(origin, direction) -1
+#define packetLeaf(ray, cursor, box) false
+#define packetCandidates(ray, cursor, first, count) 0xFFFFFFFF
+#endif
+
+// Leaves hit by other rays, in front-to-back order, found by the CPU engine in
+// the wide hierarchy collapsed from the boxes (see GPUKernel::buildWideBVH).
+// Devices walk the boxes
+#ifdef __OPENCL_VERSION__
+#define wideRay(ray) false
+#define wideLeaf(tmax, box) false
+#endif
+
+// Primitives of a leaf that may be hit by a ray, one bit per primitive. The CPU
+// engine tests several primitives at once, devices test them one by one
+#ifdef __OPENCL_VERSION__
+#define primitiveCandidates(sceneInfo, ray, first, count, shadows) 0xFFFFFFFF
+#endif
+
+// Last primitive found to occlude a lamp, cached by each thread of the CPU
+// engine. Shadow rays of neighbouring pixels are often occluded by the same
+// primitive
+#ifdef __OPENCL_VERSION__
+#define cachedOccluder(lamp) -1
+#define cacheOccluder(lamp, primitive)
+#endif
+
+// Quantized boxes are decoded relative to their ancestors, which traversals
+// keep on a stack. Programs are only built with COMPRESSED_BOXES when the scene
+// uses quantized boxes, so that traversals of regular boxes do not reserve it
+#ifdef COMPRESSED_BOXES
+#define BOX_ANCESTORS(name) float4 name[2 * COMPRESSED_BOXES_TREE_DEPTH]
+#else
+#define BOX_ANCESTORS(name) float4* name = 0
+#endif
+
 // Typedefs
 typedef int4 PrimitiveXYIdBuffer;
 typedef unsigned char BitmapBuffer;
-typedef float RandomBuffer;
 typedef int Lamp;
 typedef struct
 {
@@ -38,10 +83,19 @@ typedef struct
 
 // Constants
 #define NB_MAX_ITERATIONS 10
+#define NB_MIN_ADAPTIVE_SAMPLES 8
+#define ANTIALIASING_DEPTH_RATIO 0.05f
+#define RUSSIAN_ROULETTE_DEPTH 2
+#define RUSSIAN_ROULETTE_THROUGHPUT 0.25f
+#define RANDOM_RANGE 0.01f
 #define MAXDEPTH 10
 #define CONST __global
 
 #define NB_MAX_MATERIALS 65536 // Last 30 materials are reserved
+#define BOUNDING_BOXES_TREE_DEPTH 64
+#define COMPRESSED_BOXES_HEADER_SIZE 2
+#define COMPRESSED_BOXES_TREE_DEPTH 32
+#define COMPRESSED_BOXES_QUANTIZATION_STEPS 255.f
 #define gColorDepth 3
 
 #define MATERIAL_NONE -1
@@ -51,6 +105,7 @@ typedef struct
 
 // Globals
 #define PI 3.14159265358979323846f
+#define EPSILON 1e-6f
 
 // Kinect
 #define KINECT_COLOR_WIDTH 640
@@ -110,6 +165,23 @@ enum AtmosphericEffect
     aeFog = 1
 };
 
+enum SamplerType
+{
+    stRandom = 0,
+    stSobol = 1
+};
+
+// Dimensions of the random numbers drawn by stochastic effects
+#define RANDOM_DEPTH_OF_FIELD 0       // 2 dimensions: eye position
+#define RANDOM_LAMP_POSITION 2        // 3 dimensions: soft shadows
+#define RANDOM_LAMP 5                 // Lamp picked from the light hierarchy
+#define RANDOM_LAMP_NOISE 6           // Lamp intensity noise of materials
+#define RANDOM_VIEW_NOISE 7           // 3 dimensions: noise of reflected rays
+#define RANDOM_ILLUMINATION 10        // Random light intensity
+#define RANDOM_GLOBAL_ILLUMINATION 11 // 3 dimensions per ray iteration
+#define RANDOM_RUSSIAN_ROULETTE 41    // 1 dimension per ray iteration
+#define RANDOM_PATTERN 0              // 2 dimensions: samples of post processing effects
+
 // Scene information
 typedef struct ALIGNMENT
 {
@@ -138,6 +210,9 @@ typedef struct ALIGNMENT
     int gradientBackground;                         // Gradient background
     float geometryEpsilon;                          // Geometry epsilon
     float rayEpsilon;                               // Ray epsilon
+    int compressedBoxes;                            // Bounding boxes are quantized (CompressedBoundingBox)
+    float samplingThreshold;                        // Relative error below which pixels stop being sampled (0: off)
+    enum SamplerType sampler;                       // Random number sequences of stochastic effects
     float4 backgroundColor;                         // Background color
 } SceneInfo;
 
@@ -171,7 +246,9 @@ enum PrimitiveType
     ptMagicCarpet = 8,
     ptEnvironment = 9,
     ptEllipsoid = 10,
-    ptQuad = 11
+    ptQuad = 11,
+    ptCone = 12,
+    ptInstance = 13
 };
 
 typedef struct ALIGNMENT
@@ -225,6 +302,15 @@ typedef struct ALIGNMENT
     int2 indexForNextBox; // If no intersection, how many of the following boxes can be skipped?
 } BoundingBox;
 
+typedef struct ALIGNMENT
+{
+    uchar lower[3];       // Bottom-Left corner, relative to the parent box
+    uchar upper[3];       // Top-Right corner, relative to the parent box
+    ushort nbPrimitives;  // Number of primitives in the box
+    uint startIndex;      // Index of the first primitive in the box
+    uint indexForNextBox; // Boxes to skip (lower 24 bits) and depth of the box (upper 8 bits)
+} CompressedBoundingBox;
+
 typedef struct ALIGNMENT
 {
     // Vertices
@@ -376,7 +462,7 @@ ________________________________________________________________________________
 Convert float4 into OpenGL RGB color
 ________________________________________________________________________________
 */
-static void makeColor(const SceneInfo* sceneInfo, const float4* color, CONST BitmapBuffer* bitmap, int index)
+static void makeColor(const SceneInfo* sceneInfo, float4* color, CONST BitmapBuffer* bitmap, int index)
 {
     (*color).x = ((*color).x > 1.f) ? 1.f : (*color).x;
     (*color).y = ((*color).y > 1.f) ? 1.f : (*color).y;
@@ -414,6 +500,80 @@ static void makeColor(const SceneInfo* sceneInfo, const float4* color, CONST Bit
 /*
 ________________________________________________________________________________
 
+Random numbers. They are computed from a counter made of the pixel, the
+dimension and the path tracing iteration, so that stochastic effects need no
+random buffer, and neighbouring pixels draw uncorrelated numbers. With the
+Sobol sampler, pairs of dimensions follow a (0,2)-sequence over the iterations
+that progressive rendering accumulates. The sequence of each pair is shuffled,
+and scrambled per pixel
+________________________________________________________________________________
+*/
+static uint hashCounter(uint value)
+{
+    // PCG hash
+    const uint state = value * 747796405u + 2891336453u;
+    const uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static uint randomBits(const int index, const int dimension, const int sample)
+{
+    return hashCounter(hashCounter(hashCounter((uint)index) + (uint)dimension) + (uint)sample);
+}
+
+static uint sobolBits(uint sample, const int dimension)
+{
+    if (dimension == 0)
+    {
+        // Van der Corput sequence
+        sample = ((sample >> 1) & 0x55555555u) | ((sample & 0x55555555u) << 1);
+        sample = ((sample >> 2) & 0x33333333u) | ((sample & 0x33333333u) << 2);
+        sample = ((sample >> 4) & 0x0F0F0F0Fu) | ((sample & 0x0F0F0F0Fu) << 4);
+        sample = ((sample >> 8) & 0x00FF00FFu) | ((sample & 0x00FF00FFu) << 8);
+        return (sample >> 16) | (sample << 16);
+    }
+
+    uint bits = 0;
+    for (uint v = 1u << 31; sample != 0; sample >>= 1, v ^= v >> 1)
+        if (sample & 1u)
+            bits ^= v;
+    return bits;
+}
+
+static float uniformFromBits(const uint bits)
+{
+    return (float)(bits >> 8) * (1.f / 16777216.f);
+}
+
+// Random number in [0, 1)
+static float randomUniform(const SceneInfo* sceneInfo, const int index, const int dimension)
+{
+    if ((*sceneInfo).sampler == stSobol)
+    {
+        // Shuffling by a xor only permutes aligned blocks of the sequence, which
+        // keeps the samples of each block stratified
+        const uint sample = (uint)max((*sceneInfo).pathTracingIteration - NB_MAX_ITERATIONS, 0);
+        const uint shuffle = randomBits(-1, dimension / 2, 0);
+        return uniformFromBits(sobolBits(sample ^ shuffle, dimension % 2) ^ randomBits(index, dimension, 0));
+    }
+    return uniformFromBits(randomBits(index, dimension, (*sceneInfo).pathTracingIteration));
+}
+
+// Random number in [-RANDOM_RANGE / 2, RANDOM_RANGE / 2)
+static float randomJitter(const SceneInfo* sceneInfo, const int index, const int dimension)
+{
+    return (randomUniform(sceneInfo, index, dimension) - 0.5f) * RANDOM_RANGE;
+}
+
+// Same for the i-th sample of post processing effects, identical for all pixels
+static float patternJitter(const int i, const int dimension)
+{
+    return (uniformFromBits(randomBits(i, RANDOM_PATTERN + dimension, 0)) - 0.5f) * RANDOM_RANGE;
+}
+
+/*
+________________________________________________________________________________
+
 Mandelbrot Set
 ________________________________________________________________________________
 */
@@ -844,7 +1004,7 @@ ________________________________________________________________________________
 Box intersection
 ________________________________________________________________________________
 */
-static bool boxIntersection(CONST BoundingBox* box, const Ray* ray, const float t0, const float t1)
+static bool boxIntersection(const BoundingBox* box, const Ray* ray, const float t0, const float t1)
 {
     float tmin, tmax, tymin, tymax, tzmin, tzmax;
 
@@ -876,6 +1036,47 @@ static bool boxIntersection(CONST BoundingBox* box, const Ray* ray, const float
 /*
 ________________________________________________________________________________
 
+Returns the box at the given index of the flattened tree. When boxes are
+quantized, corners are decoded relative to the parent box. Boxes are visited
+in depth-first order, so the parent of a box is the last box decoded at the
+previous depth, and ancestors only need to be stored by depth
+________________________________________________________________________________
+*/
+static BoundingBox fetchBox(const SceneInfo* sceneInfo, CONST BoundingBox* boundingBoxes, const int index,
+                            float4* ancestors)
+{
+#ifdef COMPRESSED_BOXES
+    if ((*sceneInfo).compressedBoxes == 0)
+        return boundingBoxes[index];
+
+    CONST float4* frame = (CONST float4*)boundingBoxes;
+    CONST CompressedBoundingBox* nodes = (CONST CompressedBoundingBox*)boundingBoxes;
+    const CompressedBoundingBox node = nodes[COMPRESSED_BOXES_HEADER_SIZE + index];
+    const uint depth = node.indexForNextBox >> 24;
+    const float4 lower = (depth == 0) ? frame[0] : ancestors[2 * (depth - 1)];
+    const float4 upper = (depth == 0) ? frame[1] : ancestors[2 * (depth - 1) + 1];
+    const float4 step = (upper - lower) * (1.f / COMPRESSED_BOXES_QUANTIZATION_STEPS);
+
+    BoundingBox box;
+    box.parameters[0] =
+        lower + step * make_float4((float)node.lower[0], (float)node.lower[1], (float)node.lower[2], 0.f);
+    box.parameters[1] =
+        lower + step * make_float4((float)node.upper[0], (float)node.upper[1], (float)node.upper[2], 0.f);
+    box.nbPrimitives = node.nbPrimitives;
+    box.startIndex = node.startIndex;
+    box.indexForNextBox.x = node.indexForNextBox & 0xFFFFFF;
+    box.indexForNextBox.y = 0;
+    ancestors[2 * depth] = box.parameters[0];
+    ancestors[2 * depth + 1] = box.parameters[1];
+    return box;
+#else
+    return boundingBoxes[index];
+#endif
+}
+
+/*
+________________________________________________________________________________
+
 Ellipsoid intersection
 ________________________________________________________________________________
 */
@@ -1011,10 +1212,11 @@ ________________________________________________________________________________
 Sphere intersection
 ________________________________________________________________________________
 */
-static bool sphereIntersection(const SceneInfo* sceneInfo, CONST Primitive* sphere, CONST Material* materials,
-                               const Ray* ray, float4* intersection, float4* normal, float* shadowIntensity)
+// Distance of the closest intersection in front of the ray origin, along the
+// normalized direction of the ray. back is set when the origin is inside
+static bool sphereDistance(const SceneInfo* sceneInfo, CONST Primitive* sphere, const Ray* ray, float* distance,
+                           bool* back)
 {
-    bool back = false;
     // solve the equation sphere-ray to find the intersections
     float4 O_C = (*ray).origin - (*sphere).p0;
     float4 dir = normalize((*ray).direction);
@@ -1036,7 +1238,7 @@ static bool sphereIntersection(const SceneInfo* sceneInfo, CONST Primitive* sphe
     float t = 0.f;
     if (t1 <= (*sceneInfo).geometryEpsilon)
     {
-        back = true;
+        (*back) = true;
         t = t2;
     }
     else if (t2 <= (*sceneInfo).geometryEpsilon)
@@ -1046,6 +1248,18 @@ static bool sphereIntersection(const SceneInfo* sceneInfo, CONST Primitive* sphe
 
     if (t < (*sceneInfo).geometryEpsilon)
         return false; // Too close to intersection
+    (*distance) = t;
+    return true;
+}
+
+static bool sphereIntersection(const SceneInfo* sceneInfo, CONST Primitive* sphere, CONST Material* materials,
+                               const Ray* ray, float4* intersection, float4* normal, float* shadowIntensity)
+{
+    bool back = false;
+    float t;
+    if (!sphereDistance(sceneInfo, sphere, ray, &t, &back))
+        return false;
+    float4 dir = normalize((*ray).direction);
     (*intersection) = (*ray).origin + t * dir;
 
     if (materials[(*sphere).materialId].attributes.y == 0)
@@ -1067,7 +1281,7 @@ static bool sphereIntersection(const SceneInfo* sceneInfo, CONST Primitive* sphe
         (*normal) *= -1.f;
 
     // Shadow management
-    r = dot(dir, (*normal));
+    float r = dot(dir, (*normal));
     (*shadowIntensity) = (materials[(*sphere).materialId].transparency != 0.f) ? (1.f - fabs(r)) : 1.f;
 
     return true;
@@ -1310,9 +1524,8 @@ ________________________________________________________________________________
 Triangle intersection
 ________________________________________________________________________________
 */
-static bool triangleIntersection(const SceneInfo* sceneInfo, CONST Primitive* triangle, const Ray* ray,
-                                 float4* intersection, float4* normal, float4* areas, float* shadowIntensity,
-                                 const bool processingShadows)
+// Ray parameter of the intersection, before normals are interpolated
+static bool triangleDistance(const SceneInfo* sceneInfo, CONST Primitive* triangle, const Ray* ray, float* distance)
 {
     // Reject rays using the barycentric coordinates of
     // the intersection point with respect to T.
@@ -1359,6 +1572,17 @@ static bool triangleIntersection(const SceneInfo* sceneInfo, CONST Primitive* tr
     float t = dot(E03, Q) / det;
     if (t < 0.f)
         return false;
+    (*distance) = t;
+    return true;
+}
+
+static bool triangleIntersection(const SceneInfo* sceneInfo, CONST Primitive* triangle, const Ray* ray,
+                                 float4* intersection, float4* normal, float4* areas, float* shadowIntensity,
+                                 const bool processingShadows)
+{
+    float t;
+    if (!triangleDistance(sceneInfo, triangle, ray, &t))
+        return false;
 
     // Intersection
     (*intersection) = (*ray).origin + t * (*ray).direction;
@@ -1407,6 +1631,117 @@ static bool triangleIntersection(const SceneInfo* sceneInfo, CONST Primitive* tr
 /*
 ________________________________________________________________________________
 
+Instance intersection
+The ray is transformed into the object space of the mesh, whose boxes are
+walked like the ones of the scene. The closest intersection and its normal are
+transformed back into world space, and meshPrimitive receives the index of the
+primitive of the mesh that was hit. Ray parameters are the same in both spaces
+________________________________________________________________________________
+*/
+static bool instanceIntersection(const SceneInfo* sceneInfo, CONST Primitive* instance,
+                                 CONST BoundingBox* boundingBoxes, CONST Primitive* primitives,
+                                 CONST Material* materials, CONST BitmapBuffer* textures, const Ray* ray,
+                                 const float maxDistance, const bool processingShadows, int* meshPrimitive,
+                                 float4* intersection, float4* normal, float4* areas, float* shadowIntensity)
+{
+    const float3 origin = (*ray).origin.xyz - (*instance).size.xyz;
+    const float3 direction = (*ray).direction.xyz;
+    Ray r;
+    r.origin = make_float4(dot((*instance).p0.xyz, origin), dot((*instance).p1.xyz, origin),
+                           dot((*instance).p2.xyz, origin), 0.f);
+    r.direction = make_float4(dot((*instance).p0.xyz, direction), dot((*instance).p1.xyz, direction),
+                              dot((*instance).p2.xyz, direction), 0.f);
+    computeRayAttributes(&r);
+
+    const float rayLength = length(direction);
+    float minDistance = maxDistance;
+    bool hit = false;
+    int cptBoxes = (int)(*instance).vt0.x;
+    const int lastBox = cptBoxes + (int)(*instance).vt0.y;
+    while (cptBoxes < lastBox)
+    {
+        const BoundingBox box = boundingBoxes[cptBoxes];
+        if (boxIntersection(&box, &r, 0.f, minDistance / rayLength))
+        {
+            for (int cptPrimitives = 0; cptPrimitives < box.nbPrimitives; ++cptPrimitives)
+            {
+                CONST Primitive* primitive = &primitives[box.startIndex + cptPrimitives];
+                if (processingShadows && materials[(*primitive).materialId].attributes.x != 0)
+                    continue;
+
+                float4 objectIntersection = {0.f, 0.f, 0.f, 0.f};
+                float4 objectNormal = {0.f, 0.f, 0.f, 0.f};
+                float4 objectAreas = {0.f, 0.f, 0.f, 0.f};
+                float objectShadowIntensity = 0.f;
+                bool i = false;
+                if ((*sceneInfo).extendedGeometry)
+                {
+                    switch ((*primitive).type)
+                    {
+                    case ptEnvironment:
+                    case ptSphere:
+                        i = sphereIntersection(sceneInfo, primitive, materials, &r, &objectIntersection, &objectNormal,
+                                               &objectShadowIntensity);
+                        break;
+                    case ptCylinder:
+                        i = cylinderIntersection(sceneInfo, primitive, materials, &r, &objectIntersection,
+                                                 &objectNormal, &objectShadowIntensity);
+                        break;
+                    case ptEllipsoid:
+                        i = ellipsoidIntersection(sceneInfo, primitive, materials, &r, &objectIntersection,
+                                                  &objectNormal, &objectShadowIntensity);
+                        break;
+                    case ptTriangle:
+                        i = triangleIntersection(sceneInfo, primitive, &r, &objectIntersection, &objectNormal,
+                                                 &objectAreas, &objectShadowIntensity, processingShadows);
+                        break;
+                    case ptCamera:
+                        break;
+                    default:
+                        i = planeIntersection(sceneInfo, primitive, materials, textures, &r, &objectIntersection,
+                                              &objectNormal, &objectShadowIntensity, false);
+                        break;
+                    }
+                }
+                else
+                    i = triangleIntersection(sceneInfo, primitive, &r, &objectIntersection, &objectNormal,
+                                             &objectAreas, &objectShadowIntensity, processingShadows);
+
+                if (i)
+                {
+                    const float3 p = objectIntersection.xyz;
+                    const float4 worldIntersection = make_float4(dot((*instance).n0.xyz, p) + (*instance).size.x,
+                                                                 dot((*instance).n1.xyz, p) + (*instance).size.y,
+                                                                 dot((*instance).n2.xyz, p) + (*instance).size.z,
+                                                                 (*ray).origin.w);
+                    const float distance = length(worldIntersection - (*ray).origin);
+                    if (distance > (*sceneInfo).geometryEpsilon && distance < minDistance)
+                    {
+                        // Normals are transformed by the transpose of the inverse transformation
+                        const float3 n = normalize((*instance).p0.xyz * objectNormal.x +
+                                                   (*instance).p1.xyz * objectNormal.y +
+                                                   (*instance).p2.xyz * objectNormal.z);
+                        minDistance = distance;
+                        (*meshPrimitive) = box.startIndex + cptPrimitives;
+                        (*intersection) = worldIntersection;
+                        (*normal) = make_float4(n.x, n.y, n.z, 0.f);
+                        (*areas) = objectAreas;
+                        (*shadowIntensity) = objectShadowIntensity;
+                        hit = true;
+                    }
+                }
+            }
+            ++cptBoxes;
+        }
+        else
+            cptBoxes += box.indexForNextBox.x;
+    }
+    return hit;
+}
+
+/*
+________________________________________________________________________________
+
 (*intersection) Shader
 ________________________________________________________________________________
 */
@@ -1496,20 +1831,137 @@ static float4 intersectionShader(const SceneInfo* sceneInfo, CONST Primitive* pr
 /*
 ________________________________________________________________________________
 
+Shadow cast by a primitive on a shadow ray, 0 when the primitive does not
+occlude the lamp. Opaque spheres and triangles are only tested for the
+distance of the intersection, normals being needed to tint the shadows of
+transparent primitives and to cull double sided triangles. Hits closer than
+t0, in units of the ray direction, are ignored. Transparent primitives add
+their tint to color, occluded is set when an opaque primitive fully shadows
+the lamp
+________________________________________________________________________________
+*/
+static float primitiveShadow(const SceneInfo* sceneInfo, CONST BoundingBox* boudingBoxes,
+                             CONST Primitive* primitives, CONST Material* materials, CONST BitmapBuffer* textures,
+                             CONST Primitive* primitive, const int objectId, const Ray* r, const float t0,
+                             float4* color, bool* occluded)
+{
+    if ((*primitive).index == objectId || materials[(*primitive).materialId].attributes.x != 0)
+        return 0.f;
+
+    float4 intersection = {0.f, 0.f, 0.f, 0.f};
+    float4 normal = {0.f, 0.f, 0.f, 0.f};
+    float4 areas = {0.f, 0.f, 0.f, 0.f};
+    float shadowIntensity = 0.f;
+    const bool opaque = materials[(*primitive).materialId].transparency == 0.f;
+    bool hit = false;
+    if ((*primitive).type == ptInstance)
+    {
+        int meshPrimitive = -1;
+        hit = instanceIntersection(sceneInfo, primitive, boudingBoxes, primitives, materials, textures, r,
+                                   length((*r).direction), true, &meshPrimitive, &intersection, &normal, &areas,
+                                   &shadowIntensity);
+        // Shadows take the material of the mesh, unless it is overridden
+        if (hit && (*primitive).vt1.x == 0.f)
+            primitive = &primitives[meshPrimitive];
+    }
+    else if ((*sceneInfo).extendedGeometry)
+    {
+        switch ((*primitive).type)
+        {
+        case ptSphere:
+            if (opaque)
+            {
+                float t = 0.f;
+                bool back = false;
+                hit = sphereDistance(sceneInfo, primitive, r, &t, &back);
+                intersection = (*r).origin + t * normalize((*r).direction);
+                shadowIntensity = 1.f;
+            }
+            else
+                hit = sphereIntersection(sceneInfo, primitive, materials, r, &intersection, &normal,
+                                         &shadowIntensity);
+            break;
+        case ptCylinder:
+            hit = cylinderIntersection(sceneInfo, primitive, materials, r, &intersection, &normal, &shadowIntensity);
+            break;
+        case ptCamera:
+            hit = false;
+            break;
+        case ptEllipsoid:
+            hit = ellipsoidIntersection(sceneInfo, primitive, materials, r, &intersection, &normal, &shadowIntensity);
+            break;
+        case ptTriangle:
+            if (opaque && !(*sceneInfo).doubleSidedTriangles)
+            {
+                float t = 0.f;
+                hit = triangleDistance(sceneInfo, primitive, r, &t);
+                intersection = (*r).origin + t * (*r).direction;
+                shadowIntensity = 1.f;
+            }
+            else
+                hit = triangleIntersection(sceneInfo, primitive, r, &intersection, &normal, &areas,
+                                           &shadowIntensity, true);
+            break;
+        default:
+            hit = planeIntersection(sceneInfo, primitive, materials, textures, r, &intersection, &normal,
+                                    &shadowIntensity, false);
+            break;
+        }
+    }
+    else if (opaque && !(*sceneInfo).doubleSidedTriangles)
+    {
+        float t = 0.f;
+        hit = triangleDistance(sceneInfo, primitive, r, &t);
+        intersection = (*r).origin + t * (*r).direction;
+        shadowIntensity = 1.f;
+    }
+    else
+        hit = triangleIntersection(sceneInfo, primitive, r, &intersection, &normal, &areas, &shadowIntensity, true);
+    if (!hit)
+        return 0.f;
+
+    float4 O_I = intersection - (*r).origin;
+    float4 O_L = (*r).direction;
+    float l = length(O_I);
+    if (!(l > (*sceneInfo).geometryEpsilon && l > t0 * length(O_L) && l < length(O_L)))
+        return 0.f;
+
+    float ratio = shadowIntensity * (*sceneInfo).shadowIntensity;
+    if (materials[(*primitive).materialId].transparency != 0.f)
+    {
+        // Shadow color
+        O_L = normalize(O_L);
+        float a = fabs(dot(O_L, normal));
+        ratio *= (1.f - 0.8f * materials[(*primitive).materialId].transparency) * a;
+        (*color).x += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.x);
+        (*color).y += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.y);
+        (*color).z += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.z);
+    }
+    else
+        (*occluded) = ratio >= (*sceneInfo).shadowIntensity;
+    return ratio;
+}
+
+/*
+________________________________________________________________________________
+
 Shadows computation
 We do not consider the object from which the ray is launched...
 This object cannot shadow itself !
 
 We now have to find the (*intersection) between the considered object and the ray
 which origin is the considered 3D float4 and which direction is defined by the
-light source center.
+light source center. The traversal stops at the first opaque primitive fully
+shadowing the lamp, which is then tested first by the next shadow ray cast
+towards the same lamp. The lamp being occluded, transparent primitives no
+longer tint the shadow
 @return 1.f when pixel is in the shades
 ________________________________________________________________________________
 */
 static float processShadows(const SceneInfo* sceneInfo, CONST BoundingBox* boudingBoxes, const int nbActiveBoxes,
                             CONST Primitive* primitives, CONST Material* materials, CONST BitmapBuffer* textures,
-                            const int nbPrimitives, const float4 lampCenter, const float4 origin, const int objectId,
-                            const int iteration, float4* color)
+                            const int nbPrimitives, const int lamp, const float4 lampCenter, const float4 origin,
+                            const int objectId, const int iteration, float4* color)
 {
     float result = 0.f;
     int cptBoxes = 0;
@@ -1522,80 +1974,53 @@ static float processShadows(const SceneInfo* sceneInfo, CONST BoundingBox* boudi
     computeRayAttributes(&r);
     float minDistance = (iteration < 2) ? (*sceneInfo).viewDistance : (*sceneInfo).viewDistance / (iteration + 1);
 
+    // Hits of the cached occluder are only kept where its box would be hit
+    bool occluded = false;
+    const float t0 = 0.05f;
+    const int occluder = cachedOccluder(lamp);
+    if (occluder >= 0 && occluder < nbPrimitives)
+    {
+        float4 tint = {0.f, 0.f, 0.f, 0.f};
+        primitiveShadow(sceneInfo, boudingBoxes, primitives, materials, textures, &primitives[occluder], objectId, &r,
+                        t0, &tint, &occluded);
+        if (occluded)
+            return (*sceneInfo).shadowIntensity;
+    }
+
+    const bool wide = wideRay(&r);
+    BOX_ANCESTORS(ancestors);
     while (result < (*sceneInfo).shadowIntensity && cptBoxes < nbActiveBoxes)
     {
-        CONST BoundingBox* box = &boudingBoxes[cptBoxes];
-        if (boxIntersection(box, &r, 0.05f, minDistance))
+        BoundingBox decodedBox;
+        if (wide)
+        {
+            if (!wideLeaf(minDistance, &decodedBox))
+                break;
+        }
+        else
+            decodedBox = fetchBox(sceneInfo, boudingBoxes, cptBoxes, ancestors);
+        const BoundingBox* box = &decodedBox;
+        if (boxIntersection(box, &r, t0, minDistance))
         {
+            uint candidates = 0;
             int cptPrimitives = 0;
             while (result < (*sceneInfo).shadowIntensity && cptPrimitives < (*box).nbPrimitives)
             {
-                float4 intersection = {0.f, 0.f, 0.f, 0.f};
-                float4 normal = {0.f, 0.f, 0.f, 0.f};
-                float4 areas = {0.f, 0.f, 0.f, 0.f};
-                float shadowIntensity = 0.f;
-
-                CONST Primitive* primitive = &primitives[(*box).startIndex + cptPrimitives];
-                if ((*primitive).index != objectId && materials[(*primitive).materialId].attributes.x == 0)
+                if ((cptPrimitives & 31) == 0)
+                    candidates = primitiveCandidates(sceneInfo, &r, (*box).startIndex + cptPrimitives,
+                                                     min((*box).nbPrimitives - cptPrimitives, 32), true);
+                if (((candidates >> (cptPrimitives & 31)) & 1) != 0)
                 {
-                    bool hit = false;
-                    if ((*sceneInfo).extendedGeometry)
-                    {
-                        switch ((*primitive).type)
-                        {
-                        case ptSphere:
-                            hit = sphereIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                     &shadowIntensity);
-                            break;
-                        case ptCylinder:
-                            hit = cylinderIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                       &shadowIntensity);
-                            break;
-                        case ptCamera:
-                            hit = false;
-                            break;
-                        case ptEllipsoid:
-                            hit = ellipsoidIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                        &shadowIntensity);
-                            break;
-                        case ptTriangle:
-                            hit = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
-                                                       &shadowIntensity, true);
-                            break;
-                        default:
-                            hit = planeIntersection(sceneInfo, primitive, materials, textures, &r, &intersection,
-                                                    &normal, &shadowIntensity, false);
-                            break;
-                        }
-                    }
-                    else
-                    {
-                        hit = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
-                                                   &shadowIntensity, true);
-                    }
-                    if (hit)
+                    result += primitiveShadow(sceneInfo, boudingBoxes, primitives, materials, textures,
+                                              &primitives[(*box).startIndex + cptPrimitives], objectId, &r, 0.f,
+                                              color, &occluded);
+                    if (occluded)
                     {
-                        float4 O_I = intersection - r.origin;
-                        float4 O_L = r.direction;
-                        float l = length(O_I);
-                        if (l > (*sceneInfo).geometryEpsilon && l < length(O_L))
-                        {
-                            float ratio = shadowIntensity * (*sceneInfo).shadowIntensity;
-                            if (materials[(*primitive).materialId].transparency != 0.f)
-                            {
-                                // Shadow color
-                                O_L = normalize(O_L);
-                                float a = fabs(dot(O_L, normal));
-                                float r = (materials[(*primitive).materialId].transparency == 0.f)
-                                              ? 1.f
-                                              : (1.f - 0.8f * materials[(*primitive).materialId].transparency);
-                                ratio *= r * a;
-                                (*color).x += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.x);
-                                (*color).y += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.y);
-                                (*color).z += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.z);
-                            }
-                            result += ratio;
-                        }
+                        cacheOccluder(lamp, (*box).startIndex + cptPrimitives);
+                        (*color).x = 0.f;
+                        (*color).y = 0.f;
+                        (*color).z = 0.f;
+                        return (*sceneInfo).shadowIntensity;
                     }
                 }
                 ++cptPrimitives;
@@ -1614,6 +2039,85 @@ static float processShadows(const SceneInfo* sceneInfo, CONST BoundingBox* boudi
 /*
 ________________________________________________________________________________
 
+Light importance
+
+Lights are stored first in the light information buffer, followed by the nodes
+of their hierarchy. Nodes store the power of the lights they contain in color.w
+and the radius of their bounds in color.x. The importance is an estimate of the
+light received at the given position.
+________________________________________________________________________________
+*/
+static float lightImportance(CONST LightInformation* lightInformation, const int lightInformationSize,
+                             const int index, const float4 position)
+{
+    CONST LightInformation* light = &lightInformation[index];
+    float power = (*light).color.w;
+    float radius = 0.f;
+    if (index < lightInformationSize)
+        power *= ((*light).color.x + (*light).color.y + (*light).color.z) / 3.f;
+    else
+        radius = (*light).color.x;
+    const float4 delta = (*light).location - position;
+    const float distance = delta.x * delta.x + delta.y * delta.y + delta.z * delta.z;
+    return power / max(distance, max(radius * radius, EPSILON));
+}
+
+/*
+________________________________________________________________________________
+
+Light sampling
+
+Walks down the light hierarchy from its root. Once path tracing has started,
+children are picked randomly according to their importance and the returned
+weight compensates for the probability of the selected light, so that the
+accumulated frames converge to the contribution of all lights. Before that, the
+most important light is picked.
+________________________________________________________________________________
+*/
+static int sampleLight(const SceneInfo* sceneInfo, CONST LightInformation* lightInformation,
+                       const int lightInformationSize, const float4 position, float u, float* weight)
+{
+    (*weight) = 1.f;
+    if (lightInformationSize < 2)
+        return lightInformationSize - 1;
+
+    const bool stochastic = (*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS;
+    float probability = 1.f;
+    int index = lightInformationSize;
+    while (index >= lightInformationSize)
+    {
+        const int left = lightInformation[index].primitiveId;
+        const int right = lightInformation[index].materialId;
+        const float leftImportance = lightImportance(lightInformation, lightInformationSize, left, position);
+        const float rightImportance = lightImportance(lightInformation, lightInformationSize, right, position);
+        const float total = leftImportance + rightImportance;
+        const float p = (total > 0.f) ? leftImportance / total : 0.5f;
+        if (stochastic)
+        {
+            if (u < p)
+            {
+                u /= p;
+                probability *= p;
+                index = left;
+            }
+            else
+            {
+                u = (u - p) / (1.f - p);
+                probability *= 1.f - p;
+                index = right;
+            }
+        }
+        else
+            index = (p >= 0.5f) ? left : right;
+    }
+    if (stochastic)
+        (*weight) = 1.f / (max(probability, EPSILON) * lightInformationSize);
+    return index;
+}
+
+/*
+________________________________________________________________________________
+
 Primitive shader
 ________________________________________________________________________________
 */
@@ -1621,7 +2125,7 @@ static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, const
                               CONST BoundingBox* boundingBoxes, const int nbActiveBoxes, CONST Primitive* primitives,
                               const int nbActivePrimitives, CONST LightInformation* lightInformation,
                               const int lightInformationSize, const int nbActiveLamps, CONST Material* materials,
-                              CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, const float4 origin,
+                              CONST BitmapBuffer* textures, const float4 origin,
                               float4* normal, const int objectId, float4* intersection, const float4 areas,
                               float4* closestColor, const int iteration, float4* refractionFromColor,
                               float* shadowIntensity, float4* totalBlinn, float4* attributes)
@@ -1664,16 +2168,17 @@ static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, const
         int C = 1; // (lightInformationSize>1) ? 2 : 1;
         for (int c = 0; c < C; ++c)
         {
-            int cptLamp = ((*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS)
-                              ? ((*sceneInfo).pathTracingIteration % lightInformationSize + C - 1)
-                              : 0;
+            // Pick one lamp from the light hierarchy instead of scanning all of them
+            float lampWeight = 1.f;
+            const float u = randomUniform(sceneInfo, index, RANDOM_LAMP);
+            const int cptLamp =
+                sampleLight(sceneInfo, lightInformation, lightInformationSize, (*intersection), u, &lampWeight);
 
-            if (lightInformation[cptLamp].primitiveId != (*primitive).index)
+            if (cptLamp >= 0 && lightInformation[cptLamp].primitiveId != (*primitive).index)
             {
                 // randomize lamp center
                 float4 center = lightInformation[cptLamp].location;
 
-                int t = (index + (*sceneInfo).timestamp) % (MAX_BITMAP_SIZE - 3);
                 CONST Material* m = &materials[lightInformation[cptLamp].materialId];
                 const bool condition =
                     (*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS &&
@@ -1683,9 +2188,9 @@ static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, const
                 {
                     float a = (*m).innerIllumination.y * 10.f * (*sceneInfo).pathTracingIteration /
                               (float)((*sceneInfo).maxPathTracingIterations);
-                    center.x += randoms[t] * a;
-                    center.y += randoms[t + 1] * a;
-                    center.z += randoms[t + 2] * a;
+                    center.x += randomJitter(sceneInfo, index, RANDOM_LAMP_POSITION) * a;
+                    center.y += randomJitter(sceneInfo, index, RANDOM_LAMP_POSITION + 1) * a;
+                    center.z += randomJitter(sceneInfo, index, RANDOM_LAMP_POSITION + 2) * a;
                 }
 
                 float4 lightRay = center - (*intersection);
@@ -1707,7 +2212,7 @@ static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, const
                     if (condition)
                         (*shadowIntensity) =
                             processShadows(sceneInfo, boundingBoxes, nbActiveBoxes, primitives, materials, textures,
-                                           nbActivePrimitives, center, (*intersection),
+                                           nbActivePrimitives, cptLamp, center, (*intersection),
                                            lightInformation[cptLamp].primitiveId, iteration, &shadowColor);
 
                     if ((*sceneInfo).graphicsLevel > glNoShading)
@@ -1730,11 +2235,13 @@ static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, const
 
                         if ((*material).innerIllumination.w != 0.f)
                             // Randomize lamp intensity depending on material noise, for more realistic rendering
-                            lambert *= (1.f + randoms[t] * (*material).innerIllumination.w * 100.f);
+                            lambert *= (1.f + randomJitter(sceneInfo, index, RANDOM_LAMP_NOISE) *
+                                           (*material).innerIllumination.w * 100.f);
 
                         lambert *= (1.f - (*shadowIntensity));
                         lambert += (*sceneInfo).backgroundColor.w;
                         lambert *= (1.f - photonEnergy);
+                        lambert *= lampWeight;
 
                         // Lighted object, not in the shades
                         lampsColor += lambert * lightInformation[cptLamp].color - shadowColor;
@@ -1760,6 +2267,7 @@ static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, const
 
                                 blinnTerm = specular.x * pow(blinnTerm, specular.y);
                                 blinnTerm *= (1.f - photonEnergy);
+                                blinnTerm *= lampWeight;
                                 (*totalBlinn).x +=
                                     lightInformation[cptLamp].color.x * lightInformation[cptLamp].color.w * blinnTerm;
                                 (*totalBlinn).y +=
@@ -1819,18 +2327,51 @@ inline bool intersectionWithPrimitives(const SceneInfo* sceneInfo, CONST Boundin
     bool i = false;
     float shadowIntensity = 0.f;
 
+    // When the ray was traced in a packet, only the leaves it reached are
+    // visited, and tested again against the closest intersection
+    const int packet = (iteration < 2) ? packetRay((*ray).origin, (*ray).direction) : -1;
+    int packetCursor = 0;
+    const bool wide = (packet == -1) && wideRay(&r);
+
     int cptBoxes = 0;
+    BOX_ANCESTORS(ancestors);
     while (cptBoxes < nbActiveBoxes)
     {
-        CONST BoundingBox* box = &boundingBoxes[cptBoxes];
+        BoundingBox decodedBox;
+        if (packet != -1)
+        {
+            if (!packetLeaf(packet, &packetCursor, &decodedBox))
+                break;
+        }
+        else if (wide)
+        {
+            if (!wideLeaf(minDistance, &decodedBox))
+                break;
+        }
+        else
+            decodedBox = fetchBox(sceneInfo, boundingBoxes, cptBoxes, ancestors);
+        const BoundingBox* box = &decodedBox;
         if (boxIntersection(box, &r, 0.f, minDistance))
         {
             // Intersection with Box
             if ((*sceneInfo).renderBoxes == 0)
             {
-                // Intersection with primitive within boxes
+                // Intersection with primitive within boxes, skipping the ones
+                // missed by the ray, 32 primitives at a time
+                uint candidates = 0;
                 for (int cptPrimitives = 0; cptPrimitives < (*box).nbPrimitives; ++cptPrimitives)
                 {
+                    if ((cptPrimitives & 31) == 0)
+                    {
+                        const int nbCandidates = min((*box).nbPrimitives - cptPrimitives, 32);
+                        candidates = (packet != -1)
+                                         ? packetCandidates(packet, packetCursor, cptPrimitives, nbCandidates)
+                                         : primitiveCandidates(sceneInfo, &r, (*box).startIndex + cptPrimitives,
+                                                               nbCandidates, false);
+                    }
+                    if (((candidates >> (cptPrimitives & 31)) & 1) == 0)
+                        continue;
+
                     CONST Primitive* primitive = &primitives[(*box).startIndex + cptPrimitives];
                     CONST Material* material = &materials[(*primitive).materialId];
                     const bool condition =
@@ -1840,8 +2381,13 @@ inline bool intersectionWithPrimitives(const SceneInfo* sceneInfo, CONST Boundin
                     if (condition) // !!!! TEST SHALL BE REMOVED TO INCREASE TRANSPARENCY QUALITY !!!
                     {
                         float4 areas = {0.f, 0.f, 0.f, 0.f};
+                        int meshPrimitive = -1;
                         i = false;
-                        if ((*sceneInfo).extendedGeometry)
+                        if ((*primitive).type == ptInstance)
+                            i = instanceIntersection(sceneInfo, primitive, boundingBoxes, primitives, materials,
+                                                     textures, &r, minDistance, false, &meshPrimitive, &intersection,
+                                                     &normal, &areas, &shadowIntensity);
+                        else if ((*sceneInfo).extendedGeometry)
                         {
                             switch ((*primitive).type)
                             {
@@ -1879,9 +2425,13 @@ inline bool intersectionWithPrimitives(const SceneInfo* sceneInfo, CONST Boundin
                             distance < minDistance;
                         if (condition)
                         {
-                            // Only keep intersection with the closest object
+                            // Only keep intersection with the closest object. Primitives of
+                            // meshes are shaded with their own material, unless the
+                            // instance overrides it
                             minDistance = distance;
-                            (*closestPrimitive) = (*box).startIndex + cptPrimitives;
+                            (*closestPrimitive) = (meshPrimitive != -1 && (*primitive).vt1.x == 0.f)
+                                                      ? meshPrimitive
+                                                      : (*box).startIndex + cptPrimitives;
                             (*closestIntersection) = intersection;
                             (*closestNormal) = normal;
                             (*closestAreas) = areas;
@@ -1911,7 +2461,7 @@ inline float4 intersectionsWithPrimitives(const int index, const SceneInfo* scen
                                           const int nbActivePrimitives, CONST Material* materials,
                                           CONST BitmapBuffer* textures, CONST LightInformation* lightInformation,
                                           const int lightInformationSize, const int nbActiveLamps,
-                                          CONST RandomBuffer* randoms, const PostProcessingInfo* postProcessingInfo,
+                                          const PostProcessingInfo* postProcessingInfo,
                                           const Ray* ray)
 {
     Ray r;
@@ -1936,9 +2486,11 @@ inline float4 intersectionsWithPrimitives(const int index, const SceneInfo* scen
     // memset(&normals[0],0,sizeof(bool)*MAXDEPTH);
 
     int cptBoxes = 0;
+    BOX_ANCESTORS(ancestors);
     while (cptBoxes < nbActiveBoxes)
     {
-        CONST BoundingBox* box = &boundingBoxes[cptBoxes];
+        const BoundingBox decodedBox = fetchBox(sceneInfo, boundingBoxes, cptBoxes, ancestors);
+        const BoundingBox* box = &decodedBox;
         if (boxIntersection(box, &r, 0.f, (*sceneInfo).viewDistance))
         {
             // Intersection with primitive within boxes
@@ -1948,7 +2500,16 @@ inline float4 intersectionsWithPrimitives(const int index, const SceneInfo* scen
                 CONST Primitive* primitive = &primitives[(*box).startIndex + cptPrimitives];
                 CONST Material* material = &materials[(*primitive).materialId];
                 float4 areas = {0.f, 0.f, 0.f, 0.f};
-                if ((*sceneInfo).extendedGeometry)
+                if ((*primitive).type == ptInstance)
+                {
+                    int meshPrimitive = -1;
+                    i = instanceIntersection(sceneInfo, primitive, boundingBoxes, primitives, materials, textures, &r,
+                                             (*sceneInfo).viewDistance, false, &meshPrimitive, &intersection, &normal,
+                                             &areas, &shadowIntensity);
+                    if (i && (*primitive).vt1.x == 0.f)
+                        material = &materials[primitives[meshPrimitive].materialId];
+                }
+                else if ((*sceneInfo).extendedGeometry)
                 {
                     switch ((*primitive).type)
                     {
@@ -2001,7 +2562,7 @@ inline float4 intersectionsWithPrimitives(const int index, const SceneInfo* scen
                             color =
                                 primitiveShader(index, sceneInfo, postProcessingInfo, boundingBoxes, nbActiveBoxes,
                                                 primitives, nbActivePrimitives, lightInformation, lightInformationSize,
-                                                nbActiveLamps, materials, textures, randoms, r.origin, &normal,
+                                                nbActiveLamps, materials, textures, r.origin, &normal,
                                                 (*box).startIndex + cptPrimitives, &intersection, areas, &closestColor,
                                                 0, &refractionFromColor, &shadowIntensity, &rBlinn, &attributes);
                         }
@@ -2074,7 +2635,7 @@ inline float4 launchVolumeRendering(const int index, CONST BoundingBox* bounding
                                     CONST Primitive* primitives, const int nbActivePrimitives,
                                     CONST LightInformation* lightInformation, const int lightInformationSize,
                                     const int nbActiveLamps, CONST Material* materials, CONST BitmapBuffer* textures,
-                                    CONST RandomBuffer* randoms, const Ray* ray, const SceneInfo* sceneInfo,
+                                    const Ray* ray, const SceneInfo* sceneInfo,
                                     const PostProcessingInfo* postProcessingInfo, float* depthOfField,
                                     CONST PrimitiveXYIdBuffer* primitiveXYId)
 {
@@ -2083,7 +2644,7 @@ inline float4 launchVolumeRendering(const int index, CONST BoundingBox* bounding
     (*primitiveXYId).z = 0;
     float4 intersectionColor =
         intersectionsWithPrimitives(index, sceneInfo, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                    materials, textures, lightInformation, lightInformationSize, nbActiveLamps, randoms,
+                                    materials, textures, lightInformation, lightInformationSize, nbActiveLamps,
                                     postProcessingInfo, ray);
     return intersectionColor;
 }
@@ -2105,7 +2666,7 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
                                CONST Primitive* primitives, const int nbActivePrimitives,
                                CONST LightInformation* lightInformation, const int lightInformationSize,
                                const int nbActiveLamps, CONST Material* materials, CONST BitmapBuffer* textures,
-                               CONST RandomBuffer* randoms, const Ray* ray, const SceneInfo* sceneInfo,
+                               const Ray* ray, const SceneInfo* sceneInfo,
                                const PostProcessingInfo* postProcessingInfo, float* depthOfField,
                                CONST PrimitiveXYIdBuffer* primitiveXYId)
 {
@@ -2123,19 +2684,22 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
     (*primitiveXYId).z = 0;
     int currentMaterialId = -2;
 
-    // TODO
-    float colorContributions[NB_MAX_ITERATIONS];
-    float4 colors[NB_MAX_ITERATIONS];
-    for (int i = 0; i < NB_MAX_ITERATIONS; ++i)
-    {
-        colorContributions[i] = 0.f;
-        colors[i].x = 0.f;
-        colors[i].y = 0.f;
-        colors[i].z = 0.f;
-        colors[i].w = 0.f;
-    }
-
+    // Bounces are composited front to back. Each one adds its color weighted by
+    // the throughput left by the previous ones, and keeps the share given by its
+    // contribution for the next bounce. The last bounce takes all of it
+    float throughput = 1.f;
+    float4 bounceColor = {0.f, 0.f, 0.f, 0.f};
+    float bounceContribution = 0.f;
+    float firstWeight = 1.f;
+    float reflectedWeight = 1.f;
+    bool terminated = false;
+
+    // Specular highlight, the maximum of the ones of all bounces. It is added
+    // as the increases of that maximum, each one compensated for the Russian
+    // roulette that the path survived before reaching its bounce
     float4 recursiveBlinn = {0.f, 0.f, 0.f, 0.f};
+    float4 specularColor = {0.f, 0.f, 0.f, 0.f};
+    float rouletteWeight = 1.f;
 
     // Variable declarations
     float shadowIntensity = 0.f;
@@ -2163,6 +2727,34 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
 
     while (iteration < currentMaxIteration && rayLength < (*sceneInfo).viewDistance && carryon)
     {
+        if (iteration != 0)
+        {
+            // The previous bounce is followed by this one
+            const float weight = throughput * (1.f - bounceContribution);
+            intersectionColor += bounceColor * weight;
+            if (iteration == 1)
+                firstWeight = weight;
+            if (iteration - 1 == reflectedRays)
+                reflectedWeight = weight;
+            throughput *= bounceContribution;
+
+            // Russian roulette. Once samples are accumulated, paths with a low
+            // throughput survive with a probability proportional to it, and
+            // surviving ones are given back the throughput of the others
+            if ((*sceneInfo).pathTracingIteration > NB_MAX_ITERATIONS && iteration >= RUSSIAN_ROULETTE_DEPTH &&
+                throughput < RUSSIAN_ROULETTE_THROUGHPUT)
+            {
+                const float survival = throughput / RUSSIAN_ROULETTE_THROUGHPUT;
+                if (randomUniform(sceneInfo, index, RANDOM_RUSSIAN_ROULETTE + iteration) >= survival)
+                {
+                    terminated = true;
+                    break;
+                }
+                rouletteWeight /= survival;
+                throughput = RUSSIAN_ROULETTE_THROUGHPUT;
+            }
+        }
+
         float4 areas = {0.f, 0.f, 0.f, 0.f};
         // If no intersection with lamps detected. Now compute intersection with Primitives
         if (carryon)
@@ -2179,23 +2771,17 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
 
             if (iteration == 0)
             {
-                colors[iteration].x = 0.f;
-                colors[iteration].y = 0.f;
-                colors[iteration].z = 0.f;
-                colors[iteration].w = 0.f;
-                colorContributions[iteration] = 1.f;
-
                 firstIntersection = closestIntersection;
                 latestIntersection = closestIntersection;
 
                 if ((*sceneInfo).advancedIllumination == aiBasic || (*sceneInfo).advancedIllumination == aiFull)
                 {
                     // Global illumination
-                    int t = (index + (*sceneInfo).timestamp) % (MAX_BITMAP_SIZE - 3);
+                    const int dimension = RANDOM_GLOBAL_ILLUMINATION + 3 * iteration;
                     pathTracingRay.origin = closestIntersection + normal * (*sceneInfo).rayEpsilon;
-                    pathTracingRay.direction.x = 50.f * randoms[t];
-                    pathTracingRay.direction.y = 50.f * randoms[t + 1];
-                    pathTracingRay.direction.z = 50.f * randoms[t + 2];
+                    pathTracingRay.direction.x = 50.f * randomJitter(sceneInfo, index, dimension);
+                    pathTracingRay.direction.y = 50.f * randomJitter(sceneInfo, index, dimension + 1);
+                    pathTracingRay.direction.z = 50.f * randomJitter(sceneInfo, index, dimension + 2);
 
                     float cos_theta = dot(normalize(pathTracingRay.direction), normal);
                     if (cos_theta < 0.f)
@@ -2216,14 +2802,14 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
 
             // Get object color
             rBlinn.w = attributes.y;
-            colors[iteration] = primitiveShader(index, sceneInfo, postProcessingInfo, boundingBoxes, nbActiveBoxes,
-                                                primitives, nbActivePrimitives, lightInformation, lightInformationSize,
-                                                nbActiveLamps, materials, textures, randoms, rayOrigin.origin, &normal,
-                                                closestPrimitive, &closestIntersection, areas, &closestColor, iteration,
-                                                &refractionFromColor, &shadowIntensity, &rBlinn, &attributes);
+            bounceColor = primitiveShader(index, sceneInfo, postProcessingInfo, boundingBoxes, nbActiveBoxes,
+                                          primitives, nbActivePrimitives, lightInformation, lightInformationSize,
+                                          nbActiveLamps, materials, textures, rayOrigin.origin, &normal,
+                                          closestPrimitive, &closestIntersection, areas, &closestColor, iteration,
+                                          &refractionFromColor, &shadowIntensity, &rBlinn, &attributes);
 
             // Primitive illumination
-            float colorLight = colors[iteration].x + colors[iteration].y + colors[iteration].z;
+            float colorLight = bounceColor.x + bounceColor.y + bounceColor.z;
             (*primitiveXYId).z += (colorLight > (*sceneInfo).transparentColor) ? 16 : 0;
 
             float segmentLength = length(closestIntersection - latestIntersection);
@@ -2246,16 +2832,16 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
                     rayLength += length;
                     rayLength = (rayLength > (*sceneInfo).viewDistance) ? (*sceneInfo).viewDistance : rayLength;
                     a = (rayLength / (*sceneInfo).viewDistance);
-                    colors[iteration].x -= a;
-                    colors[iteration].y -= a;
-                    colors[iteration].z -= a;
+                    bounceColor.x -= a;
+                    bounceColor.y -= a;
+                    bounceColor.z -= a;
                 }
 
                 // Actual refraction
                 float4 O_E = normalize(closestIntersection - rayOrigin.origin);
                 vectorRefraction(&reflectedTarget, O_E, refraction, normal, initialRefraction);
 
-                colorContributions[iteration] = transparency - a;
+                bounceContribution = transparency - a;
 
                 // Prepare next ray
                 initialRefraction = refraction;
@@ -2276,21 +2862,24 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
                 {
                     float4 O_E = normalize(closestIntersection - rayOrigin.origin);
                     vectorReflection(reflectedTarget, O_E, normal);
-                    colorContributions[iteration] = attributes.x;
+                    bounceContribution = attributes.x;
                 }
                 else
                 {
                     // No more intersections with primitives -> skybox
                     carryon = false;
-                    colorContributions[iteration] = 1.f;
+                    bounceContribution = 1.f;
                 }
             }
 
             // Contribute to final color
             rBlinn /= (iteration + 1);
-            recursiveBlinn.x = (rBlinn.x > recursiveBlinn.x) ? rBlinn.x : recursiveBlinn.x;
-            recursiveBlinn.y = (rBlinn.y > recursiveBlinn.y) ? rBlinn.y : recursiveBlinn.y;
-            recursiveBlinn.z = (rBlinn.z > recursiveBlinn.z) ? rBlinn.z : recursiveBlinn.z;
+            float4 highlight = recursiveBlinn;
+            highlight.x = (rBlinn.x > recursiveBlinn.x) ? rBlinn.x : recursiveBlinn.x;
+            highlight.y = (rBlinn.y > recursiveBlinn.y) ? rBlinn.y : recursiveBlinn.y;
+            highlight.z = (rBlinn.z > recursiveBlinn.z) ? rBlinn.z : recursiveBlinn.z;
+            specularColor += (highlight - recursiveBlinn) * rouletteWeight;
+            recursiveBlinn = highlight;
 
             rayOrigin.origin = closestIntersection + reflectedTarget * (*sceneInfo).rayEpsilon;
             rayOrigin.direction = closestIntersection + reflectedTarget;
@@ -2302,17 +2891,16 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
                 // Randomize view
                 float ratio = materials[primitives[closestPrimitive].materialId].color.w;
                 ratio *= (attributes.y == 0.f) ? 1000.f : 1.f;
-                int rindex = (index + (*sceneInfo).timestamp) % (MAX_BITMAP_SIZE - 3);
-                rayOrigin.direction.x += randoms[rindex] * ratio;
-                rayOrigin.direction.y += randoms[rindex + 1] * ratio;
-                rayOrigin.direction.z += randoms[rindex + 2] * ratio;
+                rayOrigin.direction.x += randomJitter(sceneInfo, index, RANDOM_VIEW_NOISE) * ratio;
+                rayOrigin.direction.y += randomJitter(sceneInfo, index, RANDOM_VIEW_NOISE + 1) * ratio;
+                rayOrigin.direction.z += randomJitter(sceneInfo, index, RANDOM_VIEW_NOISE + 2) * ratio;
             }
         }
         else
         {
             // Background
             if ((*sceneInfo).skyboxMaterialId != MATERIAL_NONE)
-                colors[iteration] = skyboxMapping(sceneInfo, materials, textures, &rayOrigin);
+                bounceColor = skyboxMapping(sceneInfo, materials, textures, &rayOrigin);
             else
             {
                 if ((*sceneInfo).extendedGeometry == 2)
@@ -2321,16 +2909,27 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
                     float4 dir = normalize(rayOrigin.direction - rayOrigin.origin);
                     float angle = 0.5f - dot(normal, dir);
                     angle = (angle > 1.f) ? 1.f : angle;
-                    colors[iteration] = (1.f - angle) * (*sceneInfo).backgroundColor;
+                    bounceColor = (1.f - angle) * (*sceneInfo).backgroundColor;
                 }
                 else
-                    colors[iteration] = (*sceneInfo).backgroundColor;
+                    bounceColor = (*sceneInfo).backgroundColor;
             }
-            colorContributions[iteration] = 1.f;
+            bounceContribution = 1.f;
         }
         iteration++;
     }
 
+    if (iteration != 0 && !terminated)
+    {
+        // Last bounce
+        const float weight = throughput;
+        intersectionColor += bounceColor * weight;
+        if (iteration == 1)
+            firstWeight = weight;
+        if (iteration - 1 == reflectedRays)
+            reflectedWeight = weight;
+    }
+
     float4 areas = {0.f, 0.f, 0.f, 0.f};
     if ((*sceneInfo).graphicsLevel >= glReflectionsAndRefractions &&
         reflectedRays != -1) // TODO: Draft mode should only test (*sceneInfo).pathTracingIteration==iteration
@@ -2344,16 +2943,15 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
             attributes.x = materials[primitives[closestPrimitive].materialId].reflection;
             float4 color = primitiveShader(index, sceneInfo, postProcessingInfo, boundingBoxes, nbActiveBoxes,
                                            primitives, nbActivePrimitives, lightInformation, lightInformationSize,
-                                           nbActiveLamps, materials, textures, randoms, reflectedRay.origin, &normal,
+                                           nbActiveLamps, materials, textures, reflectedRay.origin, &normal,
                                            closestPrimitive, &closestIntersection, areas, &closestColor, iteration,
                                            &refractionFromColor, &shadowIntensity, &rBlinn, &attributes);
-            colors[reflectedRays] += color * reflectedRatio;
+            intersectionColor += color * reflectedRatio * reflectedWeight;
 
             (*primitiveXYId).w = shadowIntensity * 255;
         }
     }
 
-    bool test = true;
     const bool condition =
         ((*sceneInfo).advancedIllumination == aiBasic || (*sceneInfo).advancedIllumination == aiFull) &&
         (*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS;
@@ -2394,19 +2992,10 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
                 pathTracingRatio *= 0.5f;
             }
         }
-        if (test)
-            colors[0] += pathTracingColor * pathTracingRatio;
+        intersectionColor += pathTracingColor * pathTracingRatio * firstWeight;
     }
 
-    if (test)
-    {
-        for (int i = iteration - 2; i >= 0; --i)
-            colors[i] = colors[i] * (1.f - colorContributions[i]) + colors[i + 1] * colorContributions[i];
-        intersectionColor = colors[0];
-        intersectionColor += recursiveBlinn;
-    }
-    else
-        intersectionColor = colors[0];
+    intersectionColor += specularColor;
 
     float len = length(firstIntersection - (*ray).origin);
     (*depthOfField) = len;
@@ -2442,127 +3031,277 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
 /*
 ________________________________________________________________________________
 
-Standard renderer
+Adaptive sampling. Once the first NB_MAX_ITERATIONS iterations are done,
+samples of a pixel are accumulated in the post processing buffer, and the sum
+of their squared luminances in sceneInfo.x. The number of samples is kept in
+sceneInfo.w. When the standard error of the mean luminance falls below
+samplingThreshold, relative to that luminance, sceneInfo.y is set and the
+pixel is no longer sampled. Edge pixels of the antialiased camera accumulate
+several samples per iteration, so colors are always averaged by sample count
 ________________________________________________________________________________
 */
-__kernel void k_standardRenderer(const int2 occupancyParameters, int device_split, int stream_split,
-                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
-                                 int nbActivePrimitives, CONST LightInformation* lightInformation,
-                                 int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
-                                 float4 direction, float4 angles, const SceneInfo sceneInfo,
-                                 const PostProcessingInfo postProcessingInfo,
-                                 CONST PostProcessingBuffer* postProcessingBuffer,
-                                 CONST PrimitiveXYIdBuffer* primitiveXYIds)
+static float sampleLuminance(const float4 color)
 {
-    int x = get_global_id(0);
-    int y = get_global_id(1);
-    int index = (stream_split + y) * sceneInfo.size.x + x;
-    if (index > sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
-        return;
+    return 0.299f * color.x + 0.587f * color.y + 0.114f * color.z;
+}
 
-    // Antialisazing
-    float2 AArotatedGrid[4] = {{3.f, 5.f}, {5.f, -3.f}, {-3.f, -5.f}, {-5.f, 3.f}};
+static bool sampleConverged(const SceneInfo* sceneInfo, CONST PostProcessingBuffer* postProcessingBuffer,
+                            const int index)
+{
+    return (*sceneInfo).samplingThreshold > 0.f && (*sceneInfo).pathTracingIteration > NB_MAX_ITERATIONS &&
+           postProcessingBuffer[index].sceneInfo.y != 0.f;
+}
+
+static void addSample(CONST PostProcessingBuffer* postProcessingBuffer, const int index, const float4 color)
+{
+    const float luminance = sampleLuminance(color);
+    postProcessingBuffer[index].colorInfo.x += color.x;
+    postProcessingBuffer[index].colorInfo.y += color.y;
+    postProcessingBuffer[index].colorInfo.z += color.z;
+    postProcessingBuffer[index].sceneInfo.x += luminance * luminance;
+    postProcessingBuffer[index].sceneInfo.w += 1.f;
+}
+
+static void updateConvergence(const SceneInfo* sceneInfo, CONST PostProcessingBuffer* postProcessingBuffer,
+                              const int index)
+{
+    const float n = postProcessingBuffer[index].sceneInfo.w;
+    if ((*sceneInfo).samplingThreshold > 0.f && (*sceneInfo).pathTracingIteration > NB_MAX_ITERATIONS &&
+        n >= NB_MIN_ADAPTIVE_SAMPLES)
+    {
+        // Dark pixels are compared to a minimum luminance, not to their own
+        const float mean = sampleLuminance(postProcessingBuffer[index].colorInfo) / n;
+        const float variance = max(postProcessingBuffer[index].sceneInfo.x / n - mean * mean, 0.f);
+        if (sqrt(variance / n) <= (*sceneInfo).samplingThreshold * max(mean, 0.05f))
+            postProcessingBuffer[index].sceneInfo.y = 1.f;
+    }
+}
+
+static void accumulateSample(const SceneInfo* sceneInfo, CONST PostProcessingBuffer* postProcessingBuffer,
+                             const int index, const float4 color)
+{
+    if ((*sceneInfo).pathTracingIteration <= NB_MAX_ITERATIONS)
+    {
+        postProcessingBuffer[index].colorInfo.x = 0.f;
+        postProcessingBuffer[index].colorInfo.y = 0.f;
+        postProcessingBuffer[index].colorInfo.z = 0.f;
+        postProcessingBuffer[index].sceneInfo.x = 0.f;
+        postProcessingBuffer[index].sceneInfo.y = 0.f;
+        postProcessingBuffer[index].sceneInfo.z = 0.f;
+        postProcessingBuffer[index].sceneInfo.w = 0.f;
+    }
+    addSample(postProcessingBuffer, index, color);
+    updateConvergence(sceneInfo, postProcessingBuffer, index);
+}
 
+// Mean of the samples accumulated by a pixel
+static float4 sampledColor(const SceneInfo* sceneInfo, CONST PostProcessingBuffer* postProcessingBuffer,
+                           const int index)
+{
+    return postProcessingBuffer[index].colorInfo / max(postProcessingBuffer[index].sceneInfo.w, 1.f);
+}
+
+// Pixels that need no rendering in this iteration
+static bool skipPixel(const SceneInfo* sceneInfo, const int2 occupancyParameters,
+                      CONST PostProcessingBuffer* postProcessingBuffer, CONST PrimitiveXYIdBuffer* primitiveXYIds,
+                      const int index)
+{
     // Beware out of bounds error!
     // And only process pixels that need extra rendering
-    const bool condition =
-        index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
-        (sceneInfo.pathTracingIteration > primitiveXYIds[index].y && // Still need to process iterations
-         primitiveXYIds[index].w == 0 &&                             // Shadows? if so, compute soft shadows by randomizing light positions
-         sceneInfo.pathTracingIteration > 0 && sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS);
-    if (condition)
-        return;
+    return index >= (*sceneInfo).size.x * (*sceneInfo).size.y / occupancyParameters.x ||
+           ((*sceneInfo).pathTracingIteration > primitiveXYIds[index].y && // Still need to process iterations
+            primitiveXYIds[index].w == 0 && // Shadows? if so, compute soft shadows by randomizing light positions
+            (*sceneInfo).pathTracingIteration > 0 && (*sceneInfo).pathTracingIteration <= NB_MAX_ITERATIONS) ||
+           sampleConverged(sceneInfo, postProcessingBuffer, index); // Converged pixels need no more samples
+}
+
+/*
+________________________________________________________________________________
+
+Primary ray of the standard renderer, for the given antialiasing sample. The
+CPU engine also calls primary ray functions, to trace rays in packets
+________________________________________________________________________________
+*/
+static Ray standardPrimaryRay(const SceneInfo* sceneInfo, const PostProcessingInfo* postProcessingInfo,
+                              CONST PostProcessingBuffer* postProcessingBuffer, const int index, const int x,
+                              const int y, const int split, const float4 origin,
+                              const float4 direction, const float4 angles, const int sample)
+{
+    // Antialisazing
+    const float2 AArotatedGrid[4] = {{3.f, 5.f}, {5.f, -3.f}, {-3.f, -5.f}, {-5.f, 3.f}};
 
     Ray ray;
     ray.origin = origin;
     ray.direction = direction;
 
     float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
-    if (sceneInfo.cameraType == ctVR)
+    if ((*sceneInfo).cameraType == ctVR)
         rotationCenter = origin;
 
-    bool antialiasingActivated = (sceneInfo.cameraType == ctAntialiazed);
-
-    if (postProcessingInfo.type != ppe_depthOfField && sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS)
+    if ((*postProcessingInfo).type != ppe_depthOfField && (*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS)
     {
         // Randomize view for natural depth of field
-        float a = postProcessingInfo.param1 / 20000.f;
-        int rindex = (index + sceneInfo.timestamp) % (MAX_BITMAP_SIZE - 2);
-        ray.origin.x += randoms[rindex] * postProcessingBuffer[index].colorInfo.w * a;
-        ray.origin.y += randoms[rindex + 1] * postProcessingBuffer[index].colorInfo.w * a;
+        float a = (*postProcessingInfo).param1 / 20000.f;
+        ray.origin.x +=
+            randomJitter(sceneInfo, index, RANDOM_DEPTH_OF_FIELD) * postProcessingBuffer[index].colorInfo.w * a;
+        ray.origin.y +=
+            randomJitter(sceneInfo, index, RANDOM_DEPTH_OF_FIELD + 1) * postProcessingBuffer[index].colorInfo.w * a;
     }
 
-    float dof = 0.f;
-
-    if (sceneInfo.cameraType == ctOrthographic)
+    if ((*sceneInfo).cameraType == ctOrthographic)
     {
-        ray.direction.x = ray.origin.z * 0.001f * (float)(x - (sceneInfo.size.x / 2));
-        ray.direction.y = -ray.origin.z * 0.001f * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
+        ray.direction.x = ray.origin.z * 0.001f * (float)(x - ((*sceneInfo).size.x / 2));
+        ray.direction.y = -ray.origin.z * 0.001f * (float)(split + y - ((*sceneInfo).size.y / 2));
         ray.origin.x = ray.direction.x;
         ray.origin.y = ray.direction.y;
     }
     else
     {
-        float ratio = (float)sceneInfo.size.x / (float)sceneInfo.size.y;
+        float ratio = (float)(*sceneInfo).size.x / (float)(*sceneInfo).size.y;
         float2 step;
-        step.x = ratio * angles.w / (float)sceneInfo.size.x;
-        step.y = angles.w / (float)sceneInfo.size.y;
-        ray.direction.x = ray.direction.x - step.x * (float)(x - (sceneInfo.size.x / 2));
-        ray.direction.y = ray.direction.y + step.y * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
+        step.x = ratio * angles.w / (float)(*sceneInfo).size.x;
+        step.y = angles.w / (float)(*sceneInfo).size.y;
+        ray.direction.x = ray.direction.x - step.x * (float)(x - ((*sceneInfo).size.x / 2));
+        ray.direction.y = ray.direction.y + step.y * (float)(split + y - ((*sceneInfo).size.y / 2));
     }
 
     vectorRotation(&ray.origin, rotationCenter, angles);
     vectorRotation(&ray.direction, rotationCenter, angles);
 
+    ray.direction.x += AArotatedGrid[sample].x;
+    ray.direction.y += AArotatedGrid[sample].y;
+    return ray;
+}
+
+/*
+________________________________________________________________________________
+
+Standard renderer
+________________________________________________________________________________
+*/
+__kernel void k_standardRenderer(const int2 occupancyParameters, int device_split, int stream_split,
+                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
+                                 int nbActivePrimitives, CONST LightInformation* lightInformation,
+                                 int lightInformationSize, int nbActiveLamps, CONST Material* materials,
+                                 CONST BitmapBuffer* textures, float4 origin,
+                                 float4 direction, float4 angles, const SceneInfo sceneInfo,
+                                 const PostProcessingInfo postProcessingInfo,
+                                 CONST PostProcessingBuffer* postProcessingBuffer,
+                                 CONST PrimitiveXYIdBuffer* primitiveXYIds)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int index = (stream_split + y) * sceneInfo.size.x + x;
+    if (index > sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
+        return;
+
+    if (skipPixel(&sceneInfo, occupancyParameters, postProcessingBuffer, primitiveXYIds, index))
+        return;
+
+    // The antialiased camera also starts with one sample per pixel, edge
+    // pixels being supersampled by k_antialiasingRenderer
+    float dof = 0.f;
+    const int split = device_split + stream_split;
+
     float4 color = {0.f, 0.f, 0.f, 0.f};
-    Ray r = ray;
-    if (antialiasingActivated)
-    {
-        for (int I = 0; I < 4; ++I)
-        {
-            r.direction.x = ray.direction.x + AArotatedGrid[I].x;
-            r.direction.y = ray.direction.y + AArotatedGrid[I].y;
-            float4 c = launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                        lightInformation, lightInformationSize, nbActiveLamps, materials, textures,
-                                        randoms, &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
-            color += c;
-        }
-    }
-    else
-    {
-        r.direction.x = ray.direction.x + AArotatedGrid[sceneInfo.pathTracingIteration % 4].x;
-        r.direction.y = ray.direction.y + AArotatedGrid[sceneInfo.pathTracingIteration % 4].y;
-    }
+    Ray r = standardPrimaryRay(&sceneInfo, &postProcessingInfo, postProcessingBuffer, index, x, y, split,
+                               origin, direction, angles, sceneInfo.pathTracingIteration % 4);
     color += launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives, lightInformation,
-                              lightInformationSize, nbActiveLamps, materials, textures, randoms, &r, &sceneInfo,
+                              lightInformationSize, nbActiveLamps, materials, textures, &r, &sceneInfo,
                               &postProcessingInfo, &dof, &primitiveXYIds[index]);
 
     if (sceneInfo.advancedIllumination == aiRandomIllumination)
     {
         // Randomize light intensity
-        int rindex = (index + sceneInfo.timestamp) % MAX_BITMAP_SIZE;
-        color += sceneInfo.backgroundColor * randoms[rindex] * 5.f;
+        color += sceneInfo.backgroundColor * randomJitter(&sceneInfo, index, RANDOM_ILLUMINATION) * 5.f;
     }
 
-    if (antialiasingActivated)
-        color /= 5.f;
-
     if (sceneInfo.pathTracingIteration == 0)
         postProcessingBuffer[index].colorInfo.w = dof;
 
-    if (sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
+    accumulateSample(&sceneInfo, postProcessingBuffer, index, color);
+}
+
+/*
+________________________________________________________________________________
+
+Edges of the antialiased camera, found once every pixel has its first sample.
+A pixel is on an edge when one of its neighbours sees another primitive, or
+lies at a significantly different depth. Edge pixels are flagged in the
+sceneInfo.z component of the post processing buffer
+________________________________________________________________________________
+*/
+__kernel void k_antialiasingEdges(const int2 occupancyParameters, const SceneInfo sceneInfo,
+                                  CONST PrimitiveXYIdBuffer* primitiveXYIds,
+                                  CONST PostProcessingBuffer* postProcessingBuffer)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int index = y * sceneInfo.size.x + x;
+
+    // Beware out of bounds error!
+    if (index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
+        return;
+
+    const int2 neighbours[4] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    const int primitive = primitiveXYIds[index].x;
+    const float depth = postProcessingBuffer[index].colorInfo.w;
+    bool edge = false;
+    for (int i = 0; i < 4; ++i)
     {
-        postProcessingBuffer[index].colorInfo.x = color.x;
-        postProcessingBuffer[index].colorInfo.y = color.y;
-        postProcessingBuffer[index].colorInfo.z = color.z;
+        const int xx = x + neighbours[i].x;
+        const int yy = y + neighbours[i].y;
+        if (xx >= 0 && xx < sceneInfo.size.x && yy >= 0 && yy < sceneInfo.size.y)
+        {
+            const int localIndex = yy * sceneInfo.size.x + xx;
+            const float localDepth = postProcessingBuffer[localIndex].colorInfo.w;
+            edge = edge || primitiveXYIds[localIndex].x != primitive ||
+                   fabs(localDepth - depth) > ANTIALIASING_DEPTH_RATIO * max(localDepth, depth);
+        }
     }
-    else
+    postProcessingBuffer[index].sceneInfo.z = edge ? 1.f : 0.f;
+}
+
+/*
+________________________________________________________________________________
+
+Antialiasing renderer. Pixels flagged by k_antialiasingEdges receive the 4
+samples of the rotated grid, on top of the one of the standard renderer
+________________________________________________________________________________
+*/
+__kernel void k_antialiasingRenderer(const int2 occupancyParameters, int device_split, int stream_split,
+                                     CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
+                                     int nbActivePrimitives, CONST LightInformation* lightInformation,
+                                     int lightInformationSize, int nbActiveLamps, CONST Material* materials,
+                                     CONST BitmapBuffer* textures, float4 origin,
+                                     float4 direction, float4 angles, const SceneInfo sceneInfo,
+                                     const PostProcessingInfo postProcessingInfo,
+                                     CONST PostProcessingBuffer* postProcessingBuffer,
+                                     CONST PrimitiveXYIdBuffer* primitiveXYIds)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int index = (stream_split + y) * sceneInfo.size.x + x;
+    if (skipPixel(&sceneInfo, occupancyParameters, postProcessingBuffer, primitiveXYIds, index) ||
+        postProcessingBuffer[index].sceneInfo.z == 0.f)
+        return;
+
+    float dof = 0.f;
+    const int split = device_split + stream_split;
+    const int primitive = primitiveXYIds[index].x;
+    for (int I = 0; I < 4; ++I)
     {
-        postProcessingBuffer[index].colorInfo.x += color.x;
-        postProcessingBuffer[index].colorInfo.y += color.y;
-        postProcessingBuffer[index].colorInfo.z += color.z;
+        Ray r = standardPrimaryRay(&sceneInfo, &postProcessingInfo, postProcessingBuffer, index, x, y, split,
+                                   origin, direction, angles, I);
+        float4 color = launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
+                                        lightInformation, lightInformationSize, nbActiveLamps, materials, textures,
+                                        &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
+        addSample(postProcessingBuffer, index, color);
     }
+    updateConvergence(&sceneInfo, postProcessingBuffer, index);
+
+    // Keep the primitive seen by the first sample, for the edges of the next iteration
+    primitiveXYIds[index].x = primitive;
 }
 
 /*
@@ -2575,7 +3314,7 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
                                CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
                                int nbActivePrimitives, CONST LightInformation* lightInformation,
                                int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                               CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
+                               CONST BitmapBuffer* textures, float4 origin,
                                float4 direction, float4 angles, const SceneInfo sceneInfo,
                                const PostProcessingInfo postProcessingInfo,
                                CONST PostProcessingBuffer* postProcessingBuffer,
@@ -2588,15 +3327,7 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
     // Antialisazing
     float2 AArotatedGrid[4] = {{3.f, 5.f}, {5.f, -3.f}, {-3.f, -5.f}, {-5.f, 3.f}};
 
-    // Beware out of bounds error!
-    // And only process pixels that need extra rendering
-    const bool condition =
-        index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
-        (sceneInfo.pathTracingIteration > primitiveXYIds[index].y && // Still need to process iterations
-         primitiveXYIds[index].w == 0 && // Shadows? if so, compute soft shadows by randomizing light positions
-         sceneInfo.pathTracingIteration > 0 && sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS);
-
-    if (condition)
+    if (skipPixel(&sceneInfo, occupancyParameters, postProcessingBuffer, primitiveXYIds, index))
         return;
 
     Ray ray;
@@ -2613,9 +3344,10 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
     {
         // Randomize view for natural depth of field
         float a = postProcessingInfo.param1 / 20000.f;
-        int rindex = (index + sceneInfo.timestamp) % (MAX_BITMAP_SIZE - 2);
-        ray.origin.x += randoms[rindex] * postProcessingBuffer[index].colorInfo.w * a;
-        ray.origin.y += randoms[rindex + 1] * postProcessingBuffer[index].colorInfo.w * a;
+        ray.origin.x +=
+            randomJitter(&sceneInfo, index, RANDOM_DEPTH_OF_FIELD) * postProcessingBuffer[index].colorInfo.w * a;
+        ray.origin.y +=
+            randomJitter(&sceneInfo, index, RANDOM_DEPTH_OF_FIELD + 1) * postProcessingBuffer[index].colorInfo.w * a;
     }
 
     float dof = 0.f;
@@ -2651,7 +3383,7 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
             float4 c =
                 launchVolumeRendering(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
                                       lightInformation, lightInformationSize, nbActiveLamps, materials, textures,
-                                      randoms, &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
+                                      &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
             color += c;
         }
     }
@@ -2661,14 +3393,13 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
         r.direction.y = ray.direction.y + AArotatedGrid[sceneInfo.pathTracingIteration % 4].y;
     }
     color += launchVolumeRendering(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                   lightInformation, lightInformationSize, nbActiveLamps, materials, textures, randoms,
-                                   &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
+                                   lightInformation, lightInformationSize, nbActiveLamps, materials, textures, &r,
+                                   &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
 
     if (sceneInfo.advancedIllumination == aiRandomIllumination)
     {
         // Randomize light intensity
-        int rindex = (index + sceneInfo.timestamp) % MAX_BITMAP_SIZE;
-        color += sceneInfo.backgroundColor * randoms[rindex] * 5.f;
+        color += sceneInfo.backgroundColor * randomJitter(&sceneInfo, index, RANDOM_ILLUMINATION) * 5.f;
     }
 
     if (antialiasingActivated)
@@ -2677,18 +3408,45 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
     if (sceneInfo.pathTracingIteration == 0)
         postProcessingBuffer[index].colorInfo.w = dof;
 
-    if (sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-    {
-        postProcessingBuffer[index].colorInfo.x = color.x;
-        postProcessingBuffer[index].colorInfo.y = color.y;
-        postProcessingBuffer[index].colorInfo.z = color.z;
-    }
-    else
-    {
-        postProcessingBuffer[index].colorInfo.x += color.x;
-        postProcessingBuffer[index].colorInfo.y += color.y;
-        postProcessingBuffer[index].colorInfo.z += color.z;
-    }
+    accumulateSample(&sceneInfo, postProcessingBuffer, index, color);
+}
+
+/*
+________________________________________________________________________________
+
+Ray of the given eye for the anaglyph renderer
+________________________________________________________________________________
+*/
+static Ray anaglyphEyeRay(const SceneInfo* sceneInfo, CONST PrimitiveXYIdBuffer* primitiveXYIds, const int x,
+                          const int y, const float4 origin, const float4 direction, const float4 angles,
+                          const bool leftEye)
+{
+    float focus = primitiveXYIds[(*sceneInfo).size.x * (*sceneInfo).size.y / 2].x - origin.z;
+    float eyeSeparation = (*sceneInfo).eyeSeparation * (focus / direction.z);
+
+    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
+    if ((*sceneInfo).cameraType == ctVR)
+        rotationCenter = origin;
+
+    float ratio = (float)(*sceneInfo).size.x / (float)(*sceneInfo).size.y;
+    float2 step;
+    step.x = 4.f * ratio * angles.w / (float)(*sceneInfo).size.x;
+    step.y = 4.f * angles.w / (float)(*sceneInfo).size.y;
+
+    Ray eyeRay;
+    eyeRay.origin = origin;
+    eyeRay.direction = direction;
+    eyeRay.origin.x = leftEye ? origin.x + eyeSeparation : origin.x - eyeSeparation;
+    eyeRay.origin.y = origin.y;
+    eyeRay.origin.z = origin.z;
+
+    eyeRay.direction.x = direction.x - step.x * (float)(x - ((*sceneInfo).size.x / 2));
+    eyeRay.direction.y = direction.y + step.y * (float)(y - ((*sceneInfo).size.y / 2));
+    eyeRay.direction.z = direction.z;
+
+    // vectorRotation( eyeRay.origin, rotationCenter, angles );
+    vectorRotation(&eyeRay.direction, rotationCenter, angles);
+    return eyeRay;
 }
 
 /*
@@ -2701,7 +3459,7 @@ __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_spli
                                  CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
                                  int nbActivePrimitives, CONST LightInformation* lightInformation,
                                  int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
+                                 CONST BitmapBuffer* textures, float4 origin,
                                  float4 direction, float4 angles, const SceneInfo sceneInfo,
                                  const PostProcessingInfo postProcessingInfo,
                                  CONST PostProcessingBuffer* postProcessingBuffer,
@@ -2712,16 +3470,11 @@ __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_spli
     int index = y * sceneInfo.size.x + x;
 
     // Beware out of bounds error!
-    if (index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
+    // And only process pixels that need extra rendering
+    if (index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
+        sampleConverged(&sceneInfo, postProcessingBuffer, index))
         return;
 
-    float focus = primitiveXYIds[sceneInfo.size.x * sceneInfo.size.y / 2].x - origin.z;
-    float eyeSeparation = sceneInfo.eyeSeparation * (focus / direction.z);
-
-    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
-    if (sceneInfo.cameraType == ctVR)
-        rotationCenter = origin;
-
     if (sceneInfo.pathTracingIteration == 0)
     {
         postProcessingBuffer[index].colorInfo.x = 0.f;
@@ -2731,44 +3484,19 @@ __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_spli
     }
 
     float dof = postProcessingInfo.param1;
-    Ray eyeRay;
-
-    float ratio = (float)sceneInfo.size.x / (float)sceneInfo.size.y;
-    float2 step;
-    step.x = 4.f * ratio * angles.w / (float)sceneInfo.size.x;
-    step.y = 4.f * angles.w / (float)sceneInfo.size.y;
 
     // Left eye
-    eyeRay.origin.x = origin.x + eyeSeparation;
-    eyeRay.origin.y = origin.y;
-    eyeRay.origin.z = origin.z;
-
-    eyeRay.direction.x = direction.x - step.x * (float)(x - (sceneInfo.size.x / 2));
-    eyeRay.direction.y = direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
-    eyeRay.direction.z = direction.z;
-
-    // vectorRotation( eyeRay.origin, rotationCenter, angles );
-    vectorRotation(&eyeRay.direction, rotationCenter, angles);
-
+    Ray eyeRay = anaglyphEyeRay(&sceneInfo, primitiveXYIds, x, y, origin, direction, angles, true);
     float4 colorLeft =
         launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives, lightInformation,
-                         lightInformationSize, nbActiveLamps, materials, textures, randoms, &eyeRay, &sceneInfo,
+                         lightInformationSize, nbActiveLamps, materials, textures, &eyeRay, &sceneInfo,
                          &postProcessingInfo, &dof, &primitiveXYIds[index]);
 
     // Right eye
-    eyeRay.origin.x = origin.x - eyeSeparation;
-    eyeRay.origin.y = origin.y;
-    eyeRay.origin.z = origin.z;
-
-    eyeRay.direction.x = direction.x - step.x * (float)(x - (sceneInfo.size.x / 2));
-    eyeRay.direction.y = direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
-    eyeRay.direction.z = direction.z;
-
-    vectorRotation(&eyeRay.direction, rotationCenter, angles);
-
+    eyeRay = anaglyphEyeRay(&sceneInfo, primitiveXYIds, x, y, origin, direction, angles, false);
     float4 colorRight =
         launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives, lightInformation,
-                         lightInformationSize, nbActiveLamps, materials, textures, randoms, &eyeRay, &sceneInfo,
+                         lightInformationSize, nbActiveLamps, materials, textures, &eyeRay, &sceneInfo,
                          &postProcessingInfo, &dof, &primitiveXYIds[index]);
 
     float r1 = colorLeft.x * 0.299f + colorLeft.y * 0.587f + colorLeft.z * 0.114f;
@@ -2781,18 +3509,68 @@ __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_spli
 
     if (sceneInfo.pathTracingIteration == 0)
         postProcessingBuffer[index].colorInfo.w = dof;
-    if (sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
+    const float4 color = {r1 + r2, g1 + g2, b1 + b2, 0.f};
+    accumulateSample(&sceneInfo, postProcessingBuffer, index, color);
+}
+
+/*
+________________________________________________________________________________
+
+Ray of the 3D vision renderer, the left half of the frame being seen by the
+left eye. Returns false for pixels outside of the lenses
+________________________________________________________________________________
+*/
+static bool visionEyeRay(const SceneInfo* sceneInfo, CONST PrimitiveXYIdBuffer* primitiveXYIds, const int x,
+                         const int y, const float4 origin, const float4 direction, const float4 angles, Ray* eyeRay)
+{
+    float focus = primitiveXYIds[(*sceneInfo).size.x * (*sceneInfo).size.y / 2].x - origin.z;
+    float eyeSeparation = (*sceneInfo).eyeSeparation * (direction.z / focus);
+
+    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
+    if ((*sceneInfo).cameraType == ctVR)
+        rotationCenter = origin;
+
+    int halfWidth = (*sceneInfo).size.x / 2;
+
+    float ratio = (float)(*sceneInfo).size.x / (float)(*sceneInfo).size.y;
+    float2 step;
+    step.x = ratio * angles.w / (float)(*sceneInfo).size.x;
+    step.y = angles.w / (float)(*sceneInfo).size.y;
+
+    (*eyeRay).origin = origin;
+    (*eyeRay).direction = direction;
+    if (x < halfWidth)
     {
-        postProcessingBuffer[index].colorInfo.x = r1 + r2;
-        postProcessingBuffer[index].colorInfo.y = g1 + g2;
-        postProcessingBuffer[index].colorInfo.z = b1 + b2;
+        // Left eye
+        (*eyeRay).origin.x = origin.x + eyeSeparation;
+        (*eyeRay).origin.y = origin.y;
+        (*eyeRay).origin.z = origin.z;
+
+        (*eyeRay).direction.x =
+            direction.x - step.x * (float)(x - ((*sceneInfo).size.x / 2) + halfWidth / 2) + (*sceneInfo).eyeSeparation;
+        (*eyeRay).direction.y = direction.y + step.y * (float)(y - ((*sceneInfo).size.y / 2));
+        (*eyeRay).direction.z = direction.z;
     }
     else
     {
-        postProcessingBuffer[index].colorInfo.x += r1 + r2;
-        postProcessingBuffer[index].colorInfo.y += g1 + g2;
-        postProcessingBuffer[index].colorInfo.z += b1 + b2;
+        // Right eye
+        (*eyeRay).origin.x = origin.x - eyeSeparation;
+        (*eyeRay).origin.y = origin.y;
+        (*eyeRay).origin.z = origin.z;
+
+        (*eyeRay).direction.x =
+            direction.x - step.x * (float)(x - ((*sceneInfo).size.x / 2) - halfWidth / 2) - (*sceneInfo).eyeSeparation;
+        (*eyeRay).direction.y = direction.y + step.y * (float)(y - ((*sceneInfo).size.y / 2));
+        (*eyeRay).direction.z = direction.z;
     }
+
+    if (sqrt((*eyeRay).direction.x * (*eyeRay).direction.x + (*eyeRay).direction.y * (*eyeRay).direction.y) >
+        (halfWidth * 6))
+        return false;
+
+    vectorRotation(&(*eyeRay).origin, rotationCenter, angles);
+    vectorRotation(&(*eyeRay).direction, rotationCenter, angles);
+    return true;
 }
 
 /*
@@ -2805,7 +3583,7 @@ __kernel void k_3DVisionRenderer(const int2 occupancyParameters, int device_spli
                                  CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
                                  int nbActivePrimitives, CONST LightInformation* lightInformation,
                                  int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
+                                 CONST BitmapBuffer* textures, float4 origin,
                                  float4 direction, float4 angles, const SceneInfo sceneInfo,
                                  const PostProcessingInfo postProcessingInfo,
                                  CONST PostProcessingBuffer* postProcessingBuffer,
@@ -2816,16 +3594,11 @@ __kernel void k_3DVisionRenderer(const int2 occupancyParameters, int device_spli
     int index = y * sceneInfo.size.x + x;
 
     // Beware out of bounds error!
-    if (index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
+    // And only process pixels that need extra rendering
+    if (index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
+        sampleConverged(&sceneInfo, postProcessingBuffer, index))
         return;
 
-    float focus = primitiveXYIds[sceneInfo.size.x * sceneInfo.size.y / 2].x - origin.z;
-    float eyeSeparation = sceneInfo.eyeSeparation * (direction.z / focus);
-
-    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
-    if (sceneInfo.cameraType == ctVR)
-        rotationCenter = origin;
-
     if (sceneInfo.pathTracingIteration == 0)
     {
         postProcessingBuffer[index].colorInfo.x = 0.f;
@@ -2835,68 +3608,26 @@ __kernel void k_3DVisionRenderer(const int2 occupancyParameters, int device_spli
     }
 
     float dof = postProcessingInfo.param1;
-    int halfWidth = sceneInfo.size.x / 2;
-
-    float ratio = (float)sceneInfo.size.x / (float)sceneInfo.size.y;
-    float2 step;
-    step.x = ratio * angles.w / (float)sceneInfo.size.x;
-    step.y = angles.w / (float)sceneInfo.size.y;
 
     Ray eyeRay;
-    if (x < halfWidth)
-    {
-        // Left eye
-        eyeRay.origin.x = origin.x + eyeSeparation;
-        eyeRay.origin.y = origin.y;
-        eyeRay.origin.z = origin.z;
-
-        eyeRay.direction.x =
-            direction.x - step.x * (float)(x - (sceneInfo.size.x / 2) + halfWidth / 2) + sceneInfo.eyeSeparation;
-        eyeRay.direction.y = direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
-        eyeRay.direction.z = direction.z;
-    }
-    else
+    if (!visionEyeRay(&sceneInfo, primitiveXYIds, x, y, origin, direction, angles, &eyeRay))
     {
-        // Right eye
-        eyeRay.origin.x = origin.x - eyeSeparation;
-        eyeRay.origin.y = origin.y;
-        eyeRay.origin.z = origin.z;
-
-        eyeRay.direction.x =
-            direction.x - step.x * (float)(x - (sceneInfo.size.x / 2) - halfWidth / 2) - sceneInfo.eyeSeparation;
-        eyeRay.direction.y = direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
-        eyeRay.direction.z = direction.z;
-    }
-
-    if (sqrt(eyeRay.direction.x * eyeRay.direction.x + eyeRay.direction.y * eyeRay.direction.y) > (halfWidth * 6))
+        // Nothing to sample outside of the lenses
+        postProcessingBuffer[index].sceneInfo.y = 1.f;
         return;
-
-    vectorRotation(&eyeRay.origin, rotationCenter, angles);
-    vectorRotation(&eyeRay.direction, rotationCenter, angles);
+    }
 
     float4 color = launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                    lightInformation, lightInformationSize, nbActiveLamps, materials, textures, randoms,
+                                    lightInformation, lightInformationSize, nbActiveLamps, materials, textures,
                                     &eyeRay, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
 
     // Randomize light intensity
-    int rindex = (index + sceneInfo.timestamp) % MAX_BITMAP_SIZE;
-    color += sceneInfo.backgroundColor * randoms[rindex] * 5.f;
+    color += sceneInfo.backgroundColor * randomJitter(&sceneInfo, index, RANDOM_ILLUMINATION) * 5.f;
 
     // Contribute to final image
     if (sceneInfo.pathTracingIteration == 0)
         postProcessingBuffer[index].colorInfo.w = dof;
-    if (sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
-    {
-        postProcessingBuffer[index].colorInfo.x = color.x;
-        postProcessingBuffer[index].colorInfo.y = color.y;
-        postProcessingBuffer[index].colorInfo.z = color.z;
-    }
-    else
-    {
-        postProcessingBuffer[index].colorInfo.x += color.x;
-        postProcessingBuffer[index].colorInfo.y += color.y;
-        postProcessingBuffer[index].colorInfo.z += color.z;
-    }
+    accumulateSample(&sceneInfo, postProcessingBuffer, index, color);
 }
 
 /*
@@ -2909,7 +3640,7 @@ __kernel void k_fishEyeRenderer(const int2 occupancyParameters, int device_split
                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
                                 int nbActivePrimitives, CONST LightInformation* lightInformation,
                                 int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                                CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
+                                CONST BitmapBuffer* textures, float4 origin,
                                 float4 direction, float4 angles, const SceneInfo sceneInfo,
                                 const PostProcessingInfo postProcessingInfo,
                                 CONST PostProcessingBuffer* postProcessingBuffer,
@@ -2934,9 +3665,7 @@ __kernel void k_default(const int2 occupancyParameters, const SceneInfo sceneInf
     if (index > sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
         return;
 
-    float4 localColor = postProcessingBuffer[index].colorInfo;
-    if (sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-        localColor /= (float)(sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
+    float4 localColor = sampledColor(&sceneInfo, postProcessingBuffer, index);
     makeColor(&sceneInfo, &localColor, bitmap, index);
 }
 
@@ -2946,9 +3675,9 @@ ________________________________________________________________________________
 Post Processing Effect: Depth of field
 ________________________________________________________________________________
 */
-__kernel void k_depthOfField(const int2 occupancyParameters, const SceneInfo sceneInfo, const PostProcessingInfo postProcessingInfo,
-                             CONST PostProcessingBuffer* postProcessingBuffer, CONST RandomBuffer* randoms,
-                             CONST BitmapBuffer* bitmap)
+__kernel void k_depthOfField(const int2 occupancyParameters, const SceneInfo sceneInfo,
+                             const PostProcessingInfo postProcessingInfo,
+                             CONST PostProcessingBuffer* postProcessingBuffer, CONST BitmapBuffer* bitmap)
 {
     int x = get_global_id(0);
     int y = get_global_id(1);
@@ -2964,23 +3693,18 @@ __kernel void k_depthOfField(const int2 occupancyParameters, const SceneInfo sce
 
     for (int i = 0; i < postProcessingInfo.param3; ++i)
     {
-        int ix = i % wh;
-        int iy = (i + 100) % wh;
-        int xx = x + depth * randoms[ix] * postProcessingInfo.param2;
-        int yy = y + depth * randoms[iy] * postProcessingInfo.param2;
+        int xx = x + depth * patternJitter(i, 0) * postProcessingInfo.param2;
+        int yy = y + depth * patternJitter(i, 1) * postProcessingInfo.param2;
         if (xx >= 0 && xx < sceneInfo.size.x && yy >= 0 && yy < sceneInfo.size.y)
         {
             int localIndex = yy * sceneInfo.size.x + xx;
             if (localIndex >= 0 && localIndex < wh)
-                localColor += postProcessingBuffer[localIndex].colorInfo;
+                localColor += sampledColor(&sceneInfo, postProcessingBuffer, localIndex);
         }
         else
-            localColor += postProcessingBuffer[index].colorInfo;
+            localColor += sampledColor(&sceneInfo, postProcessingBuffer, index);
     }
     localColor /= postProcessingInfo.param3;
-
-    if (sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-        localColor /= (float)(sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
     localColor.w = 1.f;
     makeColor(&sceneInfo, &localColor, bitmap, index);
 }
@@ -2993,8 +3717,7 @@ ________________________________________________________________________________
 */
 __kernel void k_ambientOcclusion(const int2 occupancyParameters, SceneInfo sceneInfo,
                                  PostProcessingInfo postProcessingInfo,
-                                 CONST PostProcessingBuffer* postProcessingBuffer, CONST RandomBuffer* randoms,
-                                 CONST BitmapBuffer* bitmap)
+                                 CONST PostProcessingBuffer* postProcessingBuffer, CONST BitmapBuffer* bitmap)
 {
     int x = get_global_id(0);
     int y = get_global_id(1);
@@ -3003,7 +3726,6 @@ __kernel void k_ambientOcclusion(const int2 occupancyParameters, SceneInfo scene
     if (index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
         return;
 
-    int wh = sceneInfo.size.x * sceneInfo.size.y;
     float occ = 0.f;
     float4 localColor = postProcessingBuffer[index].colorInfo;
     float depth = localColor.w;
@@ -3014,12 +3736,12 @@ __kernel void k_ambientOcclusion(const int2 occupancyParameters, SceneInfo scene
     {
         for (int Y = -step; Y < step; Y += 2)
         {
-            int ix = i % wh;
-            int iy = (i + 100) % wh;
+            const float jitterX = patternJitter(i, 0);
+            const float jitterY = patternJitter(i, 1);
             ++i;
             c += 1.f;
-            int xx = x + (X * postProcessingInfo.param2 * randoms[ix] / 10.f);
-            int yy = y + (Y * postProcessingInfo.param2 * randoms[iy] / 10.f);
+            int xx = x + (X * postProcessingInfo.param2 * jitterX / 10.f);
+            int yy = y + (Y * postProcessingInfo.param2 * jitterY / 10.f);
             if (xx >= 0 && xx < sceneInfo.size.x && yy >= 0 && yy < sceneInfo.size.y)
             {
                 int localIndex = yy * sceneInfo.size.x + xx;
@@ -3034,8 +3756,7 @@ __kernel void k_ambientOcclusion(const int2 occupancyParameters, SceneInfo scene
     // occ += 0.3f; // Ambient light
     occ = (occ > 1.f) ? 1.f : occ;
     occ = (occ < 0.f) ? 0.f : occ;
-    if (sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-        localColor /= (float)(sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
+    localColor = sampledColor(&sceneInfo, postProcessingBuffer, index);
 
     localColor.x -= occ;
     localColor.y -= occ;
@@ -3055,7 +3776,7 @@ ________________________________________________________________________________
 */
 __kernel void k_radiosity(const int2 occupancyParameters, SceneInfo sceneInfo, PostProcessingInfo postProcessingInfo,
                           CONST PrimitiveXYIdBuffer* primitiveXYIds, CONST PostProcessingBuffer* postProcessingBuffer,
-                          CONST RandomBuffer* randoms, CONST BitmapBuffer* bitmap)
+                          CONST BitmapBuffer* bitmap)
 {
     int x = get_global_id(0);
     int y = get_global_id(1);
@@ -3092,11 +3813,10 @@ __kernel void k_filter(const int2 occupancyParameters, SceneInfo sceneInfo, Post
 
     // Filters
     #define NB_FILTERS 6
-    const int2 filterSize[NB_FILTERS]; // = {{3, 3}, {5, 5}, {3, 3}, {3, 3}, {5, 5}, {5, 5}};
+    const int2 filterSize[NB_FILTERS] = {{3, 3}, {5, 5}, {3, 3}, {3, 3}, {5, 5}, {5, 5}};
 
-    const float2 filterFactors[NB_FILTERS];
-    // = {{1.f, 128.f}, {1.f, 0.f},  {1.f, 0.f},
-    // {1.f, 0.f},   {0.2f, 0.f}, {0.125f, 0.f}}; // Factor and Bias
+    // Factor and bias
+    const float2 filterFactors[NB_FILTERS] = {{1.f, 128.f}, {1.f, 0.f}, {1.f, 0.f}, {1.f, 0.f}, {0.2f, 0.f}, {0.125f, 0.f}};
 
     const float filterInfo[NB_FILTERS][5][5] =
     {
@@ -3159,9 +3879,7 @@ __kernel void k_filter(const int2 occupancyParameters, SceneInfo sceneInfo, Post
                     (y - filterSize[postProcessingInfo.param3].y / 2 + filterY + sceneInfo.size.y) % sceneInfo.size.y;
                 int localIndex = imageY * sceneInfo.size.x + imageX;
 
-                float4 c = postProcessingBuffer[localIndex].colorInfo;
-                if (sceneInfo.pathTracingIteration > NB_MAX_ITERATIONS)
-                    c /= (float)(sceneInfo.pathTracingIteration - NB_MAX_ITERATIONS + 1);
+                float4 c = sampledColor(&sceneInfo, postProcessingBuffer, localIndex);
 
                 localColor.x += c.x * filterInfo[postProcessingInfo.param3][filterX][filterY];
                 localColor.y += c.y * filterInfo[postProcessingInfo.param3][filterX][filterY];
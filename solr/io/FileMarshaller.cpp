@@ -42,10 +42,11 @@ const std::string SCENEINFO = "SCENEINFO";
 const std::string PRIMITIVE = "PRIMITIVE";
 const std::string MATERIAL = "MATERIAL";
 const std::string TEXTURE = "TEXTURE";
-#ifdef USE_OPENCL
-const size_t FORMAT_VERSION = 1;
-#else
+// The CPU engine shares the structure layout of the OpenCL one
+#ifdef USE_CUDA
 const size_t FORMAT_VERSION = 2;
+#else
+const size_t FORMAT_VERSION = 1;
 #endif
 }
 
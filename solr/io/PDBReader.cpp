@@ -228,12 +228,7 @@ struct Atom
     int processed;
     int id;
     int index;
-#ifdef USE_CUDA
     vec4f position;
-#endif
-#ifdef USE_OPENCL
-    vec4f position;
-#endif
     int materialId;
     int chainId;
     int residue;
@@ -560,13 +555,7 @@ vec4f PDBReader::loadAtomsFromFile(const std::string &filename, GPUKernel &cudaK
     objectSize.y = (maxPos.y - minPos.y);
     objectSize.z = (maxPos.z - minPos.z);
 
-#ifdef USE_CUDA
-    vec4f center;
-#endif
-
-#ifdef USE_OPENCL
     vec4f center;
-#endif
 
     center.x = (minPos.x + maxPos.x) / 2.f;
     center.y = (minPos.y + maxPos.y) / 2.f;
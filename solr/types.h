@@ -52,7 +52,7 @@ inline vec3f make_vec3f(const float x = 0.f, const float y = 0.f, const float z
 inline vec4f make_vec4f(const float x = 0.f, const float y = 0.f, const float z = 0.f, const float w = 0.f) { return{ {x, y, z, w } }; }
 
 #define __ALIGN16__
-#else
+#elif defined(USE_CUDA)
 #include <vector_types.h>
 
 typedef float vec1f;
@@ -73,6 +73,42 @@ inline vec3f make_vec3f(const float x = 0.f, const float y = 0.f, const float z
 inline vec4f make_vec4f(const float x = 0.f, const float y = 0.f, const float z = 0.f, const float w = 0.f) { return{ x, y, z, w }; }
 
 #define __ALIGN16__ __align__(16)
+#else
+#include <stddef.h>
+
+// The CPU engine runs the OpenCL kernels, vectors have the layout of the
+// OpenCL host types
+struct alignas(8) vec2f
+{
+    float x, y;
+};
+struct alignas(16) vec4f
+{
+    float x, y, z, w;
+};
+struct alignas(8) vec2i
+{
+    int x, y;
+};
+struct alignas(16) vec4i
+{
+    int x, y, z, w;
+};
+
+typedef float vec1f;
+typedef vec4f vec3f;
+typedef int vec1i;
+typedef vec4i vec3i;
+typedef vec4i PrimitiveXYIdBuffer;
+
+inline vec2i make_vec2i(const int x = 0, const int y = 0) { return{ x, y }; }
+inline vec3i make_vec3i(const int x = 0, const int y = 0, const int z = 0) { return{ x, y, z, 0 }; }
+inline vec4i make_vec4i(const int x = 0, const int y = 0, const int z = 0, const int w = 0) { return{ x, y, z, w }; }
+inline vec2f make_vec2f(const float x = 0.f, const float y = 0.f) { return{ x, y }; }
+inline vec3f make_vec3f(const float x = 0.f, const float y = 0.f, const float z = 0.f) { return{ x, y, z, 0.f }; }
+inline vec4f make_vec4f(const float x = 0.f, const float y = 0.f, const float z = 0.f, const float w = 0.f) { return{ x, y, z, w }; }
+
+#define __ALIGN16__
 #endif
 
 // Vectors
@@ -90,6 +126,10 @@ typedef int Lamp;
 #define _CRT_SECURE_NO_WARNINGS
 #define __INLINE__ inline
 
+// Accumulation buffer of progressive rendering. With the OpenCL and CPU
+// engines, sceneInfo holds the per-pixel sampling statistics: x is the sum of
+// squared luminances, y is set once the pixel has converged, z flags the edges
+// supersampled by the antialiased camera, w is the number of accumulated samples
 struct PostProcessingBuffer
 {
     vec4f colorInfo;
@@ -136,6 +176,12 @@ enum AtmosphericEffect
     aeFog = 1
 };
 
+enum SamplerType
+{
+    stRandom = 0, // Hashed counters
+    stSobol = 1   // Scrambled Sobol sequences
+};
+
 // Scene information
 struct __ALIGN16__ SceneInfo
 {
@@ -164,6 +210,9 @@ struct __ALIGN16__ SceneInfo
     vec1i gradientBackground;                  // Gradient background
     vec1f geometryEpsilon;                     // Geometry epsilon
     vec1f rayEpsilon;                          // Ray epsilon
+    vec1i compressedBoxes;                     // Bounding boxes are quantized (CompressedBoundingBox)
+    vec1f samplingThreshold;                   // Relative error below which pixels stop being sampled (0: off)
+    SamplerType sampler;                       // Random number sequences of stochastic effects
     vec4f backgroundColor;                     // Background color
 };
 
@@ -203,7 +252,8 @@ enum PrimitiveType
     ptEnvironment = 9,
     ptEllipsoid = 10,
     ptQuad = 11,
-    ptCone = 12
+    ptCone = 12,
+    ptInstance = 13 // Mesh placed in the scene, see GPUKernel::addInstance
 };
 
 // Material structure
@@ -260,6 +310,19 @@ struct __ALIGN16__ BoundingBox
 };
 typedef std::map<size_t, BoundingBox> BoundingBoxes;
 
+// Quantized Bounding Box Structure
+// Corners are stored on 8 bits, relative to the box of the parent node. The
+// first COMPRESSED_BOXES_HEADER_SIZE entries of the array hold the corners of
+// the root frame as two float4
+struct CompressedBoundingBox
+{
+    unsigned char lower[3];       // Bottom-Left corner, relative to the parent box
+    unsigned char upper[3];       // Top-Right corner, relative to the parent box
+    unsigned short nbPrimitives;  // Number of primitives in the box
+    unsigned int startIndex;      // Index of the first primitive in the box
+    unsigned int indexForNextBox; // Boxes to skip (lower 24 bits) and depth of the box (upper 8 bits)
+};
+
 // Primitive Structure
 struct __ALIGN16__ Primitive
 {